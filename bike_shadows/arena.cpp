@@ -0,0 +1,94 @@
+#include "arena.h"
+
+Arena::Arena(int blockSize)
+    : m_block(-1), m_offset(0), m_blockSize(qMax(blockSize, 1024))
+{
+    m_padding[0] = 0;
+}
+
+Arena::~Arena()
+{
+    Q_FOREACH(const Block &block, m_blocks)
+        delete [] block.data;
+}
+
+void *Arena::allocate(qint64 size, int alignment)
+{
+    // Blocks come from new[], so aligning offsets is aligning addresses as
+    // long as alignment is no more than new[]'s own
+    alignment = qBound(1, alignment, 16);
+    size = qMax(size, qint64(1));
+
+    qint64 start = m_block < 0 ? 0 : (m_offset + alignment-1) & ~qint64(alignment-1);
+    while(m_block < 0 || start + size > m_blocks.at(m_block).size)
+    {
+        // The rest of the current block goes unused until the next reset
+        if(m_block+1 >= m_blocks.size())
+            this->addBlock(qMax(qint64(m_blockSize), size));
+        ++m_block;
+        m_offset = 0;
+        start = 0;
+    }
+
+    m_offset = start + size;
+    ++m_stats.allocations;
+    m_stats.usedBytes += size;
+    return m_blocks.at(m_block).data + start;
+}
+
+void Arena::reserve(qint64 bytes)
+{
+    const qint64 free = m_block < 0 ? 0 : m_blocks.at(m_block).size - m_offset;
+    if(free >= bytes)
+        return;
+
+    // Blocks left over from before are used if they are large enough
+    for(int i=m_block+1; i<m_blocks.size(); i++)
+    {
+        if(m_blocks.at(i).size >= bytes)
+        {
+            m_blocks.move(i, m_block+1);
+            ++m_block;
+            m_offset = 0;
+            return;
+        }
+    }
+
+    this->addBlock(bytes);
+    m_blocks.move(m_blocks.size()-1, m_block+1);
+    ++m_block;
+    m_offset = 0;
+}
+
+void Arena::reset()
+{
+    if(m_block > 0)
+    {
+        qint64 size = 0;
+        Q_FOREACH(const Block &block, m_blocks)
+        {
+            size += block.size;
+            delete [] block.data;
+        }
+        m_blocks.clear();
+        m_stats.capacity = 0;
+        this->addBlock(size);
+    }
+
+    m_block = m_blocks.isEmpty() ? -1 : 0;
+    m_offset = 0;
+    m_stats.allocations = 0;
+    m_stats.usedBytes = 0;
+    m_stats.blockAllocations = 0;
+}
+
+void Arena::addBlock(qint64 size)
+{
+    Block block;
+    block.data = new char[size_t(size)];
+    block.size = size;
+    m_blocks.append(block);
+
+    m_stats.capacity += size;
+    ++m_stats.blockAllocations;
+}
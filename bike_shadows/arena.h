@@ -0,0 +1,63 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <QVector>
+
+/*
+ * Linear (bump) allocator. Allocations are carved one after the other out
+ * of large blocks and are never freed on their own; reset() releases all
+ * of them at once and keeps the blocks for reuse. Nothing is ever
+ * destructed, so only plain data (vectors, indexes, draw ranges) goes in.
+ *
+ * The heap is only touched when the arena runs out of room. If a cycle
+ * (a frame, say) needed more than one block, reset() replaces them with a
+ * single block as large as all of them, so an arena that is reset every
+ * frame, or reserve()d up front, settles into not touching it at all.
+ */
+class Arena
+{
+public:
+    enum { DefaultBlockSize = 256*1024 };
+
+    Arena(int blockSize=DefaultBlockSize);
+    ~Arena();
+
+    // Never returns nullptr. Alignment must be a power of two.
+    void *allocate(qint64 size, int alignment=16);
+    template <class T> T *allocate(int count) {
+        return static_cast<T*>( this->allocate(qint64(count)*qint64(sizeof(T)), int(alignof(T))) );
+    }
+
+    // Makes room for at least bytes more in the current block
+    void reserve(qint64 bytes);
+
+    void reset();
+
+    struct Statistics
+    {
+        Statistics() : allocations(0), usedBytes(0), capacity(0), blockAllocations(0) { }
+        int allocations;        // since the last reset
+        qint64 usedBytes;       // since the last reset, including padding
+        qint64 capacity;        // bytes in blocks
+        int blockAllocations;   // heap allocations since the last reset
+    };
+    Statistics statistics() const { return m_stats; }
+
+private:
+    void addBlock(qint64 size);
+
+private:
+    struct Block
+    {
+        char *data;
+        qint64 size;
+    };
+    QVector<Block> m_blocks;
+    int m_block;        // the one allocations come from
+    qint64 m_offset;    // into m_block
+    int m_blockSize;
+    Statistics m_stats;
+    char m_padding[4];
+};
+
+#endif // ARENA_H
@@ -0,0 +1,15 @@
+QT += gui
+
+CONFIG += console
+CONFIG -= app_bundle
+
+TARGET = bike_shadows_benchmark
+
+include(../pipeline.pri)
+
+HEADERS += \
+    benchmarkrunner.h
+
+SOURCES += \
+    benchmarkrunner.cpp \
+    main.cpp
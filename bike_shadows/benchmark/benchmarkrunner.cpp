@@ -0,0 +1,521 @@
+#include "benchmarkrunner.h"
+#include "renderpipeline.h"
+#include "indirectrenderer.h"
+#include "meshstreamer.h"
+#include "sceneloader.h"
+#include "transformkernels.h"
+
+#include <QImage>
+#include <QJsonArray>
+#include <QElapsedTimer>
+#include <QOpenGLContext>
+#include <QOffscreenSurface>
+#include <QOpenGLTimerQuery>
+#include <QOpenGLFramebufferObject>
+#include <QtMath>
+#include <algorithm>
+#include <cstring>
+
+// OpenGL versions tried, newest first
+static const QPair<int,int> CONTEXT_VERSIONS[] = { qMakePair(4,6), qMakePair(4,5), qMakePair(4,3), qMakePair(3,3) };
+
+static QJsonObject Statistics(QVector<double> samples)
+{
+    QJsonObject ret;
+    if(samples.isEmpty())
+        return ret;
+
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0;
+    Q_FOREACH(double sample, samples)
+        sum += sample;
+
+    const int p95 = qMin(samples.size()-1, int(qCeil(0.95*samples.size()))-1);
+    ret.insert("mean", sum / samples.size());
+    ret.insert("min", samples.first());
+    ret.insert("max", samples.last());
+    ret.insert("median", samples.at(samples.size()/2));
+    ret.insert("p95", samples.at(qMax(p95, 0)));
+    return ret;
+}
+
+BenchmarkRunner::BenchmarkRunner(const Config &config)
+    : m_config(config), m_context(nullptr), m_surface(nullptr),
+      m_fbo(nullptr), m_pipeline(nullptr)
+{
+
+}
+
+BenchmarkRunner::~BenchmarkRunner()
+{
+    if(m_context)
+    {
+        m_context->makeCurrent(m_surface);
+        delete m_pipeline;
+        delete m_fbo;
+        m_context->doneCurrent();
+    }
+
+    delete m_context;
+    delete m_surface;
+}
+
+bool BenchmarkRunner::initialize()
+{
+    m_surface = new QOffscreenSurface;
+    m_surface->setFormat(QSurfaceFormat::defaultFormat());
+    m_surface->create();
+    if(!m_surface->isValid())
+    {
+        m_errorString = "Could not create an offscreen surface";
+        return false;
+    }
+
+    // The newest compatibility context there is, so that indirect draws
+    // (4.3) and reversed-Z (4.5) are measured wherever the driver has them.
+    // Drivers that fail on versions they do not have are walked down.
+    for(const QPair<int,int> &version : CONTEXT_VERSIONS)
+    {
+        QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+        format.setVersion(version.first, version.second);
+
+        m_context = new QOpenGLContext;
+        m_context->setFormat(format);
+        if(m_context->create() && m_context->makeCurrent(m_surface))
+            break;
+
+        delete m_context;
+        m_context = nullptr;
+    }
+
+    if(!m_context)
+    {
+        m_errorString = "Could not create an OpenGL context";
+        return false;
+    }
+
+    m_fbo = new QOpenGLFramebufferObject(m_config.frameSize, QOpenGLFramebufferObject::CombinedDepthStencil);
+    if(!m_fbo->isValid())
+    {
+        m_errorString = "Could not create a framebuffer object";
+        return false;
+    }
+
+    m_pipeline = new RenderPipeline;
+    m_pipeline->initialize();
+    m_pipeline->setTargetFramebuffer(m_fbo->handle());
+    if(m_config.streamingBudget > 0)
+    {
+        m_pipeline->setMeshStreamingEnabled(true);
+        m_pipeline->meshStreamer()->setMemoryBudget(qint64(m_config.streamingBudget)*1024*1024);
+    }
+    if(!this->createScene())
+    {
+        m_errorString = QString("Could not load the scene %1").arg(m_config.sceneFileName);
+        return false;
+    }
+
+    // After the scene, so that the command line wins over a scene file
+    m_pipeline->setShadowsEnabled(m_config.shadowsEnabled);
+    m_pipeline->setIndirectDrawsEnabled(m_config.indirectDraws);
+    m_pipeline->indirectRenderer()->setOcclusionCullingEnabled(m_config.occlusionCulling);
+    m_pipeline->setReversedZEnabled(m_config.reversedZ);
+    this->applyShadowSettings(m_config.shadowMapFormat, m_config.shadowMapSize, m_config.shadowFilterRange);
+    m_pipeline->resize(m_config.frameSize.width(), m_config.frameSize.height());
+
+    return true;
+}
+
+QJsonObject BenchmarkRunner::run()
+{
+    QOpenGLFunctions *gl = m_context->functions();
+
+    // Timer queries need GL 3.3 or ARB_timer_query. Without them only CPU
+    // times are reported.
+    QOpenGLTimerQuery shadowQuery, sceneQuery;
+    const bool gpuTimers = shadowQuery.create() && sceneQuery.create();
+
+    QVector<double> cpuShadow, cpuScene, cpuFrame, gpuShadow, gpuScene;
+    QVector<double> residentBytes, uploadedBytes;
+    QElapsedTimer timer;
+
+    // Errors raised by the frames, not by whatever ran before them
+    while(gl->glGetError() != GL_NO_ERROR) { }
+    int errorCount = 0;
+    GLenum firstError = GL_NO_ERROR;
+
+    const int totalFrames = m_config.warmupFrameCount + m_config.frameCount;
+    for(int frame=0; frame<totalFrames; frame++)
+    {
+        const bool measure = frame >= m_config.warmupFrameCount;
+        qint64 shadowTime = 0;
+
+        timer.start();
+        if(m_config.shadowsEnabled)
+        {
+            if(gpuTimers)
+                shadowQuery.begin();
+            m_pipeline->renderToShadowMap();
+            if(gpuTimers)
+                shadowQuery.end();
+            shadowTime = timer.nsecsElapsed();
+        }
+
+        if(gpuTimers)
+            sceneQuery.begin();
+        m_pipeline->renderToScreen();
+        if(gpuTimers)
+            sceneQuery.end();
+        const qint64 sceneTime = timer.nsecsElapsed() - shadowTime;
+
+        // CPU time is submission time, frame time includes waiting for the GPU
+        gl->glFinish();
+        const qint64 frameTime = timer.nsecsElapsed();
+
+        for(GLenum error = gl->glGetError(); error != GL_NO_ERROR; error = gl->glGetError())
+        {
+            if(errorCount++ == 0)
+                firstError = error;
+        }
+
+        // Keep the turntable going, so that the transform stage has work
+        QMatrix4x4 sceneMatrix = m_pipeline->sceneMatrix();
+        sceneMatrix.rotate(3, 0, 1, 0);
+        m_pipeline->setSceneMatrix(sceneMatrix);
+
+        if(!measure)
+            continue;
+
+        if(m_config.shadowsEnabled)
+            cpuShadow.append(double(shadowTime) / 1e6);
+        if(m_pipeline->meshStreamer())
+        {
+            const MeshStreamer::Statistics stats = m_pipeline->meshStreamer()->statistics();
+            residentBytes.append(double(stats.residentBytes));
+            uploadedBytes.append(double(stats.uploadedBytes));
+        }
+        cpuScene.append(double(sceneTime) / 1e6);
+        cpuFrame.append(double(frameTime) / 1e6);
+        if(gpuTimers)
+        {
+            if(m_config.shadowsEnabled)
+                gpuShadow.append(double(shadowQuery.waitForResult()) / 1e6);
+            gpuScene.append(double(sceneQuery.waitForResult()) / 1e6);
+        }
+    }
+
+    QJsonObject config;
+    config.insert("bikes", m_config.bikeCount);
+    config.insert("shadowMapSize", m_config.shadowMapSize);
+    config.insert("shadowMapFormat", RenderPipeline::shadowMapFormatName(m_config.shadowMapFormat));
+    config.insert("shadowFilterRange", m_config.shadowFilterRange);
+    config.insert("shadows", m_config.shadowsEnabled);
+    config.insert("frames", m_config.frameCount);
+    config.insert("width", m_config.frameSize.width());
+    config.insert("height", m_config.frameSize.height());
+    config.insert("streamingBudget", m_config.streamingBudget);
+    config.insert("indirectDraws", m_pipeline->isUsingIndirectDraws());
+    config.insert("occlusionCulling", m_pipeline->isUsingIndirectDraws() && m_config.occlusionCulling);
+    config.insert("gpuDrawCount", m_pipeline->isUsingIndirectDraws() && m_pipeline->indirectRenderer()->isUsingDrawCount());
+    config.insert("reversedZ", m_pipeline->isUsingReversedZ());
+    if(!m_config.sceneFileName.isEmpty())
+        config.insert("scene", m_config.sceneFileName);
+
+    QJsonObject glInfo;
+    glInfo.insert("vendor", QString::fromLatin1(reinterpret_cast<const char*>(gl->glGetString(GL_VENDOR))));
+    glInfo.insert("renderer", QString::fromLatin1(reinterpret_cast<const char*>(gl->glGetString(GL_RENDERER))));
+    glInfo.insert("version", QString::fromLatin1(reinterpret_cast<const char*>(gl->glGetString(GL_VERSION))));
+    glInfo.insert("contextVersion", QString("%1.%2").arg(m_context->format().majorVersion())
+                                                   .arg(m_context->format().minorVersion()));
+    glInfo.insert("timerQueries", gpuTimers);
+    glInfo.insert("errors", errorCount);
+
+    // A pass that raised errors, or whose timer query was cut short by
+    // another one, measured something other than what it says
+    if(errorCount > 0)
+        qWarning("%d OpenGL errors while rendering, the first was 0x%04x", errorCount, firstError);
+    if(gpuTimers && !gpuScene.isEmpty() && *std::min_element(gpuScene.constBegin(), gpuScene.constEnd()) <= 0)
+        qWarning("Some scene passes have no GPU time");
+
+    QJsonObject shadowPass;
+    shadowPass.insert("cpu", Statistics(cpuShadow));
+    shadowPass.insert("gpu", Statistics(gpuShadow));
+
+    QJsonObject scenePass;
+    scenePass.insert("cpu", Statistics(cpuScene));
+    scenePass.insert("gpu", Statistics(gpuScene));
+
+    QJsonObject passes;
+    passes.insert("shadow", shadowPass);
+    passes.insert("scene", scenePass);
+
+    QJsonObject ret;
+    ret.insert("config", config);
+    ret.insert("gl", glInfo);
+    ret.insert("passes", passes);
+    ret.insert("frame", Statistics(cpuFrame));
+    if(!m_sceneLoading.isEmpty())
+        ret.insert("sceneLoading", m_sceneLoading);
+
+    if(m_pipeline->meshStreamer())
+    {
+        const MeshStreamer::Statistics stats = m_pipeline->meshStreamer()->statistics();
+        QJsonObject streaming;
+        streaming.insert("residentBytes", Statistics(residentBytes));
+        streaming.insert("uploadedBytes", Statistics(uploadedBytes));
+        streaming.insert("chunks", m_pipeline->meshStreamer()->chunkCount());
+        streaming.insert("residentChunks", stats.residentChunks);
+        streaming.insert("uploads", double(stats.totalUploads));
+        streaming.insert("evictions", double(stats.totalEvictions));
+        ret.insert("streaming", streaming);
+    }
+    return ret;
+}
+
+// Peak signal to noise ratio of b against a, over the color channels
+static double Psnr(const QImage &a, const QImage &b)
+{
+    if(a.size() != b.size())
+        return 0;
+
+    const QImage first = a.convertToFormat(QImage::Format_RGB32);
+    const QImage second = b.convertToFormat(QImage::Format_RGB32);
+    double sum = 0;
+    for(int y=0; y<first.height(); y++)
+    {
+        const QRgb *row1 = reinterpret_cast<const QRgb*>(first.constScanLine(y));
+        const QRgb *row2 = reinterpret_cast<const QRgb*>(second.constScanLine(y));
+        for(int x=0; x<first.width(); x++)
+        {
+            const int dr = qRed(row1[x]) - qRed(row2[x]);
+            const int dg = qGreen(row1[x]) - qGreen(row2[x]);
+            const int db = qBlue(row1[x]) - qBlue(row2[x]);
+            sum += double(dr*dr + dg*dg + db*db);
+        }
+    }
+
+    // Identical images are reported as 100 dB, JSON has no infinity
+    const double mse = sum / (3.0 * double(first.width()) * double(first.height()));
+    if(mse <= 0)
+        return 100;
+    return qMin(100.0, 10.0 * std::log10(255.0*255.0 / mse));
+}
+
+QJsonObject BenchmarkRunner::runShadowSweep(double minimumPsnr)
+{
+    const QMatrix4x4 sceneMatrix = m_pipeline->sceneMatrix();
+    const int sizes[] = { 512, 1024, 2048, 4096 };
+    const RenderPipeline::ShadowMapFormat formats[] = { RenderPipeline::Depth16, RenderPipeline::Depth24, RenderPipeline::Depth32F };
+
+    // The reference is the most precise and best filtered shadow on offer
+    this->applyShadowSettings(RenderPipeline::Depth32F, 4096, 2);
+    m_pipeline->setSceneMatrix(sceneMatrix);
+    const QImage reference = this->renderStill();
+
+    QJsonArray configurations;
+    QJsonObject recommended;
+    double recommendedTime = 0;
+    for(RenderPipeline::ShadowMapFormat format : formats)
+    {
+        for(int size : sizes)
+        {
+            for(int filterRange=0; filterRange<=2; filterRange++)
+            {
+                // Every configuration sees the same frames
+                this->applyShadowSettings(format, size, filterRange);
+                m_pipeline->setSceneMatrix(sceneMatrix);
+                const double psnr = Psnr(reference, this->renderStill());
+
+                m_pipeline->setSceneMatrix(sceneMatrix);
+                const QJsonObject report = this->run();
+                const QJsonObject passes = report.value("passes").toObject();
+                const bool gpuTimes = report.value("gl").toObject().value("timerQueries").toBool();
+
+                // GPU time of both passes where it can be measured, frame
+                // time (which waits for the GPU) otherwise
+                double time = report.value("frame").toObject().value("mean").toDouble();
+                if(gpuTimes)
+                    time = passes.value("shadow").toObject().value("gpu").toObject().value("mean").toDouble() +
+                           passes.value("scene").toObject().value("gpu").toObject().value("mean").toDouble();
+
+                QJsonObject configuration;
+                configuration.insert("shadowMapFormat", RenderPipeline::shadowMapFormatName(format));
+                configuration.insert("shadowMapSize", size);
+                configuration.insert("shadowFilterRange", filterRange);
+                configuration.insert("psnr", psnr);
+                configuration.insert("time", time);
+                configurations.append(configuration);
+
+                if(psnr >= minimumPsnr && (recommended.isEmpty() || time < recommendedTime))
+                {
+                    recommended = configuration;
+                    recommendedTime = time;
+                }
+            }
+        }
+    }
+
+    QJsonObject ret;
+    ret.insert("minimumPsnr", minimumPsnr);
+    ret.insert("configurations", configurations);
+    ret.insert("recommended", recommended);
+    return ret;
+}
+
+void BenchmarkRunner::applyShadowSettings(RenderPipeline::ShadowMapFormat format, int size, int filterRange)
+{
+    m_config.shadowMapFormat = format;
+    m_config.shadowMapSize = size;
+    m_config.shadowFilterRange = filterRange;
+    m_pipeline->setShadowMapFormat(format);
+    m_pipeline->setShadowMapSize(size);
+    m_pipeline->setShadowFilterRange(filterRange);
+}
+
+QImage BenchmarkRunner::renderStill()
+{
+    if(m_config.shadowsEnabled)
+        m_pipeline->renderToShadowMap();
+    m_pipeline->renderToScreen();
+    m_context->functions()->glFinish();
+    return m_fbo->toImage();
+}
+
+bool BenchmarkRunner::createScene()
+{
+    if(!m_config.sceneFileName.isEmpty())
+    {
+        SceneLoader loader(m_pipeline);
+        if(!loader.load(m_config.sceneFileName))
+            return false;
+
+        m_sceneLoading = loader.statisticsJson();
+        return true;
+    }
+
+    // Bikes share their meshes and are laid out in a grid on the platform,
+    // facing alternate ways
+    SceneStore *scene = m_pipeline->scene();
+
+    const int columns = qMax(1, int(qCeil(qSqrt(qreal(m_config.bikeCount)))));
+    const float spacing = 4.0f;
+    for(int i=0; i<m_config.bikeCount; i++)
+    {
+        const int row = i / columns;
+        const int column = i % columns;
+
+        QMatrix4x4 matrix;
+        matrix.translate( (float(column) - float(columns-1)/2.0f)*spacing, 0,
+                          (float(row) - float(columns-1)/2.0f)*spacing );
+        matrix.rotate( (i%2) ? -20 : 20, 0, 1, 0 );
+        m_pipeline->addBike(matrix);
+    }
+
+    const int platform = m_pipeline->addMesh(m_pipeline->loadMesh(":/platform.obj"));
+    scene->createInstance(platform, QMatrix4x4(), SceneStore::Visible);
+    return true;
+}
+
+QJsonObject BenchmarkRunner::runTransformBenchmark(int instanceCount, int iterations)
+{
+    // Instances on a grid; every other one is also scaled, so that both the
+    // rigid and the general normal matrix paths are exercised.
+    const int count = qMax(1, instanceCount);
+    const int columns = qMax(1, int(qCeil(qSqrt(qreal(count)))));
+    QVector<QMatrix4x4> localMatrices(count);
+    QVector<float> locals(count*16);
+    QVector<int> meshIndexes(count, 0);
+    for(int i=0; i<count; i++)
+    {
+        QMatrix4x4 &matrix = localMatrices[i];
+        matrix.translate( float(i%columns)*4.0f, 0, float(i/columns)*4.0f );
+        matrix.rotate( float(i%360), 0, 1, 0 );
+        if(i%2)
+            matrix.scale(1.0f + float(i%5)*0.1f);
+        memcpy(locals.data() + i*16, matrix.constData(), 16*sizeof(float));
+    }
+
+    BoundingBox localBox;
+    localBox.x.min = -1; localBox.x.max = 1;
+    localBox.y.min = 0; localBox.y.max = 2;
+    localBox.z.min = -0.5f; localBox.z.max = 0.5f;
+    const float localBounds[6] = { 0, 1, 0, 1, 1, 0.5f };
+
+    QMatrix4x4 projectionMatrix, viewMatrix, lightViewMatrix;
+    projectionMatrix.perspective(45.0f, 16.0f/9.0f, 0.1f, 1000.0f);
+    viewMatrix.lookAt(QVector3D(0, 50, 100), QVector3D(0, 0, 0), QVector3D(0, 1, 0));
+    lightViewMatrix.lookAt(QVector3D(100, 200, 100), QVector3D(0, 0, 0), QVector3D(0, 1, 0));
+
+    QVector<double> perModel, batched;
+    QElapsedTimer timer;
+    float checksum = 0;
+    int nrRigid = 0;
+
+    QVector<float> worlds(count*16), modelViews(count*16), mvps(count*16);
+    QVector<float> lightViews(count*16), lightMvps(count*16), normals(count*9), bounds(count*6);
+    QVector<uchar> rigid(count);
+
+    for(int iteration=0; iteration<qMax(1, iterations); iteration++)
+    {
+        QMatrix4x4 sceneMatrix;
+        sceneMatrix.rotate(float(iteration*3), 0, 1, 0);
+
+        // What the renderers did per model: QMatrix4x4 products, a 4x4
+        // inverse for the normal matrix and the 8 corners of the box.
+        timer.start();
+        for(int i=0; i<count; i++)
+        {
+            const QMatrix4x4 modelMatrix = sceneMatrix * localMatrices.at(i);
+            const QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
+            const QMatrix4x4 modelViewProjectionMatrix = projectionMatrix * modelViewMatrix;
+            const QMatrix4x4 normalMatrix = modelMatrix.inverted().transposed();
+            const QMatrix4x4 lightModelViewMatrix = lightViewMatrix * modelMatrix;
+            const QMatrix4x4 lightViewProjectionMatrix = projectionMatrix * lightModelViewMatrix;
+
+            QVector3D minimum, maximum;
+            for(int c=0; c<8; c++)
+            {
+                const QVector3D corner( (c&1) ? localBox.x.max : localBox.x.min,
+                                        (c&2) ? localBox.y.max : localBox.y.min,
+                                        (c&4) ? localBox.z.max : localBox.z.min );
+                const QVector3D p = modelMatrix.map(corner);
+                minimum = c ? QVector3D(qMin(p.x(), minimum.x()), qMin(p.y(), minimum.y()), qMin(p.z(), minimum.z())) : p;
+                maximum = c ? QVector3D(qMax(p.x(), maximum.x()), qMax(p.y(), maximum.y()), qMax(p.z(), maximum.z())) : p;
+            }
+
+            checksum += modelViewProjectionMatrix(0,0) + normalMatrix(1,1) +
+                        lightViewProjectionMatrix(2,2) + minimum.x() + maximum.y();
+        }
+        perModel.append(double(timer.nsecsElapsed()) / 1e6);
+
+        // The batched stage, as done by SceneStore and RenderPipeline
+        timer.start();
+        MultiplyMatrices(sceneMatrix.constData(), locals.constData(), nullptr, count, worlds.data());
+        TransformBounds(worlds.constData(), localBounds, meshIndexes.constData(), count, bounds.data());
+        nrRigid = NormalMatrices(worlds.constData(), nullptr, count, normals.data(), rigid.data());
+        MultiplyMatrices(viewMatrix.constData(), worlds.constData(), nullptr, count, modelViews.data());
+        MultiplyMatrices((projectionMatrix*viewMatrix).constData(), worlds.constData(), nullptr, count, mvps.data());
+        MultiplyMatrices(lightViewMatrix.constData(), worlds.constData(), nullptr, count, lightViews.data());
+        MultiplyMatrices((projectionMatrix*lightViewMatrix).constData(), worlds.constData(), nullptr, count, lightMvps.data());
+        batched.append(double(timer.nsecsElapsed()) / 1e6);
+
+        checksum += mvps.last() + normals.last() + lightMvps.last() + bounds.last();
+    }
+
+    const QJsonObject perModelStatistics = Statistics(perModel);
+    const QJsonObject batchedStatistics = Statistics(batched);
+    const double perModelMedian = perModelStatistics.value("median").toDouble();
+    const double batchedMedian = batchedStatistics.value("median").toDouble();
+
+    QJsonObject ret;
+    ret.insert("instances", count);
+    ret.insert("iterations", qMax(1, iterations));
+    ret.insert("kernels", QString::fromLatin1(TransformKernelName()));
+    ret.insert("rigidInstances", nrRigid);
+    ret.insert("perModel", perModelStatistics);
+    ret.insert("batched", batchedStatistics);
+    ret.insert("speedup", batchedMedian > 0 ? perModelMedian/batchedMedian : 0.0);
+    ret.insert("checksum", double(checksum));
+    return ret;
+}
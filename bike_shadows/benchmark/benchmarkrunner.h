@@ -0,0 +1,76 @@
+#ifndef BENCHMARK_RUNNER_H
+#define BENCHMARK_RUNNER_H
+
+#include <QJsonObject>
+#include <QSize>
+#include <QVector>
+
+#include "renderpipeline.h"
+
+class QImage;
+class QOpenGLContext;
+class QOffscreenSurface;
+class QOpenGLFramebufferObject;
+
+/*
+ * Renders the shadow pipeline into an offscreen framebuffer for a fixed
+ * number of frames and reports per pass timings. Needs no window or display,
+ * so it works under Mesa llvmpipe on headless machines too.
+ */
+class BenchmarkRunner
+{
+public:
+    struct Config
+    {
+        Config() : bikeCount(2), shadowMapSize(2048), shadowMapFormat(RenderPipeline::Depth24), shadowFilterRange(2),
+            frameCount(200), warmupFrameCount(10), frameSize(1280, 720),
+            streamingBudget(0), shadowsEnabled(true), indirectDraws(true), occlusionCulling(false),
+            reversedZ(false) { }
+        int bikeCount;
+        int shadowMapSize;
+        RenderPipeline::ShadowMapFormat shadowMapFormat;
+        int shadowFilterRange;
+        int frameCount;
+        int warmupFrameCount;
+        QSize frameSize;
+        int streamingBudget; // megabytes, 0 to keep meshes in GPU memory
+        QString sceneFileName; // replaces the bikes, if set
+        bool shadowsEnabled;
+        bool indirectDraws;     // where the context supports them
+        bool occlusionCulling;  // of the indirect draws
+        bool reversedZ;         // where the context supports it
+    };
+
+    BenchmarkRunner(const Config &config);
+    ~BenchmarkRunner();
+
+    bool initialize();
+    QString errorString() const { return m_errorString; }
+
+    QJsonObject run();
+
+    // Runs every combination of shadow map format, size and PCF kernel, and
+    // recommends the fastest whose image is within minimumPsnr (in dB) of
+    // the best possible one
+    QJsonObject runShadowSweep(double minimumPsnr);
+
+    // CPU only microbenchmark of the transform stage: the per-model
+    // QMatrix4x4 path against the batch kernels of transformkernels.h
+    static QJsonObject runTransformBenchmark(int instanceCount, int iterations);
+
+private:
+    bool createScene();
+    void applyShadowSettings(RenderPipeline::ShadowMapFormat format, int size, int filterRange);
+    QImage renderStill();
+
+private:
+    Config m_config;
+    QString m_errorString;
+    QOpenGLContext *m_context;
+    QOffscreenSurface *m_surface;
+    QOpenGLFramebufferObject *m_fbo;
+    RenderPipeline *m_pipeline;
+    QJsonObject m_sceneLoading;
+};
+
+#endif // BENCHMARK_RUNNER_H
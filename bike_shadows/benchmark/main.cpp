@@ -0,0 +1,161 @@
+#include <QFile>
+#include <QJsonDocument>
+#include <QSurfaceFormat>
+#include <QGuiApplication>
+#include <QCommandLineParser>
+
+#include "benchmarkrunner.h"
+
+/*
+ * Headless benchmark for the shadow pipeline. For example
+ *
+ *   QT_QPA_PLATFORM=offscreen ./bike_shadows_benchmark --bikes 16 --shadow-map-size 1024 --pcf 1
+ *
+ * On machines without a display use a platform plugin that can create
+ * OpenGL contexts without one, e.g. QT_QPA_PLATFORM=minimalegl with
+ * EGL_PLATFORM=surfaceless and Mesa's llvmpipe driver.
+ *
+ * --transforms 100000 runs only the (CPU) transform stage microbenchmark.
+ *
+ * --stream-budget 8 streams the meshes in, within 8 MB of GPU memory.
+ *
+ * --scene file.json renders the scene described in the file (see
+ * SceneLoader) instead of --bikes bikes, and reports how it loaded.
+ *
+ * --no-indirect draws every instance from the CPU even where GPU culling
+ * and indirect draws are supported, and --occlusion-culling adds occlusion
+ * culling against the depth of the last frame to them. The config in the
+ * report says whether indirect draws (OpenGL 4.3) and reversed-Z (4.5 or
+ * ARB_clip_control) were used, as the context may not have them.
+ *
+ * --reversed-z renders the scene pass with reversed, floating point depth
+ * and an infinite far plane, where the context has glClipControl.
+ *
+ * The report counts the OpenGL errors raised while rendering, and the
+ * benchmark exits with 1 if there were any.
+ *
+ * --sweep-shadows runs every shadow map format, size and PCF kernel, and
+ * recommends the fastest that comes within --min-psnr dB of the best.
+ */
+int main(int argc, char **argv)
+{
+    QGuiApplication a(argc, argv);
+    QGuiApplication::setApplicationName("bike_shadows_benchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders the bike_shadows scene offscreen and reports per pass timings as JSON");
+    parser.addHelpOption();
+
+    const QCommandLineOption bikesOption("bikes", "Number of bikes in the scene", "count", "2");
+    const QCommandLineOption shadowSizeOption("shadow-map-size", "Width and height of the shadow map", "size", "2048");
+    const QCommandLineOption shadowFormatOption("shadow-map-format", "Shadow map depth format: 16, 24 or 32f", "format", "24");
+    const QCommandLineOption pcfOption("pcf", "PCF range: 0 = single tap, 1 = 3x3, 2 = 5x5", "range", "2");
+    const QCommandLineOption noShadowsOption("no-shadows", "Skip the shadow pass");
+    const QCommandLineOption framesOption("frames", "Number of measured frames", "count", "200");
+    const QCommandLineOption warmupOption("warmup", "Number of frames rendered before measuring", "count", "10");
+    const QCommandLineOption sizeOption("size", "Size of the framebuffer", "WxH", "1280x720");
+    const QCommandLineOption streamOption("stream-budget", "Stream meshes within this much GPU memory", "megabytes");
+    const QCommandLineOption sceneOption("scene", "Render this scene file instead of the bikes", "file");
+    const QCommandLineOption sweepOption("sweep-shadows", "Benchmark all shadow map configurations and recommend one");
+    const QCommandLineOption psnrOption("min-psnr", "Quality threshold of --sweep-shadows, in dB", "dB", "40");
+    const QCommandLineOption transformsOption("transforms", "Only benchmark the transform stage for this many instances", "count");
+    const QCommandLineOption noIndirectOption("no-indirect", "Draw every instance from the CPU, without GPU culling");
+    const QCommandLineOption occlusionOption("occlusion-culling", "Cull on the GPU against the depth of the last frame");
+    const QCommandLineOption reversedZOption("reversed-z", "Reversed floating point depth with an infinite far plane");
+    const QCommandLineOption outputOption("output", "Write the report to this file instead of stdout", "file");
+    parser.addOptions( QList<QCommandLineOption>() << bikesOption << shadowSizeOption
+                       << shadowFormatOption << pcfOption << noShadowsOption << framesOption
+                       << warmupOption << sizeOption << streamOption << sceneOption << sweepOption
+                       << psnrOption << transformsOption << noIndirectOption << occlusionOption
+                       << reversedZOption << outputOption );
+    parser.process(a);
+
+    BenchmarkRunner::Config config;
+    config.bikeCount = qMax(0, parser.value(bikesOption).toInt());
+    config.shadowMapSize = qMax(16, parser.value(shadowSizeOption).toInt());
+    config.shadowFilterRange = qBound(0, parser.value(pcfOption).toInt(), 2);
+
+    // 24 is as good as DEPTH24, the name the pipeline and scene files use
+    const QString shadowFormat = parser.value(shadowFormatOption).toUpper();
+    bool shadowFormatFound = false;
+    for(int i=RenderPipeline::Depth16; i<=RenderPipeline::Depth32F && !shadowFormatFound; i++)
+    {
+        const QString name = RenderPipeline::shadowMapFormatName(RenderPipeline::ShadowMapFormat(i));
+        if(name == shadowFormat || name == "DEPTH" + shadowFormat)
+        {
+            config.shadowMapFormat = RenderPipeline::ShadowMapFormat(i);
+            shadowFormatFound = true;
+        }
+    }
+    if(!shadowFormatFound)
+    {
+        qCritical("Unknown shadow map format %s, expected 16, 24 or 32f", qPrintable(parser.value(shadowFormatOption)));
+        return 1;
+    }
+
+    config.shadowsEnabled = !parser.isSet(noShadowsOption);
+    config.indirectDraws = !parser.isSet(noIndirectOption);
+    config.occlusionCulling = parser.isSet(occlusionOption);
+    config.reversedZ = parser.isSet(reversedZOption);
+    config.frameCount = qMax(1, parser.value(framesOption).toInt());
+    config.warmupFrameCount = qMax(0, parser.value(warmupOption).toInt());
+    config.sceneFileName = parser.value(sceneOption);
+    if(parser.isSet(streamOption))
+        config.streamingBudget = qMax(1, parser.value(streamOption).toInt());
+
+    const QStringList size = parser.value(sizeOption).split("x");
+    if(size.size() == 2)
+        config.frameSize = QSize( qMax(1, size.first().toInt()), qMax(1, size.last().toInt()) );
+
+    // BenchmarkRunner asks for the newest version the driver has
+    QSurfaceFormat format;
+    format.setDepthBufferSize(24);
+    format.setProfile(QSurfaceFormat::CompatibilityProfile);
+    QSurfaceFormat::setDefaultFormat(format);
+
+    QJsonObject result;
+    int exitCode = 0;
+    if(parser.isSet(transformsOption))
+        result = BenchmarkRunner::runTransformBenchmark(parser.value(transformsOption).toInt(), config.frameCount);
+    else
+    {
+        BenchmarkRunner runner(config);
+        if(!runner.initialize())
+        {
+            qCritical("%s", qPrintable(runner.errorString()));
+            return 1;
+        }
+
+        if(parser.isSet(sweepOption))
+            result = runner.runShadowSweep(parser.value(psnrOption).toDouble());
+        else
+        {
+            result = runner.run();
+
+            // Timings of frames that raised OpenGL errors are not to be
+            // trusted; the report is still written, but the run fails
+            if(result.value("gl").toObject().value("errors").toInt() > 0)
+                exitCode = 1;
+        }
+    }
+
+    const QByteArray report = QJsonDocument(result).toJson();
+    if(parser.isSet(outputOption))
+    {
+        QFile file(parser.value(outputOption));
+        if(!file.open(QFile::WriteOnly))
+        {
+            qCritical("Could not write to %s", qPrintable(file.fileName()));
+            return 1;
+        }
+        file.write(report);
+    }
+    else
+    {
+        QFile out;
+        out.open(stdout, QFile::WriteOnly);
+        out.write(report);
+    }
+
+    return exitCode;
+}
@@ -1,21 +1,31 @@
 QT += opengl
 
+include(pipeline.pri)
+
 HEADERS += \
-    objmodel.h \
+    framecapture.h \
     simplerenderwindow.h \
-    shadowrenderwindow.h
+    shadowrenderwindow.h \
+    threadedrenderwindow.h
 
 SOURCES += \
-    objmodel.cpp \
+    framecapture.cpp \
     main.cpp \
     shadowrenderwindow.cpp \
-    simplerenderwindow.cpp
-
-RESOURCES += \
-    bike_shadows.qrc
+    simplerenderwindow.cpp \
+    threadedrenderwindow.cpp
 
 DISTFILES += \
+    bike_scene.json \
+    oit_composite_fragment.glsl \
     platform.obj \
     scene_fragment.glsl \
-    scene_vertex.glsl
-
+    scene_vertex.glsl \
+    upscale_fragment.glsl \
+    fullscreen_vertex.glsl \
+    cull_compute.glsl \
+    depth_pyramid_compute.glsl \
+    scene_indirect_vertex.glsl \
+    shadow_indirect_vertex.glsl \
+    highlight_vertex.glsl \
+    highlight_fragment.glsl
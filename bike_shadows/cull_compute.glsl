@@ -0,0 +1,203 @@
+#version 430
+
+// One invocation per instance, for each of the parts of its mesh: culls the
+// part against the view frustum (and, with OCCLUSION_CULLING, against the
+// depth pyramid of the last frame), picks its LOD as ObjModel::selectLod()
+// does, and appends a draw command for it. Commands are compacted into a
+// list qt_ListCapacity long, or into two of them with SPLIT_TRANSPARENT,
+// opaque parts in the first and transparent parts in the second. counts[]
+// has the number of commands appended to each, which is the draw count
+// where the context takes one from a buffer; where it does not, whatever
+// is left of a list has been cleared to empty commands. With REVERSED_Z
+// the pyramid holds reversed depth (1 at the near plane, 0 at infinity,
+// with a [0,1] clip range). See IndirectRenderer.
+
+layout(local_size_x = 64) in;
+
+struct instance_record
+{
+    mat4 world;
+    vec4 normal[3];
+    uvec4 info;         // x: mesh record, y: SceneStore flags
+};
+
+struct mesh_record
+{
+    vec4 sphere;        // bounds of the mesh, in model space
+    uvec4 parts;        // x: first part record, y: number of them
+};
+
+struct part_record
+{
+    vec4 sphere;        // bounds of the part, in model space
+    ivec4 lodStart;     // first index, in the shared index buffer
+    ivec4 lodLength;
+    ivec4 info;         // base vertex, material, number of LODs, transparent
+};
+
+struct draw_command
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { instance_record instances[]; };
+layout(std430, binding = 1) readonly buffer Meshes { mesh_record meshes[]; };
+layout(std430, binding = 2) readonly buffer Parts { part_record parts[]; };
+layout(std430, binding = 3) writeonly buffer Commands { draw_command commands[]; };
+layout(std430, binding = 4) writeonly buffer DrawRecords { ivec2 drawRecords[]; };
+layout(std430, binding = 5) buffer Counters { uint counts[2]; };
+
+uniform vec4 qt_FrustumPlanes[6];   // in world space, normalized, facing in
+uniform mat4 qt_ViewMatrix;
+uniform float qt_ProjectionScale;   // element (1,1) of the projection matrix
+uniform float qt_Lod0ScreenSize;
+uniform float qt_LodBias;
+uniform uint qt_InstanceCount;
+uniform uint qt_RequiredFlags;      // that an instance must all have to be drawn
+uniform uint qt_ListCapacity;
+
+#ifdef OCCLUSION_CULLING
+uniform sampler2D qt_DepthPyramid;              // farthest depth under each texel, per level
+uniform mat4 qt_OccluderViewProjectionMatrix;   // that the pyramid was rendered with
+uniform ivec2 qt_DepthPyramidSize;              // of the part of level 0 in use
+uniform int qt_DepthPyramidLevels;
+#endif
+
+const int c_maxLod = 3;
+
+bool isInFrustum(vec3 center, float radius)
+{
+    for(int i=0; i<6; i++)
+    {
+        if(dot(qt_FrustumPlanes[i].xyz, center) + qt_FrustumPlanes[i].w < -radius)
+            return false;
+    }
+    return true;
+}
+
+#ifdef OCCLUSION_CULLING
+float farthestDepth(ivec2 texel, int level)
+{
+    ivec2 levelSize = max((qt_DepthPyramidSize + (1 << level) - 1) >> level, ivec2(1, 1));
+    return texelFetch(qt_DepthPyramid, clamp(texel, ivec2(0, 0), levelSize - 1), level).r;
+}
+
+bool isOccluded(vec3 center, float radius)
+{
+    // Screen rectangle and nearest depth of the box around the sphere
+    vec2 minCoords = vec2(1.0, 1.0);
+    vec2 maxCoords = vec2(0.0, 0.0);
+#ifdef REVERSED_Z
+    float nearest = 0.0;
+#else
+    float nearest = 1.0;
+#endif
+    for(int i=0; i<8; i++)
+    {
+        vec3 corner = center + radius * vec3((i & 1) != 0 ? 1.0 : -1.0,
+                                             (i & 2) != 0 ? 1.0 : -1.0,
+                                             (i & 4) != 0 ? 1.0 : -1.0);
+        vec4 clip = qt_OccluderViewProjectionMatrix * vec4(corner, 1.0);
+        if(clip.w <= 0.0)
+            return false;   // reaches behind the eye
+
+        vec3 ndc = clip.xyz / clip.w;
+        minCoords = min(minCoords, ndc.xy * 0.5 + 0.5);
+        maxCoords = max(maxCoords, ndc.xy * 0.5 + 0.5);
+#ifdef REVERSED_Z
+        nearest = max(nearest, ndc.z);
+#else
+        nearest = min(nearest, ndc.z * 0.5 + 0.5);
+#endif
+    }
+
+    minCoords = clamp(minCoords, 0.0, 1.0);
+    maxCoords = clamp(maxCoords, 0.0, 1.0);
+
+    // The level at which the rectangle spans no more than two texels
+    // either way, so four taps cover it
+    vec2 size = (maxCoords - minCoords) * vec2(qt_DepthPyramidSize);
+    int level = int(ceil(log2(max(max(size.x, size.y), 1.0))));
+    level = clamp(level, 0, qt_DepthPyramidLevels - 1);
+
+    ivec2 lo = ivec2(minCoords * vec2(qt_DepthPyramidSize)) >> level;
+    ivec2 hi = ivec2(maxCoords * vec2(qt_DepthPyramidSize)) >> level;
+#ifdef REVERSED_Z
+    float farthest = min( min(farthestDepth(lo, level), farthestDepth(ivec2(hi.x, lo.y), level)),
+                          min(farthestDepth(ivec2(lo.x, hi.y), level), farthestDepth(hi, level)) );
+
+    return nearest < farthest;
+#else
+    float farthest = max( max(farthestDepth(lo, level), farthestDepth(ivec2(hi.x, lo.y), level)),
+                          max(farthestDepth(ivec2(lo.x, hi.y), level), farthestDepth(hi, level)) );
+
+    return nearest > farthest;
+#endif
+}
+#endif
+
+void main(void)
+{
+    uint instanceIndex = gl_GlobalInvocationID.x;
+    if(instanceIndex >= qt_InstanceCount)
+        return;
+
+    instance_record instance = instances[instanceIndex];
+    if((instance.info.y & qt_RequiredFlags) != qt_RequiredFlags)
+        return;
+
+    mesh_record mesh = meshes[instance.info.x];
+
+    float scale = max( max(length(instance.world[0].xyz), length(instance.world[1].xyz)),
+                       length(instance.world[2].xyz) );
+
+    // One LOD for all parts of the instance, from the bounds of the mesh
+    vec3 meshCenter = (instance.world * vec4(mesh.sphere.xyz, 1.0)).xyz;
+    float meshRadius = mesh.sphere.w * scale;
+    if(!isInFrustum(meshCenter, meshRadius))
+        return;
+
+    int lod = 0;
+    float distance = -(qt_ViewMatrix * vec4(meshCenter, 1.0)).z;
+    if(distance > meshRadius)
+    {
+        float screenSize = meshRadius * qt_ProjectionScale / distance;
+        lod = clamp(int(log2(qt_Lod0ScreenSize / screenSize) + qt_LodBias), 0, c_maxLod);
+    }
+
+    for(uint p=mesh.parts.x; p<mesh.parts.x+mesh.parts.y; p++)
+    {
+        part_record part = parts[p];
+
+        vec3 center = (instance.world * vec4(part.sphere.xyz, 1.0)).xyz;
+        float radius = part.sphere.w * scale;
+        if(!isInFrustum(center, radius))
+            continue;
+#ifdef OCCLUSION_CULLING
+        if(isOccluded(center, radius))
+            continue;
+#endif
+
+        int partLod = min(lod, part.info.z - 1);
+#ifdef SPLIT_TRANSPARENT
+        uint list = part.info.w != 0 ? 1u : 0u;
+#else
+        uint list = 0u;
+#endif
+        uint slot = atomicAdd(counts[list], 1u);
+        if(slot >= qt_ListCapacity)
+            continue;
+        slot += list * qt_ListCapacity;
+
+        commands[slot].count = uint(part.lodLength[partLod]);
+        commands[slot].instanceCount = 1u;
+        commands[slot].firstIndex = uint(part.lodStart[partLod]);
+        commands[slot].baseVertex = part.info.x;
+        commands[slot].baseInstance = slot;
+        drawRecords[slot] = ivec2(int(instanceIndex), part.info.y);
+    }
+}
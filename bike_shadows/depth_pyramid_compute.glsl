@@ -0,0 +1,46 @@
+#version 430
+
+// Builds one level of IndirectRenderer's depth pyramid, in which every
+// texel holds the farthest depth of the texels it covers in the level
+// below. The first level is a copy of the depth buffer (FIRST_LEVEL).
+// With REVERSED_Z depth falls with distance, so the farthest is the least.
+// Sizes are rounded up from level to level, so that the texels on odd
+// edges are never dropped.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+#ifdef REVERSED_Z
+#define FARTHEST(a, b) min(a, b)
+#else
+#define FARTHEST(a, b) max(a, b)
+#endif
+
+#ifdef FIRST_LEVEL
+uniform sampler2D qt_Depth;
+#else
+layout(r32f, binding = 0) readonly uniform image2D qt_Source;
+#endif
+layout(r32f, binding = 1) writeonly uniform image2D qt_Destination;
+
+uniform ivec2 qt_SourceSize;
+uniform ivec2 qt_DestinationSize;
+
+void main(void)
+{
+    ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+    if(texel.x >= qt_DestinationSize.x || texel.y >= qt_DestinationSize.y)
+        return;
+
+#ifdef FIRST_LEVEL
+    float depth = texelFetch(qt_Depth, texel, 0).r;
+#else
+    ivec2 last = qt_SourceSize - ivec2(1, 1);
+    ivec2 source = texel * 2;
+    float depth = FARTHEST( FARTHEST(imageLoad(qt_Source, min(source, last)).r,
+                                     imageLoad(qt_Source, min(source + ivec2(1, 0), last)).r),
+                            FARTHEST(imageLoad(qt_Source, min(source + ivec2(0, 1), last)).r,
+                                     imageLoad(qt_Source, min(source + ivec2(1, 1), last)).r) );
+#endif
+
+    imageStore(qt_Destination, texel, vec4(depth, 0.0, 0.0, 0.0));
+}
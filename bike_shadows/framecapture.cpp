@@ -0,0 +1,322 @@
+#include "framecapture.h"
+#include "frameprofiler.h"
+
+#include <QFile>
+#include <QImage>
+#include <QMutex>
+#include <QThread>
+#include <QDateTime>
+#include <QWaitCondition>
+#include <cstring>
+
+// How long a frame may take on the GPU before its readback is waited on
+// regardless. Only a hung GPU takes this long.
+static const GLuint64 FENCE_TIMEOUT = 1000000000; // nanoseconds
+
+class CaptureWriter : public QThread
+{
+public:
+    CaptureWriter() : m_stopped(false) { m_padding[0] = 0; }
+    ~CaptureWriter() {
+        this->stop();
+    }
+
+    void stop() {
+        m_mutex.lock();
+        m_stopped = true;
+        m_condition.wakeAll();
+        m_mutex.unlock();
+        this->wait();
+    }
+
+    // Returns false, and takes nothing, if too many frames are queued
+    bool enqueue(const QImage &image, const QString &fileName, bool raw) {
+        QMutexLocker locker(&m_mutex);
+        if(m_jobs.size() >= FrameCapture::MaxQueuedFrames)
+            return false;
+
+        Job job;
+        job.image = image;
+        job.fileName = fileName;
+        job.raw = raw;
+        m_jobs.append(job);
+        m_condition.wakeAll();
+        return true;
+    }
+
+    bool isIdle() {
+        QMutexLocker locker(&m_mutex);
+        return m_jobs.isEmpty();
+    }
+
+protected:
+    void run();
+
+private:
+    struct Job
+    {
+        QImage image;
+        QString fileName;
+        bool raw;
+    };
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QList<Job> m_jobs;
+    bool m_stopped;
+    char m_padding[7];
+};
+
+void CaptureWriter::run()
+{
+    QFile rawFile;
+    while(1)
+    {
+        // Queued frames are written out even when stopped, so that nothing
+        // captured is lost on the way out
+        m_mutex.lock();
+        while(m_jobs.isEmpty() && !m_stopped)
+            m_condition.wait(&m_mutex);
+        if(m_jobs.isEmpty())
+        {
+            m_mutex.unlock();
+            break;
+        }
+        const Job job = m_jobs.first();
+        m_mutex.unlock();
+
+        // OpenGL reads bottom row first
+        const QImage image = job.image.mirrored(false, true);
+        if(job.raw)
+        {
+            if(rawFile.fileName() != job.fileName)
+            {
+                rawFile.close();
+                rawFile.setFileName(job.fileName);
+                if(!rawFile.open(QFile::WriteOnly|QFile::Append))
+                    qWarning("Could not write frames to %s", qPrintable(job.fileName));
+            }
+            if(rawFile.isOpen())
+                rawFile.write(reinterpret_cast<const char*>(image.constBits()), qint64(image.bytesPerLine())*image.height());
+        }
+        else if(!image.save(job.fileName, "PNG"))
+            qWarning("Could not write %s", qPrintable(job.fileName));
+
+        // Dequeued only once written, so that isIdle() means on disk
+        m_mutex.lock();
+        m_jobs.removeFirst();
+        m_mutex.unlock();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+FrameCapture::FrameCapture()
+    : m_nextSlot(0), m_pendingCount(0), m_directory(QDir::temp()), m_recordedFrames(0),
+      m_capturedFrames(0), m_droppedFrames(0), m_writer(new CaptureWriter),
+      m_format(PngFrames), m_recording(false), m_initialized(false)
+{
+    m_padding[0] = 0;
+    for(int i=0; i<FramesInFlight; i++)
+    {
+        Slot &slot = m_slots[i];
+        slot.buffer = 0;
+        slot.capacity = 0;
+        slot.fence = nullptr;
+        slot.raw = false;
+    }
+
+    m_writer->start(QThread::LowPriority);
+}
+
+FrameCapture::~FrameCapture()
+{
+    if(m_initialized)
+    {
+        // Frames in flight are finished off, then the buffers go
+        this->collect(true);
+        for(int i=0; i<FramesInFlight; i++)
+        {
+            // Left behind only if the GPU never finished them
+            if(m_slots[i].fence)
+                glDeleteSync(m_slots[i].fence);
+            if(m_slots[i].buffer > 0)
+                glDeleteBuffers(1, &m_slots[i].buffer);
+        }
+    }
+
+    delete m_writer;
+}
+
+QString FrameCapture::takeSnapshot()
+{
+    m_snapshotFileName = m_directory.absoluteFilePath( QString("bike_shadows_snapshot_%1.png").arg(this->timestamp()) );
+    return m_snapshotFileName;
+}
+
+QString FrameCapture::startRecording(Format format)
+{
+    this->stopRecording();
+
+    const QString name = QString("bike_shadows_recording_%1").arg(this->timestamp());
+    if(format == PngFrames)
+    {
+        m_directory.mkpath(name);
+        m_recordingPath = m_directory.absoluteFilePath(name);
+    }
+    else
+        m_recordingPath = m_directory.absoluteFilePath(name + ".rgba");
+
+    m_format = format;
+    m_recordingSize = QSize();
+    m_recordedFrames = 0;
+    m_recording = true;
+    return m_recordingPath;
+}
+
+void FrameCapture::stopRecording()
+{
+    m_recording = false;
+}
+
+bool FrameCapture::isBusy() const
+{
+    return m_recording || !m_snapshotFileName.isEmpty() || m_pendingCount > 0 || !m_writer->isIdle();
+}
+
+void FrameCapture::captureFrame(uint framebuffer, const QSize &size)
+{
+    if(!m_recording && m_snapshotFileName.isEmpty() && m_pendingCount == 0)
+        return;
+
+    FrameProfiler::Scope scope("capture");
+
+    this->initialize(); // init happens only once.
+    this->collect(false);
+    if(!m_recording && m_snapshotFileName.isEmpty())
+        return;
+
+    // The slot about to be reused is FramesInFlight frames old, and read
+    // back by now on any sane driver. If not, only that one is waited on,
+    // and if even that times out the frame is dropped rather than the slot
+    // reused while in flight. A snapshot is simply taken a frame later.
+    Slot &slot = m_slots[m_nextSlot];
+    if(slot.fence)
+    {
+        const GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+        if(status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+        {
+            if(m_recording)
+                ++m_droppedFrames;
+            return;
+        }
+        // Signaled, and the oldest, so it is read back now
+        this->collect(false);
+    }
+
+    QString fileName;
+    bool raw = false;
+    if(!m_snapshotFileName.isEmpty())
+    {
+        fileName = m_snapshotFileName;
+        m_snapshotFileName.clear();
+    }
+    else if(m_recording)
+    {
+        // A raw file has no room for frames of another size
+        if(m_format == RawFrames)
+        {
+            if(m_recordingSize.isEmpty())
+                m_recordingSize = size;
+            if(size != m_recordingSize)
+            {
+                qWarning("Frame size changed, recording stopped");
+                this->stopRecording();
+                return;
+            }
+            fileName = m_recordingPath;
+            raw = true;
+        }
+        else
+            fileName = QDir(m_recordingPath).absoluteFilePath( QString("frame_%1.png").arg(m_recordedFrames, 6, 10, QChar('0')) );
+        ++m_recordedFrames;
+    }
+
+    if(fileName.isEmpty() || size.isEmpty())
+        return;
+
+    const int bytes = size.width()*size.height()*4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    if(bytes > slot.capacity)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+        slot.capacity = bytes;
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.size = size;
+    slot.fileName = fileName;
+    slot.raw = raw;
+    ++m_pendingCount;
+    m_nextSlot = (m_nextSlot+1) % FramesInFlight;
+}
+
+void FrameCapture::initialize()
+{
+    if(m_initialized)
+        return;
+
+    QOpenGLExtraFunctions::initializeOpenGLFunctions();
+    for(int i=0; i<FramesInFlight; i++)
+        glGenBuffers(1, &m_slots[i].buffer);
+
+    m_initialized = true;
+}
+
+void FrameCapture::collect(bool wait)
+{
+    // Oldest first, so that frames reach the writer in order
+    for(int i=0; i<FramesInFlight && m_pendingCount > 0; i++)
+    {
+        Slot &slot = m_slots[(m_nextSlot+i) % FramesInFlight];
+        if(!slot.fence)
+            continue;
+
+        const GLenum status = glClientWaitSync(slot.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                               wait ? FENCE_TIMEOUT : 0);
+        if(status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+            break;
+
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+        --m_pendingCount;
+
+        const int bytes = slot.size.width()*slot.size.height()*4;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        const uchar *pixels = static_cast<const uchar*>( glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT) );
+        if(pixels)
+        {
+            // The only copy made on this thread. Everything else happens on
+            // the writer's.
+            QImage image(slot.size, QImage::Format_RGBA8888);
+            memcpy(image.bits(), pixels, size_t(bytes));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+            if(m_writer->enqueue(image, slot.fileName, slot.raw))
+                ++m_capturedFrames;
+            else
+                ++m_droppedFrames;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+}
+
+QString FrameCapture::timestamp() const
+{
+    return QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss-zzz");
+}
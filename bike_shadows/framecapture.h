@@ -0,0 +1,92 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <QDir>
+#include <QSize>
+#include <QString>
+#include <QOpenGLExtraFunctions>
+
+class CaptureWriter;
+
+/*
+ * Captures rendered frames without stalling the pipeline. Each captured
+ * frame is read into one of a ring of pixel buffer objects, which the GPU
+ * fills in its own time. A few frames later, when its fence has signaled,
+ * the buffer is mapped and copied out, and a writer thread flips and saves
+ * the frame. The render thread only pays for the copy.
+ *
+ * Snapshots are single PNG files. Recordings are either a directory of PNG
+ * frames, or a single file of raw RGBA frames, top row first, which for
+ * example "ffmpeg -f rawvideo -pix_fmt rgba -s WxH -r 60 -i file" turns
+ * into a video. Frames are dropped, and counted, when the writer falls too
+ * far behind.
+ */
+class FrameCapture : public QOpenGLExtraFunctions
+{
+public:
+    FrameCapture();
+    ~FrameCapture();
+
+    enum { FramesInFlight = 3, MaxQueuedFrames = 16 };
+    enum Format { PngFrames, RawFrames };
+
+    // Where snapshots and recordings go, the temp directory by default
+    void setDirectory(const QDir &val) { m_directory = val; }
+    QDir directory() const { return m_directory; }
+
+    // Captures the next frame into a PNG file, and returns its name
+    QString takeSnapshot();
+
+    // Captures every frame from the next one on, and returns the name of
+    // the directory or file the frames go into
+    QString startRecording(Format format);
+    void stopRecording();
+    bool isRecording() const { return m_recording; }
+    Format recordingFormat() const { return m_format; }
+
+    // True while frames are in flight, or wanted. Frames must keep coming
+    // until then.
+    bool isBusy() const;
+
+    // Call once per frame, after the frame has been rendered into
+    // framebuffer. Reads it back if it is to be captured, and hands frames
+    // read back earlier over to the writer.
+    void captureFrame(uint framebuffer, const QSize &size);
+
+    int capturedFrameCount() const { return m_capturedFrames; }
+    int droppedFrameCount() const { return m_droppedFrames; }
+
+private:
+    void initialize();
+    void collect(bool wait);
+    QString timestamp() const;
+
+private:
+    struct Slot
+    {
+        uint buffer;
+        int capacity;       // bytes
+        GLsync fence;
+        QSize size;
+        QString fileName;
+        bool raw;
+    };
+    Slot m_slots[FramesInFlight];
+    int m_nextSlot;
+    int m_pendingCount;
+
+    QDir m_directory;
+    QString m_snapshotFileName;
+    QString m_recordingPath;
+    QSize m_recordingSize;
+    int m_recordedFrames;
+    int m_capturedFrames;
+    int m_droppedFrames;
+    CaptureWriter *m_writer;
+    Format m_format;
+    bool m_recording;
+    bool m_initialized;
+    char m_padding[2];
+};
+
+#endif // FRAME_CAPTURE_H
@@ -0,0 +1,324 @@
+#include "frameprofiler.h"
+
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QOpenGLContext>
+#include <QOpenGLTimeMonitor>
+#include <QtMath>
+#include <algorithm>
+
+bool FrameProfiler::enabled = false;
+QAtomicInt FrameProfiler::loadAllocations(0);
+QAtomicInteger<qint64> FrameProfiler::loadAllocatedBytes(0);
+QAtomicInt FrameProfiler::loadHeapAllocations(0);
+
+Q_GLOBAL_STATIC(FrameProfiler, frameProfiler)
+
+FrameProfiler *FrameProfiler::instance()
+{
+    return frameProfiler;
+}
+
+FrameProfiler::FrameProfiler()
+    : m_frameNumber(0), m_currentSlot(0), m_gpuTimersAvailable(true), m_inFrame(false)
+{
+    m_padding[0] = 0;
+}
+
+FrameProfiler::~FrameProfiler()
+{
+    // Timer queries belong to a context that is most likely gone by now,
+    // so they are leaked on purpose.
+}
+
+void FrameProfiler::setEnabled(bool val)
+{
+    if(enabled == val)
+        return;
+
+    enabled = val;
+    if(enabled && !m_clock.isValid())
+        m_clock.start();
+
+    m_openSections.clear();
+    m_inFrame = false;
+}
+
+void FrameProfiler::beginFrame()
+{
+    if(!enabled)
+        return;
+
+    if(m_inFrame)
+        this->endFrame();
+
+    m_currentSlot = int(m_frameNumber % FramesInFlight);
+    Frame &frame = m_frames[m_currentSlot];
+
+    // Results of the frame that last used this slot should be in by now
+    if(frame.pending)
+        this->collectGpuResults(m_currentSlot);
+
+    if(frame.monitor == nullptr && m_gpuTimersAvailable && QOpenGLContext::currentContext())
+    {
+        frame.monitor = new QOpenGLTimeMonitor;
+        frame.monitor->setSampleCount(MaxSectionsPerFrame*2);
+        if(!frame.monitor->create())
+        {
+            delete frame.monitor;
+            frame.monitor = nullptr;
+            m_gpuTimersAvailable = false;
+        }
+    }
+
+    if(frame.monitor)
+        frame.monitor->reset();
+
+    frame.number = m_frameNumber++;
+    frame.sections.clear();
+    m_openSections.clear();
+    m_counters = Counters();
+    m_inFrame = true;
+}
+
+void FrameProfiler::endFrame()
+{
+    if(!enabled || !m_inFrame)
+        return;
+
+    while(!m_openSections.isEmpty())
+        this->endSection();
+
+    m_lastCounters = m_counters;
+    m_inFrame = false;
+
+    Frame &frame = m_frames[m_currentSlot];
+    frame.pending = true;
+    if(frame.monitor == nullptr)
+        this->collectGpuResults(m_currentSlot);
+}
+
+void FrameProfiler::beginSection(const QString &name)
+{
+    if(!enabled || !m_inFrame)
+        return;
+
+    Frame &frame = m_frames[m_currentSlot];
+    if(frame.sections.size() >= MaxSectionsPerFrame)
+        return;
+
+    Section section;
+    section.name = name;
+    section.depth = m_openSections.size();
+    section.cpuStart = m_clock.nsecsElapsed();
+    section.cpuEnd = section.cpuStart;
+    section.gpuStart = frame.monitor ? frame.monitor->recordSample() : -1;
+    section.gpuEnd = -1;
+    section.gpuStartTime = 0;
+    section.gpuEndTime = 0;
+
+    if(section.depth == 0 && !m_sectionOrder.contains(name))
+        m_sectionOrder.append(name);
+
+    m_openSections.append(frame.sections.size());
+    frame.sections.append(section);
+}
+
+void FrameProfiler::endSection()
+{
+    if(!enabled || m_openSections.isEmpty())
+        return;
+
+    Frame &frame = m_frames[m_currentSlot];
+    Section &section = frame.sections[m_openSections.takeLast()];
+    section.cpuEnd = m_clock.nsecsElapsed();
+    section.gpuEnd = frame.monitor ? frame.monitor->recordSample() : -1;
+
+    this->addSample(m_cpuSamples, section.name, double(section.cpuEnd-section.cpuStart)/1e6);
+}
+
+void FrameProfiler::addDrawCall(int indexCount)
+{
+    ++m_counters.drawCalls;
+    m_counters.triangles += indexCount/3;
+}
+
+void FrameProfiler::addStateChanges(int count)
+{
+    m_counters.stateChanges += count;
+}
+
+void FrameProfiler::addAllocations(int count, qint64 bytes, int heapAllocations)
+{
+    m_counters.allocations += count;
+    m_counters.allocatedBytes += bytes;
+    m_counters.heapAllocations += heapAllocations;
+}
+
+void FrameProfiler::countLoadAllocations(int count, qint64 bytes, int heapAllocations)
+{
+    loadAllocations.fetchAndAddRelaxed(count);
+    loadAllocatedBytes.fetchAndAddRelaxed(bytes);
+    loadHeapAllocations.fetchAndAddRelaxed(heapAllocations);
+}
+
+FrameProfiler::Counters FrameProfiler::loadCounters() const
+{
+    Counters ret;
+    ret.allocations = loadAllocations.loadAcquire();
+    ret.allocatedBytes = loadAllocatedBytes.loadAcquire();
+    ret.heapAllocations = loadHeapAllocations.loadAcquire();
+    return ret;
+}
+
+void FrameProfiler::collectGpuResults(int slot)
+{
+    Frame &frame = m_frames[slot];
+    if(!frame.pending)
+        return;
+
+    if(frame.monitor)
+    {
+        const QVector<GLuint64> samples = frame.monitor->waitForSamples();
+        for(int i=0; i<frame.sections.size(); i++)
+        {
+            Section &section = frame.sections[i];
+            if(section.gpuStart < 0 || section.gpuEnd < 0 ||
+               section.gpuStart >= samples.size() || section.gpuEnd >= samples.size())
+                continue;
+
+            section.gpuStartTime = qint64(samples.at(section.gpuStart));
+            section.gpuEndTime = qint64(samples.at(section.gpuEnd));
+            this->addSample(m_gpuSamples, section.name, double(section.gpuEndTime-section.gpuStartTime)/1e6);
+        }
+    }
+
+    Frame traceFrame;
+    traceFrame.number = frame.number;
+    traceFrame.sections = frame.sections;
+    m_trace.append(traceFrame);
+    if(m_trace.size() > TraceFrameCount)
+        m_trace.removeFirst();
+
+    frame.pending = false;
+}
+
+void FrameProfiler::addSample(QHash<QString, QVector<double> > &samples, const QString &name, double value)
+{
+    QVector<double> &values = samples[name];
+    if(values.size() >= SampleWindow)
+        values.removeFirst();
+    values.append(value);
+}
+
+FrameProfiler::Statistics FrameProfiler::statistics(const QVector<double> &samples)
+{
+    Statistics ret;
+    if(samples.isEmpty())
+        return ret;
+
+    QVector<double> sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+
+    double sum = 0;
+    Q_FOREACH(double sample, sorted)
+        sum += sample;
+
+    ret.mean = sum / sorted.size();
+    ret.p95 = sorted.at( qBound(0, int(qCeil(0.95*sorted.size()))-1, sorted.size()-1) );
+    ret.max = sorted.last();
+    return ret;
+}
+
+FrameProfiler::Statistics FrameProfiler::cpuStatistics(const QString &section) const
+{
+    return statistics(m_cpuSamples.value(section));
+}
+
+FrameProfiler::Statistics FrameProfiler::gpuStatistics(const QString &section) const
+{
+    return statistics(m_gpuSamples.value(section));
+}
+
+QString FrameProfiler::summary() const
+{
+    QStringList lines;
+    lines << "ms (mean / p95 / max)";
+    Q_FOREACH(const QString &name, m_sectionOrder)
+    {
+        const Statistics cpu = this->cpuStatistics(name);
+        QString line = QString("%1 cpu %2 / %3 / %4").arg(name, -8)
+                .arg(cpu.mean, 0, 'f', 2).arg(cpu.p95, 0, 'f', 2).arg(cpu.max, 0, 'f', 2);
+        if(m_gpuSamples.contains(name))
+        {
+            const Statistics gpu = this->gpuStatistics(name);
+            line += QString("  gpu %1 / %2 / %3")
+                    .arg(gpu.mean, 0, 'f', 2).arg(gpu.p95, 0, 'f', 2).arg(gpu.max, 0, 'f', 2);
+        }
+        lines << line;
+    }
+
+    lines << QString("%1 draws, %2 triangles, %3 state changes")
+             .arg(m_lastCounters.drawCalls).arg(m_lastCounters.triangles).arg(m_lastCounters.stateChanges);
+    lines << QString("%1 frame allocations, %2 KB, %3 from the heap")
+             .arg(m_lastCounters.allocations).arg(m_lastCounters.allocatedBytes/1024)
+             .arg(m_lastCounters.heapAllocations);
+
+    const Counters load = this->loadCounters();
+    lines << QString("%1 load allocations, %2 KB, %3 from the heap")
+             .arg(load.allocations).arg(load.allocatedBytes/1024).arg(load.heapAllocations);
+    return lines.join("\n");
+}
+
+bool FrameProfiler::writeTrace(const QString &fileName) const
+{
+    QFile file(fileName);
+    if(!file.open(QFile::WriteOnly))
+        return false;
+
+    // GPU timestamps run on their own clock; line them up with the CPU start
+    // of the first timed section in each frame.
+    QJsonArray events;
+    Q_FOREACH(const Frame &frame, m_trace)
+    {
+        qint64 gpuOffset = 0;
+        bool gpuOffsetKnown = false;
+        Q_FOREACH(const Section &section, frame.sections)
+        {
+            QJsonObject cpuEvent;
+            cpuEvent.insert("name", section.name);
+            cpuEvent.insert("cat", "cpu");
+            cpuEvent.insert("ph", "X");
+            cpuEvent.insert("ts", double(section.cpuStart)/1e3);
+            cpuEvent.insert("dur", double(section.cpuEnd-section.cpuStart)/1e3);
+            cpuEvent.insert("pid", 1);
+            cpuEvent.insert("tid", 1);
+            cpuEvent.insert("args", QJsonObject{ {"frame", double(frame.number)} });
+            events.append(cpuEvent);
+
+            if(section.gpuEndTime <= section.gpuStartTime)
+                continue;
+
+            if(!gpuOffsetKnown)
+            {
+                gpuOffset = section.cpuStart - section.gpuStartTime;
+                gpuOffsetKnown = true;
+            }
+
+            QJsonObject gpuEvent = cpuEvent;
+            gpuEvent.insert("cat", "gpu");
+            gpuEvent.insert("ts", double(section.gpuStartTime+gpuOffset)/1e3);
+            gpuEvent.insert("dur", double(section.gpuEndTime-section.gpuStartTime)/1e3);
+            gpuEvent.insert("tid", 2);
+            events.append(gpuEvent);
+        }
+    }
+
+    QJsonObject trace;
+    trace.insert("traceEvents", events);
+    trace.insert("displayTimeUnit", "ms");
+    file.write( QJsonDocument(trace).toJson(QJsonDocument::Compact) );
+    return true;
+}
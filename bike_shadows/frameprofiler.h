@@ -0,0 +1,152 @@
+#ifndef FRAME_PROFILER_H
+#define FRAME_PROFILER_H
+
+#include <QHash>
+#include <QAtomicInt>
+#include <QString>
+#include <QVector>
+#include <QElapsedTimer>
+
+class QOpenGLTimeMonitor;
+
+/*
+ * Collects CPU and GPU time of named sections of a frame (passes, model
+ * renders), and counts draw calls, triangles and state changes.
+ *
+ * GPU times come from timestamp queries, which are read back a couple of
+ * frames late so that the CPU never waits on them. Rolling statistics of
+ * the last SampleWindow frames are kept per section, and the events of the
+ * last few frames can be written out as a Chrome trace (chrome://tracing).
+ *
+ * Everything is a no-op unless profiling is enabled; the counters in the
+ * draw loops then cost a single branch.
+ */
+class FrameProfiler
+{
+public:
+    static FrameProfiler *instance();
+    static bool isEnabled() { return enabled; }
+
+    void setEnabled(bool val);
+
+    enum { SampleWindow = 120, FramesInFlight = 3, MaxSectionsPerFrame = 128, TraceFrameCount = 60 };
+
+    void beginFrame();
+    void endFrame();
+
+    void beginSection(const QString &name);
+    void endSection();
+
+    static void countDrawCall(int indexCount) {
+        if(enabled) instance()->addDrawCall(indexCount);
+    }
+    static void countStateChange(int count=1) {
+        if(enabled) instance()->addStateChanges(count);
+    }
+
+    // Allocations of the frame (from its arena), and how many of them had
+    // to go to the heap
+    static void countAllocations(int count, qint64 bytes, int heapAllocations) {
+        if(enabled) instance()->addAllocations(count, bytes, heapAllocations);
+    }
+
+    // Allocations made while loading meshes, on any thread. Counted even
+    // when profiling is off, as loading is usually over by the time it is
+    // turned on.
+    static void countLoadAllocations(int count, qint64 bytes, int heapAllocations);
+
+    struct Statistics
+    {
+        Statistics() : mean(0), p95(0), max(0) { }
+        double mean, p95, max; // milliseconds
+    };
+    Statistics cpuStatistics(const QString &section) const;
+    Statistics gpuStatistics(const QString &section) const;
+
+    struct Counters
+    {
+        Counters() : drawCalls(0), triangles(0), stateChanges(0), allocations(0),
+            allocatedBytes(0), heapAllocations(0) { }
+        int drawCalls, triangles, stateChanges;
+        int allocations;
+        qint64 allocatedBytes;
+        int heapAllocations;
+    };
+    Counters lastFrameCounters() const { return m_lastCounters; }
+    Counters loadCounters() const;
+
+    // Multi-line summary of all passes, for use in overlays
+    QString summary() const;
+
+    bool writeTrace(const QString &fileName) const;
+
+    class Scope
+    {
+    public:
+        Scope(const char *name) : m_active(enabled) {
+            if(m_active) instance()->beginSection(QString::fromLatin1(name));
+        }
+        Scope(const char *name, int index) : m_active(enabled) {
+            if(m_active) instance()->beginSection(QString::fromLatin1(name) + QString::number(index));
+        }
+        ~Scope() {
+            if(m_active) instance()->endSection();
+        }
+
+    private:
+        bool m_active;
+        char m_padding[7];
+    };
+
+    FrameProfiler();
+    ~FrameProfiler();
+
+private:
+    void addDrawCall(int indexCount);
+    void addStateChanges(int count);
+    void addAllocations(int count, qint64 bytes, int heapAllocations);
+    void collectGpuResults(int slot);
+    void addSample(QHash<QString,QVector<double> > &samples, const QString &name, double value);
+    static Statistics statistics(const QVector<double> &samples);
+
+private:
+    static bool enabled;
+    static QAtomicInt loadAllocations;
+    static QAtomicInteger<qint64> loadAllocatedBytes;
+    static QAtomicInt loadHeapAllocations;
+
+    struct Section
+    {
+        QString name;
+        int depth;
+        qint64 cpuStart, cpuEnd;    // nanoseconds since the profiler started
+        int gpuStart, gpuEnd;       // timestamp sample indexes, -1 if none
+        qint64 gpuStartTime, gpuEndTime;
+    };
+
+    struct Frame
+    {
+        Frame() : number(-1), monitor(nullptr), pending(false) { }
+        qint64 number;
+        QVector<Section> sections;
+        QOpenGLTimeMonitor *monitor;
+        bool pending;
+    };
+
+    QElapsedTimer m_clock;
+    qint64 m_frameNumber;
+    int m_currentSlot;
+    Frame m_frames[FramesInFlight];
+    QVector<int> m_openSections;
+    Counters m_counters;
+    Counters m_lastCounters;
+    QHash<QString, QVector<double> > m_cpuSamples;
+    QHash<QString, QVector<double> > m_gpuSamples;
+    QStringList m_sectionOrder;
+    QVector<Frame> m_trace;
+    bool m_gpuTimersAvailable;
+    bool m_inFrame;
+    char m_padding[6];
+};
+
+#endif // FRAME_PROFILER_H
@@ -0,0 +1,100 @@
+#include "framescheduler.h"
+
+#include <QTimer>
+
+const qreal FrameScheduler::MaxFrameTime = 0.1;
+
+FrameScheduler::FrameScheduler(const std::function<void()> &requestFrame)
+    : m_requestFrame(requestFrame), m_timer(new QTimer), m_mode(Continuous),
+      m_frameRate(30), m_measuredFrameRate(0), m_framesSinceRateUpdate(0),
+      m_frameRequested(false)
+{
+    m_padding[0] = 0;
+
+    m_timer->setTimerType(Qt::PreciseTimer);
+    m_timer->setInterval( int(1000.0/m_frameRate) );
+    QObject::connect(m_timer, &QTimer::timeout, [=]() { this->invalidate(); });
+
+    this->invalidate();
+}
+
+FrameScheduler::~FrameScheduler()
+{
+    delete m_timer;
+}
+
+void FrameScheduler::setMode(Mode mode)
+{
+    if(m_mode == mode)
+        return;
+
+    m_mode = mode;
+    if(m_mode == FixedRate)
+        m_timer->start();
+    else
+        m_timer->stop();
+
+    // Animation time starts afresh, instead of covering the time spent in
+    // the previous mode
+    m_frameClock.invalidate();
+    this->invalidate();
+}
+
+QString FrameScheduler::modeName(Mode mode)
+{
+    switch(mode)
+    {
+    case OnDemand: return "on demand";
+    case Continuous: return "continuous";
+    case FixedRate: return "fixed rate";
+    }
+
+    return QString();
+}
+
+void FrameScheduler::setFrameRate(qreal val)
+{
+    m_frameRate = qBound(qreal(1), val, qreal(1000));
+    m_timer->setInterval( qMax(1, int(1000.0/m_frameRate)) );
+}
+
+void FrameScheduler::invalidate()
+{
+    // Requests are collapsed until the frame is rendered
+    if(m_frameRequested)
+        return;
+
+    m_frameRequested = true;
+    m_requestFrame();
+}
+
+qreal FrameScheduler::beginFrame()
+{
+    m_frameRequested = false;
+
+    qreal ret = 0;
+    if(m_frameClock.isValid())
+        ret = qreal(m_frameClock.restart()) / 1000.0;
+    else
+        m_frameClock.start();
+
+    if(!m_rateClock.isValid())
+        m_rateClock.start();
+    ++m_framesSinceRateUpdate;
+    if(m_rateClock.elapsed() >= 1000)
+    {
+        m_measuredFrameRate = qreal(m_framesSinceRateUpdate) * 1000.0 / qreal(m_rateClock.restart());
+        m_framesSinceRateUpdate = 0;
+    }
+
+    if(m_mode == OnDemand)
+        return 0;
+
+    return qMin(ret, MaxFrameTime);
+}
+
+void FrameScheduler::endFrame()
+{
+    if(m_mode == Continuous)
+        this->invalidate();
+}
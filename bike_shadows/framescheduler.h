@@ -0,0 +1,67 @@
+#ifndef FRAME_SCHEDULER_H
+#define FRAME_SCHEDULER_H
+
+#include <QString>
+#include <QElapsedTimer>
+#include <functional>
+
+class QTimer;
+
+/*
+ * Decides when a window produces its next frame, and how much animation
+ * time each frame covers.
+ *
+ * OnDemand renders only when invalidate() is called (input, resize, a
+ * change in the scene) and does not animate, so an idle window costs
+ * nothing. Continuous asks for a new frame as soon as one is done; with
+ * QWindow::requestUpdate() or QOpenGLWidget::update() that is paced by the
+ * display's vsync. FixedRate renders from a timer at frameRate().
+ *
+ * The scheduler only asks for frames through the requestFrame function
+ * given to it; the window calls beginFrame() and endFrame() around its
+ * rendering.
+ */
+class FrameScheduler
+{
+public:
+    enum Mode { OnDemand, Continuous, FixedRate };
+
+    FrameScheduler(const std::function<void()> &requestFrame);
+    ~FrameScheduler();
+
+    void setMode(Mode mode);
+    Mode mode() const { return m_mode; }
+    static QString modeName(Mode mode);
+
+    // Frames per second in FixedRate mode. 30 by default.
+    void setFrameRate(qreal val);
+    qreal frameRate() const { return m_frameRate; }
+
+    // Something changed and needs to be rendered
+    void invalidate();
+
+    // Returns the animation time, in seconds, that the frame about to be
+    // rendered should advance by. Zero in OnDemand mode; never more than
+    // MaxFrameTime, so that a stall does not make animations jump.
+    qreal beginFrame();
+    void endFrame();
+
+    // Frames actually rendered per second, averaged over the last second
+    qreal measuredFrameRate() const { return m_measuredFrameRate; }
+
+    static const qreal MaxFrameTime;
+
+private:
+    std::function<void()> m_requestFrame;
+    QTimer *m_timer;
+    QElapsedTimer m_frameClock;
+    QElapsedTimer m_rateClock;
+    Mode m_mode;
+    qreal m_frameRate;
+    qreal m_measuredFrameRate;
+    int m_framesSinceRateUpdate;
+    bool m_frameRequested;
+    char m_padding[3];
+};
+
+#endif // FRAME_SCHEDULER_H
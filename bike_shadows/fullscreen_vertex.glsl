@@ -0,0 +1,8 @@
+attribute vec2 qt_Vertex;
+varying vec2 v_TexCoord;
+
+void main(void)
+{
+    v_TexCoord = qt_Vertex * 0.5 + 0.5;
+    gl_Position = vec4(qt_Vertex, 0.0, 1.0);
+}
@@ -0,0 +1,6 @@
+uniform vec4 qt_Color;     // blended over the scene by its alpha
+
+void main(void)
+{
+    gl_FragColor = qt_Color;
+}
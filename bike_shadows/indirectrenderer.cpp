@@ -0,0 +1,803 @@
+#include "indirectrenderer.h"
+#include "frameprofiler.h"
+#include "scenestore.h"
+#include "sceneshading.h"
+#include "shaderprogram.h"
+#include "streambuffer.h"
+
+#include <QOpenGLBuffer>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QtMath>
+#include <cstring>
+
+#ifndef GL_PARAMETER_BUFFER
+#define GL_PARAMETER_BUFFER 0x80EE
+#endif
+
+// Work group sizes of the compute shaders
+static const int CULL_GROUP_SIZE = 64;
+static const int PYRAMID_GROUP_SIZE = 8;
+
+// Bytes per DrawElementsIndirectCommand and per draw record
+static const int COMMAND_SIZE = 5*int(sizeof(quint32));
+static const int DRAW_RECORD_SIZE = 2*int(sizeof(qint32));
+
+// Shader storage bindings, as in the shaders
+enum { InstanceBinding, MeshBinding, PartBinding, CommandBinding, DrawRecordBinding,
+       CounterBinding, MaterialBinding };
+
+// Bits of a cull program permutation
+enum { SplitTransparentVariant = 1, OcclusionCullingVariant = 2, ReversedZVariant = 4 };
+
+static void ToSphere(const BoundingBox &box, float *sphere)
+{
+    const QVector3D center = box.center();
+    sphere[0] = center.x();
+    sphere[1] = center.y();
+    sphere[2] = center.z();
+    sphere[3] = 0.5f * QVector3D(box.width(), box.height(), box.depth()).length();
+}
+
+IndirectRenderer::IndirectRenderer()
+    : m_multiDrawElementsIndirect(nullptr), m_multiDrawElementsIndirectCount(nullptr),
+      m_clearBufferData(nullptr),
+      m_positionBuffer(0), m_normalBuffer(0), m_indexBuffer(0),
+      m_vertexCount(0), m_vertexCapacity(0), m_indexCount(0), m_indexCapacity(0),
+      m_meshBuffer(0), m_partBuffer(0), m_materialBuffer(0), m_instanceBuffer(0),
+      m_instanceRecordBuffer(0), m_instanceRecordOffset(0), m_instanceRecordCount(0),
+      m_instanceRecordSceneSize(0), m_instanceRecordFrame(0), m_storageAlignment(4),
+      m_recordsDirty(false), m_hasUndrawableMeshes(false),
+      m_commandBuffer(0), m_drawRecordBuffer(0), m_counterBuffer(0),
+      m_commandCapacity(0), m_commandCount(0), m_vertexArray(0), m_vertexArrayDirty(true),
+      m_depthFbo(0), m_depthTex(0), m_pyramidTex(0), m_pyramidLevels(0),
+      m_pyramidValid(false), m_occlusionCulling(false), m_reversedZ(false), m_shadowProgram(nullptr),
+      m_frameArena(nullptr), m_streamBuffer(nullptr), m_lightManager(nullptr), m_temporalShadows(nullptr),
+      m_transparencyBuffer(nullptr), m_shadowTextureId(0), m_shadowMapSize(2048),
+      m_shadowFilterRange(2), m_shadowDepthRange(0.1f, 1000.0f), m_supported(false),
+      m_initialized(false)
+{
+    m_padding[0] = 0;
+    m_pyramidPrograms[0] = m_pyramidPrograms[1] = nullptr;
+}
+
+IndirectRenderer::~IndirectRenderer()
+{
+    if(!m_supported)
+        return;
+
+    qDeleteAll(m_cullPrograms);
+    qDeleteAll(m_scenePrograms);
+    delete m_shadowProgram;
+    delete m_pyramidPrograms[0];
+    delete m_pyramidPrograms[1];
+
+    const uint buffers[] = { m_positionBuffer, m_normalBuffer, m_indexBuffer, m_meshBuffer,
+                             m_partBuffer, m_materialBuffer, m_instanceBuffer, m_commandBuffer,
+                             m_drawRecordBuffer, m_counterBuffer };
+    for(uint buffer : buffers)
+    {
+        if(buffer > 0)
+            glDeleteBuffers(1, &buffer);
+    }
+
+    if(m_vertexArray > 0)
+        glDeleteVertexArrays(1, &m_vertexArray);
+
+    this->releaseDepthPyramid();
+}
+
+bool IndirectRenderer::initialize()
+{
+    if(m_initialized)
+        return m_supported;
+
+    QOpenGLExtraFunctions::initializeOpenGLFunctions();
+    m_initialized = true;
+
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    const QSurfaceFormat format = context->format();
+    if(context->isOpenGLES() || format.version() < qMakePair(4,3))
+    {
+        qWarning("Indirect draws need OpenGL 4.3, meshes will be drawn one by one");
+        return false;
+    }
+
+    m_multiDrawElementsIndirect = reinterpret_cast<MultiDrawElementsIndirectFunction>(
+                context->getProcAddress("glMultiDrawElementsIndirect") );
+    m_clearBufferData = reinterpret_cast<ClearBufferDataFunction>(
+                context->getProcAddress("glClearBufferData") );
+    if(!m_multiDrawElementsIndirect || !m_clearBufferData)
+        return false;
+
+    // With a draw count from the GPU, culled commands are not even fetched
+    if(format.version() >= qMakePair(4,6))
+        m_multiDrawElementsIndirectCount = reinterpret_cast<MultiDrawElementsIndirectCountFunction>(
+                    context->getProcAddress("glMultiDrawElementsIndirectCount") );
+    else if(context->hasExtension("GL_ARB_indirect_parameters"))
+        m_multiDrawElementsIndirectCount = reinterpret_cast<MultiDrawElementsIndirectCountFunction>(
+                    context->getProcAddress("glMultiDrawElementsIndirectCountARB") );
+
+    uint *buffers[] = { &m_meshBuffer, &m_partBuffer, &m_materialBuffer, &m_instanceBuffer,
+                        &m_counterBuffer };
+    for(uint *buffer : buffers)
+        glGenBuffers(1, buffer);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_counterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 2*sizeof(quint32), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glGenVertexArrays(1, &m_vertexArray);
+
+    // Instance records in the stream buffer are bound at their offset
+    GLint alignment = 0;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    m_storageAlignment = qMax(int(alignment), 4);
+
+    m_supported = true;
+    return true;
+}
+
+void IndirectRenderer::setOcclusionCullingEnabled(bool val)
+{
+    m_occlusionCulling = val;
+    m_pyramidValid = false;
+}
+
+void IndirectRenderer::setReversedZ(bool val)
+{
+    if(m_reversedZ == val)
+        return;
+
+    // The depth copy changes format, and the pyramid its reduction
+    m_reversedZ = val;
+    if(m_supported)
+    {
+        this->releaseDepthPyramid();
+        delete m_pyramidPrograms[0];
+        delete m_pyramidPrograms[1];
+    }
+    m_pyramidPrograms[0] = m_pyramidPrograms[1] = nullptr;
+}
+
+void IndirectRenderer::updateMeshes(const SceneStore *scene)
+{
+    if(!m_supported)
+        return;
+
+    // Meshes are picked up in order, as they are uploaded
+    bool pending = false;
+    for(int i=m_meshRecordIndexes.size(); i<scene->meshCount(); i++)
+    {
+        ObjModel *mesh = scene->mesh(i);
+        if(!mesh->isUploaded())
+        {
+            pending = true;
+            break;
+        }
+
+        const int record = this->addMesh(mesh);
+        m_meshRecordIndexes.append(record);
+        m_instanceRecordFrame = 0; // its instances have no records yet
+        m_hasUndrawableMeshes |= record < 0;
+    }
+
+    m_hasUndrawableMeshes |= pending;
+    if(!pending)
+        m_hasUndrawableMeshes = m_meshRecordIndexes.contains(-1);
+}
+
+int IndirectRenderer::addMesh(ObjModel *mesh)
+{
+    if(mesh->m_meshStreamer || !mesh->m_vertexBuffer || !mesh->m_indexBuffer || mesh->m_parts.isEmpty())
+        return -1;
+
+    Q_FOREACH(const ObjModel::Part &part, mesh->m_parts)
+    {
+        if(part.type != GL_TRIANGLES)
+            return -1;
+    }
+
+    // Models split by takeParts() share buffers, which are copied once
+    QOpenGLBuffer *vertexBuffer = mesh->m_vertexBuffer.data();
+    if(!m_regions.contains(vertexBuffer))
+    {
+        const int vertexCount = mesh->m_normalOffset / int(sizeof(QVector3D));
+        const int indexCount = mesh->m_indexBuffer->size() / int(sizeof(int));
+        this->reserveGeometry(m_vertexCount + vertexCount, m_indexCount + indexCount);
+
+        const GLsizeiptr positionBytes = GLsizeiptr(vertexCount)*GLsizeiptr(sizeof(QVector3D));
+        const GLintptr vertexOffset = GLintptr(m_vertexCount)*GLintptr(sizeof(QVector3D));
+        glBindBuffer(GL_COPY_READ_BUFFER, vertexBuffer->bufferId());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_positionBuffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, vertexOffset, positionBytes);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_normalBuffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, mesh->m_normalOffset, vertexOffset, positionBytes);
+
+        glBindBuffer(GL_COPY_READ_BUFFER, mesh->m_indexBuffer->bufferId());
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_indexBuffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+                            GLintptr(m_indexCount)*GLintptr(sizeof(int)),
+                            GLsizeiptr(indexCount)*GLsizeiptr(sizeof(int)));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        Region region;
+        region.baseVertex = m_vertexCount;
+        region.firstIndex = m_indexCount;
+        m_regions.insert(vertexBuffer, region);
+        m_vertexCount += vertexCount;
+        m_indexCount += indexCount;
+    }
+    const Region region = m_regions.value(vertexBuffer);
+
+    // Materials as SceneRenderer sets them. The specular color is zeroed
+    // for parts that have none, so that one permutation does for all.
+    const int firstMaterial = m_materialRecords.size();
+    Q_FOREACH(const ObjModel::Material &material, mesh->m_materials)
+    {
+        const bool hasSpecular = (material.ambient[0] != 0.0f || material.ambient[1] != 0.0f ||
+                                  material.ambient[2] != 0.0f) && material.specularIntensity != 0.0f;
+
+        MaterialRecord record;
+        for(int i=0; i<3; i++)
+        {
+            record.ambient[i] = material.ambient[i]*material.ambientIntensity;
+            record.diffuse[i] = material.diffuse[i]*material.diffuseIntensity;
+            record.specular[i] = hasSpecular ? material.ambient[i] : 0.0f;
+        }
+        record.ambient[3] = record.diffuse[3] = 1.0f;
+        record.specular[3] = hasSpecular ? 1.0f : 0.0f;
+        record.parameters[0] = hasSpecular ? material.specularIntensity : 1.0f;
+        record.parameters[1] = material.opacity;
+        record.parameters[2] = material.brightness;
+        record.parameters[3] = 0.0f;
+        m_materialRecords.append(record);
+    }
+
+    MeshRecord meshRecord;
+    ToSphere(mesh->m_boundingBox, meshRecord.sphere);
+    meshRecord.parts[0] = quint32(m_partRecords.size());
+    meshRecord.parts[1] = quint32(mesh->m_parts.size());
+    meshRecord.parts[2] = meshRecord.parts[3] = 0;
+
+    Q_FOREACH(const ObjModel::Part &part, mesh->m_parts)
+    {
+        PartRecord record;
+        ToSphere(part.bounds, record.sphere);
+
+        const int lodCount = qBound(1, part.lodCount, int(ObjModel::MaxLodCount));
+        for(int l=0; l<ObjModel::MaxLodCount; l++)
+        {
+            const bool simplified = l > 0 && l < lodCount;
+            record.lodStart[l] = region.firstIndex + (simplified ? part.lods[l].start : part.start);
+            record.lodLength[l] = simplified ? part.lods[l].length : part.length;
+        }
+        record.info[0] = region.baseVertex;
+        record.info[1] = firstMaterial + part.material;
+        record.info[2] = lodCount;
+        record.info[3] = mesh->isTransparent(part) ? 1 : 0;
+        m_partRecords.append(record);
+    }
+
+    m_meshRecords.append(meshRecord);
+    m_recordsDirty = true;
+    return m_meshRecords.size()-1;
+}
+
+void IndirectRenderer::reserveGeometry(int vertexCount, int indexCount)
+{
+    // Buffers grow by doubling; what is already in them is copied over on
+    // the GPU
+    auto grow = [this](uint &buffer, int capacity, int stride, int usedCount) {
+        uint newBuffer = 0;
+        glGenBuffers(1, &newBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, GLsizeiptr(capacity)*stride, nullptr, GL_STATIC_DRAW);
+        if(buffer > 0)
+        {
+            glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+            if(usedCount > 0)
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, GLsizeiptr(usedCount)*stride);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            glDeleteBuffers(1, &buffer);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        buffer = newBuffer;
+        m_vertexArrayDirty = true;
+    };
+
+    if(vertexCount > m_vertexCapacity)
+    {
+        m_vertexCapacity = qMax(qMax(m_vertexCapacity*2, vertexCount), 1024);
+        grow(m_positionBuffer, m_vertexCapacity, int(sizeof(QVector3D)), m_vertexCount);
+        grow(m_normalBuffer, m_vertexCapacity, int(sizeof(QVector3D)), m_vertexCount);
+    }
+
+    if(indexCount > m_indexCapacity)
+    {
+        m_indexCapacity = qMax(qMax(m_indexCapacity*2, indexCount), 1024);
+        grow(m_indexBuffer, m_indexCapacity, int(sizeof(int)), m_indexCount);
+    }
+}
+
+void IndirectRenderer::reserveCommands(int count)
+{
+    if(count <= m_commandCapacity && m_commandBuffer > 0)
+        return;
+
+    m_commandCapacity = qMax(qMax(m_commandCapacity*2, count), 256);
+
+    if(m_commandBuffer == 0)
+        glGenBuffers(1, &m_commandBuffer);
+    if(m_drawRecordBuffer == 0)
+        glGenBuffers(1, &m_drawRecordBuffer);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(2*m_commandCapacity)*COMMAND_SIZE, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_drawRecordBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(2*m_commandCapacity)*DRAW_RECORD_SIZE, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    m_vertexArrayDirty = true;
+}
+
+void IndirectRenderer::updateVertexArray()
+{
+    if(!m_vertexArrayDirty)
+        return;
+
+    glBindVertexArray(m_vertexArray);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionBuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    // One draw record per command, picked by the command's base instance
+    glBindBuffer(GL_ARRAY_BUFFER, m_drawRecordBuffer);
+    glEnableVertexAttribArray(2);
+    glVertexAttribIPointer(2, 2, GL_INT, 0, nullptr);
+    glVertexAttribDivisor(2, 1);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    m_vertexArrayDirty = false;
+}
+
+void IndirectRenderer::uploadInstances(const SceneStore *scene)
+{
+    // Both passes of a frame cull the same records, with flags of their
+    // own, so they are written once per stream buffer frame
+    const quint64 frame = m_streamBuffer && m_streamBuffer->isInFrame() ? m_streamBuffer->frameNumber() : 0;
+    if(frame > 0 && frame == m_instanceRecordFrame && scene->instanceCount() == m_instanceRecordSceneSize)
+        return;
+
+    const int count = scene->instanceCount();
+    int recordCount = 0;
+    for(int i=0; i<count; i++)
+    {
+        if(this->isDrawable(scene->meshIndexAt(i)))
+            ++recordCount;
+    }
+
+    m_instanceRecordFrame = frame;
+    m_instanceRecordSceneSize = count;
+    m_instanceRecordCount = recordCount;
+    if(recordCount == 0)
+        return;
+
+    // Straight into this frame's region of the stream buffer, or through
+    // an arena and glBufferData where there is no room (or no frame)
+    const int size = recordCount*int(sizeof(InstanceRecord));
+    StreamBuffer::Allocation staging;
+    if(frame > 0)
+        staging = m_streamBuffer->allocate(size, m_storageAlignment);
+
+    InstanceRecord *records = static_cast<InstanceRecord*>(staging.data);
+    if(!records)
+    {
+        Arena *arena = m_frameArena;
+        if(!arena)
+        {
+            arena = &m_arena;
+            arena->reset();
+        }
+        records = arena->allocate<InstanceRecord>(recordCount);
+    }
+
+    const float *worlds = scene->worldMatrixData();
+    InstanceRecord *instance = records;
+    for(int i=0; i<count; i++)
+    {
+        const int meshIndex = scene->meshIndexAt(i);
+        if(!this->isDrawable(meshIndex))
+            continue;
+
+        const float *world = worlds + i*16;
+        const float *normal = scene->normalMatrixAt(i);
+        memcpy(instance->world, world, sizeof(instance->world));
+        for(int c=0; c<3; c++)
+        {
+            for(int r=0; r<3; r++)
+                instance->normal[c*4+r] = normal ? normal[c*3+r] : world[c*4+r];
+            instance->normal[c*4+3] = 0.0f;
+        }
+        instance->info[0] = quint32(m_meshRecordIndexes.at(meshIndex));
+        instance->info[1] = quint32(scene->flagsAt(i));
+        instance->info[2] = instance->info[3] = 0;
+        ++instance;
+    }
+
+    if(staging.data)
+    {
+        m_streamBuffer->flush();
+        m_instanceRecordBuffer = m_streamBuffer->bufferId();
+        m_instanceRecordOffset = staging.offset;
+        return;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_instanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, records, GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    m_instanceRecordBuffer = m_instanceBuffer;
+    m_instanceRecordOffset = 0;
+}
+
+void IndirectRenderer::bindInstances()
+{
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, InstanceBinding, m_instanceRecordBuffer,
+                      GLintptr(m_instanceRecordOffset),
+                      GLsizeiptr(m_instanceRecordCount)*GLsizeiptr(sizeof(InstanceRecord)));
+}
+
+void IndirectRenderer::cull(const SceneStore *scene, int flags, const QMatrix4x4 &viewMatrix,
+                            const QMatrix4x4 &projectionMatrix, Pass pass)
+{
+    m_commandCount = 0;
+    if(!m_supported || m_meshRecords.isEmpty())
+        return;
+
+    // The most commands the instances of this pass can take up in a list
+    const int count = scene->instanceCount();
+    int maxCommands = 0;
+    for(int i=0; i<count; i++)
+    {
+        const int meshIndex = scene->meshIndexAt(i);
+        if((scene->flagsAt(i) & flags) == flags && this->isDrawable(meshIndex))
+            maxCommands += int(m_meshRecords.at(m_meshRecordIndexes.at(meshIndex)).parts[1]);
+    }
+
+    if(maxCommands == 0)
+        return;
+
+    this->uploadInstances(scene);
+    this->reserveCommands(maxCommands);
+
+    if(m_recordsDirty)
+    {
+        const struct { uint buffer; const void *data; int size; } uploads[] = {
+            { m_meshBuffer, m_meshRecords.constData(), m_meshRecords.size()*int(sizeof(MeshRecord)) },
+            { m_partBuffer, m_partRecords.constData(), m_partRecords.size()*int(sizeof(PartRecord)) },
+            { m_materialBuffer, m_materialRecords.constData(), m_materialRecords.size()*int(sizeof(MaterialRecord)) }
+        };
+        for(int i=0; i<3; i++)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, uploads[i].buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, uploads[i].size, uploads[i].data, GL_STATIC_DRAW);
+        }
+        m_recordsDirty = false;
+    }
+
+    // Without a draw count from the GPU all commands are drawn, and those
+    // left over in either list are empty ones after the clear
+    if(!m_multiDrawElementsIndirectCount)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_commandBuffer);
+        m_clearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_counterBuffer);
+    m_clearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    const bool occlusion = pass == ScenePass && m_occlusionCulling && m_pyramidValid;
+    int variant = 0;
+    if(pass == ScenePass)
+        variant |= SplitTransparentVariant;
+    if(occlusion)
+        variant |= OcclusionCullingVariant;
+    if(occlusion && m_reversedZ)
+        variant |= ReversedZVariant;
+
+    QOpenGLShaderProgram *program = this->cullProgram(variant);
+    program->bind();
+
+    const ObjModel::Frustum frustum(projectionMatrix*viewMatrix, viewMatrix, false);
+    program->setUniformValueArray("qt_FrustumPlanes", frustum.planes, 6);
+    program->setUniformValue("qt_ViewMatrix", viewMatrix);
+    program->setUniformValue("qt_ProjectionScale", projectionMatrix(1,1));
+    program->setUniformValue("qt_Lod0ScreenSize", ObjModel::lod0ScreenSize());
+    program->setUniformValue("qt_LodBias", pass == ShadowPass ? ObjModel::shadowLodBias() : 0.0f);
+    glUniform1ui(program->uniformLocation("qt_InstanceCount"), GLuint(m_instanceRecordCount));
+    glUniform1ui(program->uniformLocation("qt_RequiredFlags"), GLuint(flags));
+    glUniform1ui(program->uniformLocation("qt_ListCapacity"), GLuint(m_commandCapacity));
+
+    if(occlusion)
+    {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_pyramidTex);
+        program->setUniformValue("qt_DepthPyramid", 0);
+        program->setUniformValue("qt_OccluderViewProjectionMatrix", m_occluderViewProjectionMatrix);
+        glUniform2i(program->uniformLocation("qt_DepthPyramidSize"), m_pyramidSize.width(), m_pyramidSize.height());
+        program->setUniformValue("qt_DepthPyramidLevels", m_pyramidLevels);
+    }
+
+    this->bindInstances();
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MeshBinding, m_meshBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PartBinding, m_partBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CommandBinding, m_commandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DrawRecordBinding, m_drawRecordBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CounterBinding, m_counterBuffer);
+    FrameProfiler::countStateChange(7);
+
+    glDispatchCompute(GLuint((m_instanceRecordCount + CULL_GROUP_SIZE-1) / CULL_GROUP_SIZE), 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT|GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+    if(occlusion)
+        glBindTexture(GL_TEXTURE_2D, 0);
+    program->release();
+
+    m_commandCount = maxCommands;
+}
+
+void IndirectRenderer::drawShadows(const QMatrix4x4 &lightViewProjectionMatrix)
+{
+    if(m_commandCount == 0)
+        return;
+
+    if(!m_shadowProgram)
+        m_shadowProgram = CreateShaderProgram(":/shadow_indirect_vertex.glsl", ":/shadow_fragment.glsl");
+
+    this->updateVertexArray();
+
+    m_shadowProgram->bind();
+    m_shadowProgram->setUniformValue("qt_LightViewProjectionMatrix", lightViewProjectionMatrix);
+
+    glBindVertexArray(m_vertexArray);
+    this->bindInstances();
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+    FrameProfiler::countStateChange(4);
+
+    this->drawList(0);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    m_shadowProgram->release();
+}
+
+void IndirectRenderer::drawList(int list)
+{
+    const GLintptr offset = GLintptr(list)*GLintptr(m_commandCapacity)*COMMAND_SIZE;
+    if(m_multiDrawElementsIndirectCount)
+    {
+        // The count is what the cull shader appended to the list
+        glBindBuffer(GL_PARAMETER_BUFFER, m_counterBuffer);
+        m_multiDrawElementsIndirectCount(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(offset),
+                                         GLintptr(list)*GLintptr(sizeof(quint32)), m_commandCount, 0);
+        glBindBuffer(GL_PARAMETER_BUFFER, 0);
+        FrameProfiler::countStateChange();
+    }
+    else
+        m_multiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(offset),
+                                    m_commandCount, 0);
+    FrameProfiler::countDrawCall(0);
+}
+
+void IndirectRenderer::drawScene(ObjModel::PartSelection parts, const QVector3D &eyePosition,
+                                 const QVector3D &lightDirection, const QMatrix4x4 &projectionMatrix,
+                                 const QMatrix4x4 &viewMatrix, const QMatrix4x4 &lightViewProjectionMatrix)
+{
+    if(m_commandCount == 0)
+        return;
+
+    this->updateVertexArray();
+
+    SceneShading shading;
+    shading.lights = m_lightManager;
+    shading.temporalShadows = m_temporalShadows;
+    shading.transparencyBuffer = m_transparencyBuffer;
+    shading.shadowTextureId = m_shadowTextureId;
+    shading.shadowMapSize = m_shadowMapSize;
+    shading.shadowFilterRange = m_shadowFilterRange;
+    shading.shadowDepthRange = m_shadowDepthRange;
+    shading.eyePosition = eyePosition;
+    shading.lightDirection = lightDirection;
+    shading.transparentParts = parts == ObjModel::TransparentParts;
+
+    // Per part materials are per draw here, so one permutation takes all
+    // parts; parts without specular have a black specular color
+    int variant = shading.bind();
+    if(shading.lightSpecular().rgb() != qRgb(0,0,0))
+        variant |= SceneShading::SpecularVariant;
+
+    QOpenGLShaderProgram *shader = this->sceneProgram(variant);
+    shader->bind();
+    FrameProfiler::countStateChange();
+
+    shader->setUniformValue("qt_ViewMatrix", viewMatrix);
+    shader->setUniformValue("qt_ProjectionMatrix", projectionMatrix);
+    shader->setUniformValue("qt_LightViewProjectionMatrix", lightViewProjectionMatrix);
+    shading.setUniforms(shader, variant);
+
+    glBindVertexArray(m_vertexArray);
+    this->bindInstances();
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MaterialBinding, m_materialBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+    FrameProfiler::countStateChange(4);
+
+    // Opaque parts are in the first list, transparent parts in the second
+    for(int list=0; list<2; list++)
+    {
+        if(parts != ObjModel::AllParts && (list == 1) != (parts == ObjModel::TransparentParts))
+            continue;
+
+        this->drawList(list);
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    shader->release();
+
+    shading.release(variant);
+}
+
+void IndirectRenderer::captureDepth(uint framebuffer, const QSize &size, const QMatrix4x4 &viewProjectionMatrix)
+{
+    if(!m_supported || !m_occlusionCulling || size.isEmpty())
+        return;
+
+    FrameProfiler::Scope scope("scene/depth pyramid");
+
+    if(size.width() > m_pyramidCapacity.width() || size.height() > m_pyramidCapacity.height())
+        this->resizeDepthPyramid( size.expandedTo(m_pyramidCapacity) );
+
+    // Like TransparencyBuffer, this relies on the framebuffer having a
+    // packed depth and stencil buffer of the same format as m_depthTex
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_depthFbo);
+    glBlitFramebuffer(0, 0, size.width(), size.height(), 0, 0, size.width(), size.height(),
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    if(!m_pyramidPrograms[0])
+    {
+        const QStringList defines = m_reversedZ ? QStringList() << "REVERSED_Z" : QStringList();
+        m_pyramidPrograms[0] = CreateComputeProgram(":/depth_pyramid_compute.glsl", QStringList(defines) << "FIRST_LEVEL");
+        m_pyramidPrograms[1] = CreateComputeProgram(":/depth_pyramid_compute.glsl", defines);
+    }
+
+    // Level 0 is a copy of the depth, each level after it half the last
+    QSize source = size;
+    for(int level=0; level<m_pyramidLevels; level++)
+    {
+        const QSize destination = level == 0 ? size :
+                QSize( qMax(1, (source.width()+1)/2), qMax(1, (source.height()+1)/2) );
+
+        QOpenGLShaderProgram *program = m_pyramidPrograms[level == 0 ? 0 : 1];
+        program->bind();
+        if(level == 0)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, m_depthTex);
+            program->setUniformValue("qt_Depth", 0);
+        }
+        else
+        {
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            glBindImageTexture(0, m_pyramidTex, level-1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        }
+        glBindImageTexture(1, m_pyramidTex, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glUniform2i(program->uniformLocation("qt_SourceSize"), source.width(), source.height());
+        glUniform2i(program->uniformLocation("qt_DestinationSize"), destination.width(), destination.height());
+
+        glDispatchCompute(GLuint((destination.width() + PYRAMID_GROUP_SIZE-1) / PYRAMID_GROUP_SIZE),
+                          GLuint((destination.height() + PYRAMID_GROUP_SIZE-1) / PYRAMID_GROUP_SIZE), 1);
+        source = destination;
+    }
+
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    m_pyramidPrograms[1]->release();
+
+    m_pyramidSize = size;
+    m_occluderViewProjectionMatrix = viewProjectionMatrix;
+    m_pyramidValid = true;
+}
+
+void IndirectRenderer::resizeDepthPyramid(const QSize &capacity)
+{
+    this->releaseDepthPyramid();
+
+    // A power of two, so that every level holds the rounded up half of the
+    // one below it
+    int size = 1;
+    m_pyramidLevels = 1;
+    while(size < capacity.width() || size < capacity.height())
+    {
+        size *= 2;
+        ++m_pyramidLevels;
+    }
+    m_pyramidCapacity = QSize(size, size);
+
+    glGenTextures(1, &m_depthTex);
+    glBindTexture(GL_TEXTURE_2D, m_depthTex);
+    glTexStorage2D(GL_TEXTURE_2D, 1, m_reversedZ ? GL_DEPTH32F_STENCIL8 : GL_DEPTH24_STENCIL8, size, size);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &m_pyramidTex);
+    glBindTexture(GL_TEXTURE_2D, m_pyramidTex);
+    glTexStorage2D(GL_TEXTURE_2D, m_pyramidLevels, GL_R32F, size, size);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &m_depthFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_depthFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, m_depthTex, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    m_pyramidValid = false;
+}
+
+void IndirectRenderer::releaseDepthPyramid()
+{
+    if(m_depthFbo > 0)
+        glDeleteFramebuffers(1, &m_depthFbo);
+    if(m_depthTex > 0)
+        glDeleteTextures(1, &m_depthTex);
+    if(m_pyramidTex > 0)
+        glDeleteTextures(1, &m_pyramidTex);
+
+    m_depthFbo = m_depthTex = m_pyramidTex = 0;
+    m_pyramidCapacity = QSize();
+    m_pyramidLevels = 0;
+    m_pyramidValid = false;
+}
+
+QOpenGLShaderProgram *IndirectRenderer::cullProgram(int variant)
+{
+    QOpenGLShaderProgram *ret = m_cullPrograms.value(variant, nullptr);
+    if(ret)
+        return ret;
+
+    QStringList defines;
+    if(variant & SplitTransparentVariant)
+        defines << "SPLIT_TRANSPARENT";
+    if(variant & OcclusionCullingVariant)
+        defines << "OCCLUSION_CULLING";
+    if(variant & ReversedZVariant)
+        defines << "REVERSED_Z";
+
+    ret = CreateComputeProgram(":/cull_compute.glsl", defines);
+    m_cullPrograms.insert(variant, ret);
+    return ret;
+}
+
+QOpenGLShaderProgram *IndirectRenderer::sceneProgram(int variant)
+{
+    QOpenGLShaderProgram *ret = m_scenePrograms.value(variant, nullptr);
+    if(ret)
+        return ret;
+
+    const QStringList defines = QStringList() << "INDIRECT_DRAWS" << SceneShading::defines(variant);
+    ret = CreateShaderProgram(":/scene_indirect_vertex.glsl", ":/scene_fragment.glsl", defines);
+    m_scenePrograms.insert(variant, ret);
+    return ret;
+}
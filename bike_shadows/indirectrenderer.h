@@ -0,0 +1,248 @@
+#ifndef INDIRECT_RENDERER_H
+#define INDIRECT_RENDERER_H
+
+#include <QHash>
+#include <QSize>
+#include <QVector>
+#include <QVector2D>
+#include <QMatrix4x4>
+#include <QOpenGLExtraFunctions>
+
+#include "arena.h"
+#include "objmodel.h"
+
+class LightManager;
+class SceneStore;
+class StreamBuffer;
+class TemporalShadows;
+class TransparencyBuffer;
+class QOpenGLBuffer;
+class QOpenGLShaderProgram;
+
+/*
+ * GPU driven drawing, for OpenGL 4.3 contexts (compute shaders, shader
+ * storage buffers and glMultiDrawElementsIndirect).
+ *
+ * The vertices and indexes of all meshes are copied, once, into shared
+ * buffers, next to records of the meshes, their parts and materials. Every
+ * pass uploads the instances (world and normal matrices), and a compute
+ * shader culls each part of each instance against the frustum, picks its
+ * LOD and appends a draw command for it to a compacted command list. A
+ * pass is then drawn with one glMultiDrawElementsIndirect per list,
+ * however large the scene: the instance and material of each command come
+ * in through an instanced vertex attribute, whose index is the command's
+ * base instance.
+ *
+ * Where glMultiDrawElementsIndirectCount is available (OpenGL 4.6 or
+ * ARB_indirect_parameters), the number of commands drawn is the one the
+ * cull shader counted, read from the GPU, so culled parts cost nothing.
+ * Otherwise every list is drawn in full, with the survivors at the front
+ * and the rest cleared to empty commands.
+ *
+ * With occlusion culling, the depth of the opaque parts is kept at the end
+ * of each scene pass, in a pyramid of ever coarser levels that hold the
+ * farthest depth beneath them, and parts whose bounds lie entirely behind
+ * it are culled in the next scene pass. The pyramid is a frame old by then,
+ * so things that come out from behind others can show up a frame late.
+ * With reversed-Z the farthest depth is the smallest, and the pyramid
+ * keeps the minimum instead.
+ *
+ * Streamed meshes, and meshes that are not (yet) uploaded, are not drawn
+ * here; isDrawable() tells which, and those go through ObjModel::render().
+ * Parts are culled whole, as clusters are not looked at.
+ */
+class IndirectRenderer : public QOpenGLExtraFunctions
+{
+public:
+    IndirectRenderer();
+    ~IndirectRenderer();
+
+    // Must be called with a current OpenGL context. Returns false, and
+    // nothing else does anything, below OpenGL 4.3.
+    bool initialize();
+    bool isSupported() const { return m_supported; }
+
+    // Picks up meshes added to scene since the last call
+    void updateMeshes(const SceneStore *scene);
+    bool isDrawable(int meshIndex) const {
+        return meshIndex < m_meshRecordIndexes.size() && m_meshRecordIndexes.at(meshIndex) >= 0;
+    }
+    bool hasUndrawableMeshes() const { return m_hasUndrawableMeshes; }
+
+    // Settings of the scene pass, as on ObjModel
+    void setLightManager(LightManager *val) { m_lightManager = val; }
+    void setTemporalShadows(TemporalShadows *val) { m_temporalShadows = val; }
+    void setTransparencyBuffer(TransparencyBuffer *val) { m_transparencyBuffer = val; }
+    void setShadowTextureId(uint val) { m_shadowTextureId = val; }
+    void setShadowMapSize(int val) { m_shadowMapSize = val; }
+    void setShadowFilterRange(int val) { m_shadowFilterRange = val; }
+    void setShadowDepthRange(float zNear, float zFar) { m_shadowDepthRange = QVector2D(zNear, zFar); }
+
+    // Instance records are written into streamBuffer, once per frame of
+    // it, and culled by every pass of the frame; the instances must not
+    // move between the passes. Where there is no stream buffer frame, or
+    // no room left in it, records come out of frameArena (or out of an
+    // arena of the renderer's own, if there is none) and are uploaded
+    // with glBufferData, on every cull().
+    void setStreamBuffer(StreamBuffer *val) { m_streamBuffer = val; }
+    void setFrameArena(Arena *val) { m_frameArena = val; }
+
+    void setOcclusionCullingEnabled(bool val);
+    bool isOcclusionCullingEnabled() const { return m_occlusionCulling; }
+
+    // Whether the scene pass writes reversed depth (1 at the near plane, 0
+    // at infinity) into a 32 bit float depth buffer, for captureDepth()
+    void setReversedZ(bool val);
+    bool isReversedZ() const { return m_reversedZ; }
+
+    // Fills the command lists with the parts of the instances that have all
+    // of flags and are seen through viewMatrix and projectionMatrix. The
+    // scene pass has opaque and transparent parts in separate lists.
+    enum Pass { ShadowPass, ScenePass };
+    void cull(const SceneStore *scene, int flags, const QMatrix4x4 &viewMatrix,
+              const QMatrix4x4 &projectionMatrix, Pass pass);
+
+    // Draw what the last cull() left in the command lists
+    void drawShadows(const QMatrix4x4 &lightViewProjectionMatrix);
+    void drawScene(ObjModel::PartSelection parts, const QVector3D &eyePosition,
+                   const QVector3D &lightDirection, const QMatrix4x4 &projectionMatrix,
+                   const QMatrix4x4 &viewMatrix, const QMatrix4x4 &lightViewProjectionMatrix);
+
+    // Keeps the depth of framebuffer (its bottom left size), as rendered
+    // with viewProjectionMatrix, for the occlusion culling of the next scene
+    // pass. Does nothing without occlusion culling.
+    void captureDepth(uint framebuffer, const QSize &size, const QMatrix4x4 &viewProjectionMatrix);
+
+    // Commands in the lists of the last cull(), culled or not
+    int commandCount() const { return m_commandCount; }
+
+    // Whether the lists are drawn up to the count of commands the GPU
+    // appended, rather than in full
+    bool isUsingDrawCount() const { return m_multiDrawElementsIndirectCount != nullptr; }
+
+private:
+    int addMesh(ObjModel *mesh);
+    void reserveGeometry(int vertexCount, int indexCount);
+    void reserveCommands(int count);
+    void updateVertexArray();
+    void uploadInstances(const SceneStore *scene);
+    void bindInstances();
+    void drawList(int list);
+    void resizeDepthPyramid(const QSize &capacity);
+    void releaseDepthPyramid();
+    QOpenGLShaderProgram *cullProgram(int variant);
+    QOpenGLShaderProgram *sceneProgram(int variant);
+
+private:
+    // Laid out as std430 in the shaders
+    struct InstanceRecord
+    {
+        float world[16];
+        float normal[12];   // 3x3, columns padded to 4
+        quint32 info[4];    // mesh record, SceneStore flags
+    };
+    struct MeshRecord
+    {
+        float sphere[4];
+        quint32 parts[4];   // first part record, number of them
+    };
+    struct PartRecord
+    {
+        float sphere[4];
+        qint32 lodStart[4];
+        qint32 lodLength[4];
+        qint32 info[4];     // base vertex, material, LOD count, transparent
+    };
+    struct MaterialRecord
+    {
+        float ambient[4];
+        float diffuse[4];
+        float specular[4];
+        float parameters[4]; // specular power, opacity, brightness
+    };
+    struct Region { int baseVertex, firstIndex; }; // of a mesh's buffers
+
+    typedef void (QOPENGLF_APIENTRYP MultiDrawElementsIndirectFunction)(GLenum mode, GLenum type,
+                                     const void *indirect, GLsizei drawCount, GLsizei stride);
+    typedef void (QOPENGLF_APIENTRYP MultiDrawElementsIndirectCountFunction)(GLenum mode, GLenum type,
+                                     const void *indirect, GLintptr drawCount, GLsizei maxDrawCount,
+                                     GLsizei stride);
+    typedef void (QOPENGLF_APIENTRYP ClearBufferDataFunction)(GLenum target, GLenum internalFormat,
+                                     GLenum format, GLenum type, const void *data);
+
+    MultiDrawElementsIndirectFunction m_multiDrawElementsIndirect;
+    MultiDrawElementsIndirectCountFunction m_multiDrawElementsIndirectCount; // null without 4.6 or ARB_indirect_parameters
+    ClearBufferDataFunction m_clearBufferData;
+
+    // Shared geometry: positions, normals and indexes of all meshes
+    uint m_positionBuffer;
+    uint m_normalBuffer;
+    uint m_indexBuffer;
+    int m_vertexCount, m_vertexCapacity;
+    int m_indexCount, m_indexCapacity;
+    QHash<const QOpenGLBuffer*,Region> m_regions;
+
+    // Records, and where they live on the GPU
+    QVector<int> m_meshRecordIndexes; // per mesh of the scene, -1 if not drawable
+    QVector<MeshRecord> m_meshRecords;
+    QVector<PartRecord> m_partRecords;
+    QVector<MaterialRecord> m_materialRecords;
+    uint m_meshBuffer;
+    uint m_partBuffer;
+    uint m_materialBuffer;
+    uint m_instanceBuffer;      // for instance records outside the stream buffer
+    bool m_recordsDirty;
+    bool m_hasUndrawableMeshes;
+
+    // Where the instance records of the last upload are, and the frame of
+    // the stream buffer (0 for none) and scene size they were written for
+    uint m_instanceRecordBuffer;
+    int m_instanceRecordOffset;
+    int m_instanceRecordCount;
+    int m_instanceRecordSceneSize;
+    quint64 m_instanceRecordFrame;
+    int m_storageAlignment;     // of shader storage buffer offsets
+
+    // Two lists of m_commandCapacity commands each, with a draw record per
+    // command, and the number appended to each list
+    uint m_commandBuffer;
+    uint m_drawRecordBuffer;
+    uint m_counterBuffer;
+    int m_commandCapacity;
+    int m_commandCount;
+    uint m_vertexArray;
+    bool m_vertexArrayDirty;
+
+    // Depth pyramid, for occlusion culling
+    uint m_depthFbo;
+    uint m_depthTex;
+    uint m_pyramidTex;
+    QSize m_pyramidCapacity;
+    QSize m_pyramidSize;
+    int m_pyramidLevels;
+    QMatrix4x4 m_occluderViewProjectionMatrix;
+    bool m_pyramidValid;
+    bool m_occlusionCulling;
+    bool m_reversedZ;
+
+    QHash<int,QOpenGLShaderProgram*> m_cullPrograms;
+    QHash<int,QOpenGLShaderProgram*> m_scenePrograms;
+    QOpenGLShaderProgram *m_shadowProgram;
+    QOpenGLShaderProgram *m_pyramidPrograms[2]; // first level, and the rest
+
+    Arena m_arena; // without a frame arena
+    Arena *m_frameArena;
+    StreamBuffer *m_streamBuffer;
+    LightManager *m_lightManager;
+    TemporalShadows *m_temporalShadows;
+    TransparencyBuffer *m_transparencyBuffer;
+    uint m_shadowTextureId;
+    int m_shadowMapSize;
+    int m_shadowFilterRange;
+    QVector2D m_shadowDepthRange;
+    bool m_supported;
+    bool m_initialized;
+    char m_padding[2];
+};
+
+#endif // INDIRECT_RENDERER_H
@@ -0,0 +1,258 @@
+#include "lightmanager.h"
+#include "streambuffer.h"
+
+#include <QVector4D>
+#include <QtMath>
+#include <cstring>
+
+LightManager::LightManager()
+    : m_ambientColor(40,40,40), m_diffuseColor(Qt::white), m_specularColor(Qt::white),
+      m_streamBuffer(nullptr), m_lightDataTex(0), m_clusterGridTex(0), m_lightIndexTex(0),
+      m_zNear(0.1f), m_sliceScale(0), m_initialized(false), m_dirty(true)
+{
+    m_padding[0] = 0;
+}
+
+LightManager::~LightManager()
+{
+    if(m_initialized)
+    {
+        const GLuint textures[] = { m_lightDataTex, m_clusterGridTex, m_lightIndexTex };
+        glDeleteTextures(3, textures);
+    }
+}
+
+int LightManager::addLight(const Light &light)
+{
+    if(m_lights.size() >= MaxLights)
+        return -1;
+
+    m_lights.append(light);
+    m_dirty = true;
+    return m_lights.size()-1;
+}
+
+void LightManager::removeLight(int index)
+{
+    if(index < 0 || index >= m_lights.size())
+        return;
+
+    m_lights.removeAt(index);
+    m_dirty = true;
+}
+
+void LightManager::clear()
+{
+    m_lights.clear();
+    m_dirty = true;
+}
+
+void LightManager::update(const QMatrix4x4 &viewMatrix, const QMatrix4x4 &projectionMatrix,
+                          const QSize &viewportSize, float zNear, float zFar)
+{
+    this->initTextures(); // init happens only once.
+
+    if(m_dirty)
+    {
+        this->uploadLightData();
+        m_dirty = false;
+    }
+
+    m_viewportSize = viewportSize;
+    m_zNear = zNear;
+    m_sliceScale = float(ClusterCountZ) / qLn(qreal(zFar/zNear));
+
+    const int nrClusters = ClusterCountX*ClusterCountY*ClusterCountZ;
+    m_clusterCounts.fill(0, nrClusters);
+    m_lightClusterRanges.fill(-1, m_lights.size()*6);
+
+    // Find out the range of clusters touched by each light. We bin the light's
+    // bounding sphere, which is conservative for spot lights.
+    for(int i=0; i<m_lights.size(); i++)
+    {
+        const Light &light = m_lights.at(i);
+        const QVector3D c = viewMatrix.map(light.position);
+        const float r = light.range;
+        const float depthMin = qMax(zNear, -c.z() - r);
+        const float depthMax = qMin(zFar, -c.z() + r);
+        if(depthMin > depthMax)
+            continue;
+
+        int x0 = 0, x1 = ClusterCountX-1;
+        int y0 = 0, y1 = ClusterCountY-1;
+        if(-c.z() - r > zNear)
+        {
+            float xmin = 1, xmax = -1, ymin = 1, ymax = -1;
+            for(int corner=0; corner<8; corner++)
+            {
+                const QVector4D p( c.x() + ((corner&1) ? r : -r),
+                                   c.y() + ((corner&2) ? r : -r),
+                                   c.z() + ((corner&4) ? r : -r), 1.0f );
+                const QVector4D clip = projectionMatrix * p;
+                const float x = clip.x() / clip.w();
+                const float y = clip.y() / clip.w();
+                xmin = qMin(xmin, x); xmax = qMax(xmax, x);
+                ymin = qMin(ymin, y); ymax = qMax(ymax, y);
+            }
+
+            if(xmax < -1 || xmin > 1 || ymax < -1 || ymin > 1)
+                continue;
+
+            x0 = qBound(0, int((xmin*0.5f+0.5f)*ClusterCountX), ClusterCountX-1);
+            x1 = qBound(0, int((xmax*0.5f+0.5f)*ClusterCountX), ClusterCountX-1);
+            y0 = qBound(0, int((ymin*0.5f+0.5f)*ClusterCountY), ClusterCountY-1);
+            y1 = qBound(0, int((ymax*0.5f+0.5f)*ClusterCountY), ClusterCountY-1);
+        }
+
+        const int z0 = qBound(0, int(qLn(qreal(depthMin/zNear))*qreal(m_sliceScale)), ClusterCountZ-1);
+        const int z1 = qBound(0, int(qLn(qreal(depthMax/zNear))*qreal(m_sliceScale)), ClusterCountZ-1);
+
+        int *range = m_lightClusterRanges.data() + i*6;
+        range[0] = x0; range[1] = x1;
+        range[2] = y0; range[3] = y1;
+        range[4] = z0; range[5] = z1;
+
+        for(int z=z0; z<=z1; z++)
+            for(int y=y0; y<=y1; y++)
+                for(int x=x0; x<=x1; x++)
+                {
+                    int &count = m_clusterCounts[(z*ClusterCountY + y)*ClusterCountX + x];
+                    count = qMin(count+1, int(MaxLightsPerCluster));
+                }
+    }
+
+    // Lay out the per-cluster light lists one after the other
+    m_clusterOffsets.resize(nrClusters);
+    m_clusterGrid.resize(nrClusters*2);
+    int nrIndexes = 0;
+    for(int i=0; i<nrClusters; i++)
+    {
+        m_clusterOffsets[i] = nrIndexes;
+        m_clusterGrid[i*2] = float(nrIndexes);
+        m_clusterGrid[i*2+1] = float(m_clusterCounts.at(i));
+        nrIndexes += m_clusterCounts.at(i);
+    }
+
+    const int nrIndexRows = qMax(1, (nrIndexes + LightIndexTextureWidth-1) / LightIndexTextureWidth);
+    m_lightIndexes.fill(0, nrIndexRows*LightIndexTextureWidth);
+    m_clusterCounts.fill(0);
+
+    for(int i=0; i<m_lights.size(); i++)
+    {
+        const int *range = m_lightClusterRanges.constData() + i*6;
+        if(range[0] < 0)
+            continue;
+
+        for(int z=range[4]; z<=range[5]; z++)
+            for(int y=range[2]; y<=range[3]; y++)
+                for(int x=range[0]; x<=range[1]; x++)
+                {
+                    const int cluster = (z*ClusterCountY + y)*ClusterCountX + x;
+                    int &count = m_clusterCounts[cluster];
+                    if(count < int(m_clusterGrid.at(cluster*2+1)))
+                        m_lightIndexes[m_clusterOffsets.at(cluster) + count++] = float(i);
+                }
+    }
+
+    this->uploadTexture(m_clusterGridTex, ClusterCountX*ClusterCountY, ClusterCountZ, GL_RG,
+                        m_clusterGrid.constData(), m_clusterGrid.size()*int(sizeof(float)));
+    this->uploadTexture(m_lightIndexTex, LightIndexTextureWidth, nrIndexRows, GL_RED,
+                        m_lightIndexes.constData(), m_lightIndexes.size()*int(sizeof(float)));
+}
+
+void LightManager::initTextures()
+{
+    if(m_initialized)
+        return;
+
+    QOpenGLFunctions::initializeOpenGLFunctions();
+
+    GLuint textures[3];
+    glGenTextures(3, textures);
+    m_lightDataTex = textures[0];
+    m_clusterGridTex = textures[1];
+    m_lightIndexTex = textures[2];
+
+    // Every light takes up one row of 4 texels
+    // 0: position.xyz, type
+    // 1: direction.xyz, range
+    // 2: color.rgb * intensity, cos(outerAngle)
+    // 3: cos(innerAngle)
+    const int maxIndexes = ClusterCountX*ClusterCountY*ClusterCountZ*MaxLightsPerCluster;
+    const struct { uint id; GLint internalFormat; GLenum format; int width, height; } specs[] = {
+        { m_lightDataTex, GL_RGBA32F, GL_RGBA, 4, MaxLights },
+        { m_clusterGridTex, GL_RG32F, GL_RG, ClusterCountX*ClusterCountY, ClusterCountZ },
+        { m_lightIndexTex, GL_R32F, GL_RED, LightIndexTextureWidth, maxIndexes/LightIndexTextureWidth }
+    };
+
+    for(const auto &spec : specs)
+    {
+        glBindTexture(GL_TEXTURE_2D, spec.id);
+        glTexImage2D(GL_TEXTURE_2D, 0, spec.internalFormat, spec.width, spec.height, 0,
+                     spec.format, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    m_initialized = true;
+}
+
+void LightManager::uploadLightData()
+{
+    if(m_lights.isEmpty())
+        return;
+
+    QVector<float> data(m_lights.size()*16, 0.0f);
+    for(int i=0; i<m_lights.size(); i++)
+    {
+        const Light &light = m_lights.at(i);
+        const QVector3D direction = light.direction.normalized();
+        float *texels = data.data() + i*16;
+
+        texels[0] = light.position.x();
+        texels[1] = light.position.y();
+        texels[2] = light.position.z();
+        texels[3] = float(light.type);
+
+        texels[4] = direction.x();
+        texels[5] = direction.y();
+        texels[6] = direction.z();
+        texels[7] = light.range;
+
+        texels[8] = float(light.color.redF()) * light.intensity;
+        texels[9] = float(light.color.greenF()) * light.intensity;
+        texels[10] = float(light.color.blueF()) * light.intensity;
+        texels[11] = float(qCos(qDegreesToRadians(qreal(light.outerAngle))));
+
+        texels[12] = float(qCos(qDegreesToRadians(qreal(light.innerAngle))));
+    }
+
+    this->uploadTexture(m_lightDataTex, 4, m_lights.size(), GL_RGBA,
+                        data.constData(), data.size()*int(sizeof(float)));
+}
+
+void LightManager::uploadTexture(uint texture, int width, int height, GLenum format,
+                                 const float *data, int size)
+{
+    StreamBuffer::Allocation staging;
+    if(m_streamBuffer)
+        staging = m_streamBuffer->allocate(size);
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    if(staging.data)
+    {
+        memcpy(staging.data, data, size_t(size));
+        m_streamBuffer->flush();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_streamBuffer->bufferId());
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_FLOAT,
+                        reinterpret_cast<const void*>(quintptr(staging.offset)));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    else
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_FLOAT, data);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
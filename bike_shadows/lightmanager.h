@@ -0,0 +1,120 @@
+#ifndef LIGHT_MANAGER_H
+#define LIGHT_MANAGER_H
+
+#include <QColor>
+#include <QMatrix4x4>
+#include <QSize>
+#include <QVector>
+#include <QVector3D>
+#include <QOpenGLFunctions>
+
+class StreamBuffer;
+
+struct Light
+{
+    enum Type { PointLight=0, SpotLight=1 };
+
+    Light() : type(PointLight), color(Qt::white), intensity(1.0f),
+        range(5.0f), innerAngle(20.0f), outerAngle(30.0f) { }
+
+    Type type;
+    QVector3D position;
+    QVector3D direction;
+    QColor color;
+    float intensity;
+    float range;
+    float innerAngle, outerAngle; // in degrees, only for SpotLight
+};
+
+/*
+ * Owns the lights of a scene. Apart from the key (directional) light,
+ * which also casts the shadow, any number of point and spot lights can be
+ * added. Every frame the lights are binned into a grid of clusters (screen
+ * space tiles x exponential depth slices), and the per-cluster light lists
+ * are uploaded into textures that scene_fragment.glsl walks through.
+ *
+ * Given a StreamBuffer, in a frame, uploads are staged in it and copied
+ * into the textures by the GPU, so that they never wait for the textures
+ * to be done with.
+ */
+class LightManager : public QOpenGLFunctions
+{
+public:
+    LightManager();
+    ~LightManager();
+
+    enum
+    {
+        ClusterCountX = 16,
+        ClusterCountY = 16,
+        ClusterCountZ = 16,
+        MaxLights = 256,
+        MaxLightsPerCluster = 32,
+        LightIndexTextureWidth = 1024
+    };
+
+    // Key light
+    void setAmbientColor(const QColor &val) { m_ambientColor = val; }
+    QColor ambientColor() const { return m_ambientColor; }
+
+    void setDiffuseColor(const QColor &val) { m_diffuseColor = val; }
+    QColor diffuseColor() const { return m_diffuseColor; }
+
+    void setSpecularColor(const QColor &val) { m_specularColor = val; }
+    QColor specularColor() const { return m_specularColor; }
+
+    // Point and spot lights
+    int addLight(const Light &light);
+    void removeLight(int index);
+    void clear();
+    int lightCount() const { return m_lights.size(); }
+    const Light &light(int index) const { return m_lights.at(index); }
+    Light &light(int index) { m_dirty = true; return m_lights[index]; }
+
+    void setStreamBuffer(StreamBuffer *val) { m_streamBuffer = val; }
+    StreamBuffer *streamBuffer() const { return m_streamBuffer; }
+
+    void update(const QMatrix4x4 &viewMatrix, const QMatrix4x4 &projectionMatrix,
+                const QSize &viewportSize, float zNear, float zFar);
+
+    uint lightDataTextureId() const { return m_lightDataTex; }
+    uint clusterGridTextureId() const { return m_clusterGridTex; }
+    uint lightIndexTextureId() const { return m_lightIndexTex; }
+
+    QSize viewportSize() const { return m_viewportSize; }
+    float zNear() const { return m_zNear; }
+    float clusterSliceScale() const { return m_sliceScale; }
+
+private:
+    void initTextures();
+    void uploadLightData();
+    void uploadTexture(uint texture, int width, int height, GLenum format,
+                       const float *data, int size);
+
+private:
+    QColor m_ambientColor;
+    QColor m_diffuseColor;
+    QColor m_specularColor;
+    QList<Light> m_lights;
+    StreamBuffer *m_streamBuffer;
+
+    uint m_lightDataTex;
+    uint m_clusterGridTex;
+    uint m_lightIndexTex;
+
+    QSize m_viewportSize;
+    float m_zNear;
+    float m_sliceScale;
+
+    QVector<int> m_clusterCounts;
+    QVector<int> m_clusterOffsets;
+    QVector<float> m_clusterGrid;
+    QVector<float> m_lightIndexes;
+    QVector<int> m_lightClusterRanges;
+
+    bool m_initialized;
+    bool m_dirty;
+    char m_padding[6];
+};
+
+#endif // LIGHT_MANAGER_H
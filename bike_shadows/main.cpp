@@ -1,13 +1,30 @@
 #include <QApplication>
 
 #include "shadowrenderwindow.h"
+#include "threadedrenderwindow.h"
 
 int main(int argc, char **argv)
 {
     QApplication a(argc, argv);
 
+    // --threaded renders on a dedicated thread, onto a plain QWindow
+    if(a.arguments().contains("--threaded"))
+    {
+        ThreadedRenderWindow renderWindow;
+        renderWindow.resize(600, 600);
+        renderWindow.show();
+        return a.exec();
+    }
+
     ShadowRenderWindow renderWindow;
 //    SimpleRenderWindow renderWindow;
+
+    // --scene file.json renders the scene described in the file instead
+    // of the default one
+    const int sceneArgument = a.arguments().indexOf("--scene");
+    if(sceneArgument >= 0)
+        renderWindow.setSceneFileName(a.arguments().value(sceneArgument+1));
+
     renderWindow.resize(600, 600);
     renderWindow.show();
 
@@ -0,0 +1,275 @@
+#include "meshsimplifier.h"
+
+#include <QHash>
+#include <algorithm>
+
+static const double BOUNDARY_WEIGHT = 1000.0;
+static const float MIN_NORMAL_DOT = 0.2f;
+
+MeshSimplifier::Quadric MeshSimplifier::Quadric::fromPlane(const QVector3D &normal, float d, double weight)
+{
+    const double a = double(normal.x());
+    const double b = double(normal.y());
+    const double c = double(normal.z());
+    const double dd = double(d);
+
+    Quadric q;
+    q.m[0] = a*a*weight; q.m[1] = a*b*weight; q.m[2] = a*c*weight; q.m[3] = a*dd*weight;
+    q.m[4] = b*b*weight; q.m[5] = b*c*weight; q.m[6] = b*dd*weight;
+    q.m[7] = c*c*weight; q.m[8] = c*dd*weight;
+    q.m[9] = dd*dd*weight;
+    return q;
+}
+
+double MeshSimplifier::Quadric::evaluate(const QVector3D &p) const
+{
+    const double x = double(p.x());
+    const double y = double(p.y());
+    const double z = double(p.z());
+    return m[0]*x*x + 2*m[1]*x*y + 2*m[2]*x*z + 2*m[3]*x +
+           m[4]*y*y + 2*m[5]*y*z + 2*m[6]*y +
+           m[7]*z*z + 2*m[8]*z +
+           m[9];
+}
+
+MeshSimplifier::MeshSimplifier(const QVector<QVector3D> &positions,
+                               const QVector<int> &triangles,
+                               const QVector<bool> &locked)
+    : m_liveTriangleCount(0)
+{
+    // Work on a compact set of vertices, only the ones referred to by the triangles
+    QHash<int,int> localIndexes;
+    m_triangles.reserve(triangles.size());
+    for(int i=0; i<triangles.size(); i++)
+    {
+        const int global = triangles.at(i);
+        int local = localIndexes.value(global, -1);
+        if(local < 0)
+        {
+            local = m_globalIndexes.size();
+            localIndexes.insert(global, local);
+            m_globalIndexes.append(global);
+            m_positions.append(positions.at(global));
+            m_locked.append(global < locked.size() && locked.at(global));
+        }
+        m_triangles.append(local);
+    }
+
+    const int nrVertices = m_globalIndexes.size();
+    const int nrTriangles = m_triangles.size()/3;
+    m_quadrics.resize(nrVertices);
+    m_versions.fill(0, nrVertices);
+    m_removed.fill(false, nrVertices);
+    m_vertexTriangles.resize(nrVertices);
+    m_triangleAlive.fill(true, nrTriangles);
+    m_liveTriangleCount = nrTriangles;
+
+    QHash<quint64,int> edgeUsage;
+    for(int t=0; t<nrTriangles; t++)
+    {
+        const int *tri = m_triangles.constData() + t*3;
+        const QVector3D &p0 = m_positions.at(tri[0]);
+        const QVector3D &p1 = m_positions.at(tri[1]);
+        const QVector3D &p2 = m_positions.at(tri[2]);
+        const QVector3D cross = QVector3D::crossProduct(p1-p0, p2-p0);
+        const float area = cross.length() * 0.5f;
+
+        for(int i=0; i<3; i++)
+        {
+            m_vertexTriangles[tri[i]].append(t);
+
+            const int a = qMin(tri[i], tri[(i+1)%3]);
+            const int b = qMax(tri[i], tri[(i+1)%3]);
+            edgeUsage[ (quint64(a) << 32) | quint64(b) ]++;
+        }
+
+        if(area <= 0.0f)
+            continue;
+
+        const QVector3D normal = cross.normalized();
+        const Quadric q = Quadric::fromPlane(normal, -QVector3D::dotProduct(normal, p0), double(area));
+        for(int i=0; i<3; i++)
+            m_quadrics[tri[i]] += q;
+    }
+
+    // Open boundary edges get a plane perpendicular to the triangle through
+    // them, with a heavy weight, so that the outline is kept intact.
+    for(int t=0; t<nrTriangles; t++)
+    {
+        const int *tri = m_triangles.constData() + t*3;
+        const QVector3D faceNormal = QVector3D::crossProduct(m_positions.at(tri[1])-m_positions.at(tri[0]),
+                                                             m_positions.at(tri[2])-m_positions.at(tri[0])).normalized();
+        for(int i=0; i<3; i++)
+        {
+            const int a = tri[i];
+            const int b = tri[(i+1)%3];
+            if(edgeUsage.value( (quint64(qMin(a,b)) << 32) | quint64(qMax(a,b)) ) != 1)
+                continue;
+
+            const QVector3D edge = m_positions.at(b) - m_positions.at(a);
+            const QVector3D normal = QVector3D::crossProduct(edge, faceNormal).normalized();
+            if(normal.isNull())
+                continue;
+
+            const Quadric q = Quadric::fromPlane(normal, -QVector3D::dotProduct(normal, m_positions.at(a)),
+                                                 BOUNDARY_WEIGHT * double(edge.lengthSquared()));
+            m_quadrics[a] += q;
+            m_quadrics[b] += q;
+        }
+    }
+
+    // Every edge is a candidate for collapse, in both directions.
+    QHash<quint64,int>::const_iterator it = edgeUsage.constBegin();
+    QHash<quint64,int>::const_iterator end = edgeUsage.constEnd();
+    while(it != end)
+    {
+        const int a = int(it.key() >> 32);
+        const int b = int(it.key() & 0xFFFFFFFF);
+        this->pushCollapse(a, b);
+        this->pushCollapse(b, a);
+        ++it;
+    }
+}
+
+MeshSimplifier::~MeshSimplifier()
+{
+
+}
+
+QVector<int> MeshSimplifier::simplify(int targetTriangleCount)
+{
+    while(m_liveTriangleCount > targetTriangleCount && !m_heap.isEmpty())
+    {
+        std::pop_heap(m_heap.begin(), m_heap.end());
+        const Collapse c = m_heap.takeLast();
+
+        if(m_removed.at(c.from) || m_removed.at(c.to))
+            continue;
+
+        if(m_versions.at(c.from) != c.fromVersion || m_versions.at(c.to) != c.toVersion)
+            continue;
+
+        this->collapse(c.from, c.to);
+    }
+
+    return this->triangles();
+}
+
+QVector<int> MeshSimplifier::triangles() const
+{
+    QVector<int> ret;
+    ret.reserve(m_liveTriangleCount*3);
+    for(int t=0; t<m_triangleAlive.size(); t++)
+    {
+        if(!m_triangleAlive.at(t))
+            continue;
+
+        for(int i=0; i<3; i++)
+            ret.append( m_globalIndexes.at(m_triangles.at(t*3+i)) );
+    }
+
+    return ret;
+}
+
+void MeshSimplifier::pushCollapse(int from, int to)
+{
+    if(m_locked.at(from))
+        return;
+
+    Quadric q = m_quadrics.at(from);
+    q += m_quadrics.at(to);
+
+    Collapse c;
+    c.cost = q.evaluate(m_positions.at(to));
+    c.from = from;
+    c.to = to;
+    c.fromVersion = m_versions.at(from);
+    c.toVersion = m_versions.at(to);
+    m_heap.append(c);
+    std::push_heap(m_heap.begin(), m_heap.end());
+}
+
+bool MeshSimplifier::collapse(int from, int to)
+{
+    const QVector<int> fromTriangles = m_vertexTriangles.at(from);
+
+    // Reject collapses that would flip a triangle around
+    Q_FOREACH(int t, fromTriangles)
+    {
+        if(!m_triangleAlive.at(t))
+            continue;
+
+        const int *tri = m_triangles.constData() + t*3;
+        if(tri[0] == to || tri[1] == to || tri[2] == to)
+            continue;
+
+        QVector3D p[3], q[3];
+        for(int i=0; i<3; i++)
+        {
+            p[i] = m_positions.at(tri[i]);
+            q[i] = tri[i] == from ? m_positions.at(to) : p[i];
+        }
+
+        const QVector3D before = QVector3D::crossProduct(p[1]-p[0], p[2]-p[0]).normalized();
+        const QVector3D after = QVector3D::crossProduct(q[1]-q[0], q[2]-q[0]).normalized();
+        if(after.isNull() || QVector3D::dotProduct(before, after) < MIN_NORMAL_DOT)
+            return false;
+    }
+
+    QVector<int> &toTriangles = m_vertexTriangles[to];
+    Q_FOREACH(int t, fromTriangles)
+    {
+        if(!m_triangleAlive.at(t))
+            continue;
+
+        int *tri = m_triangles.data() + t*3;
+        if(tri[0] == to || tri[1] == to || tri[2] == to)
+        {
+            m_triangleAlive[t] = false;
+            --m_liveTriangleCount;
+            continue;
+        }
+
+        for(int i=0; i<3; i++)
+            if(tri[i] == from)
+                tri[i] = to;
+        toTriangles.append(t);
+    }
+
+    // Drop the triangles that died along the way
+    QVector<int> aliveTriangles;
+    aliveTriangles.reserve(toTriangles.size());
+    Q_FOREACH(int t, toTriangles)
+        if(m_triangleAlive.at(t))
+            aliveTriangles.append(t);
+    toTriangles = aliveTriangles;
+
+    m_vertexTriangles[from].clear();
+    m_removed[from] = true;
+    m_quadrics[to] += m_quadrics.at(from);
+    ++m_versions[from];
+    ++m_versions[to];
+
+    const QVector<int> around = this->neighbours(to);
+    Q_FOREACH(int n, around)
+    {
+        this->pushCollapse(to, n);
+        this->pushCollapse(n, to);
+    }
+
+    return true;
+}
+
+QVector<int> MeshSimplifier::neighbours(int vertex) const
+{
+    QVector<int> ret;
+    Q_FOREACH(int t, m_vertexTriangles.at(vertex))
+    {
+        const int *tri = m_triangles.constData() + t*3;
+        for(int i=0; i<3; i++)
+            if(tri[i] != vertex && !ret.contains(tri[i]))
+                ret.append(tri[i]);
+    }
+
+    return ret;
+}
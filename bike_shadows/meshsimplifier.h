@@ -0,0 +1,75 @@
+#ifndef MESH_SIMPLIFIER_H
+#define MESH_SIMPLIFIER_H
+
+#include <QVector>
+#include <QVector3D>
+
+/*
+ * Reduces the triangle count of an indexed triangle list using quadric
+ * error metrics (Garland & Heckbert). Only half-edge collapses are done,
+ * so simplified triangles always refer to vertices of the original mesh.
+ *
+ * Locked vertices are never collapsed; the caller uses this to keep
+ * vertices shared with other parts in place. Open boundary edges are
+ * preserved by penalizing any movement away from them.
+ *
+ * simplify() can be called repeatedly with decreasing targets to produce
+ * a chain of LODs, each one continuing from the previous.
+ */
+class MeshSimplifier
+{
+public:
+    MeshSimplifier(const QVector<QVector3D> &positions,
+                   const QVector<int> &triangles,
+                   const QVector<bool> &locked=QVector<bool>());
+    ~MeshSimplifier();
+
+    int triangleCount() const { return m_liveTriangleCount; }
+
+    // Returns triangles (as indexes into positions) after the triangle
+    // count has been brought down to targetTriangleCount, or as close to
+    // it as possible.
+    QVector<int> simplify(int targetTriangleCount);
+
+    QVector<int> triangles() const;
+
+private:
+    struct Quadric
+    {
+        Quadric() { for(int i=0; i<10; i++) m[i] = 0; }
+        static Quadric fromPlane(const QVector3D &normal, float d, double weight);
+        Quadric &operator += (const Quadric &other) {
+            for(int i=0; i<10; i++) m[i] += other.m[i];
+            return *this;
+        }
+        double evaluate(const QVector3D &p) const;
+        double m[10];
+    };
+
+    struct Collapse
+    {
+        double cost;
+        int from, to;
+        int fromVersion, toVersion;
+        bool operator < (const Collapse &other) const { return cost > other.cost; }
+    };
+
+    void pushCollapse(int from, int to);
+    bool collapse(int from, int to);
+    QVector<int> neighbours(int vertex) const;
+
+private:
+    QVector<int> m_globalIndexes;
+    QVector<QVector3D> m_positions;
+    QVector<Quadric> m_quadrics;
+    QVector<bool> m_locked;
+    QVector<int> m_versions;
+    QVector<bool> m_removed;
+    QVector<int> m_triangles;
+    QVector<bool> m_triangleAlive;
+    QVector< QVector<int> > m_vertexTriangles;
+    QVector<Collapse> m_heap;
+    int m_liveTriangleCount;
+};
+
+#endif // MESH_SIMPLIFIER_H
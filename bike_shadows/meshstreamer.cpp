@@ -0,0 +1,324 @@
+#include "meshstreamer.h"
+#include "frameprofiler.h"
+
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+// Defaults: room for a few detailed meshes, and as much per frame as a
+// slow bus moves in a fraction of a millisecond
+static const qint64 DEFAULT_MEMORY_BUDGET = 64*1024*1024;
+static const qint64 DEFAULT_UPLOAD_BUDGET = 2*1024*1024;
+
+// Chunks read, but no longer requested for this many frames, are dropped
+// instead of uploaded
+static const qint64 STALE_FRAME_COUNT = 8;
+
+class ChunkLoader : public QThread
+{
+public:
+    ChunkLoader(const QString &fileName)
+        : m_fileName(fileName), m_stopped(false) { m_padding[0] = 0; }
+    ~ChunkLoader() {
+        this->stop();
+    }
+
+    void stop() {
+        m_mutex.lock();
+        m_stopped = true;
+        m_condition.wakeAll();
+        m_mutex.unlock();
+        this->wait();
+    }
+
+    void enqueue(int chunk, qint64 offset, qint64 size) {
+        QMutexLocker locker(&m_mutex);
+        Request request;
+        request.chunk = chunk;
+        request.offset = offset;
+        request.size = size;
+        m_requests.append(request);
+        m_condition.wakeAll();
+    }
+
+    QVector<MeshStreamer::LoadedChunk> takeLoaded() {
+        QMutexLocker locker(&m_mutex);
+        QVector<MeshStreamer::LoadedChunk> ret;
+        ret.swap(m_loaded);
+        return ret;
+    }
+
+protected:
+    void run();
+
+private:
+    struct Request
+    {
+        int chunk;
+        qint64 offset, size;
+    };
+
+    QString m_fileName;
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QVector<Request> m_requests;
+    QVector<MeshStreamer::LoadedChunk> m_loaded;
+    bool m_stopped;
+    char m_padding[7];
+};
+
+void ChunkLoader::run()
+{
+    QFile file(m_fileName);
+    if(!file.open(QFile::ReadOnly))
+    {
+        qWarning("Could not read mesh chunks from %s", qPrintable(m_fileName));
+        return;
+    }
+
+    while(1)
+    {
+        m_mutex.lock();
+        while(m_requests.isEmpty() && !m_stopped)
+            m_condition.wait(&m_mutex);
+        if(m_stopped)
+        {
+            m_mutex.unlock();
+            break;
+        }
+        const Request request = m_requests.takeFirst();
+        m_mutex.unlock();
+
+        // Reads happen outside the lock, so that the render thread never
+        // waits on the disk
+        MeshStreamer::LoadedChunk loaded;
+        loaded.chunk = request.chunk;
+        if(file.seek(request.offset))
+            loaded.data = file.read(request.size);
+        if(loaded.data.size() != request.size)
+            qWarning("Could not read mesh chunk %d", request.chunk);
+
+        m_mutex.lock();
+        m_loaded.append(loaded);
+        m_mutex.unlock();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+MeshStreamer::MeshStreamer()
+    : m_file(QDir::temp().filePath("bike_shadows_XXXXXX.chunks")), m_loader(nullptr),
+      m_frame(0), m_memoryBudget(DEFAULT_MEMORY_BUDGET), m_uploadBudget(DEFAULT_UPLOAD_BUDGET),
+      m_initialized(false)
+{
+    m_padding[0] = 0;
+
+    if(!m_file.open())
+    {
+        qWarning("Could not create a mesh chunk file");
+        return;
+    }
+
+    m_loader = new ChunkLoader(m_file.fileName());
+    m_loader->start(QThread::LowPriority);
+}
+
+MeshStreamer::~MeshStreamer()
+{
+    delete m_loader;
+
+    if(!m_initialized)
+        return;
+
+    for(int i=0; i<m_chunks.size(); i++)
+    {
+        if(m_chunks.at(i).state == Resident)
+            this->evict(i);
+    }
+}
+
+int MeshStreamer::addChunk(const QVector<QVector3D> &vertices, const QVector<QVector3D> &normals,
+                           const QVector<int> &indexes)
+{
+    if(!m_file.isOpen() || vertices.size() != normals.size())
+        return -1;
+
+    // Laid out as the chunk's vertex buffer (positions, then normals)
+    // followed by its index buffer, so that it is uploaded as read
+    Chunk chunk;
+    chunk.offset = m_file.size();
+    chunk.vertexCount = vertices.size();
+    chunk.indexCount = indexes.size();
+    chunk.lastUsed = -1;
+    chunk.vertexBuffer = chunk.indexBuffer = 0;
+    chunk.state = OnDisk;
+
+    m_file.seek(chunk.offset);
+    m_file.write(reinterpret_cast<const char*>(vertices.constData()), vertices.size()*qint64(sizeof(QVector3D)));
+    m_file.write(reinterpret_cast<const char*>(normals.constData()), normals.size()*qint64(sizeof(QVector3D)));
+    m_file.write(reinterpret_cast<const char*>(indexes.constData()), indexes.size()*qint64(sizeof(int)));
+    m_file.flush();
+
+    m_chunks.append(chunk);
+    return m_chunks.size()-1;
+}
+
+void MeshStreamer::beginFrame()
+{
+    if(!m_initialized)
+    {
+        QOpenGLFunctions::initializeOpenGLFunctions();
+        m_initialized = true;
+    }
+
+    FrameProfiler::Scope scope("stream");
+
+    ++m_frame;
+    m_stats.uploads = 0;
+    m_stats.uploadedBytes = 0;
+    m_stats.evictions = 0;
+
+    if(m_loader)
+        m_uploadQueue += m_loader->takeLoaded();
+
+    while(!m_uploadQueue.isEmpty())
+    {
+        const LoadedChunk &loaded = m_uploadQueue.first();
+        Chunk &chunk = m_chunks[loaded.chunk];
+
+        // Not wanted any more, or could not be read: back to disk, to be
+        // queued again if it is requested again
+        if(loaded.data.size() != chunk.bytes() || m_frame - chunk.lastUsed > STALE_FRAME_COUNT)
+        {
+            chunk.state = OnDisk;
+            m_uploadQueue.removeFirst();
+            continue;
+        }
+
+        if(m_stats.uploads > 0 && m_stats.uploadedBytes + chunk.bytes() > m_uploadBudget)
+            break;
+
+        // Chunks used last frame are still wanted; the rest of the queue
+        // waits until some of them are not
+        if(!this->makeRoom(chunk.bytes()))
+            break;
+
+        this->upload(loaded.chunk, loaded.data);
+        m_uploadQueue.removeFirst();
+    }
+}
+
+bool MeshStreamer::request(int chunk, Binding *binding)
+{
+    if(chunk < 0 || chunk >= m_chunks.size())
+        return false;
+
+    Chunk &c = m_chunks[chunk];
+    c.lastUsed = m_frame;
+
+    if(c.state == OnDisk && m_loader)
+    {
+        c.state = Queued;
+        m_loader->enqueue(chunk, c.offset, c.bytes());
+    }
+
+    if(c.state != Resident)
+        return false;
+
+    if(binding)
+    {
+        binding->vertexBuffer = c.vertexBuffer;
+        binding->indexBuffer = c.indexBuffer;
+        binding->normalOffset = c.vertexCount*int(sizeof(QVector3D));
+        binding->indexCount = c.indexCount;
+    }
+
+    return true;
+}
+
+bool MeshStreamer::isResident(int chunk) const
+{
+    return chunk >= 0 && chunk < m_chunks.size() && m_chunks.at(chunk).state == Resident;
+}
+
+MeshStreamer::Statistics MeshStreamer::statistics() const
+{
+    Statistics ret = m_stats;
+    ret.residentChunks = 0;
+    ret.pendingChunks = 0;
+    Q_FOREACH(const Chunk &chunk, m_chunks)
+    {
+        if(chunk.state == Resident)
+            ++ret.residentChunks;
+        else if(chunk.state == Queued)
+            ++ret.pendingChunks;
+    }
+
+    return ret;
+}
+
+void MeshStreamer::upload(int chunk, const QByteArray &data)
+{
+    Chunk &c = m_chunks[chunk];
+    const qint64 vertexBytes = qint64(c.vertexCount)*2*qint64(sizeof(QVector3D));
+
+    GLuint buffers[2];
+    glGenBuffers(2, buffers);
+    c.vertexBuffer = buffers[0];
+    c.indexBuffer = buffers[1];
+
+    glBindBuffer(GL_ARRAY_BUFFER, c.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(vertexBytes), data.constData(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, GLsizeiptr(data.size()-vertexBytes),
+                 data.constData()+vertexBytes, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    c.state = Resident;
+    m_stats.residentBytes += c.bytes();
+    m_stats.uploadedBytes += c.bytes();
+    ++m_stats.uploads;
+    ++m_stats.totalUploads;
+}
+
+void MeshStreamer::evict(int chunk)
+{
+    Chunk &c = m_chunks[chunk];
+    const GLuint buffers[] = { c.vertexBuffer, c.indexBuffer };
+    glDeleteBuffers(2, buffers);
+
+    c.vertexBuffer = c.indexBuffer = 0;
+    c.state = OnDisk;
+    m_stats.residentBytes -= c.bytes();
+    ++m_stats.evictions;
+    ++m_stats.totalEvictions;
+}
+
+bool MeshStreamer::makeRoom(qint64 bytes)
+{
+    // A linear search for the least recently used chunk is plenty for the
+    // few hundred chunks (parts times LODs) of a scene
+    while(m_stats.residentBytes + bytes > m_memoryBudget)
+    {
+        int victim = -1;
+        for(int i=0; i<m_chunks.size(); i++)
+        {
+            const Chunk &chunk = m_chunks.at(i);
+            if(chunk.state != Resident || chunk.lastUsed >= m_frame-1)
+                continue;
+            if(victim < 0 || chunk.lastUsed < m_chunks.at(victim).lastUsed)
+                victim = i;
+        }
+
+        if(victim < 0)
+            return m_stats.residentBytes == 0;
+
+        this->evict(victim);
+    }
+
+    return true;
+}
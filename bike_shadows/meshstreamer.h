@@ -0,0 +1,121 @@
+#ifndef MESH_STREAMER_H
+#define MESH_STREAMER_H
+
+#include <QVector>
+#include <QVector3D>
+#include <QTemporaryFile>
+#include <QOpenGLFunctions>
+
+class ChunkLoader;
+
+/*
+ * Keeps meshes on disk and in GPU memory only as far as they are needed.
+ *
+ * Meshes are written to a chunk file when they are loaded, one chunk per
+ * part and LOD, each with vertices and indexes of its own. Renderers
+ * request() the chunks of the parts they see, at the LOD they want. Chunks
+ * that are not resident are read by a loader thread and uploaded by
+ * beginFrame(), at most uploadBudget() bytes per frame, so that a burst of
+ * newly visible geometry does not stall a frame. Chunks that have not been
+ * used for the longest time are evicted to keep within memoryBudget().
+ *
+ * Everything must be called on the thread of the OpenGL context. That
+ * includes addChunk(), which makes no GL calls but writes the chunk file
+ * and the chunk list without a lock; ObjModel::upload() calls it there.
+ */
+class MeshStreamer : public QOpenGLFunctions
+{
+public:
+    MeshStreamer();
+    ~MeshStreamer();
+
+    // Appends a chunk to the chunk file and returns its id. The chunk holds
+    // the given vertices and normals, and triangles indexing into them.
+    int addChunk(const QVector<QVector3D> &vertices, const QVector<QVector3D> &normals,
+                 const QVector<int> &indexes);
+    int chunkCount() const { return m_chunks.size(); }
+    bool isValid() const { return m_file.isOpen(); }
+
+    // GPU memory for resident chunks, in bytes. Chunks used in the last
+    // frame are never evicted, so the budget can be exceeded for a frame
+    // if they alone do not fit.
+    void setMemoryBudget(qint64 val) { m_memoryBudget = qMax(qint64(0), val); }
+    qint64 memoryBudget() const { return m_memoryBudget; }
+
+    // Bytes uploaded per frame. At least one chunk is uploaded per frame,
+    // however big.
+    void setUploadBudget(qint64 val) { m_uploadBudget = qMax(qint64(0), val); }
+    qint64 uploadBudget() const { return m_uploadBudget; }
+
+    // Uploads chunks read since the last frame. Call once per frame, before
+    // any request().
+    void beginFrame();
+
+    struct Binding
+    {
+        Binding() : vertexBuffer(0), indexBuffer(0), normalOffset(0), indexCount(0) { }
+        uint vertexBuffer, indexBuffer;
+        int normalOffset, indexCount;
+    };
+
+    // Marks the chunk as used in this frame. Returns true, with its buffers
+    // in binding, if the chunk is resident. Otherwise the chunk is queued
+    // for loading and false is returned.
+    bool request(int chunk, Binding *binding=nullptr);
+    bool isResident(int chunk) const;
+
+    struct Statistics
+    {
+        Statistics() : residentBytes(0), residentChunks(0), pendingChunks(0),
+            uploads(0), uploadedBytes(0), evictions(0), totalUploads(0),
+            totalEvictions(0) { }
+        qint64 residentBytes;
+        int residentChunks;
+        int pendingChunks;  // queued or read, not yet uploaded
+        int uploads;        // in the last frame
+        qint64 uploadedBytes;
+        int evictions;
+        qint64 totalUploads, totalEvictions;
+    };
+    Statistics statistics() const;
+
+private:
+    void upload(int chunk, const QByteArray &data);
+    void evict(int chunk);
+    bool makeRoom(qint64 bytes);
+
+private:
+    enum State { OnDisk, Queued, Resident };
+    struct Chunk
+    {
+        qint64 offset;
+        int vertexCount, indexCount;
+        qint64 lastUsed;    // frame number
+        uint vertexBuffer, indexBuffer;
+        State state;
+
+        qint64 bytes() const { return qint64(vertexCount)*2*qint64(sizeof(QVector3D)) +
+                                      qint64(indexCount)*qint64(sizeof(int)); }
+    };
+    QVector<Chunk> m_chunks;
+
+    struct LoadedChunk
+    {
+        int chunk;
+        QByteArray data;
+    };
+    QVector<LoadedChunk> m_uploadQueue;
+
+    QTemporaryFile m_file;
+    ChunkLoader *m_loader;
+    qint64 m_frame;
+    qint64 m_memoryBudget;
+    qint64 m_uploadBudget;
+    Statistics m_stats;
+    bool m_initialized;
+    char m_padding[7];
+
+    friend class ChunkLoader;
+};
+
+#endif // MESH_STREAMER_H
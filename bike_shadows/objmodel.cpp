@@ -1,26 +1,43 @@
 #include "objmodel.h"
+#include "arena.h"
+#include "meshstreamer.h"
+#include "frameprofiler.h"
+#include "meshsimplifier.h"
+#include "sceneshading.h"
+#include "shaderprogram.h"
 #include <QFile>
 #include <QFileInfo>
+#include <QHash>
 #include <QOpenGLBuffer>
 #include <QOpenGLContext>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
+#include <QVector2D>
+#include <QVector4D>
+#include <QtMath>
+#include <cstring>
+#include <limits>
 
 class SceneRenderer : public QOpenGLFunctions
 {
 public:
-    SceneRenderer() : m_shader(nullptr),
-        m_initialized(false) { m_padding[0] = 0; }
+    SceneRenderer() : m_initialized(false) { m_padding[0] = 0; }
     ~SceneRenderer() {
-        delete m_shader;
+        qDeleteAll(m_programs);
     }
 
-    void render(ObjModel *model, const QVector3D &eyePosition, const QVector3D &lightPosition,
+    void render(ObjModel *model, const ObjModel::InstanceMatrices &matrices,
+                const QVector3D &eyePosition, const QVector3D &lightPosition,
                 const QMatrix4x4 &projectionMatrix, const QMatrix4x4 &viewMatrix,
                 const QMatrix4x4 &lightViewMatrix=QMatrix4x4());
 
 private:
-    QOpenGLShaderProgram *m_shader;
+    // Permutations are SceneShading variants
+    QOpenGLShaderProgram *program(int variant);
+
+private:
+    Arena m_arena; // for models without a frame arena
+    QHash<int,QOpenGLShaderProgram*> m_programs;
     bool m_initialized;
     char m_padding[7];
 };
@@ -34,9 +51,11 @@ public:
         delete m_shader;
     }
 
-    void render(ObjModel *model, const QMatrix4x4 &projectionMatrix, const QMatrix4x4 &lightViewMatrix);
+    void render(ObjModel *model, const ObjModel::InstanceMatrices &matrices,
+                const QMatrix4x4 &projectionMatrix);
 
 private:
+    Arena m_arena; // for models without a frame arena
     QOpenGLShaderProgram *m_shader;
     bool m_initialized;
     bool m_padding[7];
@@ -45,117 +64,478 @@ private:
 Q_GLOBAL_STATIC(SceneRenderer, sceneRenderer)
 Q_GLOBAL_STATIC(ShadowRenderer, shadowRenderer)
 
-void ObjModel::render(const QVector3D &eyePosition,
+static inline QMatrix4x4 ToMatrix(const float *values)
+{
+    QMatrix4x4 ret(Qt::Uninitialized);
+    memcpy(ret.data(), values, 16*sizeof(float));
+    return ret;
+}
+
+void ObjModel::render(const QMatrix4x4 &modelMatrix,
+                      const QVector3D &eyePosition,
+                      const QVector3D &lightDirection,
+                      const QMatrix4x4 &projectionMatrix,
+                      const QMatrix4x4 &viewMatrix,
+                      const QMatrix4x4 &lightViewMatrix)
+{
+    // One instance at a time, through QMatrix4x4
+    const QMatrix4x4 modelViewMatrix = viewMatrix * modelMatrix;
+    const QMatrix4x4 modelViewProjectionMatrix = projectionMatrix * modelViewMatrix;
+    const QMatrix4x4 lightModelViewMatrix = lightViewMatrix * modelMatrix;
+    const QMatrix4x4 lightViewProjectionMatrix = projectionMatrix * lightModelViewMatrix;
+    const QMatrix3x3 normalMatrix = modelMatrix.normalMatrix();
+
+    InstanceMatrices matrices;
+    matrices.model = modelMatrix.constData();
+    matrices.modelView = modelViewMatrix.constData();
+    matrices.modelViewProjection = modelViewProjectionMatrix.constData();
+    matrices.lightView = lightModelViewMatrix.constData();
+    matrices.lightViewProjection = lightViewProjectionMatrix.constData();
+    matrices.normal = normalMatrix.constData();
+    this->render(matrices, eyePosition, lightDirection, projectionMatrix, viewMatrix, lightViewMatrix);
+}
+
+void ObjModel::render(const InstanceMatrices &matrices,
+                      const QVector3D &eyePosition,
                       const QVector3D &lightDirection,
                       const QMatrix4x4 &projectionMatrix,
                       const QMatrix4x4 &viewMatrix,
                       const QMatrix4x4 &lightViewMatrix)
 {
-    if(m_vertexBuffer && m_indexBuffer && !m_parts.isEmpty())
+    if((m_meshStreamer || (m_vertexBuffer && m_indexBuffer)) && !m_parts.isEmpty())
     {
         if(m_renderMode == SceneMode)
-            ::sceneRenderer->render(this, eyePosition, lightDirection, projectionMatrix, viewMatrix, lightViewMatrix);
+            ::sceneRenderer->render(this, matrices, eyePosition, lightDirection, projectionMatrix, viewMatrix, lightViewMatrix);
         else if(m_renderMode == ShadowMode)
-            ::shadowRenderer->render(this, projectionMatrix, viewMatrix);
+            ::shadowRenderer->render(this, matrices, projectionMatrix);
     }
 }
 
-typedef QMap< QString,QVector<float> > MaterialProps;
-QMap<QString,MaterialProps> LoadMaterials(const QString &mtlFileName);
+// Screen size (bounding sphere radius over half the viewport height) below
+// which the model drops to the next LOD. Every halving of the screen size
+// drops one more LOD.
+static const float LOD0_SCREEN_SIZE = 0.5f;
+static const float SHADOW_LOD_BIAS = 1.0f;
+static const int MIN_LOD_TRIANGLES = 32;
+static const int MAX_CLUSTER_TRIANGLES = 96;
 
-void ObjModel::load(const QString &fileName)
+int ObjModel::lodCount() const
 {
-    struct
+    int ret = 1;
+    Q_FOREACH(const Part &part, m_parts)
+        ret = qMax(ret, part.lodCount);
+    return ret;
+}
+
+bool ObjModel::hasParts(PartSelection selection) const
+{
+    Q_FOREACH(const Part &part, m_parts)
     {
-        QVector<QVector3D> geometry;
-        QVector<QVector3D> normals;
-    } compressed, uncompressed;
-    QVector<int> indexes;
-    QMap<QString,MaterialProps> materials;
-    Part currentPart;
+        if(this->isSelected(part, selection))
+            return true;
+    }
+    return false;
+}
 
-    /*
-     * Description of OBJ file format is available on Wikipedia
-     * https://en.wikipedia.org/wiki/Wavefront_.obj_file
-     */
-    QFile file(fileName);
-    if( !file.open(QFile::ReadOnly) )
-        return;
+int ObjModel::selectLod(const QMatrix4x4 &modelViewMatrix, const QMatrix4x4 &projectionMatrix, float bias) const
+{
+    const QVector3D center = modelViewMatrix.map(m_boundingBox.center());
+    const float scale = qMax( qMax(modelViewMatrix.column(0).toVector3D().length(),
+                                   modelViewMatrix.column(1).toVector3D().length()),
+                              modelViewMatrix.column(2).toVector3D().length() );
+    const float radius = 0.5f * scale * QVector3D(m_boundingBox.width(),
+                                                  m_boundingBox.height(),
+                                                  m_boundingBox.depth()).length();
+    const float distance = -center.z();
+    if(distance <= radius)
+        return 0;
+
+    const float screenSize = radius * projectionMatrix(1,1) / distance;
+    const float lod = float(qLn(qreal(LOD0_SCREEN_SIZE/screenSize))/M_LN2) + bias;
+    return qBound(0, int(lod), MaxLodCount-1);
+}
 
-    while(!file.atEnd())
-    {
-        const QString line = file.readLine().simplified();
-        if( line.startsWith("#") )
-            continue;
+float ObjModel::lod0ScreenSize()
+{
+    return LOD0_SCREEN_SIZE;
+}
 
-        const QStringList fields = line.split(" ", QString::SkipEmptyParts);
-        if( fields.isEmpty() )
-            continue;
+float ObjModel::shadowLodBias()
+{
+    return SHADOW_LOD_BIAS;
+}
 
-        const QString type = fields.first();
+// v, vn and f records, which make up nearly all of an OBJ file, are parsed
+// straight from its bytes rather than through QString. Fields are separated
+// by blanks, of which the \r of a CRLF line end is one.
+static inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-        if(type == "mtllib")
+static inline const char *SkipBlanks(const char *c, const char *end)
+{
+    while(c < end && IsBlank(*c))
+        ++c;
+    return c;
+}
+
+static inline const char *FieldEnd(const char *c, const char *end)
+{
+    while(c < end && !IsBlank(*c))
+        ++c;
+    return c;
+}
+
+static inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// The next field as a decimal number, with optional sign, fraction and
+// exponent, whatever the locale (which strtof would follow). Digits past
+// the 19th only scale the result, being far below float precision. 0 if
+// there is no next field.
+static float ParseFloat(const char *&c, const char *end)
+{
+    static const double POWERS_OF_TEN[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const int MAX_POWER = 22;
+
+    c = SkipBlanks(c, end);
+    bool negative = false;
+    if(c < end && (*c == '-' || *c == '+'))
+        negative = *c++ == '-';
+
+    quint64 mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    for(; c < end && IsDigit(*c); ++c)
+    {
+        if(digits < 19)
         {
-            const QString mtllib = fields.last();
-            const QString path = QFileInfo(fileName).absolutePath();
-            materials.unite( ::LoadMaterials(path + mtllib) );
-            continue;
+            mantissa = mantissa*10 + quint64(*c - '0');
+            digits += mantissa > 0 ? 1 : 0;
+        }
+        else
+            ++exponent;
+    }
+    if(c < end && *c == '.')
+    {
+        for(++c; c < end && IsDigit(*c); ++c)
+        {
+            if(digits < 19)
+            {
+                mantissa = mantissa*10 + quint64(*c - '0');
+                digits += mantissa > 0 ? 1 : 0;
+                --exponent;
+            }
         }
+    }
+    if(c < end && (*c == 'e' || *c == 'E'))
+    {
+        ++c;
+        bool negativeExponent = false;
+        if(c < end && (*c == '-' || *c == '+'))
+            negativeExponent = *c++ == '-';
+        int value = 0;
+        for(; c < end && IsDigit(*c); ++c)
+            value = qMin(value*10 + (*c - '0'), 100000);
+        exponent += negativeExponent ? -value : value;
+    }
+    c = FieldEnd(c, end);
+
+    double ret = double(mantissa);
+    for(; exponent > MAX_POWER; exponent -= MAX_POWER)
+        ret *= POWERS_OF_TEN[MAX_POWER];
+    for(; exponent < -MAX_POWER; exponent += MAX_POWER)
+        ret /= POWERS_OF_TEN[MAX_POWER];
+    ret = exponent >= 0 ? ret*POWERS_OF_TEN[exponent] : ret/POWERS_OF_TEN[-exponent];
+    return float(negative ? -ret : ret);
+}
 
-        if(type == "o")
+// Index of an OBJ face corner field: 1 based from the start, or negative
+// from the end of what has been read so far. -1 if it is out of range, and
+// -2 if the field is empty (as vt is in v//vn).
+static inline int ResolveIndex(const char *begin, const char *end, int count)
+{
+    if(begin == end)
+        return -2;
+
+    const bool negative = *begin == '-';
+    if(negative || *begin == '+')
+        ++begin;
+    if(begin == end)
+        return -1;
+
+    qint64 index = 0;
+    for(; begin < end; ++begin)
+    {
+        if(!IsDigit(*begin))
+            return -1;
+        index = qMin(index*10 + (*begin - '0'), qint64(std::numeric_limits<int>::max()));
+    }
+    if(index == 0)
+        return -1;
+
+    const qint64 ret = negative ? count-index : index-1;
+    return ret >= 0 && ret < count ? int(ret) : -1;
+}
+
+// Newell's method: the normal of a planar polygon, or of the plane that
+// best fits a non planar one, in the winding order of its points. Null
+// for a degenerate polygon.
+static QVector3D PolygonNormal(const QVector3D *points, int count)
+{
+    QVector3D normal;
+    for(int i=0; i<count; i++)
+    {
+        const QVector3D &a = points[i];
+        const QVector3D &b = points[(i+1) % count];
+        normal += QVector3D( (a.y()-b.y())*(a.z()+b.z()),
+                             (a.z()-b.z())*(a.x()+b.x()),
+                             (a.x()-b.x())*(a.y()+b.y()) );
+    }
+
+    return normal.length() > 0 ? normal.normalized() : QVector3D();
+}
+
+// Signed area (times 2) of the 2D triangle abc; positive when counter
+// clockwise
+static inline float Area2(const QVector2D &a, const QVector2D &b, const QVector2D &c)
+{
+    return (b.x()-a.x())*(c.y()-a.y()) - (c.x()-a.x())*(b.y()-a.y());
+}
+
+// Splits a polygon into triangles (triples of indexes into points) that
+// keep its winding, and returns the number of indexes written. Triangles
+// and quads, and convex polygons in general, are fanned out from the first
+// point; concave ones are ear clipped in the plane of the polygon. The
+// caller provides room for 3*(n-2) triangle indexes, and n of scratch.
+static int Triangulate(const QVector3D *points, int n, const QVector3D &normal,
+                       int *triangles, int *scratch, QVector2D *projected)
+{
+    int ret = 0;
+
+    bool convex = n <= 3;
+    for(int i=0; i<n && !convex; i++)
+    {
+        const QVector3D &a = points[i];
+        const QVector3D &b = points[(i+1) % n];
+        const QVector3D &c = points[(i+2) % n];
+        if(QVector3D::dotProduct(QVector3D::crossProduct(b-a, c-b), normal) < 0)
+            break;
+        convex = i == n-1;
+    }
+
+    if(convex || normal.isNull())
+    {
+        for(int i=1; i+1<n; i++)
         {
-            if(currentPart.isValid())
-                m_parts << currentPart;
+            triangles[ret++] = 0;
+            triangles[ret++] = i;
+            triangles[ret++] = i+1;
+        }
+        return ret;
+    }
 
-            currentPart = Part();
-            currentPart.type = GL_TRIANGLES;
-            continue;
+    // Drop the axis the normal is longest along, and flip the other two if
+    // needed, so that the polygon is counter clockwise in 2D
+    const int axis = qAbs(normal.x()) > qAbs(normal.y()) ?
+                     (qAbs(normal.x()) > qAbs(normal.z()) ? 0 : 2) :
+                     (qAbs(normal.y()) > qAbs(normal.z()) ? 1 : 2);
+    const int u = (axis+1) % 3;
+    const int v = (axis+2) % 3;
+    const float flip = normal[axis] < 0 ? -1.0f : 1.0f;
+
+    for(int i=0; i<n; i++)
+    {
+        projected[i] = QVector2D(points[i][u], flip*points[i][v]);
+        scratch[i] = i;
+    }
+
+    // Ear clipping, O(n^2). An ear is a convex corner whose triangle holds
+    // no other remaining point.
+    int remaining = n;
+    int i = 0;
+    int misses = 0;
+    while(remaining > 3)
+    {
+        const int prev = scratch[(i+remaining-1) % remaining];
+        const int curr = scratch[i];
+        const int next = scratch[(i+1) % remaining];
+        const QVector2D &a = projected[prev];
+        const QVector2D &b = projected[curr];
+        const QVector2D &c = projected[next];
+
+        bool ear = Area2(a, b, c) > 0;
+        for(int k=0; k<remaining && ear; k++)
+        {
+            const int p = scratch[k];
+            if(p == prev || p == curr || p == next)
+                continue;
+            const QVector2D &q = projected[p];
+            ear = !(Area2(a, b, q) >= 0 && Area2(b, c, q) >= 0 && Area2(c, a, q) >= 0);
         }
 
-        if(type == "usemtl")
+        if(ear)
         {
-            const MaterialProps props = materials.value( fields.last() );
+            triangles[ret++] = prev;
+            triangles[ret++] = curr;
+            triangles[ret++] = next;
+            memmove(scratch+i, scratch+i+1, size_t(remaining-i-1)*sizeof(int));
+            --remaining;
+            misses = 0;
+        }
+        else
+            ++i;
+        i %= remaining;
+
+        // Self intersecting or degenerate; the rest is fanned out
+        if(!ear && ++misses > remaining)
+            break;
+    }
+
+    for(int k=1; k+1<remaining; k++)
+    {
+        triangles[ret++] = scratch[0];
+        triangles[ret++] = scratch[k];
+        triangles[ret++] = scratch[k+1];
+    }
+    return ret;
+}
+
+// Counts of the records in an OBJ file, from a quick pass over its bytes,
+// so that the parser can size everything up front
+struct ObjRecordCounts
+{
+    ObjRecordCounts() : positions(0), normals(0), triangles(0), maxCorners(3) { }
+    int positions, normals, triangles, maxCorners;
+};
 
-            const QVector<float> diffuse = props.value("Kd");
-            if(diffuse.size() == 3)
+static ObjRecordCounts CountRecords(const QByteArray &data)
+{
+    ObjRecordCounts ret;
+    const char *c = data.constData();
+    const char *end = c + data.size();
+    while(c < end)
+    {
+        while(c < end && (*c == ' ' || *c == '\t'))
+            ++c;
+
+        if(c+1 < end && c[0] == 'v' && (c[1] == ' ' || c[1] == '\t'))
+            ++ret.positions;
+        else if(c+2 < end && c[0] == 'v' && c[1] == 'n' && (c[2] == ' ' || c[2] == '\t'))
+            ++ret.normals;
+        else if(c+1 < end && c[0] == 'f' && (c[1] == ' ' || c[1] == '\t'))
+        {
+            // Corners are the runs of non blanks after the f
+            int corners = 0;
+            bool blank = true;
+            for(++c; c < end && *c != '\n'; ++c)
             {
-                currentPart.material.color.diffuse.setRgbF( qreal(diffuse[0]), qreal(diffuse[1]), qreal(diffuse[2]) );
-                currentPart.material.intensity.diffuse = 1.0;
+                const bool isBlank = *c == ' ' || *c == '\t' || *c == '\r';
+                if(blank && !isBlank)
+                    ++corners;
+                blank = isBlank;
             }
-
-            const QVector<float> ambient = props.value("Ka");
-            if(ambient.size() == 3)
+            if(corners >= 3)
             {
-                currentPart.material.color.ambient.setRgbF( qreal(ambient[0]), qreal(ambient[1]), qreal(ambient[2]) );
-                currentPart.material.intensity.ambient = 1.0;
+                ret.triangles += corners-2;
+                ret.maxCorners = qMax(ret.maxCorners, corners);
             }
+        }
 
-            const QVector<float> specular = props.value("Ks");
-            if(specular.size() == 3)
-                currentPart.material.color.specular.setRgbF( qreal(specular[0]), qreal(specular[1]), qreal(specular[2]) );
+        while(c < end && *c != '\n')
+            ++c;
+        ++c;
+    }
 
-             currentPart.material.intensity.specular = 3.0f * props.value("Ns").first() / 1000.0f;
+    return ret;
+}
 
-            if(props.contains("d"))
-                currentPart.material.opacity = props.value("d").first();
-            else if(props.contains("Tr"))
-                currentPart.material.opacity = 1.0f - props.value("Tr").first();
+void ObjModel::load(const QString &fileName)
+{
+    Material defaultMaterial;
+    defaultMaterial.reset();
+    m_materials.clear();
+    m_materials.append(defaultMaterial);
 
-            if(props.contains("illum"))
-                currentPart.material.brightness = props.value("illum").first();
-            else
-                currentPart.material.brightness = 1.0f;
+    /*
+     * Description of OBJ file format is available on Wikipedia
+     * https://en.wikipedia.org/wiki/Wavefront_.obj_file
+     */
+    QFile file(fileName);
+    if( !file.open(QFile::ReadOnly) )
+        return;
+
+    const QByteArray data = file.readAll();
+    file.close();
+
+    // Everything is sized from a pre-scan. What outlives the load goes in
+    // vectors allocated once at their final size; the scratch (normals as
+    // read, and the face parser's arrays) comes out of a single arena
+    // block, released in one go at the end.
+    const ObjRecordCounts counts = CountRecords(data);
+    struct
+    {
+        QVector<QVector3D> geometry;
+        QVector<QVector3D> normals;
+    } uncompressed;
+    QVector<QVector3D> positions;
+    QVector<int> indexes;
+    QVector<int> positionIndexes;
+    positions.reserve(counts.positions);
+    uncompressed.geometry.reserve(counts.triangles*3);
+    uncompressed.normals.reserve(counts.triangles*3);
+    indexes.reserve(counts.triangles*3);
+    positionIndexes.reserve(counts.triangles*3);
+
+    const int maxCorners = counts.maxCorners;
+    Arena arena;
+    arena.reserve( qint64(counts.normals)*qint64(sizeof(QVector3D)) +
+                   qint64(maxCorners)*qint64(sizeof(Corner)+sizeof(QVector3D)+sizeof(QVector2D)+sizeof(int)*4) +
+                   qint64(5*16) );
+    QVector3D *normals = arena.allocate<QVector3D>(counts.normals);
+    Corner *face = arena.allocate<Corner>(maxCorners);
+    QVector3D *facePoints = arena.allocate<QVector3D>(maxCorners);
+    QVector2D *projectedPoints = arena.allocate<QVector2D>(maxCorners);
+    int *faceTriangles = arena.allocate<int>(3*maxCorners);
+    int *triangulationScratch = arena.allocate<int>(maxCorners);
+    int normalCount = 0;
+
+    QHash<QString,int> materialIds;
+    Part currentPart;
+    int texCoordCount = 0;
 
+    const char *text = data.constData();
+    int lineStart = 0;
+    while(lineStart < data.size())
+    {
+        int lineEnd = data.indexOf('\n', lineStart);
+        if(lineEnd < 0)
+            lineEnd = data.size();
+        const char *c = SkipBlanks(text+lineStart, text+lineEnd);
+        const char *end = text+lineEnd;
+        lineStart = lineEnd+1;
+
+        const char *typeEnd = FieldEnd(c, end);
+        const int typeLength = int(typeEnd-c);
+        if(typeLength == 0 || *c == '#')
             continue;
-        }
 
-        if( type == "v" || type == "vn" )
+        if( (typeLength == 1 && c[0] == 'v') || (typeLength == 2 && c[0] == 'v' && c[1] == 'n') )
         {
-            const QVector3D v( fields[1].toFloat(), fields[2].toFloat(), fields[3].toFloat() );
-            if(type == "v")
+            const bool isPosition = typeLength == 1;
+            c = typeEnd;
+            const float x = ParseFloat(c, end);
+            const float y = ParseFloat(c, end);
+            const float z = ParseFloat(c, end);
+            const QVector3D v(x, y, z);
+            if(isPosition)
             {
-                compressed.geometry.append(v);
-                if(compressed.geometry.size() == 1)
+                positions.append(v);
+                if(positions.size() == 1)
                 {
                     m_boundingBox.x.min = v.x();
                     m_boundingBox.x.max = v.x();
@@ -178,55 +558,140 @@ void ObjModel::load(const QString &fileName)
                     m_boundingBox.z.max = qMax(v.z(), m_boundingBox.z.max);
                 }
             }
-            else
-            {
-                const QVector3D n = v.normalized();
-                compressed.normals.append(n);
-            }
+            else if(normalCount < counts.normals)
+                normals[normalCount++] = v.normalized();
 
             continue;
         }
 
-        if(type == "f")
+        if(typeLength == 2 && c[0] == 'v' && c[1] == 't')
         {
-            // Lets ignore non-triangles for now
-            if(fields.size() != 4)
-                continue;
+            // Not used for rendering, but counted so that relative indexes
+            // and v/vt/vn corners resolve
+            ++texCoordCount;
+            continue;
+        }
 
-            const int a = fields[1].split("/").first().toInt() - 1;
-            const int b = fields[2].split("/").first().toInt() - 1;
-            const int c = fields[3].split("/").first().toInt() - 1;
+        if(typeLength == 1 && c[0] == 'f')
+        {
+            // Corners are v, v/vt, v//vn or v/vt/vn, with 1 based or
+            // negative (relative to the end) indexes
+            const int cgs = positions.size();
+            const int cns = normalCount;
+            int cornerCount = 0;
+            bool valid = true;
+            bool hasNormals = true;
+            for(c = SkipBlanks(typeEnd, end); c < end && valid; c = SkipBlanks(c, end))
+            {
+                const char *fieldEnd = FieldEnd(c, end);
+                if(cornerCount == maxCorners)
+                {
+                    valid = false;
+                    break;
+                }
 
-            const int na = fields[1].split("/").last().toInt() - 1;
-            const int nb = fields[2].split("/").last().toInt() - 1;
-            const int nc = fields[3].split("/").last().toInt() - 1;
+                const char *slash1 = static_cast<const char*>( memchr(c, '/', size_t(fieldEnd-c)) );
+                const char *slash2 = slash1 ? static_cast<const char*>( memchr(slash1+1, '/', size_t(fieldEnd-slash1-1)) ) : nullptr;
+
+                Corner &corner = face[cornerCount++];
+                corner.position = ResolveIndex(c, slash1 ? slash1 : fieldEnd, cgs);
+                corner.normal = slash2 ? ResolveIndex(slash2+1, fieldEnd, cns) : -2;
+                const int texCoord = slash1 ? ResolveIndex(slash1+1, slash2 ? slash2 : fieldEnd, texCoordCount) : -2;
+
+                valid = corner.position >= 0 && corner.normal != -1 && texCoord != -1;
+                hasNormals &= corner.normal >= 0;
+                c = fieldEnd;
+            }
 
-            const int cgs = compressed.geometry.size();
-            if(a >= cgs || b >= cgs || c >= cgs)
+            if(!valid)
             {
-                qDebug() << "Geometry: " << a << b << c << cgs;
+                qDebug() << "Face: " << QByteArray(typeEnd, int(end-typeEnd)).simplified() << cgs << texCoordCount << cns;
                 continue;
             }
+            if(cornerCount < 3)
+                continue;
 
-            const int cns = compressed.normals.size();
-            if(na >= cns || nb >= cns || nc >= cns)
-            {
-                qDebug() << "Normals: " << na << nb << nc << cns;
+            // Faces without normals are shaded flat
+            for(int k=0; k<cornerCount; k++)
+                facePoints[k] = positions.at(face[k].position);
+            const QVector3D faceNormal = PolygonNormal(facePoints, cornerCount);
+            if(!hasNormals && faceNormal.isNull())
                 continue;
+
+            const int nrTriangleIndexes = Triangulate(facePoints, cornerCount, faceNormal, faceTriangles,
+                                                      triangulationScratch, projectedPoints);
+            for(int t=0; t+2<nrTriangleIndexes; t+=3)
+            {
+                const Corner *corners[] = { &face[faceTriangles[t]], &face[faceTriangles[t+1]],
+                                            &face[faceTriangles[t+2]] };
+
+                BoundingBox triangleBounds;
+                const QVector3D &first = positions.at(corners[0]->position);
+                triangleBounds.x.min = triangleBounds.x.max = first.x();
+                triangleBounds.y.min = triangleBounds.y.max = first.y();
+                triangleBounds.z.min = triangleBounds.z.max = first.z();
+                for(int k=1; k<3; k++)
+                {
+                    const QVector3D &p = positions.at(corners[k]->position);
+                    triangleBounds.x.min = qMin(triangleBounds.x.min, p.x());
+                    triangleBounds.x.max = qMax(triangleBounds.x.max, p.x());
+                    triangleBounds.y.min = qMin(triangleBounds.y.min, p.y());
+                    triangleBounds.y.max = qMax(triangleBounds.y.max, p.y());
+                    triangleBounds.z.min = qMin(triangleBounds.z.min, p.z());
+                    triangleBounds.z.max = qMax(triangleBounds.z.max, p.z());
+                }
+
+                if(currentPart.start < 0)
+                {
+                    currentPart.start = indexes.length();
+                    currentPart.bounds = triangleBounds;
+                }
+                else
+                    currentPart.bounds |= triangleBounds;
+
+                const int i = uncompressed.geometry.size();
+                for(int k=0; k<3; k++)
+                {
+                    uncompressed.geometry << positions.at(corners[k]->position);
+                    uncompressed.normals << (corners[k]->normal >= 0 ? normals[corners[k]->normal] : faceNormal);
+                    positionIndexes << corners[k]->position;
+                }
+                indexes << i << i+1 << i+2;
             }
 
-            if(currentPart.start < 0)
-                currentPart.start = indexes.length();
-
-            const int i = uncompressed.geometry.size();
-            uncompressed.geometry << compressed.geometry.at(a)
-                                  << compressed.geometry.at(b)
-                                  << compressed.geometry.at(c);
-            uncompressed.normals << compressed.normals.at(na)
-                                  << compressed.normals.at(nb)
-                                  << compressed.normals.at(nc);
-            indexes << i << i+1 << i+2;
-            currentPart.length = (indexes.length() - currentPart.start);
+            if(currentPart.start >= 0)
+                currentPart.length = (indexes.length() - currentPart.start);
+            continue;
+        }
+
+        // The rest is rare enough to go through QString
+        const QString line = QString::fromUtf8(c, int(end-c)).simplified();
+        const QStringList fields = line.split(" ", QString::SkipEmptyParts);
+        const QString type = fields.first();
+
+        if(type == "mtllib")
+        {
+            const QString mtllib = fields.last();
+            const QString path = QFileInfo(fileName).absolutePath();
+            this->loadMaterials(path + mtllib, materialIds);
+            continue;
+        }
+
+        if(type == "o")
+        {
+            if(currentPart.isValid())
+                m_parts << currentPart;
+
+            currentPart = Part();
+            currentPart.type = GL_TRIANGLES;
+            if(fields.size() > 1)
+                currentPart.name = fields.at(1);
+            continue;
+        }
+
+        if(type == "usemtl")
+        {
+            currentPart.material = materialIds.value(fields.last(), 0);
             continue;
         }
     }
@@ -234,20 +699,58 @@ void ObjModel::load(const QString &fileName)
     if(currentPart.isValid())
         m_parts << currentPart;
 
-    std::sort(m_parts.begin(), m_parts.end());
+    const Arena::Statistics arenaStats = arena.statistics();
+    FrameProfiler::countLoadAllocations(arenaStats.allocations, arenaStats.usedBytes, arenaStats.blockAllocations);
+
+    this->generateLods(positions, positionIndexes,
+                       uncompressed.geometry, uncompressed.normals, indexes);
+    this->buildClusters(uncompressed.geometry, indexes);
+    this->buildBvh(uncompressed.geometry, indexes);
+
+    // Buffers (and chunks, whose file is shared by all models) are left
+    // to upload(), on the thread that owns the context
+    m_pendingVertices.swap(uncompressed.geometry);
+    m_pendingNormals.swap(uncompressed.normals);
+    m_pendingIndexes.swap(indexes);
+}
+
+qint64 ObjModel::pendingUploadSize() const
+{
+    return qint64(m_pendingVertices.size()+m_pendingNormals.size())*qint64(sizeof(QVector3D)) +
+           qint64(m_pendingIndexes.size())*qint64(sizeof(int));
+}
+
+void ObjModel::upload()
+{
+    if(m_pendingIndexes.isEmpty())
+        return;
+
+    if(m_meshStreamer)
+        this->writeChunks(m_pendingVertices, m_pendingNormals, m_pendingIndexes);
+    else
+        this->createBuffers(m_pendingVertices, m_pendingNormals, m_pendingIndexes);
 
-    const QVector<QVector3D> vertices = uncompressed.geometry + uncompressed.normals;
-    m_normalOffset = uncompressed.geometry.size()*int(sizeof(QVector3D));
-    m_vertexBuffer = new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    m_pendingVertices = QVector<QVector3D>();
+    m_pendingNormals = QVector<QVector3D>();
+    m_pendingIndexes = QVector<int>();
+}
+
+void ObjModel::createBuffers(const QVector<QVector3D> &positions, const QVector<QVector3D> &normals,
+                             const QVector<int> &indexes)
+{
+    // Positions, then normals, written straight from where they are rather
+    // than joined into one more copy first
+    m_normalOffset = positions.size()*int(sizeof(QVector3D));
+    const int normalBytes = normals.size()*int(sizeof(QVector3D));
+    m_vertexBuffer.reset(new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer));
     m_vertexBuffer->create();
     m_vertexBuffer->bind();
-    m_vertexBuffer->allocate(
-            static_cast<const void*>(vertices.constData()),
-            vertices.size()*int(sizeof(QVector3D))
-        );
+    m_vertexBuffer->allocate(m_normalOffset + normalBytes);
+    m_vertexBuffer->write(0, static_cast<const void*>(positions.constData()), m_normalOffset);
+    m_vertexBuffer->write(m_normalOffset, static_cast<const void*>(normals.constData()), normalBytes);
     m_vertexBuffer->release();
 
-    m_indexBuffer = new QOpenGLBuffer(QOpenGLBuffer::IndexBuffer);
+    m_indexBuffer.reset(new QOpenGLBuffer(QOpenGLBuffer::IndexBuffer));
     m_indexBuffer->create();
     m_indexBuffer->bind();
     m_indexBuffer->allocate(
@@ -257,16 +760,476 @@ void ObjModel::load(const QString &fileName)
     m_indexBuffer->release();
 }
 
-QMap<QString,MaterialProps> LoadMaterials(const QString &mtlFileName)
+QStringList ObjModel::partNames() const
 {
-    QMap<QString,MaterialProps> ret;
+    QStringList ret;
+    Q_FOREACH(const Part &part, m_parts)
+        ret << part.name;
+    return ret;
+}
 
+int ObjModel::intersect(const QVector3D &origin, const QVector3D &direction, float *distance) const
+{
+    const TriangleBvh::Hit hit = m_bvh.intersect(origin, direction);
+    if(distance && hit.isValid())
+        *distance = hit.distance;
+    return hit.part;
+}
+
+ObjModel *ObjModel::takeParts(const QStringList &names)
+{
+    // Where each part ends up, in this model or the new one
+    QVector<int> keptParts(m_parts.size(), -1), takenParts(m_parts.size(), -1);
+    int keptCount = 0, takenCount = 0;
+    for(int i=0; i<m_parts.size(); i++)
+    {
+        if(names.contains(m_parts.at(i).name))
+            takenParts[i] = takenCount++;
+        else
+            keptParts[i] = keptCount++;
+    }
+
+    ObjModel *ret = nullptr;
+    for(int i=m_parts.size()-1; i>=0; i--)
+    {
+        if(!names.contains(m_parts.at(i).name))
+            continue;
+
+        if(ret == nullptr)
+        {
+            ret = new ObjModel;
+            ret->m_vertexBuffer = m_vertexBuffer;
+            ret->m_indexBuffer = m_indexBuffer;
+            ret->m_normalOffset = m_normalOffset;
+            ret->m_meshStreamer = m_meshStreamer;
+            ret->m_materials = m_materials;
+            ret->m_lightManager = m_lightManager;
+            ret->m_frameArena = m_frameArena;
+        }
+
+        // Clusters go along with the part. Those left behind in this model
+        // are simply no longer referred to.
+        Part part = m_parts.takeAt(i);
+        const int firstCluster = ret->m_clusters.size();
+        ret->m_clusters += m_clusters.mid(part.firstCluster, part.clusterCount);
+        part.firstCluster = firstCluster;
+        ret->m_parts.prepend(part);
+    }
+
+    if(ret)
+    {
+        ret->updateBoundingBox();
+        this->updateBoundingBox();
+
+        ret->m_bvh = m_bvh.select(takenParts);
+        m_bvh = m_bvh.select(keptParts);
+    }
+
+    return ret;
+}
+
+void ObjModel::buildBvh(const QVector<QVector3D> &vertices, const QVector<int> &indexes)
+{
+    // lods[0] of every part; buildClusters() reorders its triangles, but
+    // keeps them within the part's range
+    int nrTriangles = 0;
+    Q_FOREACH(const Part &part, m_parts)
+        nrTriangles += part.length/3;
+
+    QVector<int> triangleParts;
+    triangleParts.reserve(nrTriangles);
+    QVector<int> triangleIndexes;
+    triangleIndexes.reserve(nrTriangles*3);
+    for(int p=0; p<m_parts.size(); p++)
+    {
+        const Part &part = m_parts.at(p);
+        const int *partIndexes = indexes.constData() + part.start;
+        for(int t=0; t+2<part.length; t+=3)
+        {
+            triangleIndexes << partIndexes[t] << partIndexes[t+1] << partIndexes[t+2];
+            triangleParts << p;
+        }
+    }
+
+    m_bvh.build(vertices.constData(), triangleIndexes.constData(), triangleParts.constData(), nrTriangles);
+}
+
+void ObjModel::updateBoundingBox()
+{
+    if(m_parts.isEmpty())
+        return;
+
+    m_boundingBox = m_parts.first().bounds;
+    for(int i=1; i<m_parts.size(); i++)
+        m_boundingBox |= m_parts.at(i).bounds;
+}
+
+void ObjModel::generateLods(const QVector<QVector3D> &positions, const QVector<int> &positionIndexes,
+                            QVector<QVector3D> &vertices, QVector<QVector3D> &normals,
+                            QVector<int> &indexes)
+{
+    // Vertices shared by more than one part are never collapsed, so that
+    // part (and hence material) boundaries stay put across LODs.
+    QVector<int> owner(positions.size(), -1);
+    QVector<bool> locked(positions.size(), false);
+    for(int p=0; p<m_parts.size(); p++)
+    {
+        const Part &part = m_parts.at(p);
+        for(int i=part.start; i<part.start+part.length; i++)
+        {
+            const int v = positionIndexes.at(i);
+            if(owner.at(v) < 0)
+                owner[v] = p;
+            else if(owner.at(v) != p)
+                locked[v] = true;
+        }
+    }
+
+    for(int p=0; p<m_parts.size(); p++)
+    {
+        Part &part = m_parts[p];
+        part.lods[0].start = part.start;
+        part.lods[0].length = part.length;
+        part.lodCount = 1;
+
+        if(part.length/3 < MIN_LOD_TRIANGLES)
+            continue;
+
+        // Simplified triangles share vertices, whose normal is the average
+        // of the normals the position had in the full detail part.
+        QHash<int,QVector3D> averageNormals;
+        for(int i=part.start; i<part.start+part.length; i++)
+            averageNormals[positionIndexes.at(i)] += normals.at(indexes.at(i));
+
+        MeshSimplifier simplifier(positions, positionIndexes.mid(part.start, part.length), locked);
+        int previousLength = part.length;
+        for(int lod=1; lod<MaxLodCount; lod++)
+        {
+            const QVector<int> triangles = simplifier.simplify( (part.length/3) >> lod );
+
+            // Stop once the simplifier can't make meaningful progress
+            if(triangles.size() > previousLength*9/10)
+                break;
+
+            QHash<int,int> lodVertices;
+            part.lods[lod].start = indexes.size();
+            part.lods[lod].length = triangles.size();
+            Q_FOREACH(int v, triangles)
+            {
+                int index = lodVertices.value(v, -1);
+                if(index < 0)
+                {
+                    index = vertices.size();
+                    vertices.append(positions.at(v));
+                    normals.append(averageNormals.value(v).normalized());
+                    lodVertices.insert(v, index);
+                }
+                indexes.append(index);
+            }
+
+            part.lodCount = lod+1;
+            previousLength = triangles.size();
+        }
+    }
+}
+
+static inline quint32 SpreadBits(quint32 v)
+{
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v <<  8)) & 0x0300F00F;
+    v = (v | (v <<  4)) & 0x030C30C3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+void ObjModel::buildClusters(const QVector<QVector3D> &vertices, QVector<int> &indexes)
+{
+    m_clusters.clear();
+
+    for(int p=0; p<m_parts.size(); p++)
+    {
+        Part &part = m_parts[p];
+        part.firstCluster = m_clusters.size();
+        part.clusterCount = 0;
+
+        const int nrTriangles = part.length/3;
+        if(nrTriangles == 0)
+            continue;
+
+        // Order the triangles of the part by the dominant axis of their
+        // normal first, and along a Morton curve through their centroid
+        // next. Chopping that order into runs gives clusters that are both
+        // compact and have a narrow normal cone.
+        BoundingBox bounds;
+        QVector<QVector3D> centroids(nrTriangles);
+        QVector<QVector3D> faceNormals(nrTriangles);
+        for(int t=0; t<nrTriangles; t++)
+        {
+            const int *tri = indexes.constData() + part.start + t*3;
+            const QVector3D &a = vertices.at(tri[0]);
+            const QVector3D &b = vertices.at(tri[1]);
+            const QVector3D &c = vertices.at(tri[2]);
+            centroids[t] = (a + b + c) / 3.0f;
+            faceNormals[t] = QVector3D::crossProduct(b-a, c-a).normalized();
+
+            BoundingBox box;
+            box.x.min = box.x.max = centroids.at(t).x();
+            box.y.min = box.y.max = centroids.at(t).y();
+            box.z.min = box.z.max = centroids.at(t).z();
+            if(t == 0)
+                bounds = box;
+            else
+                bounds |= box;
+        }
+
+        const QVector3D origin(bounds.x.min, bounds.y.min, bounds.z.min);
+        const QVector3D extent(qMax(bounds.width(), 1e-6f), qMax(bounds.height(), 1e-6f), qMax(bounds.depth(), 1e-6f));
+        QVector< QPair<quint64,int> > keys(nrTriangles);
+        for(int t=0; t<nrTriangles; t++)
+        {
+            const QVector3D n = faceNormals.at(t);
+            const QVector3D an(qAbs(n.x()), qAbs(n.y()), qAbs(n.z()));
+            const int axis = (an.x() >= an.y() && an.x() >= an.z()) ? 0 : (an.y() >= an.z() ? 1 : 2);
+            const quint64 bucket = quint64(axis*2 + (n[axis] < 0 ? 1 : 0));
+
+            const QVector3D q = (centroids.at(t) - origin) / extent * 1023.0f;
+            const quint32 morton = (SpreadBits(quint32(q.x())) << 2) |
+                                   (SpreadBits(quint32(q.y())) << 1) |
+                                    SpreadBits(quint32(q.z()));
+            keys[t] = qMakePair( (bucket << 32) | quint64(morton), t );
+        }
+        std::sort(keys.begin(), keys.end());
+
+        const QVector<int> partIndexes = indexes.mid(part.start, part.length);
+        for(int t=0; t<nrTriangles; t++)
+        {
+            const int src = keys.at(t).second;
+            for(int i=0; i<3; i++)
+                indexes[part.start + t*3 + i] = partIndexes.at(src*3 + i);
+        }
+
+        for(int first=0; first<nrTriangles; )
+        {
+            // Don't let a cluster straddle two normal buckets
+            int last = qMin(first + MAX_CLUSTER_TRIANGLES, nrTriangles);
+            for(int t=first+1; t<last; t++)
+            {
+                if( (keys.at(t).first >> 32) != (keys.at(first).first >> 32) )
+                {
+                    last = t;
+                    break;
+                }
+            }
+
+            Cluster cluster;
+            cluster.start = part.start + first*3;
+            cluster.length = (last-first)*3;
+
+            BoundingBox box;
+            QVector3D axis;
+            for(int t=first; t<last; t++)
+            {
+                const int src = keys.at(t).second;
+                axis += faceNormals.at(src);
+                for(int i=0; i<3; i++)
+                {
+                    const QVector3D &v = vertices.at(indexes.at(part.start + t*3 + i));
+                    BoundingBox vbox;
+                    vbox.x.min = vbox.x.max = v.x();
+                    vbox.y.min = vbox.y.max = v.y();
+                    vbox.z.min = vbox.z.max = v.z();
+                    if(t == first && i == 0)
+                        box = vbox;
+                    else
+                        box |= vbox;
+                }
+            }
+
+            cluster.center = box.center();
+            cluster.radius = 0.0f;
+            for(int i=cluster.start; i<cluster.start+cluster.length; i++)
+                cluster.radius = qMax(cluster.radius, (vertices.at(indexes.at(i)) - cluster.center).length());
+
+            // coneCutoff is the sine of the widest angle between the axis and
+            // any of the normals. A cluster whose normals spread across more
+            // than a hemisphere can never be back-face culled.
+            cluster.coneAxis = axis.normalized();
+            float minDot = 1.0f;
+            for(int t=first; t<last; t++)
+                minDot = qMin(minDot, QVector3D::dotProduct(cluster.coneAxis, faceNormals.at(keys.at(t).second)));
+            cluster.coneCutoff = (minDot <= 0.0f || cluster.coneAxis.isNull()) ? 1.0f : qSqrt(1.0f - minDot*minDot);
+
+            m_clusters.append(cluster);
+            ++part.clusterCount;
+            first = last;
+        }
+    }
+}
+
+ObjModel::Frustum::Frustum(const QMatrix4x4 &modelViewProjectionMatrix,
+                           const QMatrix4x4 &modelViewMatrix, bool cullFront)
+    : cullFrontFaces(cullFront)
+{
+    // Planes of the view frustum, in model space
+    const QVector4D r0 = modelViewProjectionMatrix.row(0);
+    const QVector4D r1 = modelViewProjectionMatrix.row(1);
+    const QVector4D r2 = modelViewProjectionMatrix.row(2);
+    const QVector4D r3 = modelViewProjectionMatrix.row(3);
+    planes[0] = r3 + r0; planes[1] = r3 - r0;
+    planes[2] = r3 + r1; planes[3] = r3 - r1;
+    planes[4] = r3 + r2; planes[5] = r3 - r2;
+    for(int i=0; i<6; i++)
+        planes[i] /= planes[i].toVector3D().length();
+
+    eye = modelViewMatrix.inverted().map( QVector3D(0,0,0) );
+}
+
+int ObjModel::buildDrawList(const Part &part, int lod, const Frustum &frustum,
+                            DrawRange *drawList) const
+{
+    // Simplified LODs are small enough to be drawn whole
+    if(lod > 0 || part.clusterCount == 0)
+    {
+        drawList[0].start = part.lods[lod].start;
+        drawList[0].length = part.lods[lod].length;
+        return 1;
+    }
+
+    // At most one range per cluster, so maxDrawListSize() is room enough
+    int count = 0;
+
+    for(int i=part.firstCluster; i<part.firstCluster+part.clusterCount; i++)
+    {
+        const Cluster &cluster = m_clusters.at(i);
+
+        bool visible = true;
+        for(int p=0; p<6 && visible; p++)
+        {
+            const QVector4D &plane = frustum.planes[p];
+            visible = QVector3D::dotProduct(plane.toVector3D(), cluster.center) + plane.w() >= -cluster.radius;
+        }
+
+        if(visible)
+        {
+            // Culls clusters that face away from the eye entirely (or towards
+            // it, when front faces are being culled).
+            const QVector3D toCluster = cluster.center - frustum.eye;
+            const QVector3D axis = frustum.cullFrontFaces ? -cluster.coneAxis : cluster.coneAxis;
+            visible = QVector3D::dotProduct(toCluster, axis) < cluster.coneCutoff * toCluster.length() + cluster.radius;
+        }
+
+        if(!visible)
+            continue;
+
+        // Merge with the previous range if contiguous
+        if(count > 0 && drawList[count-1].start + drawList[count-1].length == cluster.start)
+            drawList[count-1].length += cluster.length;
+        else
+        {
+            drawList[count].start = cluster.start;
+            drawList[count].length = cluster.length;
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+void ObjModel::writeChunks(const QVector<QVector3D> &vertices, const QVector<QVector3D> &normals,
+                           const QVector<int> &indexes)
+{
+    // Each LOD of each part gets only the vertices it uses, renumbered in
+    // the order they are first used
+    QHash<int,int> localIndexes;
+    QVector<QVector3D> chunkVertices, chunkNormals;
+    QVector<int> chunkIndexes;
+    for(int p=0; p<m_parts.size(); p++)
+    {
+        Part &part = m_parts[p];
+        for(int l=0; l<part.lodCount; l++)
+        {
+            localIndexes.clear();
+            chunkVertices.clear();
+            chunkNormals.clear();
+            chunkIndexes.clear();
+            for(int i=part.lods[l].start; i<part.lods[l].start+part.lods[l].length; i++)
+            {
+                const int index = indexes.at(i);
+                QHash<int,int>::const_iterator it = localIndexes.constFind(index);
+                if(it == localIndexes.constEnd())
+                {
+                    it = localIndexes.insert(index, chunkVertices.size());
+                    chunkVertices.append(vertices.at(index));
+                    chunkNormals.append(normals.at(index));
+                }
+                chunkIndexes.append(it.value());
+            }
+
+            part.lods[l].chunk = m_meshStreamer->addChunk(chunkVertices, chunkNormals, chunkIndexes);
+        }
+
+        // Streamed parts are culled whole, so clusters are of no use
+        part.firstCluster = part.clusterCount = 0;
+    }
+
+    m_clusters.clear();
+}
+
+int ObjModel::residentChunk(const Part &part, int lod, const Frustum &frustum) const
+{
+    // Parts out of view are not requested, so they are neither loaded nor
+    // kept resident for their sake
+    const QVector3D center = part.bounds.center();
+    const float radius = 0.5f * QVector3D(part.bounds.width(), part.bounds.height(),
+                                          part.bounds.depth()).length();
+    for(int p=0; p<6; p++)
+    {
+        const QVector4D &plane = frustum.planes[p];
+        if(QVector3D::dotProduct(plane.toVector3D(), center) + plane.w() < -radius)
+            return -1;
+    }
+
+    // The coarsest LOD is always asked for, so that there is something to
+    // fall back on while the wanted one is on its way
+    const int coarsest = part.lodCount-1;
+    const bool coarsestResident = m_meshStreamer->request(part.lods[coarsest].chunk);
+    if(m_meshStreamer->request(part.lods[lod].chunk))
+        return part.lods[lod].chunk;
+
+    // Otherwise the nearest resident LOD, coarser ones first as they cost
+    // less to draw
+    for(int l=lod+1; l<coarsest; l++)
+    {
+        if(m_meshStreamer->isResident(part.lods[l].chunk))
+            return part.lods[l].chunk;
+    }
+    if(coarsestResident)
+        return part.lods[coarsest].chunk;
+    for(int l=lod-1; l>=0; l--)
+    {
+        if(m_meshStreamer->isResident(part.lods[l].chunk))
+            return part.lods[l].chunk;
+    }
+
+    return -1;
+}
+
+void ObjModel::loadMaterials(const QString &mtlFileName, QHash<QString,int> &materialIds)
+{
     QFile file(mtlFileName);
     if( !file.open(QFile::ReadOnly) )
-        return ret;
+        return;
 
+    // Statements of a material go straight into it; d takes precedence
+    // over Tr, whichever comes first
     QString materialName;
-    MaterialProps materialProps;
+    Material material;
+    bool hasDissolve = false;
+    auto addMaterial = [&]() {
+        if(!materialName.isEmpty())
+            materialIds.insert(materialName, this->addMaterial(material));
+    };
+
     while(!file.atEnd())
     {
         const QString line = file.readLine().simplified();
@@ -283,32 +1246,76 @@ QMap<QString,MaterialProps> LoadMaterials(const QString &mtlFileName)
         const QString type = fields.first();
         if(type == "newmtl")
         {
-            if(!materialProps.isEmpty())
-            {
-                ret[materialName] = materialProps;
-                materialProps = MaterialProps();
-            }
-
+            addMaterial();
             materialName = fields.last();
-
+            material.reset();
+            hasDissolve = false;
             continue;
         }
 
-        QVector<float> floats;
-        for(int i=1; i<fields.size(); i++)
-            floats.append( fields.at(i).toFloat() );
-        materialProps[type] = floats;
+        float values[3] = { 0, 0, 0 };
+        const int nrValues = qMin(fields.size()-1, 3);
+        for(int i=0; i<nrValues; i++)
+            values[i] = fields.at(i+1).toFloat();
+
+        if(type == "Kd" && nrValues == 3)
+        {
+            memcpy(material.diffuse, values, sizeof(values));
+            material.diffuseIntensity = 1.0f;
+        }
+        else if(type == "Ka" && nrValues == 3)
+        {
+            memcpy(material.ambient, values, sizeof(values));
+            material.ambientIntensity = 1.0f;
+        }
+        else if(type == "Ks" && nrValues == 3)
+            memcpy(material.specular, values, sizeof(values));
+        else if(type == "Ns" && nrValues > 0)
+            material.specularIntensity = 3.0f * values[0] / 1000.0f;
+        else if(type == "d" && nrValues > 0)
+        {
+            material.opacity = values[0];
+            hasDissolve = true;
+        }
+        else if(type == "Tr" && nrValues > 0 && !hasDissolve)
+            material.opacity = 1.0f - values[0];
+        else if(type == "illum" && nrValues > 0)
+            material.brightness = values[0];
     }
 
-    if(!materialProps.isEmpty())
-        ret[materialName] = materialProps;
+    addMaterial();
+}
 
-    return ret;
+int ObjModel::addMaterial(const Material &material)
+{
+    // Parts with identical materials share one, so that the renderer can
+    // tell that nothing changes between them. Models have few enough
+    // distinct materials for a linear search.
+    for(int i=0; i<m_materials.size(); i++)
+    {
+        if(m_materials.at(i) == material)
+            return i;
+    }
+
+    m_materials.append(material);
+    return m_materials.size()-1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
+QOpenGLShaderProgram *SceneRenderer::program(int variant)
+{
+    QOpenGLShaderProgram *ret = m_programs.value(variant, nullptr);
+    if(ret)
+        return ret;
+
+    ret = CreateShaderProgram(":/scene_vertex.glsl", ":/scene_fragment.glsl", SceneShading::defines(variant));
+    m_programs.insert(variant, ret);
+    return ret;
+}
+
 void SceneRenderer::render(ObjModel *model,
+                              const ObjModel::InstanceMatrices &matrices,
                               const QVector3D &eyePosition,
                               const QVector3D &lightDirection,
                               const QMatrix4x4 &projectionMatrix,
@@ -319,135 +1326,240 @@ void SceneRenderer::render(ObjModel *model,
     if(!m_initialized)
     {
         QOpenGLFunctions::initializeOpenGLFunctions();
-
-        m_shader = new QOpenGLShaderProgram;
-        m_shader->addShaderFromSourceFile(QOpenGLShader::Vertex, ":/scene_vertex.glsl");
-        m_shader->addShaderFromSourceFile(QOpenGLShader::Fragment, ":/scene_fragment.glsl");
-        m_shader->link();
-
         m_initialized = true;
     }
 
-    m_shader->bind();
-    model->m_vertexBuffer->bind();
-    model->m_indexBuffer->bind();
-
-    const QMatrix4x4 modelMatrix = model->m_sceneMatrix * model->m_matrix;
-    const QMatrix4x4 modelViewMatrix = (viewMatrix * modelMatrix);
-    const QMatrix4x4 modelViewProjectionMatrix = projectionMatrix * modelViewMatrix;
-    const QMatrix4x4 normalMatrix = modelMatrix.inverted().transposed();
+    Arena *arena = model->m_frameArena;
+    if(!arena)
+    {
+        arena = &m_arena;
+        arena->reset();
+    }
 
-    m_shader->enableAttributeArray("qt_Vertex");
-    m_shader->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 3, 0);
+    // Streamed models bind the buffers of each part's chunk instead
+    if(!model->m_meshStreamer)
+    {
+        model->m_vertexBuffer->bind();
+        model->m_indexBuffer->bind();
+        FrameProfiler::countStateChange(2);
+    }
 
-    m_shader->enableAttributeArray("qt_Normal");
-    m_shader->setAttributeBuffer("qt_Normal", GL_FLOAT, model->m_normalOffset, 3, 0);
+    const QMatrix4x4 modelMatrix = ToMatrix(matrices.model);
+    const QMatrix4x4 modelViewMatrix = ToMatrix(matrices.modelView);
+    const QMatrix4x4 modelViewProjectionMatrix = ToMatrix(matrices.modelViewProjection);
+    const QMatrix4x4 lightModelViewMatrix = ToMatrix(matrices.lightView);
+    const QMatrix4x4 lightViewProjectionMatrix = ToMatrix(matrices.lightViewProjection);
+    const QMatrix3x3 normalMatrix = matrices.normal ? QMatrix3x3(matrices.normal).transposed()
+                                                    : modelMatrix.toGenericMatrix<3,3>();
+    const int lod = model->selectLod(modelViewMatrix, projectionMatrix);
+    const ObjModel::Frustum frustum(modelViewProjectionMatrix, modelViewMatrix, false);
+
+    SceneShading shading;
+    shading.lights = model->m_lightManager;
+    shading.temporalShadows = model->m_temporalShadows;
+    shading.transparencyBuffer = model->m_transparencyBuffer;
+    shading.shadowTextureId = model->m_shadowTextureId;
+    shading.shadowMapSize = model->m_shadowMapSize;
+    shading.shadowFilterRange = model->m_shadowFilterRange;
+    shading.shadowDepthRange = model->m_shadowDepthRange;
+    shading.eyePosition = eyePosition;
+    shading.lightDirection = lightDirection;
+    shading.transparentParts = model->m_partSelection == ObjModel::TransparentParts;
+
+    const bool specularLight = shading.lightSpecular().rgb() != qRgb(0,0,0);
+    const int baseVariant = shading.bind();
+
+    // Per model state has to be set on every permutation the parts of
+    // this model end up using.
+    auto setupProgram = [&](QOpenGLShaderProgram *shader) {
+        shader->bind();
+        FrameProfiler::countStateChange();
+
+        shader->enableAttributeArray("qt_Vertex");
+        shader->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 3, 0);
+
+        shader->enableAttributeArray("qt_Normal");
+        shader->setAttributeBuffer("qt_Normal", GL_FLOAT, model->m_normalOffset, 3, 0);
+
+        shader->setUniformValue("qt_ViewMatrix", viewMatrix);
+        shader->setUniformValue("qt_NormalMatrix", normalMatrix);
+        shader->setUniformValue("qt_ModelMatrix", modelMatrix);
+        shader->setUniformValue("qt_ModelViewMatrix", modelViewMatrix);
+        shader->setUniformValue("qt_ProjectionMatrix", projectionMatrix);
+        shader->setUniformValue("qt_ModelViewProjectionMatrix", modelViewProjectionMatrix);
+
+        shader->setUniformValue("qt_LightMatrix", lightViewMatrix);
+        shader->setUniformValue("qt_LightViewMatrix", lightModelViewMatrix);
+        shader->setUniformValue("qt_LightViewProjectionMatrix", lightViewProjectionMatrix);
+
+        shading.setUniforms(shader, baseVariant);
+    };
+
+    QOpenGLShaderProgram *shader = nullptr;
+    int currentMaterial = -1;
+    Q_FOREACH(const ObjModel::Part &part, model->m_parts)
+    {
+        if(!model->isSelected(part, model->m_partSelection))
+            continue;
 
-    m_shader->setUniformValue("qt_ViewMatrix", viewMatrix);
-    m_shader->setUniformValue("qt_NormalMatrix", normalMatrix);
-    m_shader->setUniformValue("qt_ModelMatrix", modelMatrix);
-    m_shader->setUniformValue("qt_ModelViewMatrix", modelViewMatrix);
-    m_shader->setUniformValue("qt_ProjectionMatrix", projectionMatrix);
-    m_shader->setUniformValue("qt_ModelViewProjectionMatrix", modelViewProjectionMatrix);
+        const ObjModel::Material &material = model->m_materials.at(part.material);
 
-    m_shader->setUniformValue("qt_LightMatrix", lightViewMatrix);
-    m_shader->setUniformValue("qt_LightViewMatrix", lightViewMatrix * modelMatrix);
-    m_shader->setUniformValue("qt_LightViewProjectionMatrix", projectionMatrix * lightViewMatrix * modelMatrix);
+        // The ambient color doubles as the specular color. Parts without a
+        // specular term use a permutation that doesn't evaluate it at all.
+        const QVector4D specular(material.ambient[0], material.ambient[1], material.ambient[2], 1.0f);
+        const bool hasSpecular = specular.toVector3D() != QVector3D(0,0,0) &&
+                                 specularLight &&
+                                 material.specularIntensity != 0.0f;
+        QOpenGLShaderProgram *partShader = this->program( baseVariant | (hasSpecular ? SceneShading::SpecularVariant : 0) );
+        if(partShader != shader)
+        {
+            shader = partShader;
+            setupProgram(shader);
+            currentMaterial = -1;
+        }
 
-    if(model->m_shadowTextureId > 0)
-    {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, model->m_shadowTextureId);
-        m_shader->setUniformValue("qt_ShadowMap", 0);
-        m_shader->setUniformValue("qt_ShadowEnabled", true);
-    }
-    else
-        m_shader->setUniformValue("qt_ShadowEnabled", false);
+        // Consecutive parts with the same material leave the uniforms be
+        if(part.material != currentMaterial)
+        {
+            const QVector4D ambient(material.ambient[0]*material.ambientIntensity,
+                                    material.ambient[1]*material.ambientIntensity,
+                                    material.ambient[2]*material.ambientIntensity, 1.0f);
+            const QVector4D diffuse(material.diffuse[0]*material.diffuseIntensity,
+                                    material.diffuse[1]*material.diffuseIntensity,
+                                    material.diffuse[2]*material.diffuseIntensity, 1.0f);
+            shader->setUniformValue("qt_Material.ambient", ambient);
+            shader->setUniformValue("qt_Material.diffuse", diffuse);
+            shader->setUniformValue("qt_Material.specular", specular);
+            shader->setUniformValue("qt_Material.specularPower", material.specularIntensity);
+            shader->setUniformValue("qt_Material.brightness", material.brightness);
+            shader->setUniformValue("qt_Material.opacity", material.opacity);
+            FrameProfiler::countStateChange();
+            currentMaterial = part.material;
+        }
 
-    m_shader->setUniformValue("qt_Light.ambient", QColor(40,40,40));
-    m_shader->setUniformValue("qt_Light.diffuse", QColor(Qt::white));
-    m_shader->setUniformValue("qt_Light.specular", QColor(Qt::white));
-    m_shader->setUniformValue("qt_Light.direction", lightDirection);
-    m_shader->setUniformValue("qt_Light.eye", eyePosition);
+        if(model->m_meshStreamer)
+        {
+            const int chunk = model->residentChunk(part, qMin(lod, part.lodCount-1), frustum);
+            MeshStreamer::Binding binding;
+            if(!model->m_meshStreamer->request(chunk, &binding))
+                continue;
 
-    Q_FOREACH(ObjModel::Part part, model->m_parts)
-    {
-        QColor ambient = part.material.color.ambient;
-        ambient.setRgbF(
-                ambient.redF()*qreal(part.material.intensity.ambient),
-                ambient.greenF()*qreal(part.material.intensity.ambient),
-                ambient.blueF()*qreal(part.material.intensity.ambient)
-            );
+            glBindBuffer(GL_ARRAY_BUFFER, binding.vertexBuffer);
+            shader->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 3, 0);
+            shader->setAttributeBuffer("qt_Normal", GL_FLOAT, binding.normalOffset, 3, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, binding.indexBuffer);
+            FrameProfiler::countStateChange(2);
 
-        QColor diffuse = part.material.color.diffuse;
-        diffuse.setRgbF(
-                diffuse.redF()*qreal(part.material.intensity.diffuse),
-                diffuse.greenF()*qreal(part.material.intensity.diffuse),
-                diffuse.blueF()*qreal(part.material.intensity.diffuse)
-            );
+            glDrawElements(GLenum(part.type), binding.indexCount, GL_UNSIGNED_INT, nullptr);
+            FrameProfiler::countDrawCall(binding.indexCount);
+            continue;
+        }
 
-        QColor specular = part.material.color.ambient;
+        ObjModel::DrawRange *drawList = arena->allocate<ObjModel::DrawRange>(model->maxDrawListSize(part));
+        const int drawListSize = model->buildDrawList(part, qMin(lod, part.lodCount-1), frustum, drawList);
+        for(int i=0; i<drawListSize; i++)
+        {
+            const int offset = drawList[i].start * int(sizeof(int));
+            glDrawElements(GLenum(part.type), drawList[i].length, GL_UNSIGNED_INT, (void*)offset);
+            FrameProfiler::countDrawCall(drawList[i].length);
+        }
+    }
 
-        m_shader->setUniformValue("qt_Material.ambient", ambient);
-        m_shader->setUniformValue("qt_Material.diffuse", diffuse);
-        m_shader->setUniformValue("qt_Material.specular", specular);
-        m_shader->setUniformValue("qt_Material.specularPower", part.material.intensity.specular);
-        m_shader->setUniformValue("qt_Material.brightness", part.material.brightness);
-        m_shader->setUniformValue("qt_Material.opacity", part.material.opacity);
+    shading.release(baseVariant);
 
-        const int offset = part.start * int(sizeof(int));
-        glDrawElements(GLenum(part.type), part.length, GL_UNSIGNED_INT, (void*)offset);
+    if(model->m_meshStreamer)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
-
-    if(model->m_shadowTextureId > 0)
+    else
     {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        model->m_indexBuffer->release();
+        model->m_vertexBuffer->release();
     }
-
-    model->m_indexBuffer->release();
-    model->m_vertexBuffer->release();
-    m_shader->release();
+    if(shader)
+        shader->release();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 void ShadowRenderer::render(ObjModel *model,
-                            const QMatrix4x4 &projectionMatrix,
-                            const QMatrix4x4 &lightViewMatrix
+                            const ObjModel::InstanceMatrices &matrices,
+                            const QMatrix4x4 &projectionMatrix
                             )
 {
     if(!m_initialized)
     {
         QOpenGLFunctions::initializeOpenGLFunctions();
-
-        m_shader = new QOpenGLShaderProgram;
-        m_shader->addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shadow_vertex.glsl");
-        m_shader->addShaderFromSourceFile(QOpenGLShader::Fragment, ":/shadow_fragment.glsl");
-        m_shader->link();
-
+        m_shader = CreateShaderProgram(":/shadow_vertex.glsl", ":/shadow_fragment.glsl", QStringList());
         m_initialized = true;
     }
 
+    Arena *arena = model->m_frameArena;
+    if(!arena)
+    {
+        arena = &m_arena;
+        arena->reset();
+    }
+
     m_shader->bind();
-    model->m_vertexBuffer->bind();
-    model->m_indexBuffer->bind();
+    FrameProfiler::countStateChange();
+    if(!model->m_meshStreamer)
+    {
+        model->m_vertexBuffer->bind();
+        model->m_indexBuffer->bind();
+        FrameProfiler::countStateChange(2);
+    }
 
-    const QMatrix4x4 modelMatrix = model->m_sceneMatrix * model->m_matrix;
-    const QMatrix4x4 lightViewProjectionMatrix = projectionMatrix * lightViewMatrix * modelMatrix;
+    // In ShadowMode the view is the light's view
+    const QMatrix4x4 lightViewProjectionMatrix = ToMatrix(matrices.modelViewProjection);
+    const QMatrix4x4 lightModelViewMatrix = ToMatrix(matrices.modelView);
+    const int lod = model->selectLod(lightModelViewMatrix, projectionMatrix, SHADOW_LOD_BIAS);
+    const ObjModel::Frustum frustum(lightViewProjectionMatrix, lightModelViewMatrix, true);
 
     m_shader->enableAttributeArray("qt_Vertex");
     m_shader->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 3, 0);
 
     m_shader->setUniformValue("qt_LightViewProjectionMatrix", lightViewProjectionMatrix);
 
-    Q_FOREACH(ObjModel::Part part, model->m_parts)
+    Q_FOREACH(const ObjModel::Part &part, model->m_parts)
     {
-        const int offset = part.start * int(sizeof(int));
-        glDrawElements(GLenum(part.type), part.length, GL_UNSIGNED_INT, (void*)offset);
+        if(model->m_meshStreamer)
+        {
+            const int chunk = model->residentChunk(part, qMin(lod, part.lodCount-1), frustum);
+            MeshStreamer::Binding binding;
+            if(!model->m_meshStreamer->request(chunk, &binding))
+                continue;
+
+            glBindBuffer(GL_ARRAY_BUFFER, binding.vertexBuffer);
+            m_shader->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 3, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, binding.indexBuffer);
+            FrameProfiler::countStateChange(2);
+
+            glDrawElements(GLenum(part.type), binding.indexCount, GL_UNSIGNED_INT, nullptr);
+            FrameProfiler::countDrawCall(binding.indexCount);
+            continue;
+        }
+
+        ObjModel::DrawRange *drawList = arena->allocate<ObjModel::DrawRange>(model->maxDrawListSize(part));
+        const int drawListSize = model->buildDrawList(part, qMin(lod, part.lodCount-1), frustum, drawList);
+        for(int i=0; i<drawListSize; i++)
+        {
+            const int offset = drawList[i].start * int(sizeof(int));
+            glDrawElements(GLenum(part.type), drawList[i].length, GL_UNSIGNED_INT, (void*)offset);
+            FrameProfiler::countDrawCall(drawList[i].length);
+        }
     }
 
-    model->m_indexBuffer->release();
-    model->m_vertexBuffer->release();
+    if(model->m_meshStreamer)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    else
+    {
+        model->m_indexBuffer->release();
+        model->m_vertexBuffer->release();
+    }
     m_shader->release();
 }
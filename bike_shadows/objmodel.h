@@ -2,11 +2,24 @@
 #define OBJ_MODEL_H
 
 #include <QColor>
+#include <QHash>
 #include <QMatrix4x4>
 #include <QVector>
+#include <QVector2D>
 #include <QVector3D>
+#include <QVector4D>
+#include <QStringList>
+#include <QSharedPointer>
 #include <QOpenGLBuffer>
+#include <cstring>
 
+#include "trianglebvh.h"
+
+class Arena;
+class LightManager;
+class MeshStreamer;
+class TemporalShadows;
+class TransparencyBuffer;
 class SceneRenderer;
 class ShadowRenderer;
 
@@ -42,19 +55,56 @@ typedef struct _BoundingBox {
 class ObjModel
 {
 public:
-    ObjModel(const QString &fileName)
-        : m_vertexBuffer(nullptr), m_indexBuffer(nullptr),
-          m_normalOffset(0), m_renderMode(SceneMode),
-          m_shadowTextureId(0) {
+    // With a meshStreamer, the parts are written out to it as chunks,
+    // which are streamed in as they are rendered, instead of being kept in
+    // buffers of the model's own.
+    //
+    // Without uploadBuffers the file is only parsed, which needs no OpenGL
+    // context and can happen on any thread. upload() must then be called,
+    // with the context current, before the model is rendered or split.
+    ObjModel(const QString &fileName, MeshStreamer *meshStreamer=nullptr, bool uploadBuffers=true)
+        : m_normalOffset(0), m_meshStreamer(meshStreamer), m_renderMode(SceneMode),
+          m_partSelection(AllParts), m_shadowTextureId(0), m_shadowMapSize(2048),
+          m_shadowFilterRange(2), m_shadowDepthRange(0.1f, 1000.0f), m_lightManager(nullptr),
+          m_temporalShadows(nullptr), m_transparencyBuffer(nullptr), m_frameArena(nullptr) {
         this->load(fileName);
+        if(uploadBuffers)
+            this->upload();
     }
-    ~ObjModel() {
-        delete m_indexBuffer;
-        delete m_vertexBuffer;
-    }
+    ~ObjModel() { }
+
+    // Creates the vertex and index buffers (or writes the chunks) of a
+    // model constructed without uploadBuffers. Does nothing if there is
+    // nothing left to upload.
+    void upload();
+    bool isUploaded() const { return m_pendingIndexes.isEmpty(); }
+
+    // Bytes that upload() is going to move, in buffers or chunks
+    qint64 pendingUploadSize() const;
 
     BoundingBox boundingBox() const { return m_boundingBox; }
 
+    MeshStreamer *meshStreamer() const { return m_meshStreamer; }
+    bool isStreamed() const { return m_meshStreamer != nullptr; }
+
+    // Names of the objects ("o" lines) in the file, one per part
+    QStringList partNames() const;
+
+    // Part (index into partNames()) that a ray in model space, from origin
+    // along direction, hits first, or -1. The distance to the hit is in
+    // lengths of direction. Rays are cast at the full detail triangles,
+    // through a hierarchy that is built as the model is loaded.
+    int intersect(const QVector3D &origin, const QVector3D &direction, float *distance=nullptr) const;
+
+    // Corners of the full detail triangles of a part, three per triangle
+    QVector<QVector3D> partTriangles(int part) const { return m_bvh.partTriangles(part); }
+
+    // Moves the named parts out into a new model, which shares the vertex
+    // and index buffers of this one. That way pieces of a model (the wheels
+    // of the bike, say) can be given transforms of their own. Returns
+    // nullptr if none of the parts exist.
+    ObjModel *takeParts(const QStringList &names);
+
     void setSceneMatrix(const QMatrix4x4 &matrix) { m_sceneMatrix = matrix; }
     QMatrix4x4 sceneMatrix() const { return m_sceneMatrix; }
 
@@ -78,20 +128,133 @@ public:
         return *this;
     }
 
+    // Material of a part, as plain floats. Colors are RGB in 0..1.
+    struct Material
+    {
+        float ambient[3], diffuse[3], specular[3];
+        float ambientIntensity, diffuseIntensity, specularIntensity;
+        float brightness, opacity;
+
+        void reset() {
+            for(int i=0; i<3; i++) {
+                ambient[i] = diffuse[i] = 1.0f;
+                specular[i] = 0.0f;
+            }
+            ambientIntensity = 0.1f;
+            diffuseIntensity = 1.0f;
+            specularIntensity = 0.0f;
+            brightness = 1.0f;
+            opacity = 1.0f;
+        }
+        bool operator==(const Material &other) const {
+            return memcmp(this, &other, sizeof(Material)) == 0;
+        }
+    };
+    int materialCount() const { return m_materials.size(); }
+    const Material &material(int index) const { return m_materials.at(index); }
+
     enum RenderMode { ShadowMode, SceneMode };
     void setRenderMode(RenderMode mode) {
         m_renderMode = mode;
     }
     RenderMode renderMode() const { return m_renderMode; }
 
+    // Parts drawn in SceneMode. Transparent parts (opacity below 1) are
+    // meant to be drawn after the opaque parts of every model.
+    enum PartSelection { AllParts, OpaqueParts, TransparentParts };
+    void setPartSelection(PartSelection val) {
+        m_partSelection = val;
+    }
+    PartSelection partSelection() const { return m_partSelection; }
+    bool hasParts(PartSelection selection) const;
+
     void setShadowTextureId(const uint &val) {
         m_shadowTextureId = val;
     }
     uint shadowTextureId() const { return m_shadowTextureId; }
 
+    void setShadowMapSize(int val) {
+        m_shadowMapSize = val;
+    }
+    int shadowMapSize() const { return m_shadowMapSize; }
+
+    void setShadowFilterRange(int val) {
+        m_shadowFilterRange = val;
+    }
+    int shadowFilterRange() const { return m_shadowFilterRange; }
+
+    // Near and far planes of the projection the shadow map was rendered
+    // with, to bring its depth back to distances from the light
+    void setShadowDepthRange(float zNear, float zFar) {
+        m_shadowDepthRange = QVector2D(zNear, zFar);
+    }
+    QVector2D shadowDepthRange() const { return m_shadowDepthRange; }
+
+    void setLightManager(LightManager *val) {
+        m_lightManager = val;
+    }
+    LightManager *lightManager() const { return m_lightManager; }
+
+    // Shadows are filtered over time while temporalShadows is active
+    void setTemporalShadows(TemporalShadows *val) {
+        m_temporalShadows = val;
+    }
+    TemporalShadows *temporalShadows() const { return m_temporalShadows; }
+
+    // Transparent parts accumulate into transparencyBuffer while it is
+    // active, in whatever order they are drawn
+    void setTransparencyBuffer(TransparencyBuffer *val) {
+        m_transparencyBuffer = val;
+    }
+    TransparencyBuffer *transparencyBuffer() const { return m_transparencyBuffer; }
+
+    // Draw lists are allocated from frameArena, which whoever renders the
+    // model resets once a frame. Without one, the renderers use an arena of
+    // their own, reset on every render().
+    void setFrameArena(Arena *val) {
+        m_frameArena = val;
+    }
+    Arena *frameArena() const { return m_frameArena; }
+
+    enum { MaxLodCount = 4 };
+    int lodCount() const;
+    int selectLod(const QMatrix4x4 &modelViewMatrix, const QMatrix4x4 &projectionMatrix,
+                  float bias=0.0f) const;
+
+    // Tuning of selectLod(), for LODs that are picked on the GPU
+    static float lod0ScreenSize();
+    static float shadowLodBias();
+
     void render(const QVector3D &eyePosition, const QVector3D &lightDirection,
                 const QMatrix4x4 &projectionMatrix, const QMatrix4x4 &viewMatrix,
-                const QMatrix4x4 &lightViewMatrix=QMatrix4x4());
+                const QMatrix4x4 &lightViewMatrix=QMatrix4x4()) {
+        this->render(m_sceneMatrix * m_matrix, eyePosition, lightDirection,
+                     projectionMatrix, viewMatrix, lightViewMatrix);
+    }
+
+    // Renders the model as an instance placed by modelMatrix. The model's
+    // own matrix and scene matrix are not used.
+    void render(const QMatrix4x4 &modelMatrix, const QVector3D &eyePosition,
+                const QVector3D &lightDirection, const QMatrix4x4 &projectionMatrix,
+                const QMatrix4x4 &viewMatrix, const QMatrix4x4 &lightViewMatrix=QMatrix4x4());
+
+    // Matrices of one instance, already multiplied out (see
+    // transformkernels.h), column major. normal is 3x3 and is null for
+    // rigid transforms. The light matrices are not needed in ShadowMode.
+    struct InstanceMatrices
+    {
+        InstanceMatrices() : model(nullptr), modelView(nullptr), modelViewProjection(nullptr),
+            lightView(nullptr), lightViewProjection(nullptr), normal(nullptr) { }
+        const float *model;
+        const float *modelView;             // view * model
+        const float *modelViewProjection;   // projection * view * model
+        const float *lightView;             // lightView * model
+        const float *lightViewProjection;   // projection * lightView * model
+        const float *normal;
+    };
+    void render(const InstanceMatrices &matrices, const QVector3D &eyePosition,
+                const QVector3D &lightDirection, const QMatrix4x4 &projectionMatrix,
+                const QMatrix4x4 &viewMatrix, const QMatrix4x4 &lightViewMatrix=QMatrix4x4());
     void render(const QMatrix4x4 &projection, const QMatrix4x4 &view) {
         this->render( QVector3D(0,0,-1), QVector3D(1,1,1), projection, view );
     }
@@ -100,49 +263,126 @@ public:
     }
 
 private:
+    ObjModel()
+        : m_normalOffset(0), m_meshStreamer(nullptr), m_renderMode(SceneMode),
+          m_partSelection(AllParts), m_shadowTextureId(0), m_shadowMapSize(2048),
+          m_shadowFilterRange(2), m_shadowDepthRange(0.1f, 1000.0f), m_lightManager(nullptr),
+          m_temporalShadows(nullptr), m_transparencyBuffer(nullptr), m_frameArena(nullptr) { }
+
     void load(const QString &fileName);
+    void loadMaterials(const QString &mtlFileName, QHash<QString,int> &materialIds);
+    int addMaterial(const Material &material);
+    void updateBoundingBox();
+    void generateLods(const QVector<QVector3D> &positions, const QVector<int> &positionIndexes,
+                      QVector<QVector3D> &vertices, QVector<QVector3D> &normals,
+                      QVector<int> &indexes);
+    void buildClusters(const QVector<QVector3D> &vertices, QVector<int> &indexes);
+    void buildBvh(const QVector<QVector3D> &vertices, const QVector<int> &indexes);
+    void createBuffers(const QVector<QVector3D> &positions, const QVector<QVector3D> &normals,
+                       const QVector<int> &indexes);
+    void writeChunks(const QVector<QVector3D> &vertices, const QVector<QVector3D> &normals,
+                     const QVector<int> &indexes);
+
+    struct Corner { int position, normal; }; // of a face, as it is parsed
+    struct DrawRange { int start, length; };
+    struct Frustum
+    {
+        Frustum(const QMatrix4x4 &modelViewProjectionMatrix,
+                const QMatrix4x4 &modelViewMatrix, bool cullFrontFaces);
+        QVector4D planes[6];
+        QVector3D eye; // in model space
+        bool cullFrontFaces;
+    };
+    struct Part;
+    int maxDrawListSize(const Part &part) const { return qMax(part.clusterCount, 1); }
+    int buildDrawList(const Part &part, int lod, const Frustum &frustum,
+                      DrawRange *drawList) const;
+    int residentChunk(const Part &part, int lod, const Frustum &frustum) const;
 
 private:
     friend class SceneRenderer;
     friend class ShadowRenderer;
+    friend class IndirectRenderer;
+
+    // Parsed geometry, held between load() and upload()
+    QVector<QVector3D> m_pendingVertices;
+    QVector<QVector3D> m_pendingNormals;
+    QVector<int> m_pendingIndexes;
 
-    QOpenGLBuffer *m_vertexBuffer;
-    QOpenGLBuffer *m_indexBuffer;
+    QSharedPointer<QOpenGLBuffer> m_vertexBuffer;
+    QSharedPointer<QOpenGLBuffer> m_indexBuffer;
     int m_normalOffset;
+    MeshStreamer *m_meshStreamer;
     struct Part
     {
-        Part() : type(0), start(-1), length(0) {
-            material.reset();
+        Part() : type(0), start(-1), length(0), lodCount(0),
+            firstCluster(0), clusterCount(0), material(0) {
+            for(int i=0; i<MaxLodCount; i++) {
+                lods[i].start = -1;
+                lods[i].length = 0;
+                lods[i].chunk = -1;
+            }
         }
         int type, start, length;
-        struct
-        {
-            struct { QColor ambient, diffuse, specular; } color;
-            struct { float ambient, diffuse, specular; } intensity;
-            float brightness, opacity;
-            void reset() {
-                color.ambient = Qt::white;
-                color.diffuse = Qt::white;
-                color.diffuse = Qt::white;
-                intensity.ambient = 0.1f;
-                intensity.diffuse = 1.0f;
-                intensity.specular = 0.0f;
-                brightness = 1.0f;
-                opacity = 1.0f;
-            }
-        } material;
+        QString name;
+        BoundingBox bounds;
+
+        // lods[0] is the same as start & length. The rest are
+        // successively simplified versions of the part. When streamed,
+        // each LOD is a chunk in the mesh streamer instead.
+        struct { int start, length, chunk; } lods[MaxLodCount];
+        int lodCount;
+
+        // Range in m_clusters, which partition lods[0]
+        int firstCluster, clusterCount;
+
+        // Index in m_materials
+        int material;
 
         bool isValid() const { return start >= 0 && length >= 0 && type != 0; }
-        bool operator < (const Part &other) const {
-            return material.opacity > other.material.opacity;
-        }
     };
+    bool isTransparent(const Part &part) const {
+        return m_materials.at(part.material).opacity < 1.0f;
+    }
+    bool isSelected(const Part &part, PartSelection selection) const {
+        return selection == AllParts || (selection == TransparentParts) == this->isTransparent(part);
+    }
     QList<Part> m_parts;
+
+    // Distinct materials of the model's parts; the first is the default
+    // material, for parts without usemtl. Shared with models split off by
+    // takeParts(), so that their parts' indexes stay valid.
+    QVector<Material> m_materials;
+
+    // Small groups of triangles, with a bounding sphere and a cone that
+    // bounds the normals of all triangles in it.
+    struct Cluster
+    {
+        QVector3D center;
+        float radius;
+        QVector3D coneAxis;
+        float coneCutoff;
+        int start, length;
+    };
+    QVector<Cluster> m_clusters;
+
+    // Full detail triangles of all parts, for intersect(). Kept on the CPU
+    // after upload(), streamed or not.
+    TriangleBvh m_bvh;
+
     QMatrix4x4 m_matrix;
     QMatrix4x4 m_sceneMatrix;
     BoundingBox m_boundingBox;
     RenderMode m_renderMode;
+    PartSelection m_partSelection;
     uint m_shadowTextureId;
+    int m_shadowMapSize;
+    int m_shadowFilterRange;
+    QVector2D m_shadowDepthRange;
+    LightManager *m_lightManager;
+    TemporalShadows *m_temporalShadows;
+    TransparencyBuffer *m_transparencyBuffer;
+    Arena *m_frameArena;
 };
 
 #endif // OBJ_MODEL_H
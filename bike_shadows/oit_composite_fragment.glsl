@@ -0,0 +1,18 @@
+uniform sampler2D qt_Accumulation;  // weighted premultiplied colors, revealage in alpha
+uniform sampler2D qt_Weights;       // sum of weights in red
+uniform vec2 qt_UVScale;            // part of the textures drawn into
+varying vec2 v_TexCoord;
+
+void main(void)
+{
+    vec2 uv = v_TexCoord * qt_UVScale;
+    vec4 accumulation = texture2D(qt_Accumulation, uv);
+
+    // Nothing transparent here, leave the scene alone
+    float revealage = accumulation.a;
+    if(revealage >= 1.0)
+        discard;
+
+    float weights = texture2D(qt_Weights, uv).r;
+    gl_FragColor = vec4(accumulation.rgb / max(weights, 1e-5), revealage);
+}
@@ -0,0 +1,52 @@
+QT += gui
+
+INCLUDEPATH += $$PWD
+
+# qmake CONFIG+=avx builds the transform kernels (and everything else) for AVX
+avx: QMAKE_CXXFLAGS += -mavx
+
+HEADERS += \
+    $$PWD/arena.h \
+    $$PWD/frameprofiler.h \
+    $$PWD/framescheduler.h \
+    $$PWD/indirectrenderer.h \
+    $$PWD/lightmanager.h \
+    $$PWD/meshstreamer.h \
+    $$PWD/meshsimplifier.h \
+    $$PWD/objmodel.h \
+    $$PWD/renderpipeline.h \
+    $$PWD/resolutionscaler.h \
+    $$PWD/sceneloader.h \
+    $$PWD/sceneshading.h \
+    $$PWD/scenestate.h \
+    $$PWD/scenestore.h \
+    $$PWD/shaderprogram.h \
+    $$PWD/streambuffer.h \
+    $$PWD/temporalshadows.h \
+    $$PWD/transformkernels.h \
+    $$PWD/transparencybuffer.h \
+    $$PWD/trianglebvh.h
+
+SOURCES += \
+    $$PWD/arena.cpp \
+    $$PWD/frameprofiler.cpp \
+    $$PWD/framescheduler.cpp \
+    $$PWD/indirectrenderer.cpp \
+    $$PWD/lightmanager.cpp \
+    $$PWD/meshstreamer.cpp \
+    $$PWD/meshsimplifier.cpp \
+    $$PWD/objmodel.cpp \
+    $$PWD/renderpipeline.cpp \
+    $$PWD/resolutionscaler.cpp \
+    $$PWD/sceneloader.cpp \
+    $$PWD/sceneshading.cpp \
+    $$PWD/scenestore.cpp \
+    $$PWD/shaderprogram.cpp \
+    $$PWD/streambuffer.cpp \
+    $$PWD/temporalshadows.cpp \
+    $$PWD/transformkernels.cpp \
+    $$PWD/transparencybuffer.cpp \
+    $$PWD/trianglebvh.cpp
+
+RESOURCES += \
+    $$PWD/bike_shadows.qrc
@@ -0,0 +1,924 @@
+#include "renderpipeline.h"
+#include "arena.h"
+#include "shaderprogram.h"
+#include "lightmanager.h"
+#include "frameprofiler.h"
+#include "indirectrenderer.h"
+#include "meshstreamer.h"
+#include "scenestate.h"
+#include "streambuffer.h"
+#include "transformkernels.h"
+#include "resolutionscaler.h"
+#include "temporalshadows.h"
+#include "transparencybuffer.h"
+
+#include <QtMath>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+
+// glClipControl() depth modes, from OpenGL 4.5
+#ifndef GL_NEGATIVE_ONE_TO_ONE
+#define GL_NEGATIVE_ONE_TO_ONE 0x935E
+#endif
+#ifndef GL_ZERO_TO_ONE
+#define GL_ZERO_TO_ONE 0x935F
+#endif
+
+// The shadow pass, and the scene pass without reversed-Z, are clipped at
+// Z_FAR. Clustered lights are binned up to Z_FAR either way.
+static const float Z_NEAR = 0.1f;
+static const float Z_FAR = 1000.0f;
+static const float FIELD_OF_VIEW = 45.0f;
+static const char *CLIP_CONTROL_WARNING =
+        "Reversed-Z needs glClipControl (OpenGL 4.5 or ARB_clip_control), depth stays conventional";
+static const int DEFAULT_SHADOW_MAP_SIZE = 2048;
+
+// Wireframes are pulled forward by LINE_POLYGON_OFFSET, highlights (which
+// may lie over a simplified LOD of the same surface) by more
+static const float LINE_POLYGON_OFFSET = -0.03125f;
+static const float HIGHLIGHT_POLYGON_OFFSET = -1.0f;
+static const QVector4D HIGHLIGHT_COLOR(1.0f, 0.75f, 0.2f, 0.45f);
+
+// Perspective projection with the far plane at infinity, that maps the near
+// plane to depth 1 and infinity to 0 in a [0,1] clip space depth range
+static QMatrix4x4 ReversedInfinitePerspective(float verticalAngle, float aspectRatio, float nearPlane)
+{
+    const float f = 1.0f / float(qTan(qDegreesToRadians(qreal(verticalAngle)) / 2.0));
+    return QMatrix4x4(f/aspectRatio, 0.0f,  0.0f, 0.0f,
+                      0.0f,          f,     0.0f, 0.0f,
+                      0.0f,          0.0f,  0.0f, nearPlane,
+                      0.0f,          0.0f, -1.0f, 0.0f);
+}
+
+// Room per frame for the largest cluster light lists and the instance
+// records of some 20000 indirectly drawn instances
+static const int STREAM_BUFFER_REGION_SIZE = 4*1024*1024;
+static const float TURNTABLE_DEGREES_PER_SECOND = 45.0f;
+static const float WHEEL_DEGREES_PER_SECOND = 360.0f;
+
+// Objects in bike.obj that make up the wheels
+static const char *FRONT_WHEEL = "ducw";
+static const char *REAR_WHEEL = "ducw01";
+
+RenderPipeline::RenderPipeline()
+    : m_scene(new SceneStore), m_wheelAngle(0), m_frameArena(new Arena),
+      m_modelViewMatrices(nullptr), m_modelViewProjectionMatrices(nullptr),
+      m_lightViewMatrices(nullptr), m_lightViewProjectionMatrices(nullptr),
+      m_lightManager(new LightManager),
+      m_streamBuffer(new StreamBuffer(STREAM_BUFFER_REGION_SIZE)), m_resolutionScaler(new ResolutionScaler), m_temporalShadows(new TemporalShadows),
+      m_transparencyBuffer(new TransparencyBuffer), m_meshStreamer(nullptr),
+      m_indirectRenderer(new IndirectRenderer), m_clipControl(nullptr),
+      m_highlightProgram(nullptr), m_highlightPart(-1),
+      m_highlightMesh(-1), m_highlightVertexCount(0), m_highlightBuffer(0), m_width(1), m_height(1),
+      m_targetFramebuffer(0), m_shadowMapFBO(0), m_shadowMapTex(0),
+      m_shadowMapSize(DEFAULT_SHADOW_MAP_SIZE), m_shadowMapFormat(Depth24), m_shadowFilterRange(2),
+      m_shadowMapDirty(false), m_hasLightMatrices(false), m_shadowsEnabled(true), m_animated(true),
+      m_dynamicResolution(false), m_temporalShadowsEnabled(false),
+      m_orderIndependentTransparency(true), m_meshStreaming(false), m_indirectDraws(true),
+      m_highlightDirty(false), m_reversedZ(false), m_depthReversed(false), m_initialized(false)
+{
+    m_padding[0] = 0;
+    m_bikeMeshes[0] = m_bikeMeshes[1] = m_bikeMeshes[2] = -1;
+    m_lightManager->setStreamBuffer(m_streamBuffer);
+    m_indirectRenderer->setLightManager(m_lightManager);
+    m_indirectRenderer->setTemporalShadows(m_temporalShadows);
+    m_indirectRenderer->setTransparencyBuffer(m_transparencyBuffer);
+    m_indirectRenderer->setStreamBuffer(m_streamBuffer);
+    m_indirectRenderer->setFrameArena(m_frameArena);
+}
+
+RenderPipeline::~RenderPipeline()
+{
+    delete m_scene;
+    delete m_lightManager;
+    delete m_streamBuffer;
+    delete m_resolutionScaler;
+    delete m_temporalShadows;
+    delete m_transparencyBuffer;
+    delete m_indirectRenderer;
+    delete m_frameArena;
+
+    // After the scene, whose meshes refer to it
+    delete m_meshStreamer;
+
+    if(m_initialized)
+    {
+        this->releaseDepthMap();
+
+        delete m_highlightProgram;
+        if(m_highlightBuffer > 0)
+            glDeleteBuffers(1, &m_highlightBuffer);
+    }
+}
+
+void RenderPipeline::initialize()
+{
+    if(m_initialized)
+        return;
+
+    QOpenGLFunctions::initializeOpenGLFunctions();
+
+    glClearColor(0.25f, 0.45f, 0.65f, 1.0f);
+
+    glEnable(GL_DEPTH_TEST);
+
+    glDepthFunc(GL_LEQUAL);
+    glEnable(GL_POLYGON_OFFSET_LINE);
+    glPolygonOffset(LINE_POLYGON_OFFSET, LINE_POLYGON_OFFSET);
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    m_indirectRenderer->initialize();
+    m_transparencyBuffer->initialize();
+
+    // Reversed-Z needs a [0,1] clip space depth range; in the conventional
+    // [-1,1] range it would lose its precision to the mapping onto [0,1]
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if(!context->isOpenGLES() && (context->format().version() >= qMakePair(4,5) ||
+                                  context->hasExtension("GL_ARB_clip_control")))
+        m_clipControl = reinterpret_cast<ClipControlFunction>( context->getProcAddress("glClipControl") );
+
+    m_initialized = true;
+
+    // Reversed-Z may have been asked for before the context was known
+    if(m_reversedZ)
+    {
+        if(!m_clipControl)
+            qWarning("%s", CLIP_CONTROL_WARNING);
+        this->updateMatricesForScreenRendering();
+    }
+}
+
+void RenderPipeline::loadDefaultScene()
+{
+    // Both bikes share their meshes. The platform neither casts shadows
+    // nor contributes to the scene bounds.
+    QMatrix4x4 bike1;
+    bike1.translate(-2.0, 0, 0);
+    bike1.rotate(20, 0, 1, 0);
+    this->addBike(bike1);
+
+    QMatrix4x4 bike2;
+    bike2.translate(2.0, 0, 0);
+    bike2.rotate(-20, 0, 1, 0);
+    this->addBike(bike2);
+
+    const int platform = this->addMesh(this->loadMesh(":/platform.obj"));
+    m_scene->createInstance(platform, QMatrix4x4(), SceneStore::Visible);
+
+    // A ring of colored point lights around the bikes, and a couple of
+    // spot lights looking down on them.
+    const int nrRingLights = 24;
+    for(int i=0; i<nrRingLights; i++)
+    {
+        const qreal angle = 2.0*M_PI*qreal(i)/qreal(nrRingLights);
+
+        Light light;
+        light.type = Light::PointLight;
+        light.position = QVector3D(6.0f*float(qCos(angle)), 0.5f, 6.0f*float(qSin(angle)));
+        light.color = QColor::fromHsvF(qreal(i)/qreal(nrRingLights), 0.8, 1.0);
+        light.intensity = 4.0f;
+        light.range = 4.0f;
+        m_lightManager->addLight(light);
+    }
+
+    for(int i=0; i<2; i++)
+    {
+        Light light;
+        light.type = Light::SpotLight;
+        light.position = QVector3D(i ? 2.0f : -2.0f, 4.0f, 0.0f);
+        light.direction = QVector3D(0, -1, 0);
+        light.intensity = 12.0f;
+        light.range = 8.0f;
+        light.innerAngle = 15.0f;
+        light.outerAngle = 25.0f;
+        m_lightManager->addLight(light);
+    }
+}
+
+int RenderPipeline::addMesh(ObjModel *mesh)
+{
+    if(mesh == nullptr)
+        return -1;
+
+    mesh->setLightManager(m_lightManager);
+    mesh->setTemporalShadows(m_temporalShadows);
+    mesh->setTransparencyBuffer(m_transparencyBuffer);
+    mesh->setFrameArena(m_frameArena);
+    return m_scene->addMesh(mesh);
+}
+
+ObjModel *RenderPipeline::loadMesh(const QString &fileName)
+{
+    return new ObjModel(fileName, m_meshStreaming ? m_meshStreamer : nullptr);
+}
+
+SceneHandle RenderPipeline::addModel(ObjModel *model, int flags)
+{
+    const int mesh = this->addMesh(model);
+    if(mesh < 0)
+        return SceneHandle();
+
+    return m_scene->createInstance(mesh, model->matrix(), flags);
+}
+
+SceneHandle RenderPipeline::addBike(const QMatrix4x4 &matrix)
+{
+    if(m_bikeMeshes[0] < 0)
+    {
+        ObjModel *body = this->loadMesh(":/bike.obj");
+        ObjModel *frontWheel = body->takeParts(QStringList() << FRONT_WHEEL);
+        ObjModel *rearWheel = body->takeParts(QStringList() << REAR_WHEEL);
+        m_bikeMeshes[0] = this->addMesh(body);
+        m_bikeMeshes[1] = this->addMesh(frontWheel);
+        m_bikeMeshes[2] = this->addMesh(rearWheel);
+    }
+
+    const SceneHandle bike = m_scene->createInstance(m_bikeMeshes[0], matrix);
+    for(int i=1; i<3; i++)
+        this->addWheel(m_bikeMeshes[i], bike);
+
+    return bike;
+}
+
+SceneHandle RenderPipeline::addWheel(int meshIndex, const SceneHandle &parent)
+{
+    if(meshIndex < 0 || meshIndex >= m_scene->meshCount())
+        return SceneHandle();
+
+    Wheel wheel;
+    wheel.handle = m_scene->createInstance(meshIndex, QMatrix4x4(), SceneStore::DefaultFlags, parent);
+    wheel.axle = m_scene->mesh(meshIndex)->boundingBox().center();
+    m_wheels.append(wheel);
+    return wheel.handle;
+}
+
+void RenderPipeline::spinWheels(float degrees)
+{
+    // Wheels turn about the x axis through their center
+    m_wheelAngle = float(std::fmod(double(m_wheelAngle + degrees), 360.0));
+    for(int i=m_wheels.size()-1; i>=0; i--)
+    {
+        const Wheel &wheel = m_wheels.at(i);
+        if(!m_scene->isValid(wheel.handle))
+        {
+            m_wheels.removeAt(i);
+            continue;
+        }
+
+        QMatrix4x4 matrix;
+        matrix.translate(wheel.axle);
+        matrix.rotate(m_wheelAngle, 1, 0, 0);
+        matrix.translate(-wheel.axle);
+        m_scene->setTransform(wheel.handle, matrix);
+    }
+}
+
+void RenderPipeline::resize(int width, int height)
+{
+    m_width = qMax(width, 1);
+    m_height = qMax(height, 1);
+    this->updateMatricesForScreenRendering();
+}
+
+void RenderPipeline::setShadowMapSize(int val)
+{
+    if(m_shadowMapSize == val || val <= 0)
+        return;
+
+    m_shadowMapSize = val;
+    m_shadowMapDirty = true;
+}
+
+void RenderPipeline::setShadowMapFormat(ShadowMapFormat val)
+{
+    if(m_shadowMapFormat == val)
+        return;
+
+    m_shadowMapFormat = val;
+    m_shadowMapDirty = true;
+}
+
+QString RenderPipeline::shadowMapFormatName(ShadowMapFormat format)
+{
+    switch(format)
+    {
+    case Depth16: return "DEPTH16";
+    case Depth24: return "DEPTH24";
+    case Depth32F: return "DEPTH32F";
+    }
+
+    return QString();
+}
+
+void RenderPipeline::setMeshStreamingEnabled(bool val)
+{
+    // The streamer, and its chunk file, stay on for meshes already streamed
+    if(val && m_meshStreamer == nullptr)
+        m_meshStreamer = new MeshStreamer;
+    m_meshStreaming = val;
+}
+
+void RenderPipeline::setTemporalShadowsEnabled(bool val)
+{
+    if(m_temporalShadowsEnabled == val)
+        return;
+
+    m_temporalShadowsEnabled = val;
+    m_temporalShadows->invalidate();
+}
+
+bool RenderPipeline::isUsingOrderIndependentTransparency() const
+{
+    return m_orderIndependentTransparency && m_transparencyBuffer->isSupported();
+}
+
+bool RenderPipeline::isUsingIndirectDraws() const
+{
+    return m_indirectDraws && m_indirectRenderer->isSupported();
+}
+
+void RenderPipeline::setReversedZEnabled(bool val)
+{
+    if(m_reversedZ == val)
+        return;
+
+    m_reversedZ = val;
+    if(val && m_initialized && !m_clipControl)
+        qWarning("%s", CLIP_CONTROL_WARNING);
+
+    // The scene projection changes with it
+    this->updateMatricesForScreenRendering();
+}
+
+bool RenderPipeline::isUsingReversedZ() const
+{
+    return m_reversedZ && m_clipControl != nullptr;
+}
+
+SceneStore::RayHit RenderPipeline::pick(const QPointF &position, int flags) const
+{
+    // The ray from the eye through the pixel, from the near plane on. The
+    // far plane may be at infinity, so it is not unprojected.
+    const float x = 2.0f*float(position.x())/float(m_width) - 1.0f;
+    const float y = 1.0f - 2.0f*float(position.y())/float(m_height);
+    const QMatrix4x4 inverse = (m_projectionMatrix * m_viewMatrix).inverted();
+    const QVector3D eye = m_viewMatrix.inverted().map( QVector3D(0,0,0) );
+    const QVector3D nearPoint = inverse.map( QVector3D(x, y, this->isUsingReversedZ() ? 1.0f : -1.0f) );
+
+    return m_scene->intersect(nearPoint, (nearPoint - eye).normalized(), flags);
+}
+
+void RenderPipeline::setHighlight(const SceneHandle &instance, int part)
+{
+    if(m_highlight == instance && m_highlightPart == part)
+        return;
+
+    m_highlight = instance;
+    m_highlightPart = part;
+    m_highlightDirty = true;
+}
+
+void RenderPipeline::setSceneMatrix(const QMatrix4x4 &matrix)
+{
+    m_sceneMatrix = matrix;
+}
+
+void RenderPipeline::applySceneState(const SceneState &state)
+{
+    Q_FOREACH(const SceneState::InstanceTransform &transform, state.transforms)
+        m_scene->setTransform(transform.handle, transform.matrix);
+
+    this->setSceneMatrix(state.sceneMatrix);
+}
+
+void RenderPipeline::turnTable(QMatrix4x4 &sceneMatrix, qreal seconds)
+{
+    sceneMatrix.rotate(TURNTABLE_DEGREES_PER_SECOND*float(seconds), 0, 1, 0);
+}
+
+void RenderPipeline::advance(qreal seconds)
+{
+    if(!m_animated || seconds <= 0)
+        return;
+
+    RenderPipeline::turnTable(m_sceneMatrix, seconds);
+    this->spinWheels(WHEEL_DEGREES_PER_SECOND*float(seconds));
+}
+
+void RenderPipeline::render()
+{
+    FrameProfiler *profiler = FrameProfiler::isEnabled() ? FrameProfiler::instance() : nullptr;
+    if(profiler)
+        profiler->beginFrame();
+
+    this->updateDepthFormats();
+    if(m_dynamicResolution)
+        m_resolutionScaler->beginFrame(QSize(m_width, m_height));
+
+    // PASS #1
+    // Render all models into the shadow buffer first
+    if(m_shadowsEnabled)
+        this->renderToShadowMap();
+
+    // PASS #2
+    // Render all models into the scene buffer next
+    this->renderToScreen();
+
+    // PASS #3
+    // Scale the scene up to the target, if it was rendered smaller
+    if(m_dynamicResolution)
+        m_resolutionScaler->endFrame(m_targetFramebuffer);
+
+    if(profiler)
+        profiler->endFrame();
+}
+
+void RenderPipeline::prepareScene()
+{
+    FrameProfiler::Scope scope("transform");
+    m_scene->updateWorld(m_sceneMatrix);
+}
+
+void RenderPipeline::cullInstances(const QMatrix4x4 &viewProjectionMatrix, int flags)
+{
+    // Instances of meshes the indirect renderer draws are left to it. When
+    // that is all of them there is nothing to cull here.
+    const bool indirect = this->isUsingIndirectDraws();
+    if(indirect && !m_indirectRenderer->hasUndrawableMeshes())
+    {
+        m_visibleInstances.clear();
+        return;
+    }
+
+    m_scene->cull(viewProjectionMatrix, flags, m_visibleInstances);
+    if(!indirect)
+        return;
+
+    int count = 0;
+    for(int i=0; i<m_visibleInstances.size(); i++)
+    {
+        const int instance = m_visibleInstances.at(i);
+        if(!m_indirectRenderer->isDrawable(m_scene->meshIndexAt(instance)))
+            m_visibleInstances[count++] = instance;
+    }
+    m_visibleInstances.resize(count);
+}
+
+void RenderPipeline::computeInstanceMatrices(const QMatrix4x4 &viewMatrix, const QMatrix4x4 &projectionMatrix,
+                                             bool withLightMatrices)
+{
+    FrameProfiler::Scope scope("transform/instances");
+
+    // The matrices every renderer needs, for all visible instances at once
+    const int count = m_visibleInstances.size();
+    const float *worlds = m_scene->worldMatrixData();
+    const int *indexes = m_visibleInstances.constData();
+
+    m_modelViewMatrices = m_frameArena->allocate<float>(count*16);
+    m_modelViewProjectionMatrices = m_frameArena->allocate<float>(count*16);
+    MultiplyMatrices(viewMatrix.constData(), worlds, indexes, count, m_modelViewMatrices);
+    MultiplyMatrices((projectionMatrix*viewMatrix).constData(), worlds, indexes, count,
+                     m_modelViewProjectionMatrices);
+
+    m_hasLightMatrices = withLightMatrices;
+    if(withLightMatrices)
+    {
+        m_lightViewMatrices = m_frameArena->allocate<float>(count*16);
+        m_lightViewProjectionMatrices = m_frameArena->allocate<float>(count*16);
+        MultiplyMatrices(m_lightViewMatrix.constData(), worlds, indexes, count, m_lightViewMatrices);
+        MultiplyMatrices((m_shadowProjectionMatrix*m_lightViewMatrix).constData(), worlds, indexes, count,
+                         m_lightViewProjectionMatrices);
+    }
+}
+
+ObjModel::InstanceMatrices RenderPipeline::instanceMatrices(int visibleIndex) const
+{
+    const int instance = m_visibleInstances.at(visibleIndex);
+
+    ObjModel::InstanceMatrices ret;
+    ret.model = m_scene->worldMatrixData() + instance*16;
+    ret.modelView = m_modelViewMatrices + visibleIndex*16;
+    ret.modelViewProjection = m_modelViewProjectionMatrices + visibleIndex*16;
+    if(m_hasLightMatrices)
+    {
+        ret.lightView = m_lightViewMatrices + visibleIndex*16;
+        ret.lightViewProjection = m_lightViewProjectionMatrices + visibleIndex*16;
+    }
+    ret.normal = m_scene->normalMatrixAt(instance);
+    return ret;
+}
+
+void RenderPipeline::renderToShadowMap()
+{
+    FrameProfiler::Scope scope("shadow");
+
+    this->initDepthMap(); // init happens only once.
+    this->prepareScene();
+
+    // The stream buffer frame takes in the shadow pass too, so that both
+    // passes share what is uploaded; renderToScreen() ends it
+    m_streamBuffer->beginFrame();
+
+    // Render into the depth framebuffer
+    glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMapFBO);
+    glViewport(0, 0, m_shadowMapSize, m_shadowMapSize);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+
+    m_lightViewMatrix.setToIdentity();
+    m_lightViewMatrix.lookAt( m_lightPositionMatrix.map( QVector3D(0,0,0) ),
+                 m_sceneBounds.center(),
+                 m_lightPositionMatrix.map( QVector3D(0,1,0) ).normalized() );
+
+    const int shadowFlags = SceneStore::Visible|SceneStore::CastsShadow;
+    if(this->isUsingIndirectDraws())
+    {
+        FrameProfiler::Scope indirectScope("shadow/indirect");
+        m_indirectRenderer->updateMeshes(m_scene);
+        m_indirectRenderer->cull(m_scene, shadowFlags, m_lightViewMatrix, m_shadowProjectionMatrix,
+                                 IndirectRenderer::ShadowPass);
+        m_indirectRenderer->drawShadows(m_shadowProjectionMatrix * m_lightViewMatrix);
+    }
+
+    {
+        FrameProfiler::Scope cullScope("shadow/cull");
+        this->cullInstances(m_shadowProjectionMatrix * m_lightViewMatrix, shadowFlags);
+    }
+    this->computeInstanceMatrices(m_lightViewMatrix, m_shadowProjectionMatrix, false);
+
+    const QVector3D noEye(0,0,-1), noLight(1,1,1);
+    int i = 0;
+    while(i < m_visibleInstances.size())
+    {
+        const int meshIndex = m_scene->meshIndexAt(m_visibleInstances.at(i));
+        ObjModel *mesh = m_scene->mesh(meshIndex);
+        mesh->setShadowTextureId(0);
+        mesh->setRenderMode(ObjModel::ShadowMode);
+
+        FrameProfiler::Scope meshScope("shadow/mesh", meshIndex);
+        for(; i<m_visibleInstances.size() && m_scene->meshIndexAt(m_visibleInstances.at(i)) == meshIndex; i++)
+            mesh->render(this->instanceMatrices(i), noEye, noLight, m_shadowProjectionMatrix, m_lightViewMatrix);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_targetFramebuffer);
+}
+
+void RenderPipeline::renderToScreen()
+{
+    FrameProfiler::Scope scope("scene");
+
+    // Once per frame, whichever passes run. Chunks requested by the shadow
+    // pass come in here along with those of the last scene pass.
+    if(m_meshStreamer)
+        m_meshStreamer->beginFrame();
+
+    // Reversed-Z needs a float depth buffer, so outside of a dynamic
+    // resolution frame the scene goes through the scaler's framebuffer at
+    // full size
+    const bool reversedZ = this->isUsingReversedZ();
+    this->updateDepthFormats();
+    const bool ownFrame = reversedZ && !m_resolutionScaler->isInFrame();
+    if(ownFrame)
+        m_resolutionScaler->beginFrame(QSize(m_width, m_height), false);
+
+    // Within a dynamic resolution frame the scene goes offscreen, into the
+    // bottom left corner of the scaler's framebuffer
+    QSize viewportSize(m_width, m_height);
+    uint framebuffer = m_targetFramebuffer;
+    if(m_resolutionScaler->isInFrame())
+    {
+        viewportSize = m_resolutionScaler->frameSize();
+        framebuffer = m_resolutionScaler->framebuffer();
+    }
+
+    // Depth tests and clears follow the depth convention, which goes back
+    // to the conventional one at the end of the pass
+    this->setDepthReversed(reversedZ);
+
+    // Temporal shadows need a second render target for the history, so the
+    // scene goes into a framebuffer of their own and is copied over after
+    // the opaque parts
+    const bool temporalShadows = m_temporalShadowsEnabled && m_shadowsEnabled;
+    if(temporalShadows)
+        m_temporalShadows->begin(viewportSize, m_projectionMatrix * m_viewMatrix, m_sceneMatrix,
+                                 m_shadowProjectionMatrix * m_lightViewMatrix,
+                                 TemporalShadows::ShadowSettings(m_shadowMapSize, m_shadowMapFormat, m_shadowFilterRange));
+    else
+    {
+        m_temporalShadows->invalidate();
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, viewportSize.width(), viewportSize.height());
+        glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+    }
+
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_BACK);
+
+    const QVector3D center = m_sceneBounds.center();
+    const QVector3D eye(center.x(), center.y(), m_sceneBounds.z.max);
+    const QVector3D lightDirection = m_lightPositionMatrix.map( QVector3D(0,0,-1) ).normalized();
+
+    m_streamBuffer->beginFrame();
+    m_lightManager->update(m_viewMatrix, m_projectionMatrix, viewportSize, Z_NEAR, Z_FAR);
+
+    this->prepareScene();
+    const bool indirect = this->isUsingIndirectDraws();
+    if(indirect)
+    {
+        FrameProfiler::Scope indirectScope("scene/indirect");
+        m_indirectRenderer->updateMeshes(m_scene);
+        m_indirectRenderer->cull(m_scene, SceneStore::Visible, m_viewMatrix, m_projectionMatrix,
+                                 IndirectRenderer::ScenePass);
+    }
+
+    {
+        FrameProfiler::Scope cullScope("scene/cull");
+        this->cullInstances(m_projectionMatrix * m_viewMatrix, SceneStore::Visible);
+    }
+    this->computeInstanceMatrices(m_viewMatrix, m_projectionMatrix, true);
+
+    // Opaque parts of all meshes go first, then the transparent parts over
+    // them. With order independent transparency the transparent parts can
+    // be drawn in any order; without it they are simply blended in mesh
+    // order, which is only correct where they don't overlap.
+    this->drawVisibleInstances(ObjModel::OpaqueParts, eye, lightDirection);
+
+    if(temporalShadows)
+        m_temporalShadows->end(framebuffer);
+
+    // The opaque depth, for occlusion culling in the next frame
+    if(indirect)
+        m_indirectRenderer->captureDepth(framebuffer, viewportSize, m_projectionMatrix * m_viewMatrix);
+
+    const bool oit = this->isUsingOrderIndependentTransparency();
+    if(oit)
+        m_transparencyBuffer->begin(viewportSize, framebuffer);
+
+    this->drawVisibleInstances(ObjModel::TransparentParts, eye, lightDirection);
+
+    if(oit)
+        m_transparencyBuffer->end();
+
+    this->drawHighlight();
+
+    this->setDepthReversed(false);
+    if(ownFrame)
+        m_resolutionScaler->endFrame(m_targetFramebuffer);
+
+    m_streamBuffer->endFrame();
+
+    // The end of the frame, for everything allocated in it
+    const Arena::Statistics arenaStats = m_frameArena->statistics();
+    FrameProfiler::countAllocations(arenaStats.allocations, arenaStats.usedBytes, arenaStats.blockAllocations);
+    m_frameArena->reset();
+    m_modelViewMatrices = m_modelViewProjectionMatrices = nullptr;
+    m_lightViewMatrices = m_lightViewProjectionMatrices = nullptr;
+    m_hasLightMatrices = false;
+}
+
+void RenderPipeline::drawVisibleInstances(ObjModel::PartSelection parts, const QVector3D &eye,
+                                          const QVector3D &lightDirection)
+{
+    const uint shadowTextureId = m_shadowsEnabled ? m_shadowMapTex : 0;
+    const char *scopeName = parts == ObjModel::TransparentParts ? "scene/transparent" : "scene/mesh";
+
+    // Indirect draws take whatever the last cull left in their lists
+    if(this->isUsingIndirectDraws())
+    {
+        FrameProfiler::Scope indirectScope("scene/indirect");
+        m_indirectRenderer->setShadowTextureId(shadowTextureId);
+        m_indirectRenderer->setShadowMapSize(m_shadowMapSize);
+        m_indirectRenderer->setShadowFilterRange(m_shadowFilterRange);
+        m_indirectRenderer->setShadowDepthRange(Z_NEAR, Z_FAR);
+        m_indirectRenderer->drawScene(parts, eye, lightDirection, m_projectionMatrix,
+                                      m_viewMatrix, m_shadowProjectionMatrix * m_lightViewMatrix);
+    }
+
+    int i = 0;
+    while(i < m_visibleInstances.size())
+    {
+        const int meshIndex = m_scene->meshIndexAt(m_visibleInstances.at(i));
+        int end = i+1;
+        while(end < m_visibleInstances.size() && m_scene->meshIndexAt(m_visibleInstances.at(end)) == meshIndex)
+            ++end;
+
+        ObjModel *mesh = m_scene->mesh(meshIndex);
+        if(!mesh->hasParts(parts))
+        {
+            i = end;
+            continue;
+        }
+
+        mesh->setShadowTextureId(shadowTextureId);
+        mesh->setShadowMapSize(m_shadowMapSize);
+        mesh->setShadowFilterRange(m_shadowFilterRange);
+        mesh->setShadowDepthRange(Z_NEAR, Z_FAR);
+        mesh->setRenderMode(ObjModel::SceneMode);
+        mesh->setPartSelection(parts);
+
+        FrameProfiler::Scope meshScope(scopeName, meshIndex);
+        for(; i<end; i++)
+            mesh->render(this->instanceMatrices(i), eye, lightDirection,
+                         m_projectionMatrix, m_viewMatrix, m_lightViewMatrix);
+    }
+}
+
+void RenderPipeline::drawHighlight()
+{
+    const int instance = m_scene->indexOf(m_highlight);
+    if(instance < 0 || m_highlightPart < 0)
+        return;
+
+    FrameProfiler::Scope scope("scene/highlight");
+
+    // Triangles of the part are uploaded only when the highlight moves on
+    // to another part, which is rare next to frames
+    const int meshIndex = m_scene->meshIndexAt(instance);
+    if(m_highlightDirty || meshIndex != m_highlightMesh)
+    {
+        const QVector<QVector3D> triangles = m_scene->mesh(meshIndex)->partTriangles(m_highlightPart);
+        if(m_highlightBuffer == 0)
+            glGenBuffers(1, &m_highlightBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_highlightBuffer);
+        glBufferData(GL_ARRAY_BUFFER, triangles.size()*int(sizeof(QVector3D)), triangles.constData(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        m_highlightVertexCount = triangles.size();
+        m_highlightMesh = meshIndex;
+        m_highlightDirty = false;
+    }
+
+    if(m_highlightVertexCount == 0)
+        return;
+
+    if(!m_highlightProgram)
+        m_highlightProgram = CreateShaderProgram(":/highlight_vertex.glsl", ":/highlight_fragment.glsl");
+
+    // Blended over the surface it tints, without hiding what is drawn after.
+    // Towards the eye is up in reversed depth.
+    const float offsetSign = m_depthReversed ? -1.0f : 1.0f;
+    glDepthMask(GL_FALSE);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(offsetSign*HIGHLIGHT_POLYGON_OFFSET, offsetSign*HIGHLIGHT_POLYGON_OFFSET);
+
+    m_highlightProgram->bind();
+    glBindBuffer(GL_ARRAY_BUFFER, m_highlightBuffer);
+    m_highlightProgram->enableAttributeArray("qt_Vertex");
+    m_highlightProgram->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 3, 0);
+    m_highlightProgram->setUniformValue("qt_ModelViewProjectionMatrix",
+                                        m_projectionMatrix * m_viewMatrix * m_scene->worldMatrixAt(instance));
+    m_highlightProgram->setUniformValue("qt_Color", HIGHLIGHT_COLOR);
+    FrameProfiler::countStateChange(2);
+
+    glDrawArrays(GL_TRIANGLES, 0, m_highlightVertexCount);
+    FrameProfiler::countDrawCall(m_highlightVertexCount);
+
+    m_highlightProgram->disableAttributeArray("qt_Vertex");
+    m_highlightProgram->release();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glPolygonOffset(offsetSign*LINE_POLYGON_OFFSET, offsetSign*LINE_POLYGON_OFFSET);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDepthMask(GL_TRUE);
+}
+
+void RenderPipeline::updateDepthFormats()
+{
+    // Depth is copied from one offscreen framebuffer to another, which
+    // only works between buffers of the same format. Nothing changes here
+    // unless reversed-Z was switched since the last frame.
+    const bool reversedZ = this->isUsingReversedZ();
+    const uint format = reversedZ ? GL_DEPTH32F_STENCIL8 : GL_DEPTH24_STENCIL8;
+    m_resolutionScaler->setDepthFormat(format);
+    m_temporalShadows->setDepthFormat(format);
+    m_transparencyBuffer->setDepthFormat(format);
+    m_indirectRenderer->setReversedZ(reversedZ);
+}
+
+void RenderPipeline::setDepthReversed(bool val)
+{
+    if(m_depthReversed == val)
+        return;
+
+    // Nearer is greater in reversed depth, so the tests flip, the clear
+    // value is the far end, and offsets towards the eye are positive
+    const float lineOffset = val ? -LINE_POLYGON_OFFSET : LINE_POLYGON_OFFSET;
+    m_clipControl(GL_LOWER_LEFT, val ? GL_ZERO_TO_ONE : GL_NEGATIVE_ONE_TO_ONE);
+    glDepthFunc(val ? GL_GEQUAL : GL_LEQUAL);
+    glClearDepthf(val ? 0.0f : 1.0f);
+    glPolygonOffset(lineOffset, lineOffset);
+    FrameProfiler::countStateChange(4);
+
+    m_depthReversed = val;
+}
+
+void RenderPipeline::updateMatricesForScreenRendering()
+{
+    if(m_scene->instanceCount() == 0)
+        return;
+
+    m_sceneBounds = m_scene->bounds(SceneStore::ContributesToBounds);
+
+    const float width = m_sceneBounds.width();
+    const float height = m_sceneBounds.height();
+    const float depth = m_sceneBounds.depth();
+    const float size = qMax( qMax(width, height), depth );
+    const QVector3D center = m_sceneBounds.center();
+
+    m_cameraPositionMatrix.setToIdentity();
+    m_cameraPositionMatrix.translate(center.x(), center.y(), center.z());
+    m_cameraPositionMatrix.rotate(20, 0, 1, 0);
+    m_cameraPositionMatrix.rotate(-25, 1, 0, 0);
+
+    m_lightPositionMatrix = m_cameraPositionMatrix;
+    m_lightPositionMatrix.rotate(45, 0, 1, 0);
+
+    m_lightPositionMatrix.translate(0, 0, size*5.0f);
+    m_cameraPositionMatrix.translate(0, 0, size*1.5f);
+
+    m_viewMatrix.setToIdentity();
+    m_viewMatrix.lookAt( m_cameraPositionMatrix.map( QVector3D(0,0,0) ),
+                         center,
+                         m_cameraPositionMatrix.map( QVector3D(0,1,0) ).normalized() );
+
+    // The light keeps the conventional projection, whose depth the scene
+    // shader turns back into distances between Z_NEAR and Z_FAR
+    const float aspectRatio = float(m_width)/float(m_height);
+    m_shadowProjectionMatrix.setToIdentity();
+    m_shadowProjectionMatrix.perspective(FIELD_OF_VIEW, aspectRatio, Z_NEAR, Z_FAR);
+
+    if(this->isUsingReversedZ())
+        m_projectionMatrix = ReversedInfinitePerspective(FIELD_OF_VIEW, aspectRatio, Z_NEAR);
+    else
+        m_projectionMatrix = m_shadowProjectionMatrix;
+}
+
+void RenderPipeline::initDepthMap()
+{
+    // Refer http://learnopengl.com/#!Advanced-Lighting/Shadows/Shadow-Mapping
+    if(m_shadowMapFBO != 0)
+    {
+        if(m_shadowMapDirty)
+            this->allocateDepthMap();
+        return;
+    }
+
+    // Create a texture for storing the depth map
+    glGenTextures(1, &m_shadowMapTex);
+    this->allocateDepthMap();
+
+    glBindTexture(GL_TEXTURE_2D, m_shadowMapTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    GLfloat borderColor[] = { 1.0, 1.0, 1.0, 1.0 };
+    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+
+    // Create a frame-buffer and associate the texture with it.
+    glGenFramebuffers(1, &m_shadowMapFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMapFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_shadowMapTex, 0);
+
+    // Let OpenGL know that we are not interested in colors for this buffer
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+
+    // Cleanup for now.
+    glBindFramebuffer(GL_FRAMEBUFFER, m_targetFramebuffer);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void RenderPipeline::allocateDepthMap()
+{
+    // Only the storage changes; the framebuffer keeps the same texture
+    // attached, so a new size or format costs no more than the allocation
+    const struct { GLint internalFormat; GLenum type; } formats[] = {
+        { GL_DEPTH_COMPONENT16, GL_UNSIGNED_SHORT },
+        { GL_DEPTH_COMPONENT24, GL_UNSIGNED_INT },
+        { GL_DEPTH_COMPONENT32F, GL_FLOAT }
+    };
+
+    glBindTexture(GL_TEXTURE_2D, m_shadowMapTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, formats[m_shadowMapFormat].internalFormat,
+                 m_shadowMapSize, m_shadowMapSize, 0, GL_DEPTH_COMPONENT,
+                 formats[m_shadowMapFormat].type, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    m_shadowMapDirty = false;
+}
+
+void RenderPipeline::releaseDepthMap()
+{
+    if(m_shadowMapTex > 0)
+        glDeleteTextures(1, &m_shadowMapTex);
+    if(m_shadowMapFBO > 0)
+        glDeleteFramebuffers(1, &m_shadowMapFBO);
+
+    m_shadowMapTex = 0;
+    m_shadowMapFBO = 0;
+}
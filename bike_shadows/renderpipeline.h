@@ -0,0 +1,284 @@
+#ifndef RENDER_PIPELINE_H
+#define RENDER_PIPELINE_H
+
+#include <QOpenGLFunctions>
+
+#include "objmodel.h"
+#include "scenestore.h"
+
+class Arena;
+class IndirectRenderer;
+class LightManager;
+class MeshStreamer;
+class QOpenGLShaderProgram;
+class ResolutionScaler;
+class StreamBuffer;
+class TemporalShadows;
+class TransparencyBuffer;
+struct SceneState;
+
+/*
+ * Holds the scene (models, camera, lights) and renders it, with or without
+ * shadows, into whatever framebuffer is current target. It has no ties to
+ * any widget or window, so the same pipeline is used by the render windows
+ * and by the headless benchmark.
+ *
+ * Models are instances in a SceneStore. Each frame the instances are culled
+ * against the light and the camera, and the survivors are drawn grouped by
+ * mesh: opaque parts first, then transparent parts, which by default go
+ * through weighted blended order independent transparency.
+ *
+ * Meshes can be streamed (see MeshStreamer), in which case only the
+ * visible parts of them, at the LOD they are seen at, take up GPU memory.
+ *
+ * On OpenGL 4.3 and up, meshes in buffers of their own are culled and drawn
+ * on the GPU (see IndirectRenderer), a few draw calls per pass however
+ * many instances there are. Other meshes, and all of them below 4.3, are
+ * culled here and drawn one instance at a time.
+ *
+ * With dynamic resolution the scene pass renders offscreen at a scale
+ * that follows the measured GPU frame time, and is upscaled into the
+ * target framebuffer at the end of render().
+ *
+ * With reversed-Z the scene pass has an infinite far plane, and writes
+ * depth that falls from 1 at the near plane to 0 at infinity into a 32 bit
+ * float depth buffer, whose exponent makes up for the way perspective
+ * bunches depth up near the eye. The shadow pass keeps a conventional
+ * projection.
+ */
+class RenderPipeline : public QOpenGLFunctions
+{
+public:
+    RenderPipeline();
+    ~RenderPipeline();
+
+    // Must be called with a current OpenGL context
+    void initialize();
+    void loadDefaultScene();
+
+    // Takes ownership of the mesh, which can then be instanced any number
+    // of times in scene()
+    int addMesh(ObjModel *mesh);
+
+    // Loads an OBJ file, streamed through meshStreamer() if mesh streaming
+    // is enabled
+    ObjModel *loadMesh(const QString &fileName);
+
+    // Adds the model as a mesh with one instance, placed by model->matrix()
+    SceneHandle addModel(ObjModel *model, int flags=SceneStore::DefaultFlags);
+
+    // A bike, with its wheels as child instances that spin when animated.
+    // The bike meshes are loaded on first use.
+    SceneHandle addBike(const QMatrix4x4 &matrix);
+
+    // A child instance of parent that, like the wheels of the bikes, spins
+    // about the x axis through the center of its mesh when animated
+    SceneHandle addWheel(int meshIndex, const SceneHandle &parent);
+
+    SceneStore *scene() const { return m_scene; }
+    LightManager *lightManager() const { return m_lightManager; }
+
+    // Per frame uploads go through this ring buffer, whose frame starts in
+    // renderToShadowMap() (or renderToScreen() without shadows) and ends
+    // with renderToScreen()
+    StreamBuffer *streamBuffer() const { return m_streamBuffer; }
+
+    // Transient data of a frame (instance matrices, draw lists) comes out
+    // of this arena, and is all released at the end of renderToScreen()
+    Arena *frameArena() const { return m_frameArena; }
+
+    // Size of the target framebuffer in device pixels
+    void resize(int width, int height);
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    // When animated (the default) advance() turns the scene and spins the
+    // wheels of the bikes. Otherwise the scene matrix is whatever was set
+    // last.
+    void setAnimated(bool val) { m_animated = val; }
+    bool isAnimated() const { return m_animated; }
+
+    // Moves the animation forward by the given time. Animation speed is in
+    // degrees per second, so it does not depend on how often frames are
+    // rendered.
+    void advance(qreal seconds);
+
+    // Turns sceneMatrix as advance() turns the scene, for whoever animates
+    // a scene matrix away from the pipeline (see SceneState)
+    static void turnTable(QMatrix4x4 &sceneMatrix, qreal seconds);
+
+    void setSceneMatrix(const QMatrix4x4 &matrix);
+    QMatrix4x4 sceneMatrix() const { return m_sceneMatrix; }
+
+    void applySceneState(const SceneState &state);
+
+    void setTargetFramebuffer(uint fbo) { m_targetFramebuffer = fbo; }
+    uint targetFramebuffer() const { return m_targetFramebuffer; }
+
+    void setShadowsEnabled(bool val) { m_shadowsEnabled = val; }
+    bool isShadowsEnabled() const { return m_shadowsEnabled; }
+
+    // Changing the size or the format reallocates the shadow map's storage
+    // on the next frame. The texture and framebuffer themselves are kept.
+    void setShadowMapSize(int val);
+    int shadowMapSize() const { return m_shadowMapSize; }
+
+    // Depth precision of the shadow map. Depth16 halves the bandwidth of
+    // Depth24 (which is padded to 32 bits) at the cost of more acne and
+    // peter panning on large scenes.
+    enum ShadowMapFormat { Depth16, Depth24, Depth32F };
+    void setShadowMapFormat(ShadowMapFormat val);
+    ShadowMapFormat shadowMapFormat() const { return m_shadowMapFormat; }
+    static QString shadowMapFormatName(ShadowMapFormat format);
+
+    // Number of texels on either side of the center texel used for PCF.
+    // 0 means a single tap, 1 is a 3x3 kernel and 2 (default) is 5x5.
+    void setShadowFilterRange(int val) { m_shadowFilterRange = qBound(0, val, 2); }
+    int shadowFilterRange() const { return m_shadowFilterRange; }
+
+    // Filters shadows over several frames, with a fraction of the PCF taps
+    // per frame (see TemporalShadows)
+    void setTemporalShadowsEnabled(bool val);
+    bool isTemporalShadowsEnabled() const { return m_temporalShadowsEnabled; }
+    TemporalShadows *temporalShadows() const { return m_temporalShadows; }
+
+    // Transparent parts through a TransparencyBuffer (the default), where
+    // the context supports it (OpenGL 3), or blended straight into the
+    // scene in draw order
+    void setOrderIndependentTransparencyEnabled(bool val) { m_orderIndependentTransparency = val; }
+    bool isOrderIndependentTransparencyEnabled() const { return m_orderIndependentTransparency; }
+    bool isUsingOrderIndependentTransparency() const;
+
+    // Meshes loaded from then on are kept on disk and streamed into GPU
+    // memory as they come into view, within the budgets of meshStreamer().
+    // Meshes loaded before are not affected.
+    void setMeshStreamingEnabled(bool val);
+    bool isMeshStreamingEnabled() const { return m_meshStreaming; }
+    MeshStreamer *meshStreamer() const { return m_meshStreamer; }
+
+    // Only render() scales; renderToScreen() on its own is always at full
+    // resolution
+    void setDynamicResolutionEnabled(bool val) { m_dynamicResolution = val; }
+    bool isDynamicResolutionEnabled() const { return m_dynamicResolution; }
+    ResolutionScaler *resolutionScaler() const { return m_resolutionScaler; }
+
+    // GPU culling and indirect draws, where the context supports them
+    // (the default). Occlusion culling is set on indirectRenderer().
+    void setIndirectDrawsEnabled(bool val) { m_indirectDraws = val; }
+    bool isIndirectDrawsEnabled() const { return m_indirectDraws; }
+    bool isUsingIndirectDraws() const;
+    IndirectRenderer *indirectRenderer() const { return m_indirectRenderer; }
+
+    // Reversed-Z in the scene pass, where the context has glClipControl
+    // (OpenGL 4.5 or ARB_clip_control); depth stays conventional otherwise.
+    // As the target's depth buffer is not a float one, the scene then goes
+    // offscreen even at full resolution, and is copied into the target at
+    // the end of renderToScreen(). Off by default.
+    void setReversedZEnabled(bool val);
+    bool isReversedZEnabled() const { return m_reversedZ; }
+    bool isUsingReversedZ() const;
+
+    // Instance and part that are under position (in device pixels of the
+    // target, from the top left), where the last frame drew them. Only
+    // instances with all of flags are picked.
+    SceneStore::RayHit pick(const QPointF &position, int flags=SceneStore::Visible) const;
+
+    // A part of an instance that is drawn tinted, over the scene. A null
+    // handle or a negative part highlights nothing.
+    void setHighlight(const SceneHandle &instance, int part);
+    SceneHandle highlightedInstance() const { return m_highlight; }
+    int highlightedPart() const { return m_highlightPart; }
+
+    void render();
+    void renderToShadowMap();
+    void renderToScreen();
+
+    void updateMatricesForScreenRendering();
+
+private:
+    void initDepthMap();
+    void allocateDepthMap();
+    void prepareScene();
+    void cullInstances(const QMatrix4x4 &viewProjectionMatrix, int flags);
+    void spinWheels(float degrees);
+    void drawVisibleInstances(ObjModel::PartSelection parts, const QVector3D &eye,
+                              const QVector3D &lightDirection);
+    void computeInstanceMatrices(const QMatrix4x4 &viewMatrix, const QMatrix4x4 &projectionMatrix,
+                                 bool withLightMatrices);
+    ObjModel::InstanceMatrices instanceMatrices(int visibleIndex) const;
+    void drawHighlight();
+    void updateDepthFormats();
+    void setDepthReversed(bool val);
+    void releaseDepthMap();
+
+private:
+    SceneStore *m_scene;
+    QVector<int> m_visibleInstances;
+
+    struct Wheel
+    {
+        SceneHandle handle;
+        QVector3D axle; // center of the wheel, in bike coordinates
+    };
+    QVector<Wheel> m_wheels;
+    int m_bikeMeshes[3]; // body, front wheel, rear wheel
+    float m_wheelAngle;
+
+    // Per visible instance, packed as for the batch kernels. They live in
+    // the frame arena, which is reset at the end of renderToScreen().
+    Arena *m_frameArena;
+    float *m_modelViewMatrices;
+    float *m_modelViewProjectionMatrices;
+    float *m_lightViewMatrices;
+    float *m_lightViewProjectionMatrices;
+
+    QMatrix4x4 m_sceneMatrix;
+    QMatrix4x4 m_projectionMatrix;
+    QMatrix4x4 m_shadowProjectionMatrix;
+    QMatrix4x4 m_viewMatrix;
+    BoundingBox m_sceneBounds;
+    QMatrix4x4 m_cameraPositionMatrix;
+    QMatrix4x4 m_lightPositionMatrix;
+    QMatrix4x4 m_lightViewMatrix;
+    LightManager *m_lightManager;
+    StreamBuffer *m_streamBuffer;
+    ResolutionScaler *m_resolutionScaler;
+    TemporalShadows *m_temporalShadows;
+    TransparencyBuffer *m_transparencyBuffer;
+    MeshStreamer *m_meshStreamer;
+    IndirectRenderer *m_indirectRenderer;
+
+    typedef void (QOPENGLF_APIENTRYP ClipControlFunction)(GLenum origin, GLenum depth);
+    ClipControlFunction m_clipControl;
+
+    QOpenGLShaderProgram *m_highlightProgram;
+    SceneHandle m_highlight;
+    int m_highlightPart;
+    int m_highlightMesh;        // whose part is in m_highlightBuffer
+    int m_highlightVertexCount;
+    uint m_highlightBuffer;
+    int m_width;
+    int m_height;
+    uint m_targetFramebuffer;
+    uint m_shadowMapFBO;
+    uint m_shadowMapTex;
+    int m_shadowMapSize;
+    ShadowMapFormat m_shadowMapFormat;
+    int m_shadowFilterRange;
+    bool m_shadowMapDirty;
+    bool m_hasLightMatrices;
+    bool m_shadowsEnabled;
+    bool m_animated;
+    bool m_dynamicResolution;
+    bool m_temporalShadowsEnabled;
+    bool m_orderIndependentTransparency;
+    bool m_meshStreaming;
+    bool m_indirectDraws;
+    bool m_highlightDirty;
+    bool m_reversedZ;
+    bool m_depthReversed;       // as the depth state currently is
+    bool m_initialized;
+    char m_padding[3];
+};
+
+#endif // RENDER_PIPELINE_H
@@ -0,0 +1,261 @@
+#include "resolutionscaler.h"
+#include "frameprofiler.h"
+#include "shaderprogram.h"
+
+#include <QOpenGLBuffer>
+#include <QOpenGLTimerQuery>
+#include <QOpenGLShaderProgram>
+#include <QtMath>
+
+// Frame time band, relative to the target, within which the scale is left
+// alone
+static const qreal LOWER_BAND = 0.85;
+static const qreal UPPER_BAND = 1.02;
+
+// Fraction of the way to the ideal scale taken per frame
+static const qreal SCALE_RESPONSE = 0.25;
+
+// Weight of the newest sample in the smoothed frame time
+static const qreal FRAME_TIME_SMOOTHING = 0.2;
+
+ResolutionScaler::ResolutionScaler()
+    : m_fbo(0), m_colorTex(0), m_depthRenderbuffer(0), m_depthFormat(GL_DEPTH24_STENCIL8),
+      m_quad(nullptr), m_frameSlot(0),
+      m_targetFrameTime(1000.0/60.0), m_minimumScale(0.5), m_scale(1.0), m_frameTime(0),
+      m_filter(Sharpen), m_timersAvailable(true), m_initialized(false), m_inFrame(false),
+      m_timedFrame(false)
+{
+    m_programs[0] = m_programs[1] = nullptr;
+    for(int i=0; i<FramesInFlight; i++)
+    {
+        m_timers[i] = nullptr;
+        m_timerPending[i] = false;
+    }
+}
+
+ResolutionScaler::~ResolutionScaler()
+{
+    if(!m_initialized)
+        return;
+
+    this->releaseTarget();
+    delete m_programs[0];
+    delete m_programs[1];
+    delete m_quad;
+    for(int i=0; i<FramesInFlight; i++)
+        delete m_timers[i];
+}
+
+void ResolutionScaler::setMinimumScale(qreal val)
+{
+    m_minimumScale = qBound(qreal(0.25), val, qreal(1));
+    m_scale = qMax(m_scale, m_minimumScale);
+}
+
+void ResolutionScaler::setDepthFormat(uint val)
+{
+    if(m_depthFormat == val)
+        return;
+
+    m_depthFormat = val;
+    if(m_initialized)
+        this->releaseTarget();
+}
+
+QSize ResolutionScaler::renderSize(const QSize &targetSize) const
+{
+    return QSize( qMax(1, qRound(targetSize.width()*m_scale)),
+                  qMax(1, qRound(targetSize.height()*m_scale)) );
+}
+
+void ResolutionScaler::beginFrame(const QSize &targetSize, bool scaled)
+{
+    this->initialize(); // init happens only once.
+
+    if(targetSize != m_targetSize)
+        this->resizeTarget(targetSize);
+
+    // Unscaled frames are not timed: they may be nested in a timer query
+    // of the caller's, and only time part of a frame besides
+    m_timedFrame = scaled;
+    if(scaled)
+    {
+        // The query that last used this slot is FramesInFlight frames old,
+        // and done by now on any sane driver. If not, it is skipped, not
+        // waited on.
+        this->collectFrameTime(m_frameSlot);
+        this->updateScale();
+        m_renderSize = this->renderSize(m_targetSize);
+    }
+    else
+        m_renderSize = m_targetSize;
+
+    if(m_timedFrame && m_timersAvailable && !m_timerPending[m_frameSlot])
+        m_timers[m_frameSlot]->begin();
+
+    m_inFrame = true;
+}
+
+void ResolutionScaler::endFrame(uint targetFramebuffer)
+{
+    if(!m_inFrame)
+        return;
+
+    this->upscale(targetFramebuffer);
+    m_inFrame = false;
+
+    if(!m_timedFrame)
+        return;
+
+    if(m_timersAvailable && !m_timerPending[m_frameSlot])
+    {
+        m_timers[m_frameSlot]->end();
+        m_timerPending[m_frameSlot] = true;
+    }
+
+    m_frameSlot = (m_frameSlot+1) % FramesInFlight;
+}
+
+void ResolutionScaler::initialize()
+{
+    if(m_initialized)
+        return;
+
+    QOpenGLFunctions::initializeOpenGLFunctions();
+
+    m_programs[Bilinear] = CreateShaderProgram(":/fullscreen_vertex.glsl", ":/upscale_fragment.glsl");
+    m_programs[Sharpen] = CreateShaderProgram(":/fullscreen_vertex.glsl", ":/upscale_fragment.glsl",
+                                              QStringList() << "SHARPEN");
+
+    // One quad covering the viewport, drawn as a strip
+    const float vertices[] = { -1.0f, -1.0f,  1.0f, -1.0f,  -1.0f, 1.0f,  1.0f, 1.0f };
+    m_quad = new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    m_quad->create();
+    m_quad->bind();
+    m_quad->allocate(vertices, int(sizeof(vertices)));
+    m_quad->release();
+
+    for(int i=0; i<FramesInFlight && m_timersAvailable; i++)
+    {
+        m_timers[i] = new QOpenGLTimerQuery;
+        if(!m_timers[i]->create())
+            m_timersAvailable = false;
+    }
+
+    m_initialized = true;
+}
+
+void ResolutionScaler::resizeTarget(const QSize &size)
+{
+    this->releaseTarget();
+    m_targetSize = size;
+
+    glGenTextures(1, &m_colorTex);
+    glBindTexture(GL_TEXTURE_2D, m_colorTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.width(), size.height(), 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &m_depthRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, m_depthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, m_depthFormat, size.width(), size.height());
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &m_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_colorTex, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, m_depthRenderbuffer);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        qWarning("Dynamic resolution framebuffer is incomplete");
+}
+
+void ResolutionScaler::releaseTarget()
+{
+    if(m_colorTex > 0)
+        glDeleteTextures(1, &m_colorTex);
+    if(m_depthRenderbuffer > 0)
+        glDeleteRenderbuffers(1, &m_depthRenderbuffer);
+    if(m_fbo > 0)
+        glDeleteFramebuffers(1, &m_fbo);
+
+    m_colorTex = 0;
+    m_depthRenderbuffer = 0;
+    m_fbo = 0;
+    m_targetSize = QSize();
+}
+
+void ResolutionScaler::collectFrameTime(int slot)
+{
+    if(!m_timerPending[slot] || !m_timers[slot]->isResultAvailable())
+        return;
+
+    const qreal sample = qreal(m_timers[slot]->waitForResult()) / 1e6;
+    m_timerPending[slot] = false;
+
+    if(m_frameTime <= 0)
+        m_frameTime = sample;
+    else
+        m_frameTime += (sample - m_frameTime) * FRAME_TIME_SMOOTHING;
+}
+
+void ResolutionScaler::updateScale()
+{
+    if(m_frameTime <= 0)
+        return;
+
+    const qreal ratio = m_frameTime / m_targetFrameTime;
+    if(ratio >= LOWER_BAND && ratio <= UPPER_BAND)
+        return;
+
+    // GPU time goes roughly with the number of pixels, that is with the
+    // square of the scale. Aim for the middle of the band.
+    const qreal ideal = m_scale * qSqrt( (LOWER_BAND+UPPER_BAND)*0.5 / ratio );
+    m_scale += (ideal - m_scale) * SCALE_RESPONSE;
+    m_scale = qBound(m_minimumScale, m_scale, qreal(1));
+}
+
+void ResolutionScaler::upscale(uint targetFramebuffer)
+{
+    FrameProfiler::Scope scope("upscale");
+
+    glBindFramebuffer(GL_FRAMEBUFFER, targetFramebuffer);
+    glViewport(0, 0, m_targetSize.width(), m_targetSize.height());
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glDisable(GL_CULL_FACE);
+
+    // A full size frame is only copied
+    const bool scaled = m_renderSize != m_targetSize;
+    QOpenGLShaderProgram *program = m_programs[scaled ? m_filter : Bilinear];
+    program->bind();
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_colorTex);
+    program->setUniformValue("qt_Texture", 0);
+    program->setUniformValue("qt_UVScale", float(m_renderSize.width())/float(m_targetSize.width()),
+                             float(m_renderSize.height())/float(m_targetSize.height()));
+    program->setUniformValue("qt_TexelSize", 1.0f/float(m_targetSize.width()),
+                             1.0f/float(m_targetSize.height()));
+
+    // Sharpening makes up for lost resolution, so it is not needed at all
+    // at full scale
+    program->setUniformValue("qt_Sharpness", scaled ? float(0.5*(1.0-m_scale)/(1.0-m_minimumScale+1e-6)) : 0.0f);
+
+    m_quad->bind();
+    program->enableAttributeArray("qt_Vertex");
+    program->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 2);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    program->disableAttributeArray("qt_Vertex");
+    m_quad->release();
+
+    program->release();
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+}
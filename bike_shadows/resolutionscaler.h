@@ -0,0 +1,109 @@
+#ifndef RESOLUTION_SCALER_H
+#define RESOLUTION_SCALER_H
+
+#include <QSize>
+#include <QOpenGLFunctions>
+
+class QOpenGLBuffer;
+class QOpenGLTimerQuery;
+class QOpenGLShaderProgram;
+
+/*
+ * Renders the scene at a fraction of the target resolution when the GPU
+ * cannot keep up, and scales the result back up to the target.
+ *
+ * The GPU time of each frame is measured with timer queries, read back
+ * FramesInFlight frames later so that the CPU never waits on them. The
+ * scale (per axis) is steered towards the target frame time, moving only
+ * part of the way each frame and not at all while the frame time is
+ * within a band around the target, so that it settles instead of
+ * oscillating with noise.
+ *
+ * The offscreen framebuffer is allocated at full target size and the scene
+ * is drawn into its bottom left corner, so a change of scale never
+ * reallocates anything. The upscale is either plain bilinear or bilinear
+ * followed by a clamped unsharp mask, which brings back some of the detail
+ * lost to the lower resolution.
+ *
+ * Must be created and destroyed with the OpenGL context current.
+ */
+class ResolutionScaler : public QOpenGLFunctions
+{
+public:
+    ResolutionScaler();
+    ~ResolutionScaler();
+
+    enum Filter { Bilinear, Sharpen };
+    enum { FramesInFlight = 3 };
+
+    // GPU time, in milliseconds, that a frame should take. 60 fps by default.
+    void setTargetFrameTime(qreal val) { m_targetFrameTime = qMax(val, qreal(0.1)); }
+    qreal targetFrameTime() const { return m_targetFrameTime; }
+
+    // Lowest scale per axis; 0.5 renders a quarter of the pixels
+    void setMinimumScale(qreal val);
+    qreal minimumScale() const { return m_minimumScale; }
+
+    void setFilter(Filter val) { m_filter = val; }
+    Filter filter() const { return m_filter; }
+
+    qreal scale() const { return m_scale; }
+
+    // Smoothed GPU frame time in milliseconds, 0 until measured. Stays 0
+    // if timer queries are not supported, and then the scale stays put.
+    qreal frameTime() const { return m_frameTime; }
+
+    // Size the scene is rendered at, for a target of the given size
+    QSize renderSize(const QSize &targetSize) const;
+
+    // Depth (and stencil) format of framebuffer(), GL_DEPTH24_STENCIL8 by
+    // default. A change reallocates the framebuffer on the next beginFrame().
+    void setDepthFormat(uint val);
+    uint depthFormat() const { return m_depthFormat; }
+
+    // Between beginFrame() and endFrame() the scene goes into framebuffer(),
+    // at frameSize(). endFrame() upscales it into the target framebuffer.
+    // Unscaled frames are at full size, for when the scene needs a depth
+    // format the target does not have; the scale is left as it was, and
+    // they are not timed, so they can run inside a timer query of the
+    // caller's.
+    void beginFrame(const QSize &targetSize, bool scaled=true);
+    void endFrame(uint targetFramebuffer);
+    bool isInFrame() const { return m_inFrame; }
+    uint framebuffer() const { return m_fbo; }
+    QSize frameSize() const { return m_renderSize; }
+
+private:
+    void initialize();
+    void resizeTarget(const QSize &size);
+    void releaseTarget();
+    void collectFrameTime(int slot);
+    void updateScale();
+    void upscale(uint targetFramebuffer);
+
+private:
+    QSize m_targetSize;
+    QSize m_renderSize;
+    uint m_fbo;
+    uint m_colorTex;
+    uint m_depthRenderbuffer;
+    uint m_depthFormat;
+
+    QOpenGLShaderProgram *m_programs[2]; // per Filter
+    QOpenGLBuffer *m_quad;
+    QOpenGLTimerQuery *m_timers[FramesInFlight];
+    bool m_timerPending[FramesInFlight];
+    int m_frameSlot;
+
+    qreal m_targetFrameTime;
+    qreal m_minimumScale;
+    qreal m_scale;
+    qreal m_frameTime;
+    Filter m_filter;
+    bool m_timersAvailable;
+    bool m_initialized;
+    bool m_inFrame;
+    bool m_timedFrame;
+};
+
+#endif // RESOLUTION_SCALER_H
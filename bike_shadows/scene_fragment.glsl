@@ -1,3 +1,13 @@
+// Permutations are selected by SceneRenderer through these defines
+//   SHADOWS                 sample qt_ShadowMap with a PCF_RANGE (0, 1 or 2) kernel
+//   CLUSTERED_LIGHTS        add point and spot lights, up to MAX_LIGHTS_PER_CLUSTER
+//   SPECULAR                evaluate specular highlights
+//   TEMPORAL_SHADOWS        (with SHADOWS) take TEMPORAL_TAPS rotated taps and blend
+//                           with the reprojected qt_ShadowHistory; see TemporalShadows
+//   WEIGHTED_OIT            write weighted color and revealage for TransparencyBuffer
+//   INDIRECT_DRAWS          take the material from the vertex shader, per draw, as
+//                           IndirectRenderer draws many parts at once
+
 struct directional_light
 {
     vec3 direction;
@@ -17,21 +27,58 @@ struct material_properties
     float brightness;
 };
 
+struct cluster_grid
+{
+    vec3 size;          // number of clusters along x, y and z
+    vec2 viewportSize;
+    float zNear;
+    float sliceScale;   // size.z / log(zFar/zNear)
+    float maxLights;    // rows in qt_LightData
+    float indexTextureWidth;
+    float indexTextureHeight;
+};
+
 uniform directional_light qt_Light;
+
+#ifdef INDIRECT_DRAWS
+varying vec4 v_MaterialAmbient;
+varying vec4 v_MaterialDiffuse;
+varying vec4 v_MaterialSpecular;
+varying vec3 v_MaterialParameters;      // specular power, opacity, brightness
+material_properties qt_Material;
+#else
 uniform material_properties qt_Material;
+#endif
+
+#ifdef SHADOWS
 uniform sampler2D qt_ShadowMap;
-uniform bool qt_ShadowEnabled;
+uniform float qt_ShadowMapSize;
+uniform vec2 qt_ShadowDepthRange;       // near and far planes of the light's projection
+#endif
+
+#ifdef TEMPORAL_SHADOWS
+uniform sampler2D qt_ShadowHistory;     // shadow term in r, view depth in g
+uniform mat4 qt_ReprojectionMatrix;     // world to the previous frame's clip space
+uniform vec2 qt_HistoryScale;           // part of qt_ShadowHistory written last frame
+uniform float qt_HistoryWeight;         // zero when there is no usable history
+uniform float qt_TapRotation;
+#endif
+
+#ifdef CLUSTERED_LIGHTS
+uniform cluster_grid qt_Clusters;
+uniform sampler2D qt_LightData;
+uniform sampler2D qt_ClusterGrid;
+uniform sampler2D qt_LightIndexes;
+#endif
 
 varying vec4 v_Normal;
 varying vec4 v_ShadowPosition;
+varying vec3 v_WorldPosition;
+varying float v_ViewDepth;
 
-const float c_zNear = 0.1;
-const float c_ZFar = 1000.0;
 const float c_zero = 0.0;
 const float c_one = 1.0;
 const float c_half = 0.5;
-const float textureSize = 2048.0;
-const vec2 texelSize = 1.0 / vec2(textureSize,textureSize);
 
 vec4 evaluateLightMaterialColor(in vec4 normal)
 {
@@ -52,9 +99,8 @@ vec4 evaluateLightMaterialColor(in vec4 normal)
                       qt_Material.brightness;
     }
 
+#ifdef SPECULAR
     // Add specular component to it
-    const vec3 blackColor = vec3(c_zero, c_zero, c_zero);
-    if( !(qt_Material.specular.rgb == blackColor || qt_Light.specular.rgb == blackColor || qt_Material.specularPower == c_zero) )
     {
         vec4 viewDir = vec4( normalize(qt_Light.eye), 0.0 );
         vec4 reflectionVec = reflect(lightDir, normal);
@@ -67,16 +113,92 @@ vec4 evaluateLightMaterialColor(in vec4 normal)
                           specularFactor;
         }
     }
+#endif
 
     // All done!
     return vec4( finalColor, qt_Material.opacity );
 }
 
+#ifdef CLUSTERED_LIGHTS
+vec3 evaluateClusteredLights(in vec4 normal)
+{
+    vec3 finalColor = vec3(c_zero, c_zero, c_zero);
+
+    // Find the cluster this fragment falls in
+    vec2 tile = floor( gl_FragCoord.xy / qt_Clusters.viewportSize * qt_Clusters.size.xy );
+    tile = clamp( tile, vec2(c_zero, c_zero), qt_Clusters.size.xy - vec2(c_one, c_one) );
+    float slice = floor( log(max(v_ViewDepth, qt_Clusters.zNear) / qt_Clusters.zNear) * qt_Clusters.sliceScale );
+    slice = clamp( slice, c_zero, qt_Clusters.size.z - c_one );
+
+    vec2 gridCoords = vec2( tile.y*qt_Clusters.size.x + tile.x + c_half, slice + c_half ) /
+                      vec2( qt_Clusters.size.x*qt_Clusters.size.y, qt_Clusters.size.z );
+    vec2 cluster = texture2D(qt_ClusterGrid, gridCoords).rg;
+    int offset = int(cluster.x);
+    int count = int(cluster.y);
+
+    vec3 n = normal.xyz;
+#ifdef SPECULAR
+    vec3 viewDir = normalize(qt_Light.eye - v_WorldPosition);
+#endif
+
+    for(int i=0; i<MAX_LIGHTS_PER_CLUSTER; i++)
+    {
+        if(i >= count)
+            break;
+
+        float index = float(offset + i);
+        vec2 indexCoords = vec2( mod(index, qt_Clusters.indexTextureWidth) + c_half,
+                                 floor(index / qt_Clusters.indexTextureWidth) + c_half ) /
+                           vec2( qt_Clusters.indexTextureWidth, qt_Clusters.indexTextureHeight );
+        float lightIndex = texture2D(qt_LightIndexes, indexCoords).r;
+
+        float row = (lightIndex + c_half) / qt_Clusters.maxLights;
+        vec4 positionType = texture2D(qt_LightData, vec2(0.125, row));
+        vec4 directionRange = texture2D(qt_LightData, vec2(0.375, row));
+        vec4 colorCutoff = texture2D(qt_LightData, vec2(0.625, row));
+        vec4 innerCutoff = texture2D(qt_LightData, vec2(0.875, row));
+
+        vec3 lightVec = positionType.xyz - v_WorldPosition;
+        float dist = length(lightVec);
+        if(dist >= directionRange.w)
+            continue;
+
+        vec3 lightDir = lightVec / dist;
+        float diffuseFactor = max( c_zero, dot(lightDir, n) );
+        if(diffuseFactor <= c_zero)
+            continue;
+
+        // Smooth windowed inverse-square falloff, reaching zero at range
+        float ratio = dist / directionRange.w;
+        float window = clamp(c_one - ratio*ratio*ratio*ratio, c_zero, c_one);
+        float attenuation = (window*window) / (c_one + dist*dist);
+
+        if(positionType.w > c_half)
+        {
+            float spotCos = dot(-lightDir, normalize(directionRange.xyz));
+            attenuation *= smoothstep(colorCutoff.w, innerCutoff.x, spotCos);
+        }
+
+        finalColor += colorCutoff.rgb * qt_Material.diffuse.rgb * diffuseFactor * attenuation;
+
+#ifdef SPECULAR
+        vec3 halfVec = normalize(lightDir + viewDir);
+        float specularFactor = pow( max(c_zero, dot(halfVec, n)), qt_Material.specularPower );
+        finalColor += colorCutoff.rgb * qt_Material.specular.rgb * specularFactor * attenuation;
+#endif
+    }
+
+    return finalColor;
+}
+#endif
 
+#ifdef SHADOWS
 float linearizeDepth(float depth)
 {
+    float zNear = qt_ShadowDepthRange.x;
+    float zFar = qt_ShadowDepthRange.y;
     float z = depth * 2.0 - 1.0; // Back to NDC
-    return (2.0 * c_zNear * c_ZFar) / (c_ZFar + c_zNear - z * (c_ZFar - c_zNear));
+    return (2.0 * zNear * zFar) / (zFar + zNear - z * (zFar - zNear));
 }
 
 float evaluateShadow(in vec4 shadowPos)
@@ -88,8 +210,9 @@ float evaluateShadow(in vec4 shadowPos)
 
     float currentDepth = shadowPos.z;
 
+    vec2 texelSize = vec2(c_one, c_one) / qt_ShadowMapSize;
     float shadow = c_zero;
-    const int sampleRange = 2;
+    const int sampleRange = PCF_RANGE;
     const float nrSamples = (2.0*float(sampleRange) + 1.0)*(2.0*float(sampleRange) + 1.0);
     for(int x=-sampleRange; x<=sampleRange; x++)
     {
@@ -106,15 +229,95 @@ float evaluateShadow(in vec4 shadowPos)
     return shadow;
 }
 
-void main(void)
+#ifdef TEMPORAL_SHADOWS
+// Relative difference in view depth beyond which history is taken to be
+// of another surface
+const float c_historyDepthTolerance = 0.02;
+
+float evaluateTemporalShadow(in vec4 shadowPos)
 {
-    vec4 lmColor = evaluateLightMaterialColor(v_Normal);
-    if(qt_ShadowEnabled == true)
+    vec3 shadowCoords = shadowPos.xyz / shadowPos.w;
+    shadowCoords = shadowCoords * c_half + c_half;
+    if(shadowCoords.z > c_one)
+        return c_one;
+
+    float currentDepth = shadowPos.z;
+
+    // A few taps on a disk as wide as the full kernel. The disk turns from
+    // frame to frame, and from pixel to pixel by interleaved gradient noise,
+    // so that accumulated frames cover it evenly.
+    float noise = fract(52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715))));
+    float rotation = qt_TapRotation + 6.2831853 * noise;
+    float radius = float(PCF_RANGE) + c_half;
+
+    vec2 texelSize = vec2(c_one, c_one) / qt_ShadowMapSize;
+    float shadow = c_zero;
+    for(int i=0; i<TEMPORAL_TAPS; i++)
     {
-        float shadow = evaluateShadow(v_ShadowPosition);
-        gl_FragColor = vec4(lmColor.xyz * shadow, qt_Material.opacity);
+        float r = radius * sqrt( (float(i) + c_half) / float(TEMPORAL_TAPS) );
+        float theta = float(i) * 2.39996323 + rotation;
+        vec2 pcfCoords = shadowCoords.xy + r * vec2(cos(theta), sin(theta)) * texelSize;
+        float pcfDepth = linearizeDepth( texture2D(qt_ShadowMap, pcfCoords).r );
+        shadow += (currentDepth < pcfDepth) ? c_one : c_half;
     }
-    else
-        gl_FragColor = lmColor;
+
+    shadow /= float(TEMPORAL_TAPS);
+
+    // Blend with what this point looked like last frame, unless that was
+    // off screen or another surface
+    vec4 previous = qt_ReprojectionMatrix * vec4(v_WorldPosition, c_one);
+    vec2 historyCoords = previous.xy / previous.w * c_half + c_half;
+    vec2 history = texture2D(qt_ShadowHistory, historyCoords * qt_HistoryScale).rg;
+
+    float weight = qt_HistoryWeight;
+    if(previous.w <= c_zero ||
+       historyCoords.x < c_zero || historyCoords.y < c_zero ||
+       historyCoords.x > c_one || historyCoords.y > c_one ||
+       abs(history.g - previous.w) > c_historyDepthTolerance * previous.w)
+        weight = c_zero;
+
+    return mix(shadow, history.r, weight);
+}
+#endif
+#endif
+
+void main(void)
+{
+#ifdef INDIRECT_DRAWS
+    qt_Material = material_properties(v_MaterialAmbient, v_MaterialDiffuse, v_MaterialSpecular,
+                                      v_MaterialParameters.x, v_MaterialParameters.y,
+                                      v_MaterialParameters.z);
+#endif
+
+    vec4 lmColor = evaluateLightMaterialColor(v_Normal);
+#ifdef TEMPORAL_SHADOWS
+    float shadow = evaluateTemporalShadow(v_ShadowPosition);
+    lmColor = vec4(lmColor.xyz * shadow, qt_Material.opacity);
+#elif defined(SHADOWS)
+    float shadow = evaluateShadow(v_ShadowPosition);
+    lmColor = vec4(lmColor.xyz * shadow, qt_Material.opacity);
+#endif
+
+    // Point and spot lights don't cast shadows
+#ifdef CLUSTERED_LIGHTS
+    lmColor.rgb += evaluateClusteredLights(v_Normal);
+#endif
+
+#ifdef WEIGHTED_OIT
+    // Nearer surfaces weigh more, so that they dominate the average
+    // (McGuire and Bavoil, equation 9). Alpha multiplies out of the
+    // accumulation target into the revealage.
+    float alpha = lmColor.a;
+    float weight = alpha * clamp( 10.0 / (1e-5 + pow(v_ViewDepth/5.0, 2.0) + pow(v_ViewDepth/200.0, 6.0)),
+                                  1e-2, 3e3 );
+    gl_FragData[0] = vec4(lmColor.rgb * alpha * weight, alpha);
+    gl_FragData[1] = vec4(alpha * weight, c_zero, c_zero, c_zero);
+#elif defined(TEMPORAL_SHADOWS)
+    // The blended term is next frame's history
+    gl_FragData[0] = lmColor;
+    gl_FragData[1] = vec4(shadow, v_ViewDepth, c_zero, c_one);
+#else
+    gl_FragColor = lmColor;
+#endif
 }
 
@@ -0,0 +1,62 @@
+#version 430
+
+// Vertex shader of the scene permutations drawn by IndirectRenderer. The
+// instance and material of a draw come from its draw record, instead of
+// from uniforms set per model and per part.
+
+struct instance_record
+{
+    mat4 world;
+    vec4 normal[3];     // columns of the 3x3 normal matrix
+    uvec4 info;         // x: mesh record, y: SceneStore flags
+};
+
+struct material_record
+{
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+    vec4 parameters;    // specular power, opacity, brightness
+};
+
+layout(std430, binding = 0) readonly buffer Instances { instance_record instances[]; };
+layout(std430, binding = 6) readonly buffer Materials { material_record materials[]; };
+
+layout(location = 0) in vec3 qt_Vertex;
+layout(location = 1) in vec3 qt_Normal;
+layout(location = 2) in ivec2 qt_DrawRecord;   // instance and material, one per draw
+
+uniform mat4 qt_ViewMatrix;
+uniform mat4 qt_ProjectionMatrix;
+uniform mat4 qt_LightViewProjectionMatrix;      // from world space, unlike the other path
+
+out vec4 v_Normal;
+out vec4 v_ShadowPosition;
+out vec3 v_WorldPosition;
+out float v_ViewDepth;
+out vec4 v_MaterialAmbient;
+out vec4 v_MaterialDiffuse;
+out vec4 v_MaterialSpecular;
+out vec3 v_MaterialParameters;
+
+void main(void)
+{
+    instance_record instance = instances[qt_DrawRecord.x];
+    material_record material = materials[qt_DrawRecord.y];
+
+    mat3 normalMatrix = mat3(instance.normal[0].xyz, instance.normal[1].xyz, instance.normal[2].xyz);
+    vec4 worldPosition = instance.world * vec4(qt_Vertex, 1.0);
+    vec4 viewPosition = qt_ViewMatrix * worldPosition;
+
+    v_Normal = vec4(normalize(normalMatrix * qt_Normal), 0.0);
+    v_ShadowPosition = qt_LightViewProjectionMatrix * worldPosition;
+    v_WorldPosition = worldPosition.xyz;
+    v_ViewDepth = -viewPosition.z;
+
+    v_MaterialAmbient = material.ambient;
+    v_MaterialDiffuse = material.diffuse;
+    v_MaterialSpecular = material.specular;
+    v_MaterialParameters = material.parameters.xyz;
+
+    gl_Position = qt_ProjectionMatrix * viewPosition;
+}
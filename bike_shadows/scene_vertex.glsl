@@ -1,18 +1,23 @@
 attribute vec4 qt_Vertex;
 attribute vec4 qt_Normal;
 
-uniform mat4 qt_NormalMatrix;
+uniform mat4 qt_ModelMatrix;
+uniform mat4 qt_ModelViewMatrix;
+uniform mat3 qt_NormalMatrix;
 uniform mat4 qt_LightViewProjectionMatrix;
 uniform mat4 qt_ModelViewProjectionMatrix;
 
 varying vec4 v_Normal;
 varying vec4 v_ShadowPosition;
+varying vec3 v_WorldPosition;
+varying float v_ViewDepth;
 
 void main(void)
 {
-    v_Normal = normalize(qt_NormalMatrix * qt_Normal);
+    v_Normal = vec4(normalize(qt_NormalMatrix * qt_Normal.xyz), 0.0);
     v_ShadowPosition = qt_LightViewProjectionMatrix * vec4(qt_Vertex.xyz, 1.0);
+    v_WorldPosition = (qt_ModelMatrix * vec4(qt_Vertex.xyz, 1.0)).xyz;
+    v_ViewDepth = -(qt_ModelViewMatrix * vec4(qt_Vertex.xyz, 1.0)).z;
 
     gl_Position = qt_ModelViewProjectionMatrix * qt_Vertex;
 }
-
@@ -0,0 +1,387 @@
+#include "sceneloader.h"
+#include "renderpipeline.h"
+#include "lightmanager.h"
+#include "objmodel.h"
+
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QElapsedTimer>
+#include <QWaitCondition>
+
+class MeshParser : public QThread
+{
+public:
+    // Work shared by all parsers of one load. Files are handed out in
+    // order; parsed ones are listed in done until the render thread takes
+    // them for upload.
+    struct Queue
+    {
+        Queue() : next(0), meshStreamer(nullptr) { }
+        QMutex mutex;
+        QWaitCondition parsed;
+        QStringList fileNames;
+        QVector<ObjModel*> models;
+        QVector<int> done;
+        int next;
+        MeshStreamer *meshStreamer;
+    };
+
+    MeshParser(Queue *queue) : m_queue(queue) { }
+    ~MeshParser() {
+        this->wait();
+    }
+
+protected:
+    void run();
+
+private:
+    Queue *m_queue;
+};
+
+void MeshParser::run()
+{
+    while(1)
+    {
+        m_queue->mutex.lock();
+        const int index = m_queue->next < m_queue->fileNames.size() ? m_queue->next++ : -1;
+        const QString fileName = index >= 0 ? m_queue->fileNames.at(index) : QString();
+        m_queue->mutex.unlock();
+        if(index < 0)
+            break;
+
+        // Parsing, LODs and clusters are the bulk of the work, and need
+        // neither the context nor the lock
+        ObjModel *model = new ObjModel(fileName, m_queue->meshStreamer, false);
+
+        m_queue->mutex.lock();
+        m_queue->models[index] = model;
+        m_queue->done.append(index);
+        m_queue->parsed.wakeAll();
+        m_queue->mutex.unlock();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static QVector3D ReadVector(const QJsonValue &value, const QVector3D &defaultValue)
+{
+    const QJsonArray array = value.toArray();
+    if(array.size() != 3)
+        return defaultValue;
+
+    return QVector3D( float(array.at(0).toDouble()), float(array.at(1).toDouble()),
+                      float(array.at(2).toDouble()) );
+}
+
+// "#rrggbb" or any other name QColor knows, or [r, g, b] in 0..1
+static QColor ReadColor(const QJsonValue &value, const QColor &defaultValue)
+{
+    if(value.isString())
+    {
+        const QColor color(value.toString());
+        return color.isValid() ? color : defaultValue;
+    }
+
+    const QJsonArray array = value.toArray();
+    if(array.size() != 3)
+        return defaultValue;
+
+    return QColor::fromRgbF( qBound(0.0, array.at(0).toDouble(), 1.0),
+                             qBound(0.0, array.at(1).toDouble(), 1.0),
+                             qBound(0.0, array.at(2).toDouble(), 1.0) );
+}
+
+static QMatrix4x4 ReadTransform(const QJsonObject &object)
+{
+    QMatrix4x4 ret;
+    ret.translate( ReadVector(object.value("translate"), QVector3D(0,0,0)) );
+
+    const QJsonArray rotate = object.value("rotate").toArray();
+    if(rotate.size() == 4)
+        ret.rotate( float(rotate.at(0).toDouble()), float(rotate.at(1).toDouble()),
+                    float(rotate.at(2).toDouble()), float(rotate.at(3).toDouble()) );
+
+    const QJsonValue scale = object.value("scale");
+    if(scale.isDouble())
+        ret.scale( float(scale.toDouble()) );
+    else if(scale.isArray())
+        ret.scale( ReadVector(scale, QVector3D(1,1,1)) );
+
+    return ret;
+}
+
+SceneLoader::SceneLoader(RenderPipeline *pipeline)
+    : m_pipeline(pipeline)
+{
+}
+
+SceneLoader::~SceneLoader()
+{
+}
+
+bool SceneLoader::load(const QString &fileName)
+{
+    QElapsedTimer timer;
+    timer.start();
+    m_stats = Statistics();
+
+    QFile file(fileName);
+    if(!file.open(QFile::ReadOnly))
+    {
+        qWarning("Could not read scene %s", qPrintable(fileName));
+        return false;
+    }
+
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+    if(!document.isObject())
+    {
+        qWarning("%s is not a scene: %s", qPrintable(fileName), qPrintable(error.errorString()));
+        return false;
+    }
+
+    const QJsonObject scene = document.object();
+    const QDir directory = QFileInfo(fileName).absoluteDir();
+
+    // Assets, and the distinct meshes they refer to. A file split into
+    // different wheels by two assets is parsed once for each, as splitting
+    // takes the parts out of the model.
+    struct Mesh
+    {
+        QString fileName;
+        QStringList wheels;
+        int mesh;
+        QVector<int> wheelMeshes;
+    };
+    QVector<Mesh> meshes;
+    QHash<QString,int> assets;
+
+    const QJsonObject assetsJson = scene.value("assets").toObject();
+    for(QJsonObject::const_iterator it = assetsJson.constBegin(); it != assetsJson.constEnd(); ++it)
+    {
+        const QJsonObject object = it.value().toObject();
+        QString path = it.value().isString() ? it.value().toString() : object.value("mesh").toString();
+        if(path.isEmpty())
+        {
+            qWarning("Asset %s has no mesh", qPrintable(it.key()));
+            continue;
+        }
+        if(!path.startsWith(":/") && QDir::isRelativePath(path))
+            path = directory.absoluteFilePath(path);
+        path = QDir::cleanPath(path);
+
+        Mesh mesh;
+        mesh.fileName = path;
+        mesh.mesh = -1;
+        Q_FOREACH(const QJsonValue &wheel, object.value("wheels").toArray())
+            mesh.wheels << wheel.toString();
+
+        int index = -1;
+        for(int i=0; i<meshes.size() && index < 0; i++)
+        {
+            if(meshes.at(i).fileName == mesh.fileName && meshes.at(i).wheels == mesh.wheels)
+                index = i;
+        }
+        if(index < 0)
+        {
+            meshes.append(mesh);
+            index = meshes.size()-1;
+        }
+
+        assets.insert(it.key(), index);
+    }
+
+    m_stats.assetCount = assets.size();
+    m_stats.meshFileCount = meshes.size();
+
+    // All distinct meshes are parsed at once, on as many threads as there
+    // are cores (or meshes). Meanwhile this thread uploads whatever has
+    // been parsed since the last batch.
+    MeshParser::Queue queue;
+    Q_FOREACH(const Mesh &mesh, meshes)
+        queue.fileNames << mesh.fileName;
+    queue.models.fill(nullptr, meshes.size());
+    if(m_pipeline->isMeshStreamingEnabled())
+        queue.meshStreamer = m_pipeline->meshStreamer();
+
+    QList<MeshParser*> parsers;
+    m_stats.parseThreadCount = meshes.isEmpty() ? 0 : qBound(1, QThread::idealThreadCount(), meshes.size());
+    for(int i=0; i<m_stats.parseThreadCount; i++)
+    {
+        MeshParser *parser = new MeshParser(&queue);
+        parser->start();
+        parsers << parser;
+    }
+
+    int uploadedCount = 0;
+    QVector<int> batch;
+    while(uploadedCount < meshes.size())
+    {
+        queue.mutex.lock();
+        while(queue.done.isEmpty())
+            queue.parsed.wait(&queue.mutex);
+        batch.clear();
+        batch.swap(queue.done);
+        queue.mutex.unlock();
+
+        if(uploadedCount + batch.size() == meshes.size())
+            m_stats.parseTime = timer.elapsed();
+
+        QElapsedTimer uploadTimer;
+        uploadTimer.start();
+        Q_FOREACH(int index, batch)
+        {
+            ObjModel *model = queue.models.at(index);
+            m_stats.uploadedBytes += model->pendingUploadSize();
+            model->upload();
+        }
+        m_stats.uploadTime += uploadTimer.elapsed();
+        ++m_stats.uploadBatchCount;
+        uploadedCount += batch.size();
+    }
+
+    qDeleteAll(parsers);
+
+    // Wheels are split off once the buffers they share exist
+    for(int i=0; i<meshes.size(); i++)
+    {
+        Mesh &mesh = meshes[i];
+        ObjModel *model = queue.models.at(i);
+        if(model->partNames().isEmpty())
+        {
+            qWarning("Could not load a mesh from %s", qPrintable(mesh.fileName));
+            delete model;
+            continue;
+        }
+
+        QList<ObjModel*> wheels;
+        Q_FOREACH(const QString &wheel, mesh.wheels)
+        {
+            ObjModel *wheelModel = model->takeParts(QStringList() << wheel);
+            if(wheelModel)
+                wheels << wheelModel;
+            else
+                qWarning("%s has no part named %s", qPrintable(mesh.fileName), qPrintable(wheel));
+        }
+
+        mesh.mesh = m_pipeline->addMesh(model);
+        Q_FOREACH(ObjModel *wheelModel, wheels)
+            mesh.wheelMeshes << m_pipeline->addMesh(wheelModel);
+    }
+
+    // Instances
+    SceneStore *store = m_pipeline->scene();
+    Q_FOREACH(const QJsonValue &value, scene.value("instances").toArray())
+    {
+        const QJsonObject object = value.toObject();
+        const QString assetName = object.value("asset").toString();
+        const int meshIndex = assets.value(assetName, -1);
+        if(meshIndex < 0 || meshes.at(meshIndex).mesh < 0)
+        {
+            qWarning("Instance of unknown asset %s", qPrintable(assetName));
+            continue;
+        }
+        const Mesh &mesh = meshes.at(meshIndex);
+
+        int flags = 0;
+        if(object.value("visible").toBool(true))
+            flags |= SceneStore::Visible;
+        if(object.value("castsShadow").toBool(true))
+            flags |= SceneStore::CastsShadow;
+        if(object.value("contributesToBounds").toBool(true))
+            flags |= SceneStore::ContributesToBounds;
+
+        const QMatrix4x4 matrix = ReadTransform(object);
+        const QJsonObject grid = object.value("grid").toObject();
+        const QVector3D count = ReadVector(grid.value("count"), QVector3D(1,1,1));
+        const QVector3D spacing = ReadVector(grid.value("spacing"), QVector3D(0,0,0));
+        for(int z=0; z<qMax(1, int(count.z())); z++)
+        {
+            for(int y=0; y<qMax(1, int(count.y())); y++)
+            {
+                for(int x=0; x<qMax(1, int(count.x())); x++)
+                {
+                    QMatrix4x4 instanceMatrix;
+                    instanceMatrix.translate( QVector3D(float(x), float(y), float(z)) * spacing );
+                    instanceMatrix *= matrix;
+
+                    const SceneHandle handle = store->createInstance(mesh.mesh, instanceMatrix, flags);
+                    Q_FOREACH(int wheelMesh, mesh.wheelMeshes)
+                        m_pipeline->addWheel(wheelMesh, handle);
+                    ++m_stats.instanceCount;
+                }
+            }
+        }
+    }
+
+    // Lights
+    LightManager *lightManager = m_pipeline->lightManager();
+    const QJsonObject keyLight = scene.value("keyLight").toObject();
+    lightManager->setAmbientColor( ReadColor(keyLight.value("ambient"), lightManager->ambientColor()) );
+    lightManager->setDiffuseColor( ReadColor(keyLight.value("diffuse"), lightManager->diffuseColor()) );
+    lightManager->setSpecularColor( ReadColor(keyLight.value("specular"), lightManager->specularColor()) );
+
+    Q_FOREACH(const QJsonValue &value, scene.value("lights").toArray())
+    {
+        const QJsonObject object = value.toObject();
+
+        Light light;
+        light.type = object.value("type").toString() == "spot" ? Light::SpotLight : Light::PointLight;
+        light.position = ReadVector(object.value("position"), light.position);
+        light.direction = ReadVector(object.value("direction"), light.direction);
+        light.color = ReadColor(object.value("color"), light.color);
+        light.intensity = float(object.value("intensity").toDouble(double(light.intensity)));
+        light.range = float(object.value("range").toDouble(double(light.range)));
+        light.innerAngle = float(object.value("innerAngle").toDouble(double(light.innerAngle)));
+        light.outerAngle = float(object.value("outerAngle").toDouble(double(light.outerAngle)));
+        if(lightManager->addLight(light) >= 0)
+            ++m_stats.lightCount;
+    }
+
+    // Shadow settings, where given
+    const QJsonObject shadows = scene.value("shadows").toObject();
+    if(shadows.contains("enabled"))
+        m_pipeline->setShadowsEnabled( shadows.value("enabled").toBool() );
+    if(shadows.contains("size"))
+        m_pipeline->setShadowMapSize( shadows.value("size").toInt() );
+    if(shadows.contains("filterRange"))
+        m_pipeline->setShadowFilterRange( shadows.value("filterRange").toInt() );
+    if(shadows.contains("temporal"))
+        m_pipeline->setTemporalShadowsEnabled( shadows.value("temporal").toBool() );
+    if(shadows.contains("format"))
+    {
+        const QString format = shadows.value("format").toString().toUpper();
+        for(int i=RenderPipeline::Depth16; i<=RenderPipeline::Depth32F; i++)
+        {
+            if(RenderPipeline::shadowMapFormatName(RenderPipeline::ShadowMapFormat(i)) == format)
+                m_pipeline->setShadowMapFormat( RenderPipeline::ShadowMapFormat(i) );
+        }
+    }
+
+    // The camera and light follow the scene bounds
+    m_pipeline->updateMatricesForScreenRendering();
+
+    m_stats.totalTime = timer.elapsed();
+    return true;
+}
+
+QJsonObject SceneLoader::statisticsJson() const
+{
+    QJsonObject ret;
+    ret.insert("assets", m_stats.assetCount);
+    ret.insert("meshFiles", m_stats.meshFileCount);
+    ret.insert("instances", m_stats.instanceCount);
+    ret.insert("lights", m_stats.lightCount);
+    ret.insert("parseThreads", m_stats.parseThreadCount);
+    ret.insert("uploadBatches", m_stats.uploadBatchCount);
+    ret.insert("uploadedBytes", double(m_stats.uploadedBytes));
+    ret.insert("parseTime", double(m_stats.parseTime));
+    ret.insert("uploadTime", double(m_stats.uploadTime));
+    ret.insert("totalTime", double(m_stats.totalTime));
+    return ret;
+}
@@ -0,0 +1,80 @@
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include <QJsonObject>
+#include <QString>
+
+class RenderPipeline;
+
+/*
+ * Loads a scene description (JSON) into a RenderPipeline: the assets
+ * (meshes), instances of them, lights and shadow settings.
+ *
+ *  {
+ *    "assets": {
+ *      "bike": { "mesh": ":/bike.obj", "wheels": [ "ducw", "ducw01" ] },
+ *      "platform": ":/platform.obj"
+ *    },
+ *    "instances": [
+ *      { "asset": "bike", "translate": [-2, 0, 0], "rotate": [20, 0, 1, 0] },
+ *      { "asset": "bike", "translate": [-20, 0, -20], "rotate": [-20, 0, 1, 0],
+ *        "grid": { "count": [10, 1, 10], "spacing": [4, 0, 4] } },
+ *      { "asset": "platform", "castsShadow": false, "contributesToBounds": false }
+ *    ],
+ *    "keyLight": { "ambient": "#333333", "diffuse": "#ffffff", "specular": "#ffffff" },
+ *    "lights": [
+ *      { "type": "spot", "position": [0, 4, 0], "direction": [0, -1, 0], "color": "#ffffff",
+ *        "intensity": 12, "range": 8, "innerAngle": 15, "outerAngle": 25 }
+ *    ],
+ *    "shadows": { "enabled": true, "size": 2048, "format": "DEPTH24",
+ *                 "filterRange": 2, "temporal": false }
+ *  }
+ *
+ * Mesh paths are relative to the scene file, unless absolute or resources.
+ * Instance transforms are translate, then rotate (angle in degrees and an
+ * axis), then scale (one factor or three); a grid repeats the instance
+ * count times along each axis, spacing apart. The parts of an asset named
+ * in wheels become child instances that spin when animated.
+ *
+ * Loading costs in proportion to the distinct meshes, not the instances.
+ * Assets are de-duplicated by path, the distinct files are parsed on as
+ * many threads as there are cores, and the render thread uploads parsed
+ * meshes in batches, whatever has come in since the last batch, while the
+ * rest are still being parsed.
+ */
+class SceneLoader
+{
+public:
+    SceneLoader(RenderPipeline *pipeline);
+    ~SceneLoader();
+
+    // Must be called with the pipeline's OpenGL context current. Returns
+    // false, having added nothing, if the file cannot be read or is not a
+    // scene.
+    bool load(const QString &fileName);
+
+    struct Statistics
+    {
+        Statistics() : assetCount(0), meshFileCount(0), instanceCount(0),
+            lightCount(0), parseThreadCount(0), uploadBatchCount(0),
+            uploadedBytes(0), parseTime(0), uploadTime(0), totalTime(0) { }
+        int assetCount;
+        int meshFileCount;      // distinct mesh files, each parsed once
+        int instanceCount;      // top level instances, wheels not counted
+        int lightCount;
+        int parseThreadCount;
+        int uploadBatchCount;
+        qint64 uploadedBytes;
+        qint64 parseTime;       // until the last mesh was parsed, in ms
+        qint64 uploadTime;      // spent on the render thread uploading, in ms
+        qint64 totalTime;       // in ms
+    };
+    Statistics statistics() const { return m_stats; }
+    QJsonObject statisticsJson() const;
+
+private:
+    RenderPipeline *m_pipeline;
+    Statistics m_stats;
+};
+
+#endif // SCENE_LOADER_H
@@ -0,0 +1,157 @@
+#include "sceneshading.h"
+#include "frameprofiler.h"
+#include "lightmanager.h"
+#include "temporalshadows.h"
+#include "transparencybuffer.h"
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLShaderProgram>
+
+// Texture units, as set on the samplers in setUniforms()
+enum { ShadowMapUnit, LightDataUnit, ClusterGridUnit, LightIndexUnit };
+
+SceneShading::SceneShading()
+    : lights(nullptr), temporalShadows(nullptr), transparencyBuffer(nullptr),
+      shadowTextureId(0), shadowMapSize(2048), shadowFilterRange(2),
+      shadowDepthRange(0.1f, 1000.0f), transparentParts(false)
+{
+
+}
+
+QStringList SceneShading::defines(int variant)
+{
+    QStringList ret;
+    if(variant & ShadowVariant)
+        ret << "SHADOWS" << QString("PCF_RANGE %1").arg((variant >> PcfRangeShift) & 3);
+    if(variant & TemporalShadowVariant)
+        ret << "TEMPORAL_SHADOWS" << QString("TEMPORAL_TAPS %1").arg(TemporalShadows::tapCount((variant >> PcfRangeShift) & 3));
+    if(variant & ClusteredLightsVariant)
+        ret << "CLUSTERED_LIGHTS" << QString("MAX_LIGHTS_PER_CLUSTER %1").arg(int(LightManager::MaxLightsPerCluster));
+    if(variant & SpecularVariant)
+        ret << "SPECULAR";
+    if(variant & WeightedOitVariant)
+        ret << "WEIGHTED_OIT";
+    return ret;
+}
+
+QColor SceneShading::lightSpecular() const
+{
+    return lights ? lights->specularColor() : QColor(Qt::white);
+}
+
+int SceneShading::bind() const
+{
+    QOpenGLFunctions *gl = QOpenGLContext::currentContext()->functions();
+
+    int variant = 0;
+    if(shadowTextureId > 0)
+    {
+        variant |= ShadowVariant;
+        variant |= qBound(0, shadowFilterRange, 2) << PcfRangeShift;
+
+        gl->glActiveTexture(GL_TEXTURE0 + ShadowMapUnit);
+        gl->glBindTexture(GL_TEXTURE_2D, shadowTextureId);
+        FrameProfiler::countStateChange();
+    }
+
+    if(transparentParts && transparencyBuffer && transparencyBuffer->isActive())
+        variant |= WeightedOitVariant;
+
+    if((variant & ShadowVariant) && temporalShadows && temporalShadows->isActive())
+    {
+        variant |= TemporalShadowVariant;
+
+        gl->glActiveTexture(GL_TEXTURE0 + TemporalShadows::HistoryTextureUnit);
+        gl->glBindTexture(GL_TEXTURE_2D, temporalShadows->historyTextureId());
+        FrameProfiler::countStateChange();
+    }
+
+    if(lights && lights->lightCount() > 0 && lights->clusterGridTextureId() > 0)
+    {
+        variant |= ClusteredLightsVariant;
+
+        gl->glActiveTexture(GL_TEXTURE0 + LightDataUnit);
+        gl->glBindTexture(GL_TEXTURE_2D, lights->lightDataTextureId());
+        gl->glActiveTexture(GL_TEXTURE0 + ClusterGridUnit);
+        gl->glBindTexture(GL_TEXTURE_2D, lights->clusterGridTextureId());
+        gl->glActiveTexture(GL_TEXTURE0 + LightIndexUnit);
+        gl->glBindTexture(GL_TEXTURE_2D, lights->lightIndexTextureId());
+        FrameProfiler::countStateChange(3);
+    }
+
+    gl->glActiveTexture(GL_TEXTURE0);
+    return variant;
+}
+
+void SceneShading::release(int variant) const
+{
+    QOpenGLFunctions *gl = QOpenGLContext::currentContext()->functions();
+
+    if(variant & ShadowVariant)
+    {
+        gl->glActiveTexture(GL_TEXTURE0 + ShadowMapUnit);
+        gl->glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    if(variant & TemporalShadowVariant)
+    {
+        gl->glActiveTexture(GL_TEXTURE0 + TemporalShadows::HistoryTextureUnit);
+        gl->glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    if(variant & ClusteredLightsVariant)
+    {
+        for(int unit=LightDataUnit; unit<=LightIndexUnit; unit++)
+        {
+            gl->glActiveTexture(GLenum(GL_TEXTURE0 + unit));
+            gl->glBindTexture(GL_TEXTURE_2D, 0);
+        }
+    }
+
+    gl->glActiveTexture(GL_TEXTURE0);
+}
+
+void SceneShading::setUniforms(QOpenGLShaderProgram *shader, int variant) const
+{
+    if(variant & ShadowVariant)
+    {
+        shader->setUniformValue("qt_ShadowMap", int(ShadowMapUnit));
+        shader->setUniformValue("qt_ShadowMapSize", float(shadowMapSize));
+        shader->setUniformValue("qt_ShadowDepthRange", shadowDepthRange);
+    }
+
+    if(variant & TemporalShadowVariant)
+    {
+        shader->setUniformValue("qt_ShadowHistory", int(TemporalShadows::HistoryTextureUnit));
+        shader->setUniformValue("qt_ReprojectionMatrix", temporalShadows->reprojectionMatrix());
+        shader->setUniformValue("qt_HistoryScale", temporalShadows->historyScale());
+        shader->setUniformValue("qt_HistoryWeight", temporalShadows->historyWeight());
+        shader->setUniformValue("qt_TapRotation", temporalShadows->tapRotation());
+    }
+
+    shader->setUniformValue("qt_Light.ambient", lights ? lights->ambientColor() : QColor(40,40,40));
+    shader->setUniformValue("qt_Light.diffuse", lights ? lights->diffuseColor() : QColor(Qt::white));
+    shader->setUniformValue("qt_Light.specular", this->lightSpecular());
+    shader->setUniformValue("qt_Light.direction", lightDirection);
+    shader->setUniformValue("qt_Light.eye", eyePosition);
+
+    if(variant & ClusteredLightsVariant)
+    {
+        const QSize viewportSize = lights->viewportSize();
+        const int maxIndexes = LightManager::ClusterCountX*LightManager::ClusterCountY*
+                               LightManager::ClusterCountZ*LightManager::MaxLightsPerCluster;
+        shader->setUniformValue("qt_LightData", int(LightDataUnit));
+        shader->setUniformValue("qt_ClusterGrid", int(ClusterGridUnit));
+        shader->setUniformValue("qt_LightIndexes", int(LightIndexUnit));
+        shader->setUniformValue("qt_Clusters.size", QVector3D(LightManager::ClusterCountX,
+                                                              LightManager::ClusterCountY,
+                                                              LightManager::ClusterCountZ));
+        shader->setUniformValue("qt_Clusters.viewportSize", QVector2D(viewportSize.width(), viewportSize.height()));
+        shader->setUniformValue("qt_Clusters.zNear", lights->zNear());
+        shader->setUniformValue("qt_Clusters.sliceScale", lights->clusterSliceScale());
+        shader->setUniformValue("qt_Clusters.maxLights", float(LightManager::MaxLights));
+        shader->setUniformValue("qt_Clusters.indexTextureWidth", float(LightManager::LightIndexTextureWidth));
+        shader->setUniformValue("qt_Clusters.indexTextureHeight", float(maxIndexes/LightManager::LightIndexTextureWidth));
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef SCENE_SHADING_H
+#define SCENE_SHADING_H
+
+#include <QColor>
+#include <QStringList>
+#include <QVector2D>
+#include <QVector3D>
+
+class LightManager;
+class QOpenGLShaderProgram;
+class TemporalShadows;
+class TransparencyBuffer;
+
+/*
+ * Everything scene_fragment.glsl shades with apart from the material: the
+ * key light, the shadow map and its temporal history, the clustered lights
+ * and weighted blended transparency. ObjModel and IndirectRenderer both
+ * draw the scene pass through it, so that they agree on the shader
+ * permutations, texture units and uniforms.
+ *
+ * A draw picks its permutation and binds the textures with bind(), sets
+ * the uniforms on each program it uses with setUniforms(), and unbinds the
+ * textures with release().
+ */
+struct SceneShading
+{
+    SceneShading();
+
+    // Bits of a shader permutation. The PCF range takes two bits.
+    enum Variant
+    {
+        ShadowVariant = 1,
+        ClusteredLightsVariant = 2,
+        SpecularVariant = 4,
+        PcfRangeShift = 3,
+        TemporalShadowVariant = 32,
+        WeightedOitVariant = 64
+    };
+
+    // Defines that turn the shader into the given permutation
+    static QStringList defines(int variant);
+
+    // Specular color of the key light; black turns specular off for all parts
+    QColor lightSpecular() const;
+
+    // Binds the textures the settings call for, and returns the permutation
+    // they make, without SpecularVariant, which is up to each part
+    int bind() const;
+    void release(int variant) const;
+
+    void setUniforms(QOpenGLShaderProgram *shader, int variant) const;
+
+    const LightManager *lights;
+    const TemporalShadows *temporalShadows;
+    const TransparencyBuffer *transparencyBuffer;
+    uint shadowTextureId;       // 0 for no shadows
+    int shadowMapSize;
+    int shadowFilterRange;
+    QVector2D shadowDepthRange; // near and far planes of the light's projection
+    QVector3D eyePosition;
+    QVector3D lightDirection;
+    bool transparentParts;      // whether transparent parts are drawn, and only those
+};
+
+#endif // SCENE_SHADING_H
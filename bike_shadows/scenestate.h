@@ -0,0 +1,67 @@
+#ifndef SCENE_STATE_H
+#define SCENE_STATE_H
+
+#include <QAtomicInt>
+#include <QMatrix4x4>
+#include <QVector>
+
+#include "scenestore.h"
+
+/*
+ * Everything the simulation side hands over to the renderer for one frame.
+ * Only the instances listed in transforms are moved, the rest keep their
+ * current matrix.
+ */
+struct SceneState
+{
+    SceneState() : frameNumber(0) { }
+
+    struct InstanceTransform
+    {
+        SceneHandle handle;
+        QMatrix4x4 matrix;
+    };
+
+    QMatrix4x4 sceneMatrix;
+    QVector<InstanceTransform> transforms;
+    qint64 frameNumber;
+};
+
+/*
+ * Triple buffered SceneState shared between exactly one writer and one
+ * reader thread. The writer publish()es complete states; the reader picks up
+ * the latest published one with acquire(). Neither side ever blocks or sees
+ * a half written state, the two only swap buffer indexes through a single
+ * atomic.
+ */
+class SceneStateBuffer
+{
+public:
+    SceneStateBuffer() : m_back(0), m_ready(1), m_front(2) { }
+
+    // Writer side
+    void publish(const SceneState &state) {
+        m_states[m_back] = state;
+        const int old = m_ready.fetchAndStoreOrdered(m_back | Fresh);
+        m_back = old & IndexMask;
+    }
+
+    // Reader side. Returns true if a new state was picked up.
+    bool acquire() {
+        if( !(m_ready.loadAcquire() & Fresh) )
+            return false;
+        const int old = m_ready.fetchAndStoreOrdered(m_front);
+        m_front = old & IndexMask;
+        return true;
+    }
+    const SceneState &frontBuffer() const { return m_states[m_front]; }
+
+private:
+    enum { IndexMask = 3, Fresh = 4 };
+    SceneState m_states[3];
+    int m_back;
+    QAtomicInt m_ready;
+    int m_front;
+};
+
+#endif // SCENE_STATE_H
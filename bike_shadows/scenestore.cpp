@@ -0,0 +1,468 @@
+#include "scenestore.h"
+#include "transformkernels.h"
+
+#include <QtMath>
+#include <cstring>
+#include <limits>
+
+SceneStore::SceneStore() : m_dirty(true), m_sceneMatrixValid(false)
+{
+    m_padding[0] = 0;
+    toMatrix(QMatrix4x4(), m_sceneMatrix);
+}
+
+SceneStore::~SceneStore()
+{
+    qDeleteAll(m_meshes);
+}
+
+int SceneStore::addMesh(ObjModel *mesh)
+{
+    if(mesh == nullptr)
+        return -1;
+
+    const int existing = m_meshes.indexOf(mesh);
+    if(existing >= 0)
+        return existing;
+
+    const BoundingBox box = mesh->boundingBox();
+    const QVector3D center = box.center();
+
+    Bounds bounds;
+    bounds.center[0] = center.x();
+    bounds.center[1] = center.y();
+    bounds.center[2] = center.z();
+    bounds.extent[0] = box.width()/2.0f;
+    bounds.extent[1] = box.height()/2.0f;
+    bounds.extent[2] = box.depth()/2.0f;
+
+    m_meshes.append(mesh);
+    m_meshBounds.append(bounds);
+    return m_meshes.size()-1;
+}
+
+SceneHandle SceneStore::createInstance(int meshIndex, const QMatrix4x4 &matrix, int flags,
+                                       const SceneHandle &parent)
+{
+    SceneHandle handle;
+    if(meshIndex < 0 || meshIndex >= m_meshes.size())
+        return handle;
+
+    const int parentIndex = this->indexOf(parent);
+    if(!parent.isNull() && parentIndex < 0)
+        return handle;
+
+    if(m_freeSlots.isEmpty())
+    {
+        Slot slot;
+        slot.index = -1;
+        slot.generation = 0;
+        m_slots.append(slot);
+        handle.index = quint32(m_slots.size()-1);
+    }
+    else
+        handle.index = m_freeSlots.takeLast();
+
+    Slot &slot = m_slots[int(handle.index)];
+    slot.index = m_instanceMeshes.size();
+    handle.generation = slot.generation;
+
+    // Appending keeps the parent ahead of the child
+    Matrix local;
+    toMatrix(matrix, local);
+    m_localTransforms.append(local);
+    m_worldTransforms.append(local);
+    m_normalMatrices.append(NormalMatrix());
+    m_rigid.append(1);
+    m_worldBounds.append(m_meshBounds.at(meshIndex));
+    m_instanceMeshes.append(meshIndex);
+    m_instanceFlags.append(flags);
+    m_instanceSlots.append(handle.index);
+    m_parents.append(parentIndex);
+    m_localDirty.append(1);
+
+    m_dirty = true;
+    return handle;
+}
+
+void SceneStore::destroyInstance(const SceneHandle &handle)
+{
+    const int index = this->indexOf(handle);
+    if(index < 0)
+        return;
+
+    // Descendants all come after the instance, so one pass finds them
+    const int count = m_instanceMeshes.size();
+    QVector<uchar> removed(count, 0);
+    removed[index] = 1;
+    for(int i=index+1; i<count; i++)
+        removed[i] = m_parents.at(i) >= 0 && removed.at(m_parents.at(i));
+
+    // Close the gaps while keeping the order, and with it parents ahead of
+    // their children
+    QVector<int> newIndexes(count, -1);
+    int n = index;
+    for(int i=0; i<index; i++)
+        newIndexes[i] = i;
+    for(int i=index; i<count; i++)
+    {
+        Slot &slot = m_slots[int(m_instanceSlots.at(i))];
+        if(removed.at(i))
+        {
+            slot.index = -1;
+            ++slot.generation;
+            m_freeSlots.append(m_instanceSlots.at(i));
+            continue;
+        }
+
+        const int parent = m_parents.at(i);
+        newIndexes[i] = n;
+        m_localTransforms[n] = m_localTransforms.at(i);
+        m_worldTransforms[n] = m_worldTransforms.at(i);
+        m_normalMatrices[n] = m_normalMatrices.at(i);
+        m_rigid[n] = m_rigid.at(i);
+        m_worldBounds[n] = m_worldBounds.at(i);
+        m_instanceMeshes[n] = m_instanceMeshes.at(i);
+        m_instanceFlags[n] = m_instanceFlags.at(i);
+        m_instanceSlots[n] = m_instanceSlots.at(i);
+        m_localDirty[n] = m_localDirty.at(i);
+        m_parents[n] = parent < 0 ? -1 : newIndexes.at(parent);
+        slot.index = n;
+        ++n;
+    }
+
+    m_localTransforms.resize(n);
+    m_worldTransforms.resize(n);
+    m_normalMatrices.resize(n);
+    m_rigid.resize(n);
+    m_worldBounds.resize(n);
+    m_instanceMeshes.resize(n);
+    m_instanceFlags.resize(n);
+    m_instanceSlots.resize(n);
+    m_localDirty.resize(n);
+    m_parents.resize(n);
+}
+
+bool SceneStore::isValid(const SceneHandle &handle) const
+{
+    return this->indexOf(handle) >= 0;
+}
+
+void SceneStore::clear()
+{
+    m_localTransforms.clear();
+    m_worldTransforms.clear();
+    m_normalMatrices.clear();
+    m_rigid.clear();
+    m_worldBounds.clear();
+    m_instanceMeshes.clear();
+    m_instanceFlags.clear();
+    m_instanceSlots.clear();
+    m_parents.clear();
+    m_localDirty.clear();
+
+    m_freeSlots.clear();
+    for(int i=m_slots.size()-1; i>=0; i--)
+    {
+        m_slots[i].index = -1;
+        ++m_slots[i].generation;
+        m_freeSlots.append(quint32(i));
+    }
+}
+
+void SceneStore::setTransform(const SceneHandle &handle, const QMatrix4x4 &matrix)
+{
+    const int index = this->indexOf(handle);
+    if(index < 0)
+        return;
+
+    toMatrix(matrix, m_localTransforms[index]);
+    m_localDirty[index] = 1;
+    m_dirty = true;
+}
+
+QMatrix4x4 SceneStore::transform(const SceneHandle &handle) const
+{
+    const int index = this->indexOf(handle);
+    return index < 0 ? QMatrix4x4() : fromMatrix(m_localTransforms.at(index));
+}
+
+SceneHandle SceneStore::parent(const SceneHandle &handle) const
+{
+    const int index = this->indexOf(handle);
+    if(index < 0 || m_parents.at(index) < 0)
+        return SceneHandle();
+
+    return this->handleAt(m_parents.at(index));
+}
+
+void SceneStore::setFlags(const SceneHandle &handle, int flags)
+{
+    const int index = this->indexOf(handle);
+    if(index >= 0)
+        m_instanceFlags[index] = flags;
+}
+
+int SceneStore::flags(const SceneHandle &handle) const
+{
+    const int index = this->indexOf(handle);
+    return index < 0 ? 0 : m_instanceFlags.at(index);
+}
+
+int SceneStore::indexOf(const SceneHandle &handle) const
+{
+    if(handle.index >= quint32(m_slots.size()))
+        return -1;
+
+    const Slot &slot = m_slots.at(int(handle.index));
+    return slot.generation == handle.generation ? slot.index : -1;
+}
+
+SceneHandle SceneStore::handleAt(int index) const
+{
+    SceneHandle handle;
+    handle.index = m_instanceSlots.at(index);
+    handle.generation = m_slots.at(int(handle.index)).generation;
+    return handle;
+}
+
+QMatrix4x4 SceneStore::worldMatrixAt(int index) const
+{
+    return fromMatrix(m_worldTransforms.at(index));
+}
+
+int SceneStore::updateWorld(const QMatrix4x4 &sceneMatrix)
+{
+    Matrix scene;
+    toMatrix(sceneMatrix, scene);
+    const bool sceneChanged = !m_sceneMatrixValid ||
+                              std::memcmp(scene.m, m_sceneMatrix.m, sizeof(scene.m)) != 0;
+    if(!sceneChanged && !m_dirty)
+        return 0;
+
+    m_sceneMatrix = scene;
+    m_sceneMatrixValid = true;
+    m_dirty = false;
+
+    const int count = m_localTransforms.size();
+    const Matrix *locals = m_localTransforms.constData();
+    const int *parents = m_parents.constData();
+    const int *meshes = m_instanceMeshes.constData();
+    Matrix *worlds = m_worldTransforms.data();
+    uchar *localDirty = m_localDirty.data();
+
+    m_worldChanged.resize(count);
+    uchar *changed = m_worldChanged.data();
+
+    // World matrices top down. Bounds and normal matrices only depend on
+    // the instance's own world matrix, so they go in batches over runs of
+    // changed instances; when the scene matrix changed that is one run.
+    int nrUpdated = 0;
+    int runStart = -1;
+    for(int i=0; i<=count; i++)
+    {
+        if(i < count)
+        {
+            const int parent = parents[i];
+            changed[i] = localDirty[i] || (parent < 0 ? sceneChanged : changed[parent]);
+            if(changed[i])
+            {
+                localDirty[i] = 0;
+                MultiplyMatrices(parent < 0 ? scene.m : worlds[parent].m, locals[i].m, nullptr, 1, worlds[i].m);
+                if(runStart < 0)
+                    runStart = i;
+                continue;
+            }
+        }
+
+        if(runStart < 0)
+            continue;
+
+        const int runLength = i - runStart;
+        TransformBounds(worlds[runStart].m, m_meshBounds.constData()->center, meshes+runStart,
+                        runLength, m_worldBounds[runStart].center);
+        NormalMatrices(worlds[runStart].m, nullptr, runLength,
+                       m_normalMatrices[runStart].m, m_rigid.data()+runStart);
+        nrUpdated += runLength;
+        runStart = -1;
+    }
+
+    return nrUpdated;
+}
+
+const float *SceneStore::normalMatrixAt(int index) const
+{
+    return m_rigid.at(index) ? nullptr : m_normalMatrices.at(index).m;
+}
+
+BoundingBox SceneStore::bounds(int flags) const
+{
+    // Transforms relative to the scene, top down
+    const int count = m_localTransforms.size();
+    QVector<Matrix> transforms(count);
+    for(int i=0; i<count; i++)
+    {
+        const int parent = m_parents.at(i);
+        if(parent < 0)
+            transforms[i] = m_localTransforms.at(i);
+        else
+            MultiplyMatrices(transforms.at(parent).m, m_localTransforms.at(i).m, nullptr, 1, transforms[i].m);
+    }
+
+    BoundingBox ret;
+    bool first = true;
+    for(int i=0; i<count; i++)
+    {
+        if( (m_instanceFlags.at(i) & flags) != flags )
+            continue;
+
+        Bounds b;
+        TransformBounds(transforms.at(i).m, m_meshBounds.constData()->center,
+                        m_instanceMeshes.constData()+i, 1, b.center);
+
+        BoundingBox box;
+        box.x.min = b.center[0]-b.extent[0]; box.x.max = b.center[0]+b.extent[0];
+        box.y.min = b.center[1]-b.extent[1]; box.y.max = b.center[1]+b.extent[1];
+        box.z.min = b.center[2]-b.extent[2]; box.z.max = b.center[2]+b.extent[2];
+        if(first)
+            ret = box;
+        else
+            ret |= box;
+        first = false;
+    }
+
+    return ret;
+}
+
+void SceneStore::cull(const QMatrix4x4 &viewProjectionMatrix, int flags, QVector<int> &visible) const
+{
+    visible.clear();
+
+    // Planes of the view frustum, in world space
+    float planes[6][4];
+    for(int i=0; i<3; i++)
+    {
+        const QVector4D row = viewProjectionMatrix.row(i);
+        const QVector4D w = viewProjectionMatrix.row(3);
+        const QVector4D p[2] = { w + row, w - row };
+        for(int j=0; j<2; j++)
+        {
+            const float length = p[j].toVector3D().length();
+            planes[i*2+j][0] = p[j].x()/length;
+            planes[i*2+j][1] = p[j].y()/length;
+            planes[i*2+j][2] = p[j].z()/length;
+            planes[i*2+j][3] = p[j].w()/length;
+        }
+    }
+
+    // Counting sort by mesh, so that the result comes out grouped
+    m_meshOffsets.fill(0, m_meshes.size()+1);
+
+    const int count = m_worldBounds.size();
+    const Bounds *bounds = m_worldBounds.constData();
+    const int *instanceFlags = m_instanceFlags.constData();
+    const int *meshes = m_instanceMeshes.constData();
+
+    QVector<int> &passed = m_cullScratch;
+    passed.clear();
+    passed.reserve(count);
+    for(int i=0; i<count; i++)
+    {
+        if( (instanceFlags[i] & flags) != flags )
+            continue;
+
+        const Bounds &b = bounds[i];
+        bool inside = true;
+        for(int p=0; p<6 && inside; p++)
+        {
+            const float *plane = planes[p];
+            const float distance = plane[0]*b.center[0] + plane[1]*b.center[1] + plane[2]*b.center[2] + plane[3];
+            const float radius = qAbs(plane[0])*b.extent[0] + qAbs(plane[1])*b.extent[1] + qAbs(plane[2])*b.extent[2];
+            inside = distance >= -radius;
+        }
+
+        if(inside)
+        {
+            passed.append(i);
+            ++m_meshOffsets[meshes[i]+1];
+        }
+    }
+
+    for(int m=1; m<m_meshOffsets.size(); m++)
+        m_meshOffsets[m] += m_meshOffsets.at(m-1);
+
+    visible.resize(passed.size());
+    Q_FOREACH(int i, passed)
+        visible[ m_meshOffsets[meshes[i]]++ ] = i;
+}
+
+SceneStore::RayHit SceneStore::intersect(const QVector3D &origin, const QVector3D &direction, int flags) const
+{
+    RayHit ret;
+    float nearest = std::numeric_limits<float>::max();
+
+    const int count = m_worldBounds.size();
+    const Bounds *bounds = m_worldBounds.constData();
+    const int *instanceFlags = m_instanceFlags.constData();
+    for(int i=0; i<count; i++)
+    {
+        if( (instanceFlags[i] & flags) != flags )
+            continue;
+
+        // Slabs of the world bounds, to skip instances the ray misses or
+        // that lie beyond the nearest hit so far
+        const Bounds &b = bounds[i];
+        float enter = 0.0f, exit = nearest;
+        for(int a=0; a<3 && enter <= exit; a++)
+        {
+            const float o = origin[a], d = direction[a];
+            const float lo = b.center[a] - b.extent[a], hi = b.center[a] + b.extent[a];
+            if(qAbs(d) < 1e-30f)
+            {
+                if(o < lo || o > hi)
+                    exit = -1.0f;
+                continue;
+            }
+
+            float t0 = (lo - o)/d, t1 = (hi - o)/d;
+            if(t0 > t1)
+                std::swap(t0, t1);
+            enter = qMax(enter, t0);
+            exit = qMin(exit, t1);
+        }
+        if(enter > exit)
+            continue;
+
+        // Points map along the ray alike in either space, so distances in
+        // model space are distances in world space
+        bool invertible = false;
+        const QMatrix4x4 inverse = fromMatrix(m_worldTransforms.at(i)).inverted(&invertible);
+        if(!invertible)
+            continue;
+
+        float distance = 0.0f;
+        const int part = m_meshes.at(m_instanceMeshes.at(i))->intersect(inverse.map(origin),
+                                                                       inverse.mapVector(direction), &distance);
+        if(part >= 0 && distance < nearest)
+        {
+            nearest = distance;
+            ret.instance = i;
+            ret.part = part;
+            ret.distance = distance;
+        }
+    }
+
+    return ret;
+}
+
+void SceneStore::toMatrix(const QMatrix4x4 &from, Matrix &to)
+{
+    std::memcpy(to.m, from.constData(), sizeof(to.m));
+}
+
+QMatrix4x4 SceneStore::fromMatrix(const Matrix &from)
+{
+    QMatrix4x4 ret(Qt::Uninitialized);
+    std::memcpy(ret.data(), from.m, sizeof(from.m));
+    return ret;
+}
@@ -0,0 +1,159 @@
+#ifndef SCENE_STORE_H
+#define SCENE_STORE_H
+
+#include <QMatrix4x4>
+#include <QVector>
+
+#include "objmodel.h"
+
+/*
+ * Refers to an instance in a SceneStore. Handles stay valid while other
+ * instances come and go; a handle to a destroyed instance is detected
+ * through its generation, even if the slot has been reused since.
+ */
+struct SceneHandle
+{
+    SceneHandle() : index(0xFFFFFFFF), generation(0) { }
+    quint32 index;
+    quint32 generation;
+
+    bool isNull() const { return index == 0xFFFFFFFF; }
+    bool operator == (const SceneHandle &other) const {
+        return index == other.index && generation == other.generation;
+    }
+    bool operator != (const SceneHandle &other) const { return !(*this == other); }
+};
+
+/*
+ * Holds the instances of a scene as a structure of arrays: transforms,
+ * world space bounds, mesh indexes and flags each live in their own
+ * contiguous array, packed with no holes. The per-frame stages (transform,
+ * bounds, cull) walk these arrays linearly and never touch the meshes.
+ *
+ * Instances form a hierarchy. An instance's transform is relative to its
+ * parent, or to the scene matrix for top level instances. Parents always
+ * come before their children in the arrays, so one linear pass updates
+ * world matrices top down, and only for instances that are dirty or have a
+ * dirty ancestor. An unchanged scene costs nothing per frame.
+ *
+ * Meshes (ObjModel) are owned by the store and shared between instances.
+ */
+class SceneStore
+{
+public:
+    SceneStore();
+    ~SceneStore();
+
+    enum Flag
+    {
+        Visible = 1,
+        CastsShadow = 2,
+        ContributesToBounds = 4,
+        DefaultFlags = Visible|CastsShadow|ContributesToBounds
+    };
+
+    // Meshes
+    int addMesh(ObjModel *mesh);
+    int meshCount() const { return m_meshes.size(); }
+    ObjModel *mesh(int meshIndex) const { return m_meshes.at(meshIndex); }
+
+    // Instances. The parent of an instance is fixed at creation, and
+    // destroying an instance destroys its children too.
+    SceneHandle createInstance(int meshIndex, const QMatrix4x4 &matrix, int flags=DefaultFlags,
+                               const SceneHandle &parent=SceneHandle());
+    void destroyInstance(const SceneHandle &handle);
+    bool isValid(const SceneHandle &handle) const;
+    int instanceCount() const { return m_instanceMeshes.size(); }
+    void clear();
+
+    // Transform relative to the parent. Setting it marks the instance, and
+    // with it all its descendants, dirty.
+    void setTransform(const SceneHandle &handle, const QMatrix4x4 &matrix);
+    QMatrix4x4 transform(const SceneHandle &handle) const;
+    SceneHandle parent(const SceneHandle &handle) const;
+
+    void setFlags(const SceneHandle &handle, int flags);
+    int flags(const SceneHandle &handle) const;
+
+    // Instances are packed, so the index of an instance changes when
+    // others are destroyed. Indexes are only good within a frame.
+    int indexOf(const SceneHandle &handle) const;
+    SceneHandle handleAt(int index) const;
+    int meshIndexAt(int index) const { return m_instanceMeshes.at(index); }
+    int flagsAt(int index) const { return m_instanceFlags.at(index); }
+    QMatrix4x4 worldMatrixAt(int index) const;
+
+    // Packed world matrices (16 floats each, column major) for the batch
+    // kernels in transformkernels.h
+    const float *worldMatrixData() const { return m_worldTransforms.constData()->m; }
+
+    // 3x3 inverse transpose of the world matrix, column major. Null for
+    // rigid transforms, whose normal matrix is the world matrix itself.
+    const float *normalMatrixAt(int index) const;
+
+    // Recomputes world matrices, normal matrices and world bounds of the
+    // instances that are dirty, or all of them if the scene matrix changed.
+    // Returns the number of instances updated.
+    int updateWorld(const QMatrix4x4 &sceneMatrix);
+
+    // Union of the bounds of instances that have all of the flags, placed
+    // by their own and their ancestors' transforms (the scene matrix is
+    // left out).
+    BoundingBox bounds(int flags) const;
+
+    // Indexes of instances that have all of the flags and whose world
+    // bounds intersect the frustum, grouped by mesh in mesh order.
+    void cull(const QMatrix4x4 &viewProjectionMatrix, int flags, QVector<int> &visible) const;
+
+    // The instance, among those with all of the flags, that a ray in world
+    // space hits first, and the part of its mesh that is hit. Instances are
+    // tested by their world bounds first, and then the ray is taken into
+    // model space and cast at the mesh's triangles (see ObjModel::intersect()),
+    // so a cast costs microseconds, not a pass over every triangle.
+    struct RayHit
+    {
+        RayHit() : instance(-1), part(-1), distance(0) { }
+        int instance;       // index, good within the frame
+        int part;
+        float distance;     // in lengths of the ray's direction
+        bool isValid() const { return instance >= 0; }
+    };
+    RayHit intersect(const QVector3D &origin, const QVector3D &direction, int flags) const;
+
+private:
+    struct Matrix { float m[16]; }; // column major, like QMatrix4x4
+    struct NormalMatrix { float m[9]; };
+    struct Bounds { float center[3], extent[3]; };
+    struct Slot { int index; quint32 generation; };
+
+    static void toMatrix(const QMatrix4x4 &from, Matrix &to);
+    static QMatrix4x4 fromMatrix(const Matrix &from);
+
+private:
+    QVector<ObjModel*> m_meshes;
+    QVector<Bounds> m_meshBounds;
+
+    QVector<Matrix> m_localTransforms;
+    QVector<Matrix> m_worldTransforms;
+    QVector<NormalMatrix> m_normalMatrices;
+    QVector<uchar> m_rigid;
+    QVector<Bounds> m_worldBounds;
+    QVector<int> m_instanceMeshes;
+    QVector<int> m_instanceFlags;
+    QVector<quint32> m_instanceSlots;
+    QVector<int> m_parents;         // index of the parent, -1 for none
+    QVector<uchar> m_localDirty;
+    QVector<uchar> m_worldChanged;  // scratch of updateWorld()
+
+    QVector<Slot> m_slots;
+    QVector<quint32> m_freeSlots;
+
+    Matrix m_sceneMatrix;
+    mutable QVector<int> m_meshOffsets;
+    mutable QVector<int> m_cullScratch;
+    bool m_dirty;
+    bool m_sceneMatrixValid;
+    char m_padding[6];
+};
+
+#endif // SCENE_STORE_H
@@ -0,0 +1,68 @@
+#include "shaderprogram.h"
+
+#include <QFile>
+#include <QOpenGLShaderProgram>
+
+// Source of a shader file with the defines injected at the top, or right
+// after its #version line if it has one
+static QByteArray ShaderSource(const QString &fileName, const QStringList &defines)
+{
+    QFile file(fileName);
+    if(!file.open(QFile::ReadOnly))
+    {
+        qWarning("Could not read %s", qPrintable(fileName));
+        return QByteArray();
+    }
+
+    QByteArray header;
+    Q_FOREACH(const QString &define, defines)
+        header += "#define " + define.toLatin1() + "\n";
+
+    QByteArray source = file.readAll();
+    if(source.startsWith("#version"))
+    {
+        const int versionEnd = source.indexOf('\n') + 1;
+        source.insert(versionEnd > 0 ? versionEnd : source.size(), header);
+        return source;
+    }
+
+    return header + source;
+}
+
+QOpenGLShaderProgram *CreateShaderProgram(const QString &vertexShaderFile,
+                                          const QString &fragmentShaderFile,
+                                          const QStringList &defines)
+{
+    const QString files[] = { vertexShaderFile, fragmentShaderFile };
+    const QOpenGLShader::ShaderType types[] = { QOpenGLShader::Vertex, QOpenGLShader::Fragment };
+
+    QOpenGLShaderProgram *program = new QOpenGLShaderProgram;
+    for(int i=0; i<2; i++)
+    {
+        const QByteArray source = ShaderSource(files[i], defines);
+        if(!source.isEmpty())
+            program->addCacheableShaderFromSourceCode(types[i], source);
+    }
+
+    if(!program->link())
+        qWarning("Could not link %s and %s with [%s]: %s", qPrintable(vertexShaderFile),
+                 qPrintable(fragmentShaderFile), qPrintable(defines.join(", ")),
+                 qPrintable(program->log()));
+
+    return program;
+}
+
+QOpenGLShaderProgram *CreateComputeProgram(const QString &computeShaderFile,
+                                           const QStringList &defines)
+{
+    QOpenGLShaderProgram *program = new QOpenGLShaderProgram;
+    const QByteArray source = ShaderSource(computeShaderFile, defines);
+    if(!source.isEmpty())
+        program->addCacheableShaderFromSourceCode(QOpenGLShader::Compute, source);
+
+    if(!program->link())
+        qWarning("Could not link %s with [%s]: %s", qPrintable(computeShaderFile),
+                 qPrintable(defines.join(", ")), qPrintable(program->log()));
+
+    return program;
+}
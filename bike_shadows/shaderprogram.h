@@ -0,0 +1,24 @@
+#ifndef SHADER_PROGRAM_H
+#define SHADER_PROGRAM_H
+
+#include <QStringList>
+
+class QOpenGLShaderProgram;
+
+/*
+ * Compiles a program from the given shader files, with the defines injected
+ * at the top of both shaders. Sources go through Qt's cacheable shader path,
+ * which stores linked program binaries on disk (keyed by source, so every
+ * permutation gets its own entry). Later launches load the binary instead of
+ * compiling GLSL, wherever the driver supports program binaries.
+ */
+QOpenGLShaderProgram *CreateShaderProgram(const QString &vertexShaderFile,
+                                          const QString &fragmentShaderFile,
+                                          const QStringList &defines=QStringList());
+
+// The same for a compute shader (OpenGL 4.3). Shaders that start with a
+// #version line get the defines right after it.
+QOpenGLShaderProgram *CreateComputeProgram(const QString &computeShaderFile,
+                                           const QStringList &defines=QStringList());
+
+#endif // SHADER_PROGRAM_H
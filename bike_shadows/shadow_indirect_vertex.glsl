@@ -0,0 +1,22 @@
+#version 430
+
+// Vertex shader of the shadow pass drawn by IndirectRenderer
+
+struct instance_record
+{
+    mat4 world;
+    vec4 normal[3];
+    uvec4 info;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { instance_record instances[]; };
+
+layout(location = 0) in vec3 qt_Vertex;
+layout(location = 2) in ivec2 qt_DrawRecord;   // instance and material, one per draw
+
+uniform mat4 qt_LightViewProjectionMatrix;      // from world space
+
+void main(void)
+{
+    gl_Position = qt_LightViewProjectionMatrix * (instances[qt_DrawRecord.x].world * vec4(qt_Vertex, 1.0));
+}
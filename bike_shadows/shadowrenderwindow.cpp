@@ -1,98 +1,77 @@
 #include "shadowrenderwindow.h"
+#include "framecapture.h"
 
-#include <QLabel>
-#include <QOpenGLTexture>
-#include <QOpenGLFramebufferObject>
+#include <QKeyEvent>
 
-static const int SHADOW_WIDTH = 2048;
-static const int SHADOW_HEIGHT = 2048;
+static const int MIN_SHADOW_MAP_SIZE = 256;
+static const int MAX_SHADOW_MAP_SIZE = 8192;
 
 ShadowRenderWindow::ShadowRenderWindow(QWidget *parent)
-    : SimpleRenderWindow(parent), m_shadowMapFBO(0), m_shadowMapTex(0)
+    : SimpleRenderWindow(parent), m_capture(new FrameCapture)
 {
-    m_label->setText("Rendering in perspective view - WITH shadows");
+    this->setLabelText("Rendering in perspective view - WITH shadows");
+    m_pipeline->setShadowsEnabled(true);
+    this->updateTitle();
 }
 
 ShadowRenderWindow::~ShadowRenderWindow()
 {
-    if(m_shadowMapTex > 0)
-        glDeleteTextures(1, &m_shadowMapTex);
-    if(m_shadowMapFBO > 0)
-        glDeleteFramebuffers(1, &m_shadowMapFBO);
+    // Frames still in flight are read back on the way out
+    this->makeCurrent();
+    delete m_capture;
+    this->doneCurrent();
 }
 
-void ShadowRenderWindow::paintGL()
-{
-    // PASS #1
-    // Render all models into the shadow buffer first
-    Q_FOREACH(ObjModel *model, m_models)
-        model->setShadowTextureId(0);
-    this->renderToShadowMap();
-
-    // PASS #2
-    // Render all models into the scene buffer next
-    Q_FOREACH(ObjModel *model, m_models)
-        model->setShadowTextureId(m_shadowMapTex);
-    this->renderToScreen();
-}
-
-void ShadowRenderWindow::renderToShadowMap()
+void ShadowRenderWindow::keyPressEvent(QKeyEvent *e)
 {
-    this->initDepthMap(); // init happens only once.
-
-    // Render into the depth framebuffer
-    glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMapFBO);
-//    glBindTexture(GL_TEXTURE_2D, m_shadowMapTex);
-    glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-    glClear(GL_DEPTH_BUFFER_BIT);
-
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_FRONT);
-
-    m_lightViewMatrix.setToIdentity();
-    m_lightViewMatrix.lookAt( m_lightPositionMatrix.map( QVector3D(0,0,0) ),
-                 m_sceneBounds.center(),
-                 m_lightPositionMatrix.map( QVector3D(0,1,0) ).normalized() );
-
-    for(int i=0; i<m_models.size()-1; i++)
+    // C saves the next frame as a PNG snapshot. V starts and stops
+    // recording PNG frames, shift+V raw RGBA frames. G cycles through the
+    // shadow map formats, [ and ] halve and double the shadow map size, and
+    // K cycles through the PCF kernels.
+    if(e->key() == Qt::Key_G)
+    {
+        const int format = (int(m_pipeline->shadowMapFormat()) + 1) % (int(RenderPipeline::Depth32F) + 1);
+        m_pipeline->setShadowMapFormat( RenderPipeline::ShadowMapFormat(format) );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_BracketLeft || e->key() == Qt::Key_BracketRight)
+    {
+        const int size = e->key() == Qt::Key_BracketLeft ? m_pipeline->shadowMapSize()/2 : m_pipeline->shadowMapSize()*2;
+        m_pipeline->setShadowMapSize( qBound(MIN_SHADOW_MAP_SIZE, size, MAX_SHADOW_MAP_SIZE) );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_K)
+    {
+        m_pipeline->setShadowFilterRange( (m_pipeline->shadowFilterRange() + 1) % 3 );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_C)
+        qDebug("Snapshot goes to %s", qPrintable(m_capture->takeSnapshot()));
+    else if(e->key() == Qt::Key_V && m_capture->isRecording())
     {
-        ObjModel *model = m_models.at(i);
-        model->setRenderMode(ObjModel::ShadowMode);
-        model->render(m_projectionMatrix, m_lightViewMatrix);
+        m_capture->stopRecording();
+        qDebug("Recording stopped, %d frames captured, %d dropped",
+               m_capture->capturedFrameCount(), m_capture->droppedFrameCount());
+    }
+    else if(e->key() == Qt::Key_V)
+    {
+        const FrameCapture::Format format = (e->modifiers() & Qt::ShiftModifier) ?
+                    FrameCapture::RawFrames : FrameCapture::PngFrames;
+        qDebug("Recording to %s", qPrintable(m_capture->startRecording(format)));
     }
 
-//    glBindTexture(GL_TEXTURE_2D, 0);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    SimpleRenderWindow::keyPressEvent(e);
 }
 
-void ShadowRenderWindow::initDepthMap()
+void ShadowRenderWindow::paintGL()
 {
-    // Refer http://learnopengl.com/#!Advanced-Lighting/Shadows/Shadow-Mapping
-    if(m_shadowMapFBO != 0)
-        return;
-
-    // Create a texture for storing the depth map
-    glGenTextures(1, &m_shadowMapTex);
-    glBindTexture(GL_TEXTURE_2D, m_shadowMapTex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT,
-                 SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    GLfloat borderColor[] = { 1.0, 1.0, 1.0, 1.0 };
-    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
-
-    // Create a frame-buffer and associate the texture with it.
-    glGenFramebuffers(1, &m_shadowMapFBO);
-    glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMapFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_shadowMapTex, 0);
+    SimpleRenderWindow::paintGL();
 
-    // Let OpenGL know that we are not interested in colors for this buffer
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
+    m_capture->captureFrame(this->defaultFramebufferObject(),
+                            QSize(m_pipeline->width(), m_pipeline->height()));
 
-    // Cleanup for now.
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    // Frames in flight need a few more frames to come out. A fixed rate
+    // keeps them coming anyway, and records at that rate.
+    if(m_capture->isBusy() && m_scheduler->mode() != FrameScheduler::FixedRate)
+        m_scheduler->invalidate();
 }
@@ -3,6 +3,8 @@
 
 #include "simplerenderwindow.h"
 
+class FrameCapture;
+
 class ShadowRenderWindow : public SimpleRenderWindow
 {
 public:
@@ -10,14 +12,11 @@ public:
     ~ShadowRenderWindow();
 
 protected:
+    void keyPressEvent(QKeyEvent *e);
     void paintGL();
 
-    void renderToShadowMap();
-    void initDepthMap();
-
 private:
-    uint m_shadowMapFBO;
-    uint m_shadowMapTex;
+    FrameCapture *m_capture;
 };
 
 #endif // SHADOWRENDERER_H
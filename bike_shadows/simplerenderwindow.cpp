@@ -1,10 +1,23 @@
 #include "simplerenderwindow.h"
 
+#include <QDir>
 #include <QLabel>
+#include <QKeyEvent>
+#include <QMouseEvent>
+#include <QElapsedTimer>
+#include <QFontDatabase>
+
+#include "frameprofiler.h"
+#include "resolutionscaler.h"
+#include "sceneloader.h"
 
 SimpleRenderWindow::SimpleRenderWindow(QWidget *parent)
-    : QOpenGLWidget(parent)
+    : QOpenGLWidget(parent), m_pipeline(new RenderPipeline), m_titleFrameRate(-1)
 {
+    // QOpenGLWidget::update() is throttled by the window's vsync, so
+    // asking for one after every frame renders at the display rate
+    m_scheduler = new FrameScheduler([=]() { this->update(); });
+
     m_label = new QLabel(this);
     QFont font = m_label->font();
     font.setPixelSize(40);
@@ -13,127 +26,261 @@ SimpleRenderWindow::SimpleRenderWindow(QWidget *parent)
     m_label->setBackgroundRole(QPalette::NoRole);
     m_label->setWordWrap(true);
     m_label->setAlignment(Qt::AlignCenter);
-    m_label->setText("Rendering in perspective view - WITHOUT shadows");
+    this->setLabelText("Rendering in perspective view - WITHOUT shadows");
+
+    m_pipeline->setShadowsEnabled(false);
+    this->updateTitle();
+
+    // The part under the mouse is highlighted as it moves
+    this->setMouseTracking(true);
 }
 
 SimpleRenderWindow::~SimpleRenderWindow()
 {
-    qDeleteAll(m_models);
-    m_models.clear();
+    delete m_scheduler;
+
+    this->makeCurrent();
+    delete m_pipeline;
+    this->doneCurrent();
 }
 
-void SimpleRenderWindow::resizeEvent(QResizeEvent *e)
+void SimpleRenderWindow::keyPressEvent(QKeyEvent *e)
 {
-    QOpenGLWidget::resizeEvent(e);
-
-    QFontMetrics fm( m_label->font() );
-
-    QRectF labelRect = fm.boundingRect( m_label->text() );
-    labelRect.setWidth( qMin(labelRect.width(), double(this->width()-20)) );
-    labelRect.setHeight( labelRect.height()*2 );
-    labelRect.moveCenter( this->rect().center() );
-    labelRect.moveTop( this->rect().top() + 10 );
+    // P toggles the frame profiler, T saves a trace of the last few frames,
+    // M cycles through the frame scheduling modes, space pauses and resumes
+    // the animation, R toggles dynamic resolution and F switches its
+    // upscale filter, H toggles temporal (history based) shadow filtering,
+    // O order independent transparency and Z reversed-Z depth
+    if(e->key() == Qt::Key_M)
+    {
+        const int mode = (int(m_scheduler->mode()) + 1) % (int(FrameScheduler::FixedRate) + 1);
+        m_scheduler->setMode( FrameScheduler::Mode(mode) );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_Space)
+    {
+        m_pipeline->setAnimated( !m_pipeline->isAnimated() );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_R)
+    {
+        m_pipeline->setDynamicResolutionEnabled( !m_pipeline->isDynamicResolutionEnabled() );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_F)
+    {
+        ResolutionScaler *scaler = m_pipeline->resolutionScaler();
+        scaler->setFilter(scaler->filter() == ResolutionScaler::Bilinear ?
+                          ResolutionScaler::Sharpen : ResolutionScaler::Bilinear);
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_H)
+    {
+        m_pipeline->setTemporalShadowsEnabled( !m_pipeline->isTemporalShadowsEnabled() );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_O)
+    {
+        m_pipeline->setOrderIndependentTransparencyEnabled( !m_pipeline->isOrderIndependentTransparencyEnabled() );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_Z)
+    {
+        m_pipeline->setReversedZEnabled( !m_pipeline->isReversedZEnabled() );
+        this->updateTitle();
+    }
+    else if(e->key() == Qt::Key_P)
+        this->setProfilingEnabled( !FrameProfiler::isEnabled() );
+    else if(e->key() == Qt::Key_T && FrameProfiler::isEnabled())
+    {
+        const QString fileName = QDir::temp().absoluteFilePath("bike_shadows_trace.json");
+        if(FrameProfiler::instance()->writeTrace(fileName))
+            qDebug("Frame trace written to %s", qPrintable(fileName));
+    }
 
-    m_label->setGeometry(labelRect.toRect());
+    m_scheduler->invalidate();
 }
 
-void SimpleRenderWindow::initializeGL()
+void SimpleRenderWindow::mouseMoveEvent(QMouseEvent *e)
 {
-    QOpenGLFunctions::initializeOpenGLFunctions();
-
-    glClearColor(0.25f, 0.45f, 0.65f, 1.0f);
+    QOpenGLWidget::mouseMoveEvent(e);
+    this->hover(e->localPos());
+}
 
-    glEnable(GL_DEPTH_TEST);
+void SimpleRenderWindow::leaveEvent(QEvent *e)
+{
+    QOpenGLWidget::leaveEvent(e);
+    this->hover(QPointF(-1, -1));
+}
 
-    glDepthFunc(GL_LEQUAL);
-    glEnable(GL_POLYGON_OFFSET_LINE);
-    glPolygonOffset(-0.03125f, -0.03125f);
+void SimpleRenderWindow::hover(const QPointF &position)
+{
+    // A ray cast is a few microseconds, so it is done right away on every
+    // move rather than deferred to the next frame
+    SceneHandle instance;
+    int part = -1;
+    QString hoverText;
+    if(this->rect().contains(position.toPoint()))
+    {
+        QElapsedTimer timer;
+        timer.start();
+        const SceneStore::RayHit hit = m_pipeline->pick(position * this->devicePixelRatio());
+        const qint64 pickTime = timer.nsecsElapsed();
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        if(hit.isValid())
+        {
+            const SceneStore *scene = m_pipeline->scene();
+            instance = scene->handleAt(hit.instance);
+            part = hit.part;
+            hoverText = QString("%1 at %2, picked in %3 us")
+                    .arg(scene->mesh(scene->meshIndexAt(hit.instance))->partNames().value(part))
+                    .arg(double(hit.distance), 0, 'f', 2)
+                    .arg(double(pickTime)/1000.0, 0, 'f', 1);
+        }
+    }
 
-    ObjModel *bike1 = new ObjModel(":/bike.obj");
-    bike1->translate(-2.0, 0, 0);
-    bike1->rotate(20, 0, 1, 0);
+    if(instance == m_pipeline->highlightedInstance() && part == m_pipeline->highlightedPart())
+        return;
 
-    ObjModel *bike2 = new ObjModel(":/bike.obj");
-    bike2->translate(2.0, 0, 0);
-    bike2->rotate(-20, 0, 1, 0);
+    m_pipeline->setHighlight(instance, part);
+    m_hoverText = hoverText;
+    this->updateTitle();
+    m_scheduler->invalidate();
+}
 
-    m_models << bike1 << bike2;
-    m_models << new ObjModel(":/platform.obj");
+void SimpleRenderWindow::resizeEvent(QResizeEvent *e)
+{
+    QOpenGLWidget::resizeEvent(e);
+    this->updateLabelGeometry();
 }
 
-void SimpleRenderWindow::resizeGL(int /*w*/, int /*h*/)
+void SimpleRenderWindow::setLabelText(const QString &text)
 {
-    this->updateMatricesForScreenRendering();
+    m_labelText = text;
+    if(!FrameProfiler::isEnabled())
+    {
+        m_label->setText(text);
+        this->updateLabelGeometry();
+    }
 }
 
-void SimpleRenderWindow::paintGL()
+void SimpleRenderWindow::setProfilingEnabled(bool val)
 {
-    this->renderToScreen();
+    FrameProfiler::instance()->setEnabled(val);
+
+    QFont font = val ? QFontDatabase::systemFont(QFontDatabase::FixedFont) : this->font();
+    font.setPixelSize(val ? 13 : 40);
+    font.setBold(!val);
+    m_label->setFont(font);
+    m_label->setAlignment(val ? Qt::AlignLeft|Qt::AlignTop : Qt::AlignCenter);
+    m_label->setText(val ? QString() : m_labelText);
+    this->updateLabelGeometry();
 }
 
-void SimpleRenderWindow::renderToScreen()
+void SimpleRenderWindow::updateLabelGeometry()
 {
-    const int devicePixelRatio = this->devicePixelRatio();
-    const int w = this->width() * devicePixelRatio;
-    const int h = this->height() * devicePixelRatio;
-    glViewport(0, 0, w, h);
-    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+    if(FrameProfiler::isEnabled())
+    {
+        m_label->setGeometry( this->rect().adjusted(10, 10, -10, -10) );
+        return;
+    }
 
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_BACK);
+    QFontMetrics fm( m_label->font() );
 
-    const QVector3D center = m_sceneBounds.center();
-    const QVector3D eye(center.x(), center.y(), m_sceneBounds.z.max);
-    const QVector3D lightDirection = m_lightPositionMatrix.map( QVector3D(0,0,-1) ).normalized();
+    QRectF labelRect = fm.boundingRect( m_label->text() );
+    labelRect.setWidth( qMin(labelRect.width(), double(this->width()-20)) );
+    labelRect.setHeight( labelRect.height()*2 );
+    labelRect.moveCenter( this->rect().center() );
+    labelRect.moveTop( this->rect().top() + 10 );
 
-    m_sceneMatrix.rotate(3, 0, 1, 0);
+    m_label->setGeometry(labelRect.toRect());
+}
 
-    for(int i=m_models.size()-1; i>=0; i--)
+void SimpleRenderWindow::updateTitle()
+{
+    QString title = QString("Frames %1").arg( FrameScheduler::modeName(m_scheduler->mode()) );
+    if(m_scheduler->mode() == FrameScheduler::FixedRate)
+        title += QString(" at %1 fps").arg(m_scheduler->frameRate());
+    if(m_scheduler->mode() != FrameScheduler::OnDemand)
+        title += QString(" - %1 fps measured").arg(m_scheduler->measuredFrameRate(), 0, 'f', 1);
+    if(!m_pipeline->isAnimated())
+        title += " - paused";
+    if(m_pipeline->isShadowsEnabled())
     {
-        ObjModel *model = m_models.at(i);
-        model->setRenderMode(ObjModel::SceneMode);
-        model->render(eye, lightDirection, m_projectionMatrix, m_viewMatrix, m_lightViewMatrix);
-        model->setSceneMatrix(m_sceneMatrix);
+        const int kernel = 2*m_pipeline->shadowFilterRange() + 1;
+        title += QString(" - %1 %2 shadow map, %3x%3 PCF")
+                .arg(m_pipeline->shadowMapSize())
+                .arg(RenderPipeline::shadowMapFormatName(m_pipeline->shadowMapFormat()))
+                .arg(kernel);
+        if(m_pipeline->isTemporalShadowsEnabled())
+            title += " over time";
     }
+    if(!m_pipeline->isUsingOrderIndependentTransparency())
+        title += " - blended transparency";
+    if(m_pipeline->isUsingReversedZ())
+        title += " - reversed-Z";
+    if(m_pipeline->isDynamicResolutionEnabled())
+    {
+        const ResolutionScaler *scaler = m_pipeline->resolutionScaler();
+        title += QString(" - %1% resolution, %2")
+                .arg(qRound(scaler->scale()*100.0))
+                .arg(scaler->filter() == ResolutionScaler::Sharpen ? "sharpened" : "bilinear");
+    }
+
+    if(!m_hoverText.isEmpty())
+        title += " - " + m_hoverText;
+
+    m_titleFrameRate = m_scheduler->measuredFrameRate();
+    this->setWindowTitle(title);
 }
 
-void SimpleRenderWindow::updateMatricesForScreenRendering()
+void SimpleRenderWindow::initializeGL()
 {
-    if(m_models.isEmpty())
-        return;
+    m_pipeline->initialize();
+
+    // The scene file may change the shadow settings shown in the title
+    SceneLoader loader(m_pipeline);
+    if(!m_sceneFileName.isEmpty() && loader.load(m_sceneFileName))
+    {
+        const SceneLoader::Statistics stats = loader.statistics();
+        qDebug("Loaded %d instances of %d meshes in %lld ms (%lld ms parsing on %d threads, %d upload batches)",
+               stats.instanceCount, stats.meshFileCount, stats.totalTime, stats.parseTime,
+               stats.parseThreadCount, stats.uploadBatchCount);
+        this->updateTitle();
+    }
+    else
+        m_pipeline->loadDefaultScene();
+}
 
-    m_sceneBounds = m_models.first()->boundingBox();
-    for(int i=1; i<m_models.size()-1; i++)
-        m_sceneBounds |= m_models.at(i)->boundingBox();
+void SimpleRenderWindow::resizeGL(int w, int h)
+{
+    const int devicePixelRatio = this->devicePixelRatio();
+    m_pipeline->resize(w * devicePixelRatio, h * devicePixelRatio);
+}
 
-    const float width = m_sceneBounds.width();
-    const float height = m_sceneBounds.height();
-    const float depth = m_sceneBounds.depth();
-    const float size = qMax( qMax(width, height), depth );
-    const QVector3D center = m_sceneBounds.center();
+void SimpleRenderWindow::paintGL()
+{
+    // Animation follows the clock, not the frame count, so it runs at the
+    // same speed whatever the scheduling mode and the frame rate
+    m_pipeline->advance( m_scheduler->beginFrame() );
 
-    m_cameraPositionMatrix.setToIdentity();
-    m_cameraPositionMatrix.translate(center.x(), center.y(), center.z());
-    m_cameraPositionMatrix.rotate(20, 0, 1, 0);
-    m_cameraPositionMatrix.rotate(-25, 1, 0, 0);
+    // Dynamic resolution aims at the frame time the scheduler asks for. The
+    // label is a widget on top, so it stays at native resolution regardless.
+    const qreal frameRate = m_scheduler->mode() == FrameScheduler::FixedRate ? m_scheduler->frameRate() : 60.0;
+    m_pipeline->resolutionScaler()->setTargetFrameTime(1000.0/frameRate);
 
-    m_lightPositionMatrix = m_cameraPositionMatrix;
-    m_lightPositionMatrix.rotate(45, 0, 1, 0);
+    m_pipeline->setTargetFramebuffer(this->defaultFramebufferObject());
+    m_pipeline->render();
 
-    m_lightPositionMatrix.translate(0, 0, size*5.0f);
-    m_cameraPositionMatrix.translate(0, 0, size*1.5f);
+    // Keep frames coming while profiling, so that the statistics roll
+    if(FrameProfiler::isEnabled())
+    {
+        m_label->setText( FrameProfiler::instance()->summary() );
+        m_scheduler->invalidate();
+    }
 
-    m_viewMatrix.setToIdentity();
-    m_viewMatrix.lookAt( m_cameraPositionMatrix.map( QVector3D(0,0,0) ),
-                         center,
-                         m_cameraPositionMatrix.map( QVector3D(0,1,0) ).normalized() );
+    m_scheduler->endFrame();
 
-    const int w = this->width();
-    const int h = this->height();
-    m_projectionMatrix.setToIdentity();
-    m_projectionMatrix.perspective(45.0, float(w)/float(h), 0.1f, 1000.0f);
+    if(!qFuzzyCompare(m_titleFrameRate, m_scheduler->measuredFrameRate()))
+        this->updateTitle();
 }
-
@@ -2,39 +2,47 @@
 #define SIMPLERENDERER_H
 
 #include <QOpenGLWidget>
-#include <QOpenGLFunctions>
 
-#include "objmodel.h"
+#include "renderpipeline.h"
+#include "framescheduler.h"
 
 class QLabel;
 
-class SimpleRenderWindow : public QOpenGLWidget, public QOpenGLFunctions
+class SimpleRenderWindow : public QOpenGLWidget
 {
 public:
     SimpleRenderWindow(QWidget *parent=nullptr);
     ~SimpleRenderWindow();
 
+    // Scene description (see SceneLoader) loaded in place of the default
+    // scene. Must be set before the window is shown.
+    void setSceneFileName(const QString &val) { m_sceneFileName = val; }
+    QString sceneFileName() const { return m_sceneFileName; }
+
 protected:
-    void keyPressEvent(QKeyEvent *) { this->update(); }
+    void keyPressEvent(QKeyEvent *e);
+    void mouseMoveEvent(QMouseEvent *e);
+    void leaveEvent(QEvent *e);
     void resizeEvent(QResizeEvent *e);
 
     void initializeGL();
     void resizeGL(int w, int h);
     void paintGL();
 
-    void renderToScreen();
-    void updateMatricesForScreenRendering();
+    void setLabelText(const QString &text);
+    void setProfilingEnabled(bool val);
+    void updateLabelGeometry();
+    void updateTitle();
+    void hover(const QPointF &position);
 
 protected:
-    QList<ObjModel*> m_models;
-    QMatrix4x4 m_sceneMatrix;
-    QMatrix4x4 m_projectionMatrix;
-    QMatrix4x4 m_viewMatrix;
-    BoundingBox m_sceneBounds;
-    QMatrix4x4 m_cameraPositionMatrix;
-    QMatrix4x4 m_lightPositionMatrix;
-    QMatrix4x4 m_lightViewMatrix;
+    RenderPipeline *m_pipeline;
+    FrameScheduler *m_scheduler;
     QLabel *m_label;
+    QString m_labelText;
+    QString m_sceneFileName;
+    QString m_hoverText;
+    qreal m_titleFrameRate;
 };
 
 #endif // SIMPLERENDERER_H
@@ -0,0 +1,199 @@
+#include "streambuffer.h"
+#include "frameprofiler.h"
+
+#include <QOpenGLContext>
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+typedef void (QOPENGLF_APIENTRYP BufferStorageFunction)(GLenum target, GLsizeiptr size,
+                                                        const void *data, GLbitfield flags);
+
+// How long beginFrame() waits for a region before giving up on the fence.
+// Only a hung GPU takes this long.
+static const GLuint64 FENCE_TIMEOUT = 1000000000; // nanoseconds
+
+StreamBuffer::StreamBuffer(int regionSize)
+    : m_buffer(0), m_regionSize(qMax(regionSize, 256)), m_region(0), m_used(0),
+      m_stallCount(0), m_frameNumber(0), m_persistentData(nullptr), m_mapped(nullptr),
+      m_persistent(false), m_initialized(false), m_inFrame(false), m_rangeMapped(false)
+{
+    m_padding[0] = 0;
+    for(int i=0; i<FramesInFlight; i++)
+        m_fences[i] = nullptr;
+}
+
+StreamBuffer::~StreamBuffer()
+{
+    if(!m_initialized)
+        return;
+
+    for(int i=0; i<FramesInFlight; i++)
+    {
+        if(m_fences[i])
+            glDeleteSync(m_fences[i]);
+    }
+
+    if(m_persistentData)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    if(m_buffer > 0)
+        glDeleteBuffers(1, &m_buffer);
+}
+
+void StreamBuffer::beginFrame()
+{
+    this->initialize(); // init happens only once.
+
+    if(m_inFrame || m_buffer == 0)
+        return;
+
+    m_used = 0;
+    m_inFrame = true;
+    ++m_frameNumber;
+
+    if(m_persistent)
+    {
+        m_region = (m_region+1) % FramesInFlight;
+
+        GLsync &fence = m_fences[m_region];
+        if(fence)
+        {
+            // Free unless the GPU is a whole ring behind
+            if(glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            {
+                FrameProfiler::Scope scope("upload stall");
+                ++m_stallCount;
+                glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+            }
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+
+        m_mapped = m_persistentData + m_region*m_regionSize;
+        return;
+    }
+
+    // Orphaning: the storage the GPU may still be reading is left to it,
+    // and this frame writes into a new one
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, m_regionSize, nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void StreamBuffer::endFrame()
+{
+    if(!m_inFrame)
+        return;
+
+    if(m_persistent)
+        m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    else
+        this->flush();
+
+    m_mapped = nullptr;
+    m_inFrame = false;
+}
+
+StreamBuffer::Allocation StreamBuffer::allocate(int size, int alignment)
+{
+    Allocation ret;
+    if(!m_inFrame || size <= 0)
+        return ret;
+
+    const int start = ((m_used + alignment-1) / alignment) * alignment;
+    if(start + size > m_regionSize)
+        return ret;
+
+    if(m_persistent)
+    {
+        ret.data = m_mapped + start;
+        ret.offset = m_region*m_regionSize + start;
+    }
+    else
+    {
+        // A buffer that is mapped without the persistent bit cannot be read
+        // by the GPU, so the previous allocation is unmapped first. This
+        // frame's storage is fresh, so there is nothing to sync with.
+        this->flush();
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+        ret.data = glMapBufferRange(GL_COPY_WRITE_BUFFER, start, size,
+                                    GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_RANGE_BIT|GL_MAP_UNSYNCHRONIZED_BIT);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        if(!ret.data)
+            return Allocation();
+
+        m_rangeMapped = true;
+        ret.offset = start;
+    }
+
+    m_used = start + size;
+    return ret;
+}
+
+void StreamBuffer::flush()
+{
+    if(!m_rangeMapped)
+        return;
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    m_rangeMapped = false;
+}
+
+void StreamBuffer::initialize()
+{
+    if(m_initialized)
+        return;
+
+    QOpenGLExtraFunctions::initializeOpenGLFunctions();
+    m_initialized = true;
+
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    const QSurfaceFormat format = context->format();
+    if(context->isOpenGLES() || format.version() < qMakePair(3,0))
+    {
+        qWarning("Stream buffers need OpenGL 3, uploads will not go through them");
+        return;
+    }
+
+    glGenBuffers(1, &m_buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+
+    BufferStorageFunction bufferStorage = nullptr;
+    if(format.version() >= qMakePair(4,4) || context->hasExtension("GL_ARB_buffer_storage"))
+        bufferStorage = reinterpret_cast<BufferStorageFunction>(context->getProcAddress("glBufferStorage"));
+
+    if(bufferStorage)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+        bufferStorage(GL_COPY_WRITE_BUFFER, GLsizeiptr(m_regionSize)*FramesInFlight, nullptr, flags);
+        m_persistentData = static_cast<char*>( glMapBufferRange(GL_COPY_WRITE_BUFFER, 0,
+                                                                GLsizeiptr(m_regionSize)*FramesInFlight, flags) );
+        m_persistent = m_persistentData != nullptr;
+    }
+
+    // A buffer with immutable storage cannot be orphaned, so it is
+    // recreated if mapping it failed
+    if(bufferStorage && !m_persistent)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glDeleteBuffers(1, &m_buffer);
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, m_buffer);
+    }
+
+    if(!m_persistent)
+        glBufferData(GL_COPY_WRITE_BUFFER, m_regionSize, nullptr, GL_STREAM_DRAW);
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
@@ -0,0 +1,87 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include <QOpenGLExtraFunctions>
+
+/*
+ * Ring buffer for data that is written by the CPU once per frame and read
+ * by the GPU in that frame only (light lists, and the like). It is split
+ * into FramesInFlight regions, one per frame, so the CPU writes one region
+ * while the GPU still reads the previous ones.
+ *
+ * With GL_ARB_buffer_storage (or OpenGL 4.4) the buffer is mapped once,
+ * persistently and coherently. Each region is fenced at the end of its
+ * frame, and the fence is waited on when the region comes around again,
+ * which only takes time when the GPU is FramesInFlight frames behind.
+ * Without it the buffer holds a single region and is orphaned every frame,
+ * so the driver hands out fresh storage instead of syncing. Each allocation
+ * is then mapped on its own, unsynchronized, as nothing in the fresh
+ * storage is in use yet, and must be unmapped (see flush()) before the GPU
+ * reads from it.
+ *
+ * Data goes in between beginFrame() and endFrame(); the offsets returned by
+ * allocate() are into bufferId(), which can be bound to any target.
+ */
+class StreamBuffer : public QOpenGLExtraFunctions
+{
+public:
+    StreamBuffer(int regionSize);
+    ~StreamBuffer();
+
+    enum { FramesInFlight = 3 };
+
+    void beginFrame();
+    void endFrame();
+    bool isInFrame() const { return m_inFrame; }
+
+    // Counts the frames begun so far, so the current one is never 0
+    quint64 frameNumber() const { return m_frameNumber; }
+
+    // Space for size bytes in this frame's region, with offset aligned to
+    // alignment bytes. data is nullptr when the region is full, or the
+    // buffer could not be mapped at all. Without persistent mapping data
+    // is only valid until the next allocate() or flush().
+    struct Allocation
+    {
+        Allocation() : data(nullptr), offset(0) { }
+        void *data;
+        int offset;
+    };
+    Allocation allocate(int size, int alignment=4);
+
+    // Must be called between writing an allocation and the first GPU
+    // command that reads it. Unmaps the last allocation if it was mapped
+    // on its own, and does nothing with persistent mapping.
+    void flush();
+
+    uint bufferId() const { return m_buffer; }
+    int regionSize() const { return m_regionSize; }
+    bool isPersistent() const { return m_persistent; }
+
+    // Frames in which beginFrame() had to wait for the GPU
+    int stallCount() const { return m_stallCount; }
+
+    // Bytes allocated in the current (or last) frame
+    int usedBytes() const { return m_used; }
+
+private:
+    void initialize();
+
+private:
+    uint m_buffer;
+    int m_regionSize;
+    int m_region;
+    int m_used;
+    int m_stallCount;
+    GLsync m_fences[FramesInFlight];
+    quint64 m_frameNumber;
+    char *m_persistentData;
+    char *m_mapped;             // this frame's region, with persistent mapping
+    bool m_persistent;
+    bool m_initialized;
+    bool m_inFrame;
+    bool m_rangeMapped;         // an allocation is mapped, without persistent mapping
+    char m_padding[4];
+};
+
+#endif // STREAM_BUFFER_H
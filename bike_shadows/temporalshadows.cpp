@@ -0,0 +1,179 @@
+#include "temporalshadows.h"
+#include "frameprofiler.h"
+
+#include <QtMath>
+
+// Successive frames rotate the tap pattern by the golden angle, which
+// covers the disk evenly whatever the number of frames accumulated
+static const float GOLDEN_ANGLE = 2.39996323f;
+
+TemporalShadows::TemporalShadows()
+    : m_fbo(0), m_colorTex(0), m_depthRenderbuffer(0), m_depthFormat(GL_DEPTH24_STENCIL8),
+      m_current(0), m_frameIndex(0), m_blendFactor(0.2f), m_tapRotation(0), m_historyValid(false),
+      m_active(false), m_initialized(false)
+{
+    m_padding[0] = 0;
+    m_historyTex[0] = m_historyTex[1] = 0;
+}
+
+TemporalShadows::~TemporalShadows()
+{
+    if(m_initialized)
+        this->releaseTargets();
+}
+
+int TemporalShadows::tapCount(int filterRange)
+{
+    const int side = 2*qBound(0, filterRange, 2) + 1;
+    return qMax(1, (side*side + 3)/4);
+}
+
+QVector2D TemporalShadows::historyScale() const
+{
+    if(m_capacity.isEmpty())
+        return QVector2D(1, 1);
+
+    return QVector2D( float(m_previousSize.width())/float(m_capacity.width()),
+                      float(m_previousSize.height())/float(m_capacity.height()) );
+}
+
+void TemporalShadows::setDepthFormat(uint val)
+{
+    if(m_depthFormat == val)
+        return;
+
+    m_depthFormat = val;
+    if(m_initialized)
+        this->releaseTargets();
+    m_historyValid = false;
+}
+
+void TemporalShadows::begin(const QSize &size, const QMatrix4x4 &viewProjectionMatrix,
+                            const QMatrix4x4 &sceneMatrix, const QMatrix4x4 &lightViewProjectionMatrix,
+                            const ShadowSettings &shadowSettings)
+{
+    FrameProfiler::Scope scope("scene/temporal");
+
+    this->initialize(); // init happens only once.
+
+    // Targets only grow, so that dynamic resolution can change the size
+    // every frame and still find the previous frame in the history
+    if(size.width() > m_capacity.width() || size.height() > m_capacity.height())
+        this->resizeTargets( size.expandedTo(m_capacity) );
+
+    if(shadowSettings != m_shadowSettings || lightViewProjectionMatrix != m_previousLightViewProjection)
+        m_historyValid = false;
+
+    // World positions of this frame go back to the scene's root, and from
+    // there to the clip space of the previous frame
+    const QMatrix4x4 rootToClip = viewProjectionMatrix * sceneMatrix;
+    m_reprojectionMatrix = m_previousRootToClip * sceneMatrix.inverted();
+    m_previousRootToClip = rootToClip;
+    m_previousLightViewProjection = lightViewProjectionMatrix;
+    m_shadowSettings = shadowSettings;
+
+    m_tapRotation = float(std::fmod(double(m_frameIndex++) * double(GOLDEN_ANGLE), 2.0*M_PI));
+    m_current = 1-m_current;
+    m_previousSize = m_size;
+    m_size = size;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_historyTex[m_current], 0);
+    const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+
+    glViewport(0, 0, size.width(), size.height());
+    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+
+    // Where nothing is drawn: lit, at a depth no surface matches
+    const GLfloat emptyHistory[] = { 1.0f, 0.0f, 0.0f, 1.0f };
+    glClearBufferfv(GL_COLOR, 1, emptyHistory);
+
+    m_active = true;
+}
+
+void TemporalShadows::end(uint destinationFramebuffer)
+{
+    if(!m_active)
+        return;
+
+    FrameProfiler::Scope scope("scene/temporal");
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, destinationFramebuffer);
+    glBlitFramebuffer(0, 0, m_size.width(), m_size.height(), 0, 0, m_size.width(), m_size.height(),
+                      GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, destinationFramebuffer);
+
+    m_historyValid = true;
+    m_active = false;
+}
+
+void TemporalShadows::initialize()
+{
+    if(m_initialized)
+        return;
+
+    QOpenGLExtraFunctions::initializeOpenGLFunctions();
+    m_initialized = true;
+}
+
+void TemporalShadows::resizeTargets(const QSize &capacity)
+{
+    this->releaseTargets();
+    m_capacity = capacity;
+    m_historyValid = false;
+
+    // Color, then the two history textures: shadow term in red and view
+    // depth in green, so half floats
+    GLuint textures[3];
+    glGenTextures(3, textures);
+    m_colorTex = textures[0];
+    m_historyTex[0] = textures[1];
+    m_historyTex[1] = textures[2];
+    for(int i=0; i<3; i++)
+    {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        if(i == 0)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, capacity.width(), capacity.height(), 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        else
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, capacity.width(), capacity.height(), 0,
+                         GL_RG, GL_HALF_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &m_depthRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, m_depthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, m_depthFormat, capacity.width(), capacity.height());
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &m_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_colorTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_historyTex[0], 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, m_depthRenderbuffer);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        qWarning("Temporal shadow framebuffer is incomplete");
+}
+
+void TemporalShadows::releaseTargets()
+{
+    const GLuint textures[] = { m_colorTex, m_historyTex[0], m_historyTex[1] };
+    if(m_colorTex > 0)
+        glDeleteTextures(3, textures);
+    if(m_depthRenderbuffer > 0)
+        glDeleteRenderbuffers(1, &m_depthRenderbuffer);
+    if(m_fbo > 0)
+        glDeleteFramebuffers(1, &m_fbo);
+
+    m_colorTex = m_historyTex[0] = m_historyTex[1] = 0;
+    m_depthRenderbuffer = 0;
+    m_fbo = 0;
+    m_capacity = QSize();
+}
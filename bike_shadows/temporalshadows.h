@@ -0,0 +1,114 @@
+#ifndef TEMPORAL_SHADOWS_H
+#define TEMPORAL_SHADOWS_H
+
+#include <QSize>
+#include <QVector2D>
+#include <QMatrix4x4>
+#include <QOpenGLExtraFunctions>
+
+/*
+ * Spreads the PCF shadow kernel over several frames. Each frame the scene
+ * shader takes a few taps on a disk that is rotated from frame to frame
+ * (and from pixel to pixel), and blends the result with the shadow term
+ * it wrote the frame before, found by reprojecting the fragment with the
+ * previous frame's view projection. The scene pass writes the blended term
+ * and the view depth into a second color attachment, which becomes the
+ * history of the next frame.
+ *
+ * History is rejected per fragment when it is off screen or belongs to
+ * another surface (its depth differs), and dropped altogether when the
+ * light's view projection, the shadow map or the filter change.
+ *
+ * The scene pass renders into framebuffer() between begin() and end(),
+ * and end() copies color and depth on to the real destination, which
+ * must have a depth buffer of depthFormat().
+ */
+class TemporalShadows : public QOpenGLExtraFunctions
+{
+public:
+    TemporalShadows();
+    ~TemporalShadows();
+
+    enum { HistoryTextureUnit = 4 };
+
+    // Weight of the current frame in the blend. Lower is smoother once
+    // converged, but lags further behind moving shadows.
+    void setBlendFactor(float val) { m_blendFactor = qBound(0.05f, val, 1.0f); }
+    float blendFactor() const { return m_blendFactor; }
+
+    // Taps per frame, about a quarter of the full kernel's
+    static int tapCount(int filterRange);
+
+    // Depth (and stencil) format of the destination framebuffer, which the
+    // depth buffer here must match. GL_DEPTH24_STENCIL8 by default; a
+    // change reallocates the targets, and drops the history, on the next
+    // begin().
+    void setDepthFormat(uint val);
+    uint depthFormat() const { return m_depthFormat; }
+
+    // Forgets the history, for the next frame to start afresh
+    void invalidate() { m_historyValid = false; }
+
+    // What the shadow term depends on besides the light's view projection.
+    // The format is the owner's own numbering of shadow map formats.
+    struct ShadowSettings
+    {
+        ShadowSettings() : mapSize(0), mapFormat(-1), filterRange(-1) { }
+        ShadowSettings(int size, int format, int range) : mapSize(size), mapFormat(format), filterRange(range) { }
+        bool operator==(const ShadowSettings &other) const {
+            return mapSize == other.mapSize && mapFormat == other.mapFormat && filterRange == other.filterRange;
+        }
+        bool operator!=(const ShadowSettings &other) const { return !(*this == other); }
+
+        int mapSize;
+        int mapFormat;
+        int filterRange;
+    };
+
+    // viewProjectionMatrix maps world to clip space; sceneMatrix is the
+    // part of the world transform shared by everything (the turntable), so
+    // that reprojection follows the scene as it turns. The history is
+    // dropped when the light or the shadow settings differ from last time.
+    void begin(const QSize &size, const QMatrix4x4 &viewProjectionMatrix,
+               const QMatrix4x4 &sceneMatrix, const QMatrix4x4 &lightViewProjectionMatrix,
+               const ShadowSettings &shadowSettings);
+    void end(uint destinationFramebuffer);
+    bool isActive() const { return m_active; }
+    uint framebuffer() const { return m_fbo; }
+
+    // For the scene shader, valid between begin() and end()
+    uint historyTextureId() const { return m_historyTex[1-m_current]; }
+    QMatrix4x4 reprojectionMatrix() const { return m_reprojectionMatrix; }
+    QVector2D historyScale() const;
+    float historyWeight() const { return m_historyValid ? 1.0f-m_blendFactor : 0.0f; }
+    float tapRotation() const { return m_tapRotation; }
+
+private:
+    void initialize();
+    void resizeTargets(const QSize &capacity);
+    void releaseTargets();
+
+private:
+    QSize m_capacity;
+    QSize m_size;
+    QSize m_previousSize;
+    uint m_fbo;
+    uint m_colorTex;
+    uint m_historyTex[2];
+    uint m_depthRenderbuffer;
+    uint m_depthFormat;
+    int m_current;              // history written this frame
+    ShadowSettings m_shadowSettings;
+    QMatrix4x4 m_previousRootToClip;
+    QMatrix4x4 m_previousLightViewProjection;
+    QMatrix4x4 m_reprojectionMatrix;
+    quint32 m_frameIndex;
+    float m_blendFactor;
+    float m_tapRotation;
+    bool m_historyValid;
+    bool m_active;
+    bool m_initialized;
+    char m_padding[1];
+};
+
+#endif // TEMPORAL_SHADOWS_H
@@ -0,0 +1,193 @@
+#include "threadedrenderwindow.h"
+#include "renderpipeline.h"
+
+#include <QTimer>
+#include <QThread>
+#include <QKeyEvent>
+#include <QAtomicInt>
+#include <QOpenGLContext>
+#include <QGuiApplication>
+
+class RenderThread : public QThread
+{
+public:
+    RenderThread(ThreadedRenderWindow *window, QOpenGLContext *context)
+        : m_window(window), m_context(context), m_pipeline(nullptr),
+          m_frameCount(0), m_stop(0) { }
+    ~RenderThread() {
+        this->stop();
+    }
+
+    void stop() {
+        m_stop.storeRelease(1);
+        this->wait();
+    }
+
+    void setSize(const QSize &size) {
+        m_size.storeRelease( (size.width() << 16) | (size.height() & 0xFFFF) );
+    }
+
+    int takeFrameCount() { return m_frameCount.fetchAndStoreRelaxed(0); }
+
+protected:
+    void run();
+
+private:
+    ThreadedRenderWindow *m_window;
+    QOpenGLContext *m_context;
+    RenderPipeline *m_pipeline;
+    QAtomicInt m_size;
+    QAtomicInt m_frameCount;
+    QAtomicInt m_stop;
+};
+
+void RenderThread::run()
+{
+    if(!m_context->makeCurrent(m_window))
+    {
+        m_context->moveToThread(QGuiApplication::instance()->thread());
+        return;
+    }
+
+    m_pipeline = new RenderPipeline;
+    m_pipeline->initialize();
+    m_pipeline->loadDefaultScene();
+    m_pipeline->setAnimated(false);
+
+    int renderedSize = 0;
+    while(!m_stop.loadAcquire())
+    {
+        const int size = m_size.loadAcquire();
+        if(size != renderedSize)
+        {
+            m_pipeline->resize(size >> 16, size & 0xFFFF);
+            renderedSize = size;
+        }
+
+        if(m_window->sceneStateBuffer()->acquire())
+            m_pipeline->applySceneState( m_window->sceneStateBuffer()->frontBuffer() );
+
+        // swapBuffers() blocks on vsync, which paces this loop
+        m_pipeline->setTargetFramebuffer(m_context->defaultFramebufferObject());
+        m_pipeline->render();
+        m_context->swapBuffers(m_window);
+        m_frameCount.ref();
+    }
+
+    m_context->makeCurrent(m_window);
+    delete m_pipeline;
+    m_pipeline = nullptr;
+    m_context->doneCurrent();
+
+    // Hand the context back, so that it can be deleted on the GUI thread
+    m_context->moveToThread(QGuiApplication::instance()->thread());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+ThreadedRenderWindow::ThreadedRenderWindow(QWindow *parent)
+    : QWindow(parent), m_context(nullptr), m_renderThread(nullptr), m_simulationTimer(new QTimer(this)),
+      m_paused(false)
+{
+    m_padding[0] = 0;
+
+    this->setSurfaceType(QWindow::OpenGLSurface);
+
+    QSurfaceFormat format;
+    format.setDepthBufferSize(24);
+    format.setStencilBufferSize(8);
+    this->setFormat(format);
+
+    m_simulationTimer->setInterval(16);
+    m_simulationTimer->setTimerType(Qt::PreciseTimer);
+    QObject::connect(m_simulationTimer, &QTimer::timeout, [=]() { this->simulate(); });
+
+    this->updateTitle();
+}
+
+ThreadedRenderWindow::~ThreadedRenderWindow()
+{
+    if(m_renderThread)
+    {
+        m_renderThread->stop();
+        delete m_renderThread;
+    }
+
+    // The render thread has handed the context back by now
+    delete m_context;
+}
+
+void ThreadedRenderWindow::exposeEvent(QExposeEvent *)
+{
+    if(!this->isExposed() || m_renderThread)
+        return;
+
+    // The context is created here and moved over to the render thread,
+    // which does all of the OpenGL work from then on.
+    QOpenGLContext *context = new QOpenGLContext;
+    context->setFormat(this->requestedFormat());
+    if(!context->create())
+    {
+        qWarning("Could not create an OpenGL context");
+        delete context;
+        return;
+    }
+
+    m_context = context;
+    m_renderThread = new RenderThread(this, context);
+    m_renderThread->setSize(this->size() * this->devicePixelRatio());
+    context->moveToThread(m_renderThread);
+    m_renderThread->start();
+
+    m_titleTimer.start();
+    m_simulationTimer->start();
+    m_simulationClock.start();
+}
+
+void ThreadedRenderWindow::resizeEvent(QResizeEvent *)
+{
+    if(m_renderThread)
+        m_renderThread->setSize(this->size() * this->devicePixelRatio());
+}
+
+void ThreadedRenderWindow::keyPressEvent(QKeyEvent *e)
+{
+    // Space pauses and resumes the turntable
+    if(e->key() == Qt::Key_Space)
+    {
+        m_paused = !m_paused;
+        m_simulationClock.restart();
+        this->updateTitle();
+    }
+}
+
+void ThreadedRenderWindow::simulate()
+{
+    if(!m_paused)
+    {
+        // Turn by elapsed time, timers are not punctual
+        const qreal seconds = qreal(m_simulationClock.restart()) / 1000.0;
+        RenderPipeline::turnTable(m_state.sceneMatrix, seconds);
+        ++m_state.frameNumber;
+        m_sceneStates.publish(m_state);
+    }
+
+    if(m_titleTimer.elapsed() >= 1000)
+        this->updateTitle();
+}
+
+void ThreadedRenderWindow::updateTitle()
+{
+    QString title = "Rendering on a separate thread - WITH shadows";
+    if(m_renderThread && m_titleTimer.isValid())
+    {
+        const qint64 elapsed = qMax(qint64(1), m_titleTimer.restart());
+        const int frames = m_renderThread->takeFrameCount();
+        title += QString(" - %1 fps").arg( qreal(frames)*1000.0/qreal(elapsed), 0, 'f', 1 );
+    }
+
+    if(m_paused)
+        title += " - paused";
+
+    this->setTitle(title);
+}
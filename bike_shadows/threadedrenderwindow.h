@@ -0,0 +1,49 @@
+#ifndef THREADED_RENDER_WINDOW_H
+#define THREADED_RENDER_WINDOW_H
+
+#include <QWindow>
+#include <QElapsedTimer>
+
+#include "scenestate.h"
+
+class QTimer;
+class QOpenGLContext;
+class RenderThread;
+
+/*
+ * Renders the shadow pipeline on a thread of its own, with its own OpenGL
+ * context, straight onto this window's surface. The GUI thread only runs
+ * the (trivial) simulation, turning the scene around, and publishes the
+ * result through a SceneStateBuffer. Input handling on the GUI thread
+ * therefore never waits on a frame, however heavy the scene is.
+ */
+class ThreadedRenderWindow : public QWindow
+{
+public:
+    ThreadedRenderWindow(QWindow *parent=nullptr);
+    ~ThreadedRenderWindow();
+
+    SceneStateBuffer *sceneStateBuffer() { return &m_sceneStates; }
+
+protected:
+    void exposeEvent(QExposeEvent *e);
+    void resizeEvent(QResizeEvent *e);
+    void keyPressEvent(QKeyEvent *e);
+
+private:
+    void simulate();
+    void updateTitle();
+
+private:
+    SceneStateBuffer m_sceneStates;
+    SceneState m_state;
+    QOpenGLContext *m_context;
+    RenderThread *m_renderThread;
+    QTimer *m_simulationTimer;
+    QElapsedTimer m_simulationClock;
+    QElapsedTimer m_titleTimer;
+    bool m_paused;
+    char m_padding[7];
+};
+
+#endif // THREADED_RENDER_WINDOW_H
@@ -0,0 +1,207 @@
+#include "transformkernels.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define TRANSFORM_KERNELS_AVX
+#define TRANSFORM_KERNELS_SSE
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TRANSFORM_KERNELS_SSE
+#endif
+
+// Tolerance on the dot products of the columns, for a matrix to be rigid
+static const float RIGID_EPSILON = 1e-4f;
+
+const char *TransformKernelName()
+{
+#if defined(TRANSFORM_KERNELS_AVX)
+    return "avx";
+#elif defined(TRANSFORM_KERNELS_SSE)
+    return "sse";
+#else
+    return "scalar";
+#endif
+}
+
+void MultiplyMatrices(const float *a, const float *matrices, const int *indexes,
+                      int count, float *out)
+{
+#if defined(TRANSFORM_KERNELS_AVX)
+    // Two columns of the result per iteration. Each 128 bit lane of bb holds
+    // one column of b, and the in-lane permutes splat its k-th element.
+    const __m256 a0 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a));
+    const __m256 a1 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a+4));
+    const __m256 a2 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a+8));
+    const __m256 a3 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a+12));
+    for(int i=0; i<count; i++)
+    {
+        const float *b = matrices + (indexes ? indexes[i] : i)*16;
+        float *o = out + i*16;
+        for(int half=0; half<2; half++)
+        {
+            const __m256 bb = _mm256_loadu_ps(b + half*8);
+            __m256 r = _mm256_mul_ps(a0, _mm256_permute_ps(bb, 0x00));
+            r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_permute_ps(bb, 0x55)));
+            r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_permute_ps(bb, 0xAA)));
+            r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_permute_ps(bb, 0xFF)));
+            _mm256_storeu_ps(o + half*8, r);
+        }
+    }
+#elif defined(TRANSFORM_KERNELS_SSE)
+    const __m128 a0 = _mm_loadu_ps(a);
+    const __m128 a1 = _mm_loadu_ps(a+4);
+    const __m128 a2 = _mm_loadu_ps(a+8);
+    const __m128 a3 = _mm_loadu_ps(a+12);
+    for(int i=0; i<count; i++)
+    {
+        const float *b = matrices + (indexes ? indexes[i] : i)*16;
+        float *o = out + i*16;
+        for(int c=0; c<4; c++)
+        {
+            __m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[c*4]));
+            r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[c*4+1])));
+            r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[c*4+2])));
+            r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[c*4+3])));
+            _mm_storeu_ps(o + c*4, r);
+        }
+    }
+#else
+    for(int i=0; i<count; i++)
+    {
+        const float *b = matrices + (indexes ? indexes[i] : i)*16;
+        float *o = out + i*16;
+        for(int c=0; c<4; c++)
+            for(int r=0; r<4; r++)
+                o[c*4+r] = a[r]*b[c*4] + a[4+r]*b[c*4+1] + a[8+r]*b[c*4+2] + a[12+r]*b[c*4+3];
+    }
+#endif
+}
+
+void TransformBounds(const float *matrices, const float *localBounds,
+                     const int *meshIndexes, int count, float *out)
+{
+    // Center goes through the full transform, extents through the absolute
+    // values of the linear part. That is the exact AABB of the moved box,
+    // without transforming its corners.
+#if defined(TRANSFORM_KERNELS_SSE)
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    float result[8];
+    for(int i=0; i<count; i++)
+    {
+        const float *m = matrices + i*16;
+        const float *local = localBounds + meshIndexes[i]*6;
+        const __m128 c0 = _mm_loadu_ps(m);
+        const __m128 c1 = _mm_loadu_ps(m+4);
+        const __m128 c2 = _mm_loadu_ps(m+8);
+        const __m128 c3 = _mm_loadu_ps(m+12);
+
+        __m128 center = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_set1_ps(local[0])));
+        center = _mm_add_ps(center, _mm_mul_ps(c1, _mm_set1_ps(local[1])));
+        center = _mm_add_ps(center, _mm_mul_ps(c2, _mm_set1_ps(local[2])));
+
+        __m128 extent = _mm_mul_ps(_mm_and_ps(c0, absMask), _mm_set1_ps(local[3]));
+        extent = _mm_add_ps(extent, _mm_mul_ps(_mm_and_ps(c1, absMask), _mm_set1_ps(local[4])));
+        extent = _mm_add_ps(extent, _mm_mul_ps(_mm_and_ps(c2, absMask), _mm_set1_ps(local[5])));
+
+        _mm_storeu_ps(result, center);
+        _mm_storeu_ps(result+4, extent);
+
+        float *o = out + i*6;
+        o[0] = result[0]; o[1] = result[1]; o[2] = result[2];
+        o[3] = result[4]; o[4] = result[5]; o[5] = result[6];
+    }
+#else
+    for(int i=0; i<count; i++)
+    {
+        const float *m = matrices + i*16;
+        const float *local = localBounds + meshIndexes[i]*6;
+        float *o = out + i*6;
+        for(int r=0; r<3; r++)
+        {
+            o[r] = m[r]*local[0] + m[4+r]*local[1] + m[8+r]*local[2] + m[12+r];
+            o[3+r] = std::fabs(m[r])*local[3] + std::fabs(m[4+r])*local[4] + std::fabs(m[8+r])*local[5];
+        }
+    }
+#endif
+}
+
+static inline bool IsRigid(const float *m)
+{
+    const float *x = m, *y = m+4, *z = m+8;
+    const float xx = x[0]*x[0] + x[1]*x[1] + x[2]*x[2];
+    const float yy = y[0]*y[0] + y[1]*y[1] + y[2]*y[2];
+    const float zz = z[0]*z[0] + z[1]*z[1] + z[2]*z[2];
+    const float xy = x[0]*y[0] + x[1]*y[1] + x[2]*y[2];
+    const float yz = y[0]*z[0] + y[1]*z[1] + y[2]*z[2];
+    const float zx = z[0]*x[0] + z[1]*x[1] + z[2]*x[2];
+    return std::fabs(xx-1.0f) < RIGID_EPSILON && std::fabs(yy-1.0f) < RIGID_EPSILON &&
+           std::fabs(zz-1.0f) < RIGID_EPSILON && std::fabs(xy) < RIGID_EPSILON &&
+           std::fabs(yz) < RIGID_EPSILON && std::fabs(zx) < RIGID_EPSILON;
+}
+
+#if defined(TRANSFORM_KERNELS_SSE)
+static inline __m128 Cross(const __m128 &a, const __m128 &b)
+{
+    const __m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,0,2,1));
+    const __m128 bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3,0,2,1));
+    const __m128 c = _mm_sub_ps(_mm_mul_ps(a, bYZX), _mm_mul_ps(aYZX, b));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,0,2,1));
+}
+#endif
+
+int NormalMatrices(const float *matrices, const int *indexes, int count,
+                   float *out, unsigned char *rigid)
+{
+    // The inverse transpose of [a0 a1 a2] is [a1xa2 a2xa0 a0xa1] / det,
+    // where det = a0.(a1xa2). No 4x4 inverse, no transpose.
+    int nrRigid = 0;
+    for(int i=0; i<count; i++)
+    {
+        const float *m = matrices + (indexes ? indexes[i] : i)*16;
+        if(IsRigid(m))
+        {
+            rigid[i] = 1;
+            ++nrRigid;
+            continue;
+        }
+
+        rigid[i] = 0;
+        float *o = out + i*9;
+
+#if defined(TRANSFORM_KERNELS_SSE)
+        const __m128 a0 = _mm_loadu_ps(m);
+        const __m128 a1 = _mm_loadu_ps(m+4);
+        const __m128 a2 = _mm_loadu_ps(m+8);
+        const __m128 n0 = Cross(a1, a2);
+        const __m128 n1 = Cross(a2, a0);
+        const __m128 n2 = Cross(a0, a1);
+
+        float c[12];
+        _mm_storeu_ps(c, n0);
+        _mm_storeu_ps(c+4, n1);
+        _mm_storeu_ps(c+8, n2);
+#else
+        float c[12];
+        c[0] = m[5]*m[10] - m[6]*m[9];
+        c[1] = m[6]*m[8] - m[4]*m[10];
+        c[2] = m[4]*m[9] - m[5]*m[8];
+        c[4] = m[9]*m[2] - m[10]*m[1];
+        c[5] = m[10]*m[0] - m[8]*m[2];
+        c[6] = m[8]*m[1] - m[9]*m[0];
+        c[8] = m[1]*m[6] - m[2]*m[5];
+        c[9] = m[2]*m[4] - m[0]*m[6];
+        c[10] = m[0]*m[5] - m[1]*m[4];
+#endif
+
+        const float det = m[0]*c[0] + m[1]*c[1] + m[2]*c[2];
+        const float invDet = std::fabs(det) > 1e-12f ? 1.0f/det : 0.0f;
+        for(int col=0; col<3; col++)
+            for(int row=0; row<3; row++)
+                o[col*3+row] = c[col*4+row] * invDet;
+    }
+
+    return nrRigid;
+}
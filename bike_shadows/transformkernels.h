@@ -0,0 +1,34 @@
+#ifndef TRANSFORM_KERNELS_H
+#define TRANSFORM_KERNELS_H
+
+/*
+ * Batch kernels for the per-frame transform stage. All matrices are 4x4,
+ * column major (the layout of QMatrix4x4::constData()), packed one after
+ * the other. Bounds are a center and half extents, 6 floats each.
+ *
+ * Where indexes is not null, the i-th input matrix is matrices[indexes[i]],
+ * otherwise it is matrices[i]. Outputs are always packed.
+ *
+ * Built with AVX where the compiler targets it (-mavx), SSE on any other
+ * x86 and plain C++ everywhere else.
+ */
+
+// out[i] = a * matrices[i]
+void MultiplyMatrices(const float *a, const float *matrices, const int *indexes,
+                      int count, float *out);
+
+// World space AABB of localBounds[meshIndexes[i]] placed by matrices[i]
+void TransformBounds(const float *matrices, const float *localBounds,
+                     const int *meshIndexes, int count, float *out);
+
+// Inverse transpose of the upper 3x3 of each matrix, as a column major 3x3
+// (9 floats). Rotation-only (rigid) matrices are their own normal matrix,
+// so for those the inverse is skipped, rigid[i] is set to 1 and the output
+// is left untouched. Returns the number of rigid matrices.
+int NormalMatrices(const float *matrices, const int *indexes, int count,
+                   float *out, unsigned char *rigid);
+
+// "avx", "sse" or "scalar"
+const char *TransformKernelName();
+
+#endif // TRANSFORM_KERNELS_H
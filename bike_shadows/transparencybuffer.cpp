@@ -0,0 +1,200 @@
+#include "transparencybuffer.h"
+#include "frameprofiler.h"
+#include "shaderprogram.h"
+
+#include <QOpenGLBuffer>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+
+TransparencyBuffer::TransparencyBuffer()
+    : m_fbo(0), m_accumulationTex(0), m_weightTex(0), m_depthRenderbuffer(0),
+      m_depthFormat(GL_DEPTH24_STENCIL8), m_sceneFramebuffer(0), m_compositeProgram(nullptr), m_quad(nullptr),
+      m_active(false), m_supported(false), m_initialized(false)
+{
+    m_padding[0] = 0;
+}
+
+TransparencyBuffer::~TransparencyBuffer()
+{
+    if(!m_supported)
+        return;
+
+    this->releaseTargets();
+    delete m_compositeProgram;
+    delete m_quad;
+}
+
+void TransparencyBuffer::setDepthFormat(uint val)
+{
+    if(m_depthFormat == val)
+        return;
+
+    m_depthFormat = val;
+    if(m_supported)
+        this->releaseTargets();
+}
+
+void TransparencyBuffer::begin(const QSize &size, uint sceneFramebuffer)
+{
+    if(!this->initialize()) // init happens only once.
+        return;
+
+    FrameProfiler::Scope scope("scene/oit");
+
+    // Targets only grow, like the other offscreen targets, so that dynamic
+    // resolution does not reallocate them every frame
+    if(size.width() > m_capacity.width() || size.height() > m_capacity.height())
+        this->resizeTargets( size.expandedTo(m_capacity) );
+
+    m_size = size;
+    m_sceneFramebuffer = sceneFramebuffer;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_fbo);
+    glBlitFramebuffer(0, 0, size.width(), size.height(), 0, 0, size.width(), size.height(),
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glViewport(0, 0, size.width(), size.height());
+
+    // Nothing accumulated yet: no color, fully revealed, no weight
+    const GLfloat emptyAccumulation[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    const GLfloat emptyWeight[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    glClearBufferfv(GL_COLOR, 0, emptyAccumulation);
+    glClearBufferfv(GL_COLOR, 1, emptyWeight);
+
+    glDepthMask(GL_FALSE);
+    glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+
+    m_active = true;
+}
+
+void TransparencyBuffer::end()
+{
+    if(!m_active)
+        return;
+
+    FrameProfiler::Scope scope("scene/oit");
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_sceneFramebuffer);
+    glViewport(0, 0, m_size.width(), m_size.height());
+
+    // Source alpha is the revealage, how much of the scene shows through
+    glDisable(GL_DEPTH_TEST);
+    glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+
+    m_compositeProgram->bind();
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_accumulationTex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, m_weightTex);
+    m_compositeProgram->setUniformValue("qt_Accumulation", 0);
+    m_compositeProgram->setUniformValue("qt_Weights", 1);
+    m_compositeProgram->setUniformValue("qt_UVScale", float(m_size.width())/float(m_capacity.width()),
+                                        float(m_size.height())/float(m_capacity.height()));
+
+    m_quad->bind();
+    m_compositeProgram->enableAttributeArray("qt_Vertex");
+    m_compositeProgram->setAttributeBuffer("qt_Vertex", GL_FLOAT, 0, 2);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    m_compositeProgram->disableAttributeArray("qt_Vertex");
+    m_quad->release();
+    m_compositeProgram->release();
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glEnable(GL_DEPTH_TEST);
+    glDepthMask(GL_TRUE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    m_active = false;
+}
+
+bool TransparencyBuffer::initialize()
+{
+    if(m_initialized)
+        return m_supported;
+
+    QOpenGLExtraFunctions::initializeOpenGLFunctions();
+    m_initialized = true;
+
+    // Blits, multiple render targets, glClearBufferfv and half float color
+    // targets are all OpenGL 3
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if(context->isOpenGLES() || context->format().version() < qMakePair(3,0))
+    {
+        qWarning("Order independent transparency needs OpenGL 3, transparent parts will be blended in draw order");
+        return false;
+    }
+
+    m_compositeProgram = CreateShaderProgram(":/fullscreen_vertex.glsl", ":/oit_composite_fragment.glsl");
+
+    const float vertices[] = { -1.0f, -1.0f,  1.0f, -1.0f,  -1.0f, 1.0f,  1.0f, 1.0f };
+    m_quad = new QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    m_quad->create();
+    m_quad->bind();
+    m_quad->allocate(vertices, int(sizeof(vertices)));
+    m_quad->release();
+
+    m_supported = true;
+    return true;
+}
+
+void TransparencyBuffer::resizeTargets(const QSize &capacity)
+{
+    this->releaseTargets();
+    m_capacity = capacity;
+
+    // Sums of weighted colors overflow 8 bits, so half floats throughout
+    GLuint textures[2];
+    glGenTextures(2, textures);
+    m_accumulationTex = textures[0];
+    m_weightTex = textures[1];
+    for(int i=0; i<2; i++)
+    {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        if(i == 0)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, capacity.width(), capacity.height(), 0,
+                         GL_RGBA, GL_HALF_FLOAT, nullptr);
+        else
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, capacity.width(), capacity.height(), 0,
+                         GL_RED, GL_HALF_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &m_depthRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, m_depthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, m_depthFormat, capacity.width(), capacity.height());
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &m_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_accumulationTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_weightTex, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, m_depthRenderbuffer);
+    const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        qWarning("Transparency framebuffer is incomplete");
+}
+
+void TransparencyBuffer::releaseTargets()
+{
+    const GLuint textures[] = { m_accumulationTex, m_weightTex };
+    if(m_accumulationTex > 0)
+        glDeleteTextures(2, textures);
+    if(m_depthRenderbuffer > 0)
+        glDeleteRenderbuffers(1, &m_depthRenderbuffer);
+    if(m_fbo > 0)
+        glDeleteFramebuffers(1, &m_fbo);
+
+    m_accumulationTex = m_weightTex = 0;
+    m_depthRenderbuffer = 0;
+    m_fbo = 0;
+    m_capacity = QSize();
+}
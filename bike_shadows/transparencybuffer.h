@@ -0,0 +1,77 @@
+#ifndef TRANSPARENCY_BUFFER_H
+#define TRANSPARENCY_BUFFER_H
+
+#include <QSize>
+#include <QOpenGLExtraFunctions>
+
+class QOpenGLBuffer;
+class QOpenGLShaderProgram;
+
+/*
+ * Weighted blended order independent transparency (McGuire and Bavoil,
+ * JCGT 2013). Transparent surfaces are drawn in any order, after all opaque
+ * ones, into two targets: an accumulation target that sums premultiplied
+ * colors (weighted by alpha and view depth) and keeps the product of
+ * (1 - alpha) in its alpha channel (the revealage), and a second target
+ * that sums the weights. One full screen pass then composites the weighted
+ * average color over the scene, in proportion to how much of it is covered.
+ *
+ * Both targets use a single blend function (additive for colors, multiply
+ * by 1 - alpha for alpha), so nothing beyond OpenGL 3 is needed. Below it
+ * (or on OpenGL ES) isSupported() is false and begin() does nothing.
+ *
+ * Transparent surfaces are depth tested against the opaque ones, whose
+ * depth is copied over from the scene framebuffer. That framebuffer must
+ * therefore have a depth buffer of depthFormat(), like every framebuffer
+ * in this pipeline: packed 24 bit depth and 8 bit stencil, or 32 bit float
+ * depth and 8 bit stencil with reversed-Z.
+ */
+class TransparencyBuffer : public QOpenGLExtraFunctions
+{
+public:
+    TransparencyBuffer();
+    ~TransparencyBuffer();
+
+    // Must be called with a current OpenGL context. Returns false below
+    // OpenGL 3.
+    bool initialize();
+    bool isSupported() const { return m_supported; }
+
+    // Depth (and stencil) format of the scene framebuffer, which the depth
+    // buffer here must match. A change reallocates the targets on the next
+    // begin().
+    void setDepthFormat(uint val);
+    uint depthFormat() const { return m_depthFormat; }
+
+    // Copies depth from sceneFramebuffer, and leaves the accumulation
+    // targets bound and cleared, with blending and depth writes set up for
+    // transparent surfaces
+    void begin(const QSize &size, uint sceneFramebuffer);
+
+    // Composites the transparent surfaces over sceneFramebuffer, and puts
+    // blending and depth writes back as they were
+    void end();
+    bool isActive() const { return m_active; }
+
+private:
+    void resizeTargets(const QSize &capacity);
+    void releaseTargets();
+
+private:
+    QSize m_capacity;
+    QSize m_size;
+    uint m_fbo;
+    uint m_accumulationTex;
+    uint m_weightTex;
+    uint m_depthRenderbuffer;
+    uint m_depthFormat;
+    uint m_sceneFramebuffer;
+    QOpenGLShaderProgram *m_compositeProgram;
+    QOpenGLBuffer *m_quad;
+    bool m_active;
+    bool m_supported;
+    bool m_initialized;
+    char m_padding[5];
+};
+
+#endif // TRANSPARENCY_BUFFER_H
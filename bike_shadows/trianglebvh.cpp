@@ -0,0 +1,369 @@
+#include "trianglebvh.h"
+
+#include <QVarLengthArray>
+#include <algorithm>
+#include <cfloat>
+
+// Candidate split planes per axis, and the most triangles a leaf is made of
+// without weighing a split
+static const int SAH_BIN_COUNT = 16;
+static const int MIN_SPLIT_TRIANGLES = 4;
+
+// Leaves larger than this are split even where the heuristic would keep
+// them, as when all centroids coincide
+static const int MAX_LEAF_TRIANGLES = 16;
+
+// Cost of visiting a node, relative to testing a triangle
+static const float TRAVERSAL_COST = 1.0f;
+
+struct BuildBox
+{
+    BuildBox() {
+        min[0] = min[1] = min[2] = FLT_MAX;
+        max[0] = max[1] = max[2] = -FLT_MAX;
+    }
+    void grow(const float *lo, const float *hi) {
+        for(int a=0; a<3; a++) {
+            min[a] = qMin(min[a], lo[a]);
+            max[a] = qMax(max[a], hi[a]);
+        }
+    }
+    void grow(const BuildBox &other) { this->grow(other.min, other.max); }
+    float halfArea() const {
+        const float x = max[0]-min[0], y = max[1]-min[1], z = max[2]-min[2];
+        return x*y + y*z + z*x;
+    }
+    float min[3], max[3];
+};
+
+// Distance along the ray at which it enters the box, or FLT_MAX if it
+// misses it before maxDistance
+static inline float EnterBox(const float *min, const float *max, const float *origin,
+                             const float *inverseDirection, float maxDistance)
+{
+    float enter = 0.0f, exit = maxDistance;
+    for(int a=0; a<3; a++)
+    {
+        float t0 = (min[a]-origin[a])*inverseDirection[a];
+        float t1 = (max[a]-origin[a])*inverseDirection[a];
+        if(t0 > t1)
+            std::swap(t0, t1);
+        enter = qMax(enter, t0);
+        exit = qMin(exit, t1);
+    }
+
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+// Möller-Trumbore, on both faces. FLT_MAX for a miss.
+static inline float IntersectTriangle(const QVector3D &corner, const QVector3D &edge1,
+                                      const QVector3D &edge2, const QVector3D &origin,
+                                      const QVector3D &direction)
+{
+    const QVector3D p = QVector3D::crossProduct(direction, edge2);
+    const float determinant = QVector3D::dotProduct(edge1, p);
+    if(determinant == 0.0f)
+        return FLT_MAX; // parallel to the triangle, or a degenerate one
+
+    const float inverse = 1.0f / determinant;
+    const QVector3D s = origin - corner;
+    const float u = QVector3D::dotProduct(s, p) * inverse;
+    if(u < 0.0f || u > 1.0f)
+        return FLT_MAX;
+
+    const QVector3D q = QVector3D::crossProduct(s, edge1);
+    const float v = QVector3D::dotProduct(direction, q) * inverse;
+    if(v < 0.0f || u + v > 1.0f)
+        return FLT_MAX;
+
+    const float distance = QVector3D::dotProduct(edge2, q) * inverse;
+    return distance >= 0.0f ? distance : FLT_MAX;
+}
+
+TriangleBvh::TriangleBvh()
+{
+
+}
+
+TriangleBvh::~TriangleBvh()
+{
+
+}
+
+void TriangleBvh::build(const QVector3D *vertices, const int *indexes, const int *triangleParts,
+                        int triangleCount)
+{
+    this->clear();
+    if(triangleCount <= 0)
+        return;
+
+    QVector<BuildTriangle> buildTriangles(triangleCount);
+    for(int i=0; i<triangleCount; i++)
+    {
+        const QVector3D corners[] = {
+            vertices[indexes ? indexes[i*3] : i*3],
+            vertices[indexes ? indexes[i*3+1] : i*3+1],
+            vertices[indexes ? indexes[i*3+2] : i*3+2]
+        };
+
+        BuildTriangle &triangle = buildTriangles[i];
+        for(int a=0; a<3; a++)
+        {
+            triangle.min[a] = qMin(qMin(corners[0][a], corners[1][a]), corners[2][a]);
+            triangle.max[a] = qMax(qMax(corners[0][a], corners[1][a]), corners[2][a]);
+            triangle.centroid[a] = (triangle.min[a] + triangle.max[a]) * 0.5f;
+        }
+        triangle.index = i;
+    }
+
+    // A binary tree with leaves of one or more triangles has fewer than
+    // twice as many nodes as triangles
+    m_nodes.reserve(2*triangleCount);
+    this->buildNode(buildTriangles.data(), 0, triangleCount);
+    m_nodes.squeeze();
+
+    // Triangles in the order the leaves refer to them
+    m_triangles.resize(triangleCount);
+    for(int i=0; i<triangleCount; i++)
+    {
+        const int index = buildTriangles.at(i).index;
+        const QVector3D corner = vertices[indexes ? indexes[index*3] : index*3];
+
+        Triangle &triangle = m_triangles[i];
+        triangle.corner = corner;
+        triangle.edge1 = vertices[indexes ? indexes[index*3+1] : index*3+1] - corner;
+        triangle.edge2 = vertices[indexes ? indexes[index*3+2] : index*3+2] - corner;
+        triangle.part = triangleParts[index];
+    }
+}
+
+void TriangleBvh::clear()
+{
+    m_nodes.clear();
+    m_triangles.clear();
+}
+
+int TriangleBvh::buildNode(BuildTriangle *triangles, int begin, int end)
+{
+    const int index = m_nodes.size();
+    m_nodes.append(Node());
+
+    BuildBox bounds, centroids;
+    for(int i=begin; i<end; i++)
+    {
+        bounds.grow(triangles[i].min, triangles[i].max);
+        centroids.grow(triangles[i].centroid, triangles[i].centroid);
+    }
+
+    Node &node = m_nodes[index];
+    for(int a=0; a<3; a++)
+    {
+        node.min[a] = bounds.min[a];
+        node.max[a] = bounds.max[a];
+    }
+
+    // Binned SAH: triangles go into bins by centroid along each axis, and
+    // every boundary between bins is a candidate split. A leaf costs a
+    // test per triangle.
+    const int count = end - begin;
+    float bestCost = float(count);
+    int bestAxis = -1, bestSplit = 0;
+    if(count > MIN_SPLIT_TRIANGLES)
+    {
+        const float area = qMax(bounds.halfArea(), FLT_MIN);
+        for(int a=0; a<3; a++)
+        {
+            const float extent = centroids.max[a] - centroids.min[a];
+            if(extent <= 0.0f)
+                continue;
+
+            BuildBox binBounds[SAH_BIN_COUNT];
+            int binCounts[SAH_BIN_COUNT] = { 0 };
+            const float scale = float(SAH_BIN_COUNT) / extent;
+            for(int i=begin; i<end; i++)
+            {
+                const int bin = qMin(int((triangles[i].centroid[a] - centroids.min[a]) * scale), SAH_BIN_COUNT-1);
+                binBounds[bin].grow(triangles[i].min, triangles[i].max);
+                ++binCounts[bin];
+            }
+
+            // Areas and counts right of each split, then a sweep from the left
+            float rightAreas[SAH_BIN_COUNT-1];
+            int rightCounts[SAH_BIN_COUNT-1];
+            BuildBox right;
+            int rightCount = 0;
+            for(int b=SAH_BIN_COUNT-1; b>0; b--)
+            {
+                right.grow(binBounds[b]);
+                rightCount += binCounts[b];
+                rightAreas[b-1] = right.halfArea();
+                rightCounts[b-1] = rightCount;
+            }
+
+            BuildBox left;
+            int leftCount = 0;
+            for(int b=0; b<SAH_BIN_COUNT-1; b++)
+            {
+                left.grow(binBounds[b]);
+                leftCount += binCounts[b];
+                if(leftCount == 0 || rightCounts[b] == 0)
+                    continue;
+
+                const float cost = TRAVERSAL_COST +
+                        (left.halfArea()*float(leftCount) + rightAreas[b]*float(rightCounts[b])) / area;
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestSplit = b+1;
+                }
+            }
+        }
+    }
+
+    int middle = begin;
+    if(bestAxis >= 0)
+    {
+        const float origin = centroids.min[bestAxis];
+        const float scale = float(SAH_BIN_COUNT) / (centroids.max[bestAxis] - origin);
+        middle = int(std::partition(triangles+begin, triangles+end, [=](const BuildTriangle &t) {
+            return qMin(int((t.centroid[bestAxis] - origin) * scale), SAH_BIN_COUNT-1) < bestSplit;
+        }) - triangles);
+    }
+    else if(count > MAX_LEAF_TRIANGLES)
+    {
+        // Halves along the longest axis, whatever the centroids are
+        int axis = 0;
+        for(int a=1; a<3; a++)
+        {
+            if(bounds.max[a]-bounds.min[a] > bounds.max[axis]-bounds.min[axis])
+                axis = a;
+        }
+
+        middle = begin + count/2;
+        std::nth_element(triangles+begin, triangles+middle, triangles+end,
+                         [=](const BuildTriangle &t1, const BuildTriangle &t2) {
+            return t1.centroid[axis] < t2.centroid[axis];
+        });
+    }
+    else
+    {
+        node.offset = begin;
+        node.count = count;
+        return index;
+    }
+
+    // The first child follows right away; node is not used past here, as
+    // m_nodes may have been reallocated
+    this->buildNode(triangles, begin, middle);
+    const int second = this->buildNode(triangles, middle, end);
+    m_nodes[index].offset = second;
+    m_nodes[index].count = 0;
+    return index;
+}
+
+TriangleBvh::Hit TriangleBvh::intersect(const QVector3D &origin, const QVector3D &direction,
+                                        float maxDistance) const
+{
+    Hit ret;
+    if(m_nodes.isEmpty())
+        return ret;
+
+    // Zero components are nudged off zero, so that the slabs never come
+    // out as 0*infinity
+    float o[3], inverseDirection[3];
+    for(int a=0; a<3; a++)
+    {
+        o[a] = origin[a];
+        const float d = direction[a];
+        inverseDirection[a] = 1.0f / (qAbs(d) > 1e-30f ? d : 1e-30f);
+    }
+
+    const Node *nodes = m_nodes.constData();
+    const Triangle *triangles = m_triangles.constData();
+    float nearest = maxDistance;
+
+    struct Entry { int node; float distance; };
+    QVarLengthArray<Entry, 64> stack;
+    const Entry root = { 0, EnterBox(nodes[0].min, nodes[0].max, o, inverseDirection, nearest) };
+    if(root.distance < nearest)
+        stack.append(root);
+
+    while(!stack.isEmpty())
+    {
+        const Entry entry = stack.last();
+        stack.removeLast();
+        if(entry.distance >= nearest)
+            continue; // something nearer was hit since it was pushed
+
+        const Node &node = nodes[entry.node];
+        if(node.count > 0)
+        {
+            for(int i=node.offset; i<node.offset+node.count; i++)
+            {
+                const Triangle &triangle = triangles[i];
+                const float distance = IntersectTriangle(triangle.corner, triangle.edge1, triangle.edge2,
+                                                         origin, direction);
+                if(distance < nearest)
+                {
+                    nearest = distance;
+                    ret.triangle = i;
+                    ret.part = triangle.part;
+                    ret.distance = distance;
+                }
+            }
+            continue;
+        }
+
+        // The nearer child goes on top, to be visited first
+        Entry children[2] = {
+            { entry.node+1, 0.0f },
+            { node.offset, 0.0f }
+        };
+        for(int c=0; c<2; c++)
+            children[c].distance = EnterBox(nodes[children[c].node].min, nodes[children[c].node].max,
+                                            o, inverseDirection, nearest);
+        if(children[0].distance < children[1].distance)
+            std::swap(children[0], children[1]);
+
+        for(int c=0; c<2; c++)
+        {
+            if(children[c].distance < nearest)
+                stack.append(children[c]);
+        }
+    }
+
+    return ret;
+}
+
+TriangleBvh TriangleBvh::select(const QVector<int> &partMap) const
+{
+    QVector<QVector3D> vertices;
+    QVector<int> parts;
+    vertices.reserve(m_triangles.size()*3);
+    parts.reserve(m_triangles.size());
+    Q_FOREACH(const Triangle &triangle, m_triangles)
+    {
+        const int part = partMap.value(triangle.part, -1);
+        if(part < 0)
+            continue;
+
+        vertices << triangle.corner << triangle.corner + triangle.edge1 << triangle.corner + triangle.edge2;
+        parts << part;
+    }
+
+    TriangleBvh ret;
+    ret.build(vertices.constData(), nullptr, parts.constData(), parts.size());
+    return ret;
+}
+
+QVector<QVector3D> TriangleBvh::partTriangles(int part) const
+{
+    QVector<QVector3D> ret;
+    Q_FOREACH(const Triangle &triangle, m_triangles)
+    {
+        if(triangle.part == part)
+            ret << triangle.corner << triangle.corner + triangle.edge1 << triangle.corner + triangle.edge2;
+    }
+    return ret;
+}
@@ -0,0 +1,85 @@
+#ifndef TRIANGLE_BVH_H
+#define TRIANGLE_BVH_H
+
+#include <QVector>
+#include <QVector3D>
+#include <cfloat>
+
+/*
+ * Bounding volume hierarchy over the triangles of a mesh, for casting rays
+ * at it on the CPU (picking). It is built once per mesh, splitting nodes
+ * where the surface area heuristic says a ray is cheapest to trace, and
+ * is shared by all instances of the mesh, which cast rays in model space.
+ *
+ * Nodes are stored flat, depth first: the first child of a node follows
+ * it, and only the index of the second is kept, so that a traversal
+ * mostly walks forward through memory. Triangles are reordered so that
+ * those of a leaf are contiguous, and kept as a corner and two edges,
+ * ready for the ray-triangle test.
+ */
+class TriangleBvh
+{
+public:
+    TriangleBvh();
+    ~TriangleBvh();
+
+    // Triangles are triples of indexes into vertices, or consecutive
+    // triples of vertices without indexes. Each is tagged with the part of
+    // the mesh it belongs to.
+    void build(const QVector3D *vertices, const int *indexes, const int *triangleParts,
+               int triangleCount);
+    void clear();
+
+    bool isEmpty() const { return m_nodes.isEmpty(); }
+    int triangleCount() const { return m_triangles.size(); }
+    int nodeCount() const { return m_nodes.size(); }
+
+    struct Hit
+    {
+        Hit() : triangle(-1), part(-1), distance(0) { }
+        int triangle;
+        int part;
+        float distance; // in lengths of the ray's direction
+        bool isValid() const { return triangle >= 0; }
+    };
+
+    // Nearest triangle, front or back facing, that origin + t*direction
+    // hits for t in [0, maxDistance)
+    Hit intersect(const QVector3D &origin, const QVector3D &direction,
+                  float maxDistance=FLT_MAX) const;
+
+    // A hierarchy of the triangles of some of the parts. partMap maps the
+    // parts here to parts of the result, or to -1 to leave them out.
+    TriangleBvh select(const QVector<int> &partMap) const;
+
+    // Corners of the triangles of a part, three per triangle
+    QVector<QVector3D> partTriangles(int part) const;
+
+private:
+    struct BuildTriangle
+    {
+        float min[3], max[3], centroid[3];
+        int index;
+    };
+    int buildNode(BuildTriangle *triangles, int begin, int end);
+
+private:
+    struct Node
+    {
+        float min[3];
+        int offset;     // first triangle of a leaf, second child otherwise
+        float max[3];
+        int count;      // triangles of a leaf, 0 otherwise
+    };
+    QVector<Node> m_nodes;
+
+    struct Triangle
+    {
+        QVector3D corner;
+        QVector3D edge1, edge2;
+        int part;
+    };
+    QVector<Triangle> m_triangles;
+};
+
+#endif // TRIANGLE_BVH_H
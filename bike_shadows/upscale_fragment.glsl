@@ -0,0 +1,32 @@
+uniform sampler2D qt_Texture;
+uniform vec2 qt_UVScale;     // part of the texture that the scene was rendered into
+uniform vec2 qt_TexelSize;
+uniform float qt_Sharpness;
+varying vec2 v_TexCoord;
+
+vec4 fetch(vec2 uv)
+{
+    // Bilinear taps must not reach past the rendered part of the texture
+    return texture2D(qt_Texture, clamp(uv, 0.5*qt_TexelSize, qt_UVScale - 0.5*qt_TexelSize));
+}
+
+void main(void)
+{
+    vec2 uv = v_TexCoord * qt_UVScale;
+    vec4 color = fetch(uv);
+
+#ifdef SHARPEN
+    // Unsharp mask over the four neighbours (one source texel away),
+    // clamped to their range so that edges do not ring
+    vec4 n = fetch(uv + vec2(0.0, qt_TexelSize.y));
+    vec4 s = fetch(uv - vec2(0.0, qt_TexelSize.y));
+    vec4 e = fetch(uv + vec2(qt_TexelSize.x, 0.0));
+    vec4 w = fetch(uv - vec2(qt_TexelSize.x, 0.0));
+    vec4 lo = min(color, min(min(n, s), min(e, w)));
+    vec4 hi = max(color, max(max(n, s), max(e, w)));
+    vec4 sharpened = color + (color - 0.25*(n + s + e + w)) * qt_Sharpness;
+    color = clamp(sharpened, lo, hi);
+#endif
+
+    gl_FragColor = vec4(color.rgb, 1.0);
+}